@@ -245,6 +245,7 @@ BlockDriverState *bdrv_new(void)
     notifier_with_return_list_init(&bs->before_write_notifiers);
     qemu_co_queue_init(&bs->throttled_reqs[0]);
     qemu_co_queue_init(&bs->throttled_reqs[1]);
+    bs->throttle_weight = THROTTLE_GROUP_DEFAULT_WEIGHT;
     bs->refcnt = 1;
     bs->aio_context = qemu_get_aio_context();
 
@@ -2305,6 +2306,7 @@ static void swap_feature_fields(BlockDriverState *bs_top,
     assert(!bs_new->throttle_state);
     if (bs_top->throttle_state) {
         assert(bs_top->io_limits_enabled);
+        bs_new->throttle_weight = bs_top->throttle_weight;
         bdrv_io_limits_enable(bs_new, throttle_group_get_name(bs_top));
         bdrv_io_limits_disable(bs_top);
     }
@@ -3110,6 +3112,15 @@ ImageInfoSpecific *bdrv_get_specific_info(BlockDriverState *bs)
     return NULL;
 }
 
+BlockStatsSpecific *bdrv_get_specific_stats(const BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+    if (drv && drv->bdrv_get_specific_stats) {
+        return drv->bdrv_get_specific_stats(bs);
+    }
+    return NULL;
+}
+
 void bdrv_debug_event(BlockDriverState *bs, BlkdebugEvent event)
 {
     if (!bs || !bs->drv || !bs->drv->bdrv_debug_event) {
@@ -3701,7 +3712,7 @@ void bdrv_detach_aio_context(BlockDriverState *bs)
     }
 
     if (bs->throttle_state) {
-        throttle_timers_detach_aio_context(&bs->throttle_timers);
+        throttle_group_detach_aio_context(bs);
     }
     if (bs->drv->bdrv_detach_aio_context) {
         bs->drv->bdrv_detach_aio_context(bs);
@@ -3737,7 +3748,7 @@ void bdrv_attach_aio_context(BlockDriverState *bs,
         bs->drv->bdrv_attach_aio_context(bs, new_context);
     }
     if (bs->throttle_state) {
-        throttle_timers_attach_aio_context(&bs->throttle_timers, new_context);
+        throttle_group_attach_aio_context(bs, new_context);
     }
 
     QLIST_FOREACH(ban, &bs->aio_notifiers, list) {
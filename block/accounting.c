@@ -27,6 +27,8 @@
 #include "block/accounting.h"
 #include "block/block_int.h"
 #include "qemu/timer.h"
+#include "qemu/host-utils.h"
+#include "qapi/error.h"
 #include "sysemu/qtest.h"
 
 static QEMUClockType clock_type = QEMU_CLOCK_REALTIME;
@@ -46,6 +48,11 @@ void block_acct_init(BlockAcctStats *stats, bool account_invalid,
 void block_acct_cleanup(BlockAcctStats *stats)
 {
     BlockAcctTimedStats *s, *next;
+    unsigned i;
+
+    for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+        g_free(stats->histogram[i].bins);
+    }
     QSLIST_FOREACH_SAFE(s, &stats->intervals, entries, next) {
         g_free(s);
     }
@@ -66,6 +73,63 @@ void block_acct_add_interval(BlockAcctStats *stats, unsigned interval_length)
     }
 }
 
+/* Reconfigure the latency histograms and zero their bins.  A zero nbins
+ * disables them.
+ */
+bool block_latency_histogram_set(BlockAcctStats *stats, uint64_t min_ns,
+                                 unsigned nbins, Error **errp)
+{
+    unsigned i;
+
+    if (nbins == 1 || nbins > BLOCK_LATENCY_HISTOGRAM_MAX_BINS) {
+        error_setg(errp, "Number of histogram bins must be 0 or "
+                   "between 2 and %d", BLOCK_LATENCY_HISTOGRAM_MAX_BINS);
+        return false;
+    }
+    if (nbins && min_ns == 0) {
+        error_setg(errp, "Minimum histogram latency must be positive");
+        return false;
+    }
+    /* The last boundary is min_ns << (nbins - 2) */
+    if (nbins && nbins - 2 >= clz64(min_ns)) {
+        error_setg(errp, "Histogram boundaries would exceed 64 bits");
+        return false;
+    }
+
+    for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+        BlockLatencyHistogram *hist = &stats->histogram[i];
+
+        g_free(hist->bins);
+        hist->min_ns = min_ns;
+        hist->nbins = nbins;
+        hist->bins = nbins ? g_new0(uint64_t, nbins) : NULL;
+    }
+    return true;
+}
+
+/* Upper bound of bin i, which must not be the last one */
+uint64_t block_latency_histogram_boundary(BlockLatencyHistogram *hist,
+                                          unsigned i)
+{
+    assert(i < hist->nbins - 1);
+    return hist->min_ns << i;
+}
+
+static void block_latency_histogram_account(BlockLatencyHistogram *hist,
+                                            int64_t latency_ns)
+{
+    uint64_t q;
+    unsigned i;
+
+    if (!hist->bins) {
+        return;
+    }
+
+    q = MAX(latency_ns, 0) / hist->min_ns;
+    i = q ? 64 - clz64(q) : 0;
+    hist->bins[MIN(i, hist->nbins - 1)]++;
+}
+
 BlockAcctTimedStats *block_acct_interval_next(BlockAcctStats *stats,
                                               BlockAcctTimedStats *s)
 {
@@ -106,6 +170,8 @@ void block_acct_done(BlockAcctStats *stats, BlockAcctCookie *cookie)
     QSLIST_FOREACH(s, &stats->intervals, entries) {
         timed_average_account(&s->latency[cookie->type], latency_ns);
     }
+    block_latency_histogram_account(&stats->histogram[cookie->type],
+                                    latency_ns);
 }
 
 void block_acct_failed(BlockAcctStats *stats, BlockAcctCookie *cookie)
@@ -129,6 +195,8 @@ void block_acct_failed(BlockAcctStats *stats, BlockAcctCookie *cookie)
         QSLIST_FOREACH(s, &stats->intervals, entries) {
             timed_average_account(&s->latency[cookie->type], latency_ns);
         }
+        block_latency_histogram_account(&stats->histogram[cookie->type],
+                                        latency_ns);
     }
 }
 
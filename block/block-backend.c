@@ -1292,6 +1292,7 @@ void blk_update_root_state(BlockBackend *blk)
         const char *name = throttle_group_get_name(blk->bs);
         blk->root_state.throttle_group = g_strdup(name);
         blk->root_state.throttle_state = throttle_group_incref(name);
+        blk->root_state.throttle_weight = blk->bs->throttle_weight;
     } else {
         blk->root_state.throttle_group = NULL;
         blk->root_state.throttle_state = NULL;
@@ -1307,6 +1308,7 @@ void blk_apply_root_state(BlockBackend *blk, BlockDriverState *bs)
 {
     bs->detect_zeroes = blk->root_state.detect_zeroes;
     if (blk->root_state.throttle_group) {
+        bs->throttle_weight = blk->root_state.throttle_weight;
         bdrv_io_limits_enable(bs, blk->root_state.throttle_group);
     }
 }
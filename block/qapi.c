@@ -117,6 +117,8 @@ BlockDeviceInfo *bdrv_block_device_info(BlockDriverState *bs, Error **errp)
 
         info->has_group = true;
         info->group = g_strdup(throttle_group_get_name(bs));
+        info->has_group_weight = true;
+        info->group_weight = bs->throttle_weight;
     }
 
     info->write_threshold = bdrv_write_threshold_get(bs);
@@ -359,6 +361,28 @@ static BlockStats *bdrv_query_stats(BlockBackend *blk,
                                     const BlockDriverState *bs,
                                     bool query_backing);
 
+static BlockLatencyHistogramInfo *
+bdrv_latency_histogram_info(BlockLatencyHistogram *hist)
+{
+    BlockLatencyHistogramInfo *info = g_new0(BlockLatencyHistogramInfo, 1);
+    uint64List **p_boundary = &info->boundaries;
+    uint64List **p_bin = &info->bins;
+    unsigned i;
+
+    for (i = 0; i < hist->nbins; i++) {
+        *p_bin = g_new0(uint64List, 1);
+        (*p_bin)->value = hist->bins[i];
+        p_bin = &(*p_bin)->next;
+
+        if (i < hist->nbins - 1) {
+            *p_boundary = g_new0(uint64List, 1);
+            (*p_boundary)->value = block_latency_histogram_boundary(hist, i);
+            p_boundary = &(*p_boundary)->next;
+        }
+    }
+    return info;
+}
+
 static void bdrv_query_blk_stats(BlockStats *s, BlockBackend *blk)
 {
     BlockAcctStats *stats = blk_get_stats(blk);
@@ -427,6 +451,18 @@ static void bdrv_query_blk_stats(BlockStats *s, BlockBackend *blk)
         dev_stats->avg_wr_queue_depth =
             block_acct_queue_depth(ts, BLOCK_ACCT_WRITE);
     }
+
+    if (stats->histogram[BLOCK_ACCT_READ].bins) {
+        s->stats->has_rd_latency_histogram = true;
+        s->stats->rd_latency_histogram =
+            bdrv_latency_histogram_info(&stats->histogram[BLOCK_ACCT_READ]);
+        s->stats->has_wr_latency_histogram = true;
+        s->stats->wr_latency_histogram =
+            bdrv_latency_histogram_info(&stats->histogram[BLOCK_ACCT_WRITE]);
+        s->stats->has_flush_latency_histogram = true;
+        s->stats->flush_latency_histogram =
+            bdrv_latency_histogram_info(&stats->histogram[BLOCK_ACCT_FLUSH]);
+    }
 }
 
 static void bdrv_query_bds_stats(BlockStats *s, const BlockDriverState *bs,
@@ -449,6 +485,8 @@ static void bdrv_query_bds_stats(BlockStats *s, const BlockDriverState *bs,
         s->backing = bdrv_query_stats(NULL, bs->backing->bs, query_backing);
     }
 
+    s->driver_specific = bdrv_get_specific_stats(bs);
+    s->has_driver_specific = s->driver_specific != NULL;
 }
 
 static BlockStats *bdrv_query_stats(BlockBackend *blk,
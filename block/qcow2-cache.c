@@ -39,6 +39,7 @@ typedef struct Qcow2CachedTable {
     uint64_t lru_counter;
     int      ref;
     bool     dirty;
+    bool     committed; /* in the journal, but not yet written in place */
 } Qcow2CachedTable;
 
 struct Qcow2Cache {
@@ -87,7 +88,7 @@ static void qcow2_cache_table_release(BlockDriverState *bs, Qcow2Cache *c,
 static inline bool can_clean_entry(Qcow2Cache *c, int i)
 {
     Qcow2CachedTable *t = &c->entries[i];
-    return t->ref == 0 && !t->dirty && t->offset != 0 &&
+    return t->ref == 0 && !t->dirty && !t->committed && t->offset != 0 &&
         t->lru_counter <= c->cache_clean_lru_counter;
 }
 
@@ -169,30 +170,12 @@ static int qcow2_cache_flush_dependency(BlockDriverState *bs, Qcow2Cache *c)
     return 0;
 }
 
-static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
+/* Writes a dirty entry to its place in the image file without taking care of
+ * any dependencies */
+static int qcow2_cache_entry_write(BlockDriverState *bs, Qcow2Cache *c, int i)
 {
     BDRVQcow2State *s = bs->opaque;
-    int ret = 0;
-
-    if (!c->entries[i].dirty || !c->entries[i].offset) {
-        return 0;
-    }
-
-    trace_qcow2_cache_entry_flush(qemu_coroutine_self(),
-                                  c == s->l2_table_cache, i);
-
-    if (c->depends) {
-        ret = qcow2_cache_flush_dependency(bs, c);
-    } else if (c->depends_on_flush) {
-        ret = bdrv_flush(bs->file->bs);
-        if (ret >= 0) {
-            c->depends_on_flush = false;
-        }
-    }
-
-    if (ret < 0) {
-        return ret;
-    }
+    int ret;
 
     if (c == s->refcount_block_cache) {
         ret = qcow2_pre_write_overlap_check(bs, QCOW2_OL_REFCOUNT_BLOCK,
@@ -222,10 +205,57 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
     }
 
     c->entries[i].dirty = false;
+    c->entries[i].committed = false;
 
     return 0;
 }
 
+static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret = 0;
+
+    if ((!c->entries[i].dirty && !c->entries[i].committed) ||
+        !c->entries[i].offset)
+    {
+        return 0;
+    }
+
+    trace_qcow2_cache_entry_flush(qemu_coroutine_self(),
+                                  c == s->l2_table_cache, i);
+
+    /* With a journal, a table may only be written in place once it is
+     * committed.  The journal holds it until the next checkpoint, which
+     * flushes the image file first, so no flush is needed here. */
+    if (has_journal(s)) {
+        if (c->entries[i].dirty) {
+            ret = qcow2_journal_commit(bs);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+        if (!c->entries[i].committed) {
+            return 0;
+        }
+        return qcow2_cache_entry_write(bs, c, i);
+    }
+
+    if (c->depends) {
+        ret = qcow2_cache_flush_dependency(bs, c);
+    } else if (c->depends_on_flush) {
+        ret = bdrv_flush(bs->file->bs);
+        if (ret >= 0) {
+            c->depends_on_flush = false;
+        }
+    }
+
+    if (ret < 0) {
+        return ret;
+    }
+
+    return qcow2_cache_entry_write(bs, c, i);
+}
+
 int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c)
 {
     BDRVQcow2State *s = bs->opaque;
@@ -235,6 +265,10 @@ int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c)
 
     trace_qcow2_cache_flush(qemu_coroutine_self(), c == s->l2_table_cache);
 
+    if (has_journal(s)) {
+        return qcow2_journal_commit(bs);
+    }
+
     for (i = 0; i < c->size; i++) {
         ret = qcow2_cache_entry_flush(bs, c, i);
         if (ret < 0 && result != -ENOSPC) {
@@ -255,8 +289,14 @@ int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c)
 int qcow2_cache_set_dependency(BlockDriverState *bs, Qcow2Cache *c,
     Qcow2Cache *dependency)
 {
+    BDRVQcow2State *s = bs->opaque;
     int ret;
 
+    /* A journal commit updates both caches atomically */
+    if (has_journal(s)) {
+        return 0;
+    }
+
     if (dependency->depends) {
         ret = qcow2_cache_flush_dependency(bs, dependency);
         if (ret < 0) {
@@ -280,8 +320,110 @@ void qcow2_cache_depends_on_flush(Qcow2Cache *c)
     c->depends_on_flush = true;
 }
 
+bool qcow2_cache_get_depends_on_flush(Qcow2Cache *c)
+{
+    return c->depends_on_flush;
+}
+
+/* Stores the offsets and table addresses of all dirty entries in @offsets and
+ * @tables, which may be NULL if only the number of dirty entries is needed.
+ * Returns the number of dirty entries. */
+int qcow2_cache_get_dirty(BlockDriverState *bs, Qcow2Cache *c,
+    uint64_t *offsets, void **tables)
+{
+    int i, n = 0;
+
+    for (i = 0; i < c->size; i++) {
+        if (!c->entries[i].dirty || !c->entries[i].offset) {
+            continue;
+        }
+        if (offsets) {
+            offsets[n] = c->entries[i].offset;
+        }
+        if (tables) {
+            tables[n] = qcow2_cache_get_table_addr(bs, c, i);
+        }
+        n++;
+    }
+
+    return n;
+}
+
+/* Marks all dirty entries as committed once the journal holds them.  They
+ * are clean then, but must still be written in place before the journal can
+ * be emptied. */
+void qcow2_cache_mark_committed(Qcow2Cache *c)
+{
+    int i;
+
+    for (i = 0; i < c->size; i++) {
+        if (c->entries[i].dirty && c->entries[i].offset) {
+            c->entries[i].dirty = false;
+            c->entries[i].committed = true;
+        }
+    }
+
+    c->depends = NULL;
+    c->depends_on_flush = false;
+}
+
+/* Returns whether an entry was modified again after it had been committed.
+ * Writing it in place would then write an uncommitted version. */
+bool qcow2_cache_has_dirty_committed(Qcow2Cache *c)
+{
+    int i;
+
+    for (i = 0; i < c->size; i++) {
+        if (c->entries[i].dirty && c->entries[i].committed) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Writes all committed entries that haven't been modified since to their
+ * place in the image file.  Entries that fail to be written stay committed. */
+int qcow2_cache_write_committed(BlockDriverState *bs, Qcow2Cache *c)
+{
+    int result = 0;
+    int ret;
+    int i;
+
+    for (i = 0; i < c->size; i++) {
+        if (!c->entries[i].committed || c->entries[i].dirty ||
+            !c->entries[i].offset)
+        {
+            continue;
+        }
+        ret = qcow2_cache_entry_write(bs, c, i);
+        if (ret < 0 && result != -ENOSPC) {
+            result = ret;
+        }
+    }
+
+    return result;
+}
+
+/* Forgets which entries are committed after the journal has been written in
+ * place by other means */
+void qcow2_cache_clear_committed(Qcow2Cache *c)
+{
+    int i;
+
+    for (i = 0; i < c->size; i++) {
+        c->entries[i].committed = false;
+    }
+}
+
+int qcow2_cache_get_num_tables(Qcow2Cache *c)
+{
+    return c->size;
+}
+
 int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
 {
+    BDRVQcow2State *s = bs->opaque;
     int ret, i;
 
     ret = qcow2_cache_flush(bs, c);
@@ -289,6 +431,13 @@ int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
         return ret;
     }
 
+    if (has_journal(s)) {
+        ret = qcow2_cache_write_committed(bs, c);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
         c->entries[i].offset = 0;
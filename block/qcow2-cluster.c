@@ -219,7 +219,7 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
 
     /* allocate a new l2 entry */
 
-    l2_offset = qcow2_alloc_clusters(bs, s->l2_size * sizeof(uint64_t));
+    l2_offset = qcow2_alloc_clusters(bs, s->l2_size * l2_entry_size(s));
     if (l2_offset < 0) {
         ret = l2_offset;
         goto fail;
@@ -242,7 +242,7 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
 
     if ((old_l2_offset & L1E_OFFSET_MASK) == 0) {
         /* if there was no old l2 table, clear the new table */
-        memset(l2_table, 0, s->l2_size * sizeof(uint64_t));
+        memset(l2_table, 0, s->l2_size * l2_entry_size(s));
     } else {
         uint64_t* old_table;
 
@@ -289,7 +289,7 @@ fail:
     }
     s->l1_table[l1_index] = old_l2_offset;
     if (l2_offset > 0) {
-        qcow2_free_clusters(bs, l2_offset, s->l2_size * sizeof(uint64_t),
+        qcow2_free_clusters(bs, l2_offset, s->l2_size * l2_entry_size(s),
                             QCOW2_DISCARD_ALWAYS);
     }
     return ret;
@@ -302,12 +302,12 @@ fail:
  * as contiguous. (This allows it, for example, to stop at the first compressed
  * cluster which may require a different handling)
  */
-static int count_contiguous_clusters(int nb_clusters, int cluster_size,
-        uint64_t *l2_table, uint64_t stop_flags)
+static int count_contiguous_clusters(BDRVQcow2State *s, int nb_clusters,
+        uint64_t *l2_table, int l2_index, uint64_t stop_flags)
 {
     int i;
     uint64_t mask = stop_flags | L2E_OFFSET_MASK | QCOW_OFLAG_COMPRESSED;
-    uint64_t first_entry = be64_to_cpu(l2_table[0]);
+    uint64_t first_entry = get_l2_entry(s, l2_table, l2_index);
     uint64_t offset = first_entry & mask;
 
     if (!offset)
@@ -316,8 +316,8 @@ static int count_contiguous_clusters(int nb_clusters, int cluster_size,
     assert(qcow2_get_cluster_type(first_entry) == QCOW2_CLUSTER_NORMAL);
 
     for (i = 0; i < nb_clusters; i++) {
-        uint64_t l2_entry = be64_to_cpu(l2_table[i]) & mask;
-        if (offset + (uint64_t) i * cluster_size != l2_entry) {
+        uint64_t l2_entry = get_l2_entry(s, l2_table, l2_index + i) & mask;
+        if (offset + ((uint64_t) i << s->cluster_bits) != l2_entry) {
             break;
         }
     }
@@ -325,14 +325,17 @@ static int count_contiguous_clusters(int nb_clusters, int cluster_size,
 	return i;
 }
 
-static int count_contiguous_clusters_by_type(int nb_clusters,
+static int count_contiguous_clusters_by_type(BDRVQcow2State *s,
+                                             int nb_clusters,
                                              uint64_t *l2_table,
+                                             int l2_index,
                                              int wanted_type)
 {
     int i;
 
     for (i = 0; i < nb_clusters; i++) {
-        int type = qcow2_get_cluster_type(be64_to_cpu(l2_table[i]));
+        uint64_t l2_entry = get_l2_entry(s, l2_table, l2_index + i);
+        int type = qcow2_get_cluster_type(l2_entry);
 
         if (type != wanted_type) {
             break;
@@ -342,6 +345,56 @@ static int count_contiguous_clusters_by_type(int nb_clusters,
     return i;
 }
 
+/*
+ * Counterpart of count_contiguous_clusters() and
+ * count_contiguous_clusters_by_type() for images with extended L2 entries.
+ *
+ * Starting at the subcluster that contains guest offset @offset, counts the
+ * subclusters of up to @nb_clusters clusters that have the same type as the
+ * first one.  Subclusters of type QCOW2_CLUSTER_NORMAL must also be contiguous
+ * in the image file, and the flags in @stop_flags may not change from one
+ * cluster to the next.
+ *
+ * Returns the number of sectors from the start of the first cluster to the end
+ * of the last matching subcluster.
+ */
+static int count_contiguous_subclusters(BDRVQcow2State *s, uint64_t offset,
+                                        int nb_clusters, uint64_t *l2_table,
+                                        int l2_index, int wanted_type,
+                                        uint64_t stop_flags)
+{
+    uint64_t mask = stop_flags | L2E_OFFSET_MASK;
+    uint64_t first_entry = get_l2_entry(s, l2_table, l2_index) & mask;
+    int sc_index = offset_to_sc_index(s, offset);
+    int count = sc_index;
+    int i;
+
+    for (i = 0; i < nb_clusters; i++) {
+        uint64_t l2_entry = get_l2_entry(s, l2_table, l2_index + i);
+        uint64_t l2_bitmap = get_l2_bitmap(s, l2_table, l2_index + i);
+
+        if (wanted_type == QCOW2_CLUSTER_NORMAL &&
+            first_entry + ((uint64_t) i << s->cluster_bits) !=
+            (l2_entry & mask))
+        {
+            break;
+        }
+
+        for (; sc_index < QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER; sc_index++) {
+            if (qcow2_get_subcluster_type(l2_entry, l2_bitmap, sc_index)
+                != wanted_type)
+            {
+                goto out;
+            }
+            count++;
+        }
+        sc_index = 0;
+    }
+
+out:
+    return count * s->subcluster_sectors;
+}
+
 /* The crypt function is compatible with the linux cryptoloop
    algorithm for < 4 GB images. NOTE: out_buf == in_buf is
    supported */
@@ -388,74 +441,73 @@ int qcow2_encrypt_sectors(BDRVQcow2State *s, int64_t sector_num,
     return 0;
 }
 
-static int coroutine_fn copy_sectors(BlockDriverState *bs,
-                                     uint64_t start_sect,
-                                     uint64_t cluster_offset,
-                                     int n_start, int n_end)
+static int coroutine_fn do_perform_cow_read(BlockDriverState *bs,
+                                            uint64_t src_cluster_offset,
+                                            uint64_t offset_in_cluster,
+                                            QEMUIOVector *qiov)
 {
-    BDRVQcow2State *s = bs->opaque;
-    QEMUIOVector qiov;
-    struct iovec iov;
-    int n, ret;
-
-    n = n_end - n_start;
-    if (n <= 0) {
+    if (qiov->size == 0) {
         return 0;
     }
 
-    iov.iov_len = n * BDRV_SECTOR_SIZE;
-    iov.iov_base = qemu_try_blockalign(bs, iov.iov_len);
-    if (iov.iov_base == NULL) {
-        return -ENOMEM;
-    }
-
-    qemu_iovec_init_external(&qiov, &iov, 1);
-
     BLKDBG_EVENT(bs->file, BLKDBG_COW_READ);
 
     if (!bs->drv) {
-        ret = -ENOMEDIUM;
-        goto out;
+        return -ENOMEDIUM;
     }
 
     /* Call .bdrv_co_readv() directly instead of using the public block-layer
      * interface.  This avoids double I/O throttling and request tracking,
      * which can lead to deadlock when block layer copy-on-read is enabled.
      */
-    ret = bs->drv->bdrv_co_readv(bs, start_sect + n_start, n, &qiov);
-    if (ret < 0) {
-        goto out;
+    return bs->drv->bdrv_co_readv(bs, (src_cluster_offset + offset_in_cluster)
+                                      >> BDRV_SECTOR_BITS,
+                                  qiov->size >> BDRV_SECTOR_BITS, qiov);
+}
+
+static bool coroutine_fn do_perform_cow_encrypt(BlockDriverState *bs,
+                                                uint64_t src_cluster_offset,
+                                                uint64_t offset_in_cluster,
+                                                uint8_t *buffer, int nb_sectors)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Error *err = NULL;
+
+    if (nb_sectors == 0 || !bs->encrypted) {
+        return true;
     }
 
-    if (bs->encrypted) {
-        Error *err = NULL;
-        assert(s->cipher);
-        if (qcow2_encrypt_sectors(s, start_sect + n_start,
-                                  iov.iov_base, iov.iov_base, n,
-                                  true, &err) < 0) {
-            ret = -EIO;
-            error_free(err);
-            goto out;
-        }
+    assert(s->cipher);
+    if (qcow2_encrypt_sectors(s, (src_cluster_offset + offset_in_cluster)
+                                 >> BDRV_SECTOR_BITS,
+                              buffer, buffer, nb_sectors, true, &err) < 0) {
+        error_free(err);
+        return false;
     }
+    return true;
+}
 
-    ret = qcow2_pre_write_overlap_check(bs, 0,
-            cluster_offset + n_start * BDRV_SECTOR_SIZE, n * BDRV_SECTOR_SIZE);
-    if (ret < 0) {
-        goto out;
+static int coroutine_fn do_perform_cow_write(BlockDriverState *bs,
+                                             uint64_t cluster_offset,
+                                             uint64_t offset_in_cluster,
+                                             QEMUIOVector *qiov)
+{
+    int ret;
+
+    if (qiov->size == 0) {
+        return 0;
     }
 
-    BLKDBG_EVENT(bs->file, BLKDBG_COW_WRITE);
-    ret = bdrv_co_writev(bs->file->bs, (cluster_offset >> 9) + n_start, n,
-                         &qiov);
+    ret = qcow2_pre_write_overlap_check(bs, 0,
+            cluster_offset + offset_in_cluster, qiov->size);
     if (ret < 0) {
-        goto out;
+        return ret;
     }
 
-    ret = 0;
-out:
-    qemu_vfree(iov.iov_base);
-    return ret;
+    BLKDBG_EVENT(bs->file, BLKDBG_COW_WRITE);
+    return bdrv_co_writev(bs->file->bs, (cluster_offset + offset_in_cluster)
+                                        >> BDRV_SECTOR_BITS,
+                          qiov->size >> BDRV_SECTOR_BITS, qiov);
 }
 
 
@@ -537,11 +589,52 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     /* find the cluster offset for the given disk offset */
 
     l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
-    *cluster_offset = be64_to_cpu(l2_table[l2_index]);
+    *cluster_offset = get_l2_entry(s, l2_table, l2_index);
 
     /* nb_needed <= INT_MAX, thus nb_clusters <= INT_MAX, too */
     nb_clusters = size_to_clusters(s, nb_needed << 9);
 
+    if (has_subclusters(s)) {
+        uint64_t l2_bitmap = get_l2_bitmap(s, l2_table, l2_index);
+
+        ret = qcow2_get_subcluster_type(*cluster_offset, l2_bitmap,
+                                        offset_to_sc_index(s, offset));
+        switch (ret) {
+        case QCOW2_CLUSTER_COMPRESSED:
+            *cluster_offset &= L2E_COMPRESSED_OFFSET_SIZE_MASK;
+            nb_available = s->cluster_sectors;
+            break;
+        case QCOW2_CLUSTER_ZERO:
+        case QCOW2_CLUSTER_UNALLOCATED:
+            nb_available = count_contiguous_subclusters(s, offset, nb_clusters,
+                                                        l2_table, l2_index,
+                                                        ret, 0);
+            *cluster_offset = 0;
+            break;
+        case QCOW2_CLUSTER_NORMAL:
+            *cluster_offset &= L2E_OFFSET_MASK;
+            if (*cluster_offset == 0 ||
+                offset_into_cluster(s, *cluster_offset)) {
+                qcow2_signal_corruption(bs, true, -1, -1, "Invalid data "
+                                        "cluster offset %#" PRIx64 " for an "
+                                        "allocated subcluster (L2 offset: %#"
+                                        PRIx64 ", L2 index: %#x)",
+                                        *cluster_offset, l2_offset, l2_index);
+                ret = -EIO;
+                goto fail;
+            }
+            nb_available = count_contiguous_subclusters(s, offset, nb_clusters,
+                                                        l2_table, l2_index,
+                                                        ret, 0);
+            break;
+        default:
+            abort();
+        }
+
+        qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+        goto out;
+    }
+
     ret = qcow2_get_cluster_type(*cluster_offset);
     switch (ret) {
     case QCOW2_CLUSTER_COMPRESSED:
@@ -557,20 +650,21 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
             ret = -EIO;
             goto fail;
         }
-        c = count_contiguous_clusters_by_type(nb_clusters, &l2_table[l2_index],
-                                              QCOW2_CLUSTER_ZERO);
+        c = count_contiguous_clusters_by_type(s, nb_clusters, l2_table,
+                                              l2_index, QCOW2_CLUSTER_ZERO);
         *cluster_offset = 0;
         break;
     case QCOW2_CLUSTER_UNALLOCATED:
         /* how many empty clusters ? */
-        c = count_contiguous_clusters_by_type(nb_clusters, &l2_table[l2_index],
+        c = count_contiguous_clusters_by_type(s, nb_clusters, l2_table,
+                                              l2_index,
                                               QCOW2_CLUSTER_UNALLOCATED);
         *cluster_offset = 0;
         break;
     case QCOW2_CLUSTER_NORMAL:
         /* how many allocated clusters ? */
-        c = count_contiguous_clusters(nb_clusters, s->cluster_size,
-                &l2_table[l2_index], QCOW_OFLAG_ZERO);
+        c = count_contiguous_clusters(s, nb_clusters, l2_table, l2_index,
+                                      QCOW_OFLAG_ZERO);
         *cluster_offset &= L2E_OFFSET_MASK;
         if (offset_into_cluster(s, *cluster_offset)) {
             qcow2_signal_corruption(bs, true, -1, -1, "Data cluster offset %#"
@@ -659,7 +753,7 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
 
         /* Then decrease the refcount of the old table */
         if (l2_offset) {
-            qcow2_free_clusters(bs, l2_offset, s->l2_size * sizeof(uint64_t),
+            qcow2_free_clusters(bs, l2_offset, s->l2_size * l2_entry_size(s),
                                 QCOW2_DISCARD_OTHER);
         }
     }
@@ -704,7 +798,7 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 
     /* Compression can't overwrite anything. Fail if the cluster was already
      * allocated. */
-    cluster_offset = be64_to_cpu(l2_table[l2_index]);
+    cluster_offset = get_l2_entry(s, l2_table, l2_index);
     if (cluster_offset & L2E_OFFSET_MASK) {
         qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
         return 0;
@@ -728,39 +822,135 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 
     BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE_COMPRESSED);
     qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
-    l2_table[l2_index] = cpu_to_be64(cluster_offset);
+    set_l2_entry(s, l2_table, l2_index, cluster_offset);
+    if (has_subclusters(s)) {
+        set_l2_bitmap(s, l2_table, l2_index, 0);
+    }
     qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
 
     return cluster_offset;
 }
 
-static int perform_cow(BlockDriverState *bs, QCowL2Meta *m, Qcow2COWRegion *r)
+/* Largest gap between the COW regions that is read along with them */
+#define QCOW2_COW_MERGE_READ_MAX 16384
+
+/*
+ * Copies the COW regions of @m from the old location of the data (backing
+ * file, compressed cluster or unallocated space) to the newly allocated
+ * cluster.  If @m->data_qiov is set, the guest data is written together with
+ * the COW regions, so that the whole allocation takes a single write.  If
+ * the gap between both regions is small, they are also read in one go.
+ */
+static int perform_cow(BlockDriverState *bs, QCowL2Meta *m)
 {
     BDRVQcow2State *s = bs->opaque;
+    Qcow2COWRegion *start = &m->cow_start;
+    Qcow2COWRegion *end = &m->cow_end;
+    uint64_t start_bytes = start->nb_sectors * BDRV_SECTOR_SIZE;
+    uint64_t end_bytes = end->nb_sectors * BDRV_SECTOR_SIZE;
+    uint64_t data_bytes = end->offset - (start->offset + start_bytes);
+    uint64_t buffer_size;
+    bool merge_reads;
+    uint8_t *start_buffer, *end_buffer;
+    QEMUIOVector qiov;
     int ret;
 
-    if (r->nb_sectors == 0) {
+    assert(start->offset + start_bytes <= end->offset);
+    assert(!m->data_qiov || m->data_qiov->size == data_bytes);
+
+    if (start->nb_sectors == 0 && end->nb_sectors == 0) {
+        assert(!m->data_qiov);
         return 0;
     }
 
+    /* If both regions must be read and the gap between them is small, read
+     * everything at once; the data in the middle is simply overwritten */
+    merge_reads = start->nb_sectors && end->nb_sectors &&
+                  data_bytes <= QCOW2_COW_MERGE_READ_MAX;
+    if (merge_reads) {
+        buffer_size = start_bytes + data_bytes + end_bytes;
+    } else {
+        /* Keep the end region aligned in memory for the second read */
+        buffer_size = align_offset(start_bytes, bdrv_opt_mem_align(bs))
+                      + end_bytes;
+    }
+
+    start_buffer = qemu_try_blockalign(bs, buffer_size);
+    if (start_buffer == NULL) {
+        return -ENOMEM;
+    }
+    end_buffer = start_buffer + buffer_size - end_bytes;
+
+    qemu_iovec_init(&qiov, 2 + (m->data_qiov ? m->data_qiov->niov : 0));
+
     qemu_co_mutex_unlock(&s->lock);
-    ret = copy_sectors(bs, m->offset / BDRV_SECTOR_SIZE, m->alloc_offset,
-                       r->offset / BDRV_SECTOR_SIZE,
-                       r->offset / BDRV_SECTOR_SIZE + r->nb_sectors);
-    qemu_co_mutex_lock(&s->lock);
 
+    if (merge_reads) {
+        qemu_iovec_add(&qiov, start_buffer, buffer_size);
+        ret = do_perform_cow_read(bs, m->offset, start->offset, &qiov);
+    } else {
+        qemu_iovec_add(&qiov, start_buffer, start_bytes);
+        ret = do_perform_cow_read(bs, m->offset, start->offset, &qiov);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        qemu_iovec_reset(&qiov);
+        qemu_iovec_add(&qiov, end_buffer, end_bytes);
+        ret = do_perform_cow_read(bs, m->offset, end->offset, &qiov);
+    }
     if (ret < 0) {
-        return ret;
+        goto fail;
+    }
+
+    if (!do_perform_cow_encrypt(bs, m->offset, start->offset, start_buffer,
+                                start->nb_sectors) ||
+        !do_perform_cow_encrypt(bs, m->offset, end->offset, end_buffer,
+                                end->nb_sectors)) {
+        ret = -EIO;
+        goto fail;
+    }
+
+    if (m->data_qiov) {
+        /* COW regions and guest data are contiguous in the image file */
+        qemu_iovec_reset(&qiov);
+        if (start_bytes) {
+            qemu_iovec_add(&qiov, start_buffer, start_bytes);
+        }
+        qemu_iovec_concat(&qiov, m->data_qiov, 0, data_bytes);
+        if (end_bytes) {
+            qemu_iovec_add(&qiov, end_buffer, end_bytes);
+        }
+        BLKDBG_EVENT(bs->file, BLKDBG_WRITE_AIO);
+        ret = do_perform_cow_write(bs, m->alloc_offset, start->offset, &qiov);
+    } else {
+        qemu_iovec_reset(&qiov);
+        qemu_iovec_add(&qiov, start_buffer, start_bytes);
+        ret = do_perform_cow_write(bs, m->alloc_offset, start->offset, &qiov);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        qemu_iovec_reset(&qiov);
+        qemu_iovec_add(&qiov, end_buffer, end_bytes);
+        ret = do_perform_cow_write(bs, m->alloc_offset, end->offset, &qiov);
     }
 
+fail:
+    qemu_co_mutex_lock(&s->lock);
+
     /*
      * Before we update the L2 table to actually point to the new cluster, we
      * need to be sure that the refcounts have been increased and COW was
      * handled.
      */
-    qcow2_cache_depends_on_flush(s->l2_table_cache);
+    if (ret == 0) {
+        qcow2_cache_depends_on_flush(s->l2_table_cache);
+    }
 
-    return 0;
+    qemu_vfree(start_buffer);
+    qemu_iovec_destroy(&qiov);
+    return ret;
 }
 
 int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
@@ -780,12 +970,7 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
     }
 
     /* copy content of unmodified sectors */
-    ret = perform_cow(bs, m, &m->cow_start);
-    if (ret < 0) {
-        goto err;
-    }
-
-    ret = perform_cow(bs, m, &m->cow_end);
+    ret = perform_cow(bs, m);
     if (ret < 0) {
         goto err;
     }
@@ -807,18 +992,43 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
 
     assert(l2_index + m->nb_clusters <= s->l2_size);
     for (i = 0; i < m->nb_clusters; i++) {
+        uint64_t old_entry = get_l2_entry(s, l2_table, l2_index + i);
+
         /* if two concurrent writes happen to the same unallocated cluster
 	 * each write allocates separate cluster and writes data concurrently.
 	 * The first one to complete updates l2 table with pointer to its
 	 * cluster the second one has to do RMW (which is done above by
-	 * copy_sectors()), update l2 table with its cluster pointer and free
+	 * perform_cow()), update l2 table with its cluster pointer and free
 	 * old cluster. This is what this loop does */
-        if(l2_table[l2_index + i] != 0)
-            old_cluster[j++] = l2_table[l2_index + i];
+        if (old_entry != 0 && !m->keep_old) {
+            old_cluster[j++] = old_entry;
+        }
 
-        l2_table[l2_index + i] = cpu_to_be64((cluster_offset +
-                    (i << s->cluster_bits)) | QCOW_OFLAG_COPIED);
-     }
+        set_l2_entry(s, l2_table, l2_index + i,
+                     (cluster_offset + ((uint64_t) i << s->cluster_bits))
+                     | QCOW_OFLAG_COPIED);
+
+        if (has_subclusters(s)) {
+            /* The COW regions are subcluster aligned, so everything between
+             * their outer boundaries now holds valid data */
+            uint64_t cluster_start = m->offset +
+                                     ((uint64_t) i << s->cluster_bits);
+            uint64_t start = MAX(l2meta_cow_start(m), cluster_start);
+            uint64_t end = MIN(l2meta_cow_end(m),
+                               cluster_start + s->cluster_size);
+            uint64_t l2_bitmap = get_l2_bitmap(s, l2_table, l2_index + i);
+            uint64_t alloc_mask;
+
+            assert(start < end && !offset_into_subcluster(s, start) &&
+                   !offset_into_subcluster(s, end));
+            alloc_mask = qcow2_sc_alloc_mask(offset_to_sc_index(s, start),
+                                             (end - start) >>
+                                             s->subcluster_bits);
+            l2_bitmap |= alloc_mask;
+            l2_bitmap &= ~(alloc_mask << 32);
+            set_l2_bitmap(s, l2_table, l2_index + i, l2_bitmap);
+        }
+    }
 
 
     qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
@@ -831,7 +1041,7 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
      */
     if (j != 0) {
         for (i = 0; i < j; i++) {
-            qcow2_free_any_clusters(bs, be64_to_cpu(old_cluster[i]), 1,
+            qcow2_free_any_clusters(bs, old_cluster[i], 1,
                                     QCOW2_DISCARD_NEVER);
         }
     }
@@ -846,16 +1056,27 @@ err:
  * Returns the number of contiguous clusters that can be used for an allocating
  * write, but require COW to be performed (this includes yet unallocated space,
  * which must copy from the backing file)
+ *
+ * With extended L2 entries, clusters without a host offset only need COW for
+ * the subclusters that are partially written, whereas clusters with data
+ * elsewhere need a full COW.  The two kinds are never mixed in one allocation.
  */
 static int count_cow_clusters(BDRVQcow2State *s, int nb_clusters,
     uint64_t *l2_table, int l2_index)
 {
+    uint64_t first_entry = get_l2_entry(s, l2_table, l2_index);
     int i;
 
     for (i = 0; i < nb_clusters; i++) {
-        uint64_t l2_entry = be64_to_cpu(l2_table[l2_index + i]);
+        uint64_t l2_entry = get_l2_entry(s, l2_table, l2_index + i);
         int cluster_type = qcow2_get_cluster_type(l2_entry);
 
+        if (has_subclusters(s) &&
+            !(first_entry & L2E_OFFSET_MASK) != !(l2_entry & L2E_OFFSET_MASK))
+        {
+            break;
+        }
+
         switch(cluster_type) {
         case QCOW2_CLUSTER_NORMAL:
             if (l2_entry & QCOW_OFLAG_COPIED) {
@@ -904,6 +1125,15 @@ static int handle_dependencies(BlockDriverState *bs, uint64_t guest_offset,
         uint64_t old_start = l2meta_cow_start(old_alloc);
         uint64_t old_end = l2meta_cow_end(old_alloc);
 
+        if (has_subclusters(s)) {
+            /* The COW of a subcluster allocation doesn't cover the whole
+             * cluster, but the L2 entry and bitmap of the cluster are still
+             * updated at once.  Serialise everything that touches the same
+             * cluster. */
+            old_start = start_of_cluster(s, old_start);
+            old_end = align_offset(old_end, s->cluster_size);
+        }
+
         if (end <= old_start || start >= old_end) {
             /* No intersection */
         } else {
@@ -997,7 +1227,7 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
         return ret;
     }
 
-    cluster_offset = be64_to_cpu(l2_table[l2_index]);
+    cluster_offset = get_l2_entry(s, l2_table, l2_index);
 
     /* Check how many clusters are already allocated and don't need COW */
     if (qcow2_get_cluster_type(cluster_offset) == QCOW2_CLUSTER_NORMAL
@@ -1022,10 +1252,30 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
             goto out;
         }
 
+        if (has_subclusters(s)) {
+            /* We keep the allocated subclusters of QCOW_OFLAG_COPIED
+             * clusters; unallocated and zero subclusters need a COW */
+            uint64_t keep_bytes = (uint64_t)
+                count_contiguous_subclusters(s, guest_offset, nb_clusters,
+                                             l2_table, l2_index,
+                                             QCOW2_CLUSTER_NORMAL,
+                                             QCOW_OFLAG_COPIED)
+                << BDRV_SECTOR_BITS;
+
+            if (keep_bytes <= offset_into_cluster(s, guest_offset)) {
+                ret = 0;
+                goto out;
+            }
+
+            *bytes = MIN(*bytes,
+                         keep_bytes - offset_into_cluster(s, guest_offset));
+            ret = 1;
+            goto out;
+        }
+
         /* We keep all QCOW_OFLAG_COPIED clusters */
         keep_clusters =
-            count_contiguous_clusters(nb_clusters, s->cluster_size,
-                                      &l2_table[l2_index],
+            count_contiguous_clusters(s, nb_clusters, l2_table, l2_index,
                                       QCOW_OFLAG_COPIED | QCOW_OFLAG_ZERO);
         assert(keep_clusters <= nb_clusters);
 
@@ -1127,6 +1377,8 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
     uint64_t *l2_table;
     uint64_t entry;
     uint64_t nb_clusters;
+    bool keep_old = false;
+    bool full_cow = true;
     int ret;
 
     uint64_t alloc_cluster_offset;
@@ -1152,34 +1404,76 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
         return ret;
     }
 
-    entry = be64_to_cpu(l2_table[l2_index]);
+    entry = get_l2_entry(s, l2_table, l2_index);
 
-    /* For the moment, overwrite compressed clusters one by one */
-    if (entry & QCOW_OFLAG_COMPRESSED) {
+    if (has_subclusters(s) &&
+        qcow2_get_cluster_type(entry) == QCOW2_CLUSTER_NORMAL &&
+        (entry & QCOW_OFLAG_COPIED))
+    {
+        /* The cluster is ours, but the subclusters at guest_offset aren't
+         * allocated yet (handle_copied() would have taken them otherwise).
+         * Write them in place instead of allocating a new cluster. */
+        uint64_t l2_bitmap = get_l2_bitmap(s, l2_table, l2_index);
+        int sc_index = offset_to_sc_index(s, guest_offset);
+        int sc_end = sc_index;
+
+        qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+
+        alloc_cluster_offset = entry & L2E_OFFSET_MASK;
+        if (*host_offset != 0 &&
+            start_of_cluster(s, *host_offset) != alloc_cluster_offset) {
+            *bytes = 0;
+            return 0;
+        }
+
+        while (sc_end < QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER &&
+               qcow2_get_subcluster_type(entry, l2_bitmap, sc_end)
+               != QCOW2_CLUSTER_NORMAL)
+        {
+            sc_end++;
+        }
+        assert(sc_end > sc_index);
+
+        /* Pretend that the cluster ends after the last subcluster that needs
+         * to be allocated */
+        *bytes = MIN(*bytes, ((uint64_t) sc_end << s->subcluster_bits)
+                             - offset_into_cluster(s, guest_offset));
         nb_clusters = 1;
+        keep_old = true;
+        full_cow = false;
     } else {
-        nb_clusters = count_cow_clusters(s, nb_clusters, l2_table, l2_index);
-    }
+        /* For the moment, overwrite compressed clusters one by one */
+        if (entry & QCOW_OFLAG_COMPRESSED) {
+            nb_clusters = 1;
+        } else {
+            nb_clusters = count_cow_clusters(s, nb_clusters, l2_table,
+                                             l2_index);
+        }
 
-    /* This function is only called when there were no non-COW clusters, so if
-     * we can't find any unallocated or COW clusters either, something is
-     * wrong with our code. */
-    assert(nb_clusters > 0);
+        /* This function is only called when there were no non-COW clusters,
+         * so if we can't find any unallocated or COW clusters either,
+         * something is wrong with our code. */
+        assert(nb_clusters > 0);
 
-    qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+        /* Clusters without any data in the image file only need COW for the
+         * subclusters the request doesn't fully overwrite */
+        full_cow = !has_subclusters(s) || (entry & L2E_OFFSET_MASK);
 
-    /* Allocate, if necessary at a given offset in the image file */
-    alloc_cluster_offset = start_of_cluster(s, *host_offset);
-    ret = do_alloc_cluster_offset(bs, guest_offset, &alloc_cluster_offset,
-                                  &nb_clusters);
-    if (ret < 0) {
-        goto fail;
-    }
+        qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
 
-    /* Can't extend contiguous allocation */
-    if (nb_clusters == 0) {
-        *bytes = 0;
-        return 0;
+        /* Allocate, if necessary at a given offset in the image file */
+        alloc_cluster_offset = start_of_cluster(s, *host_offset);
+        ret = do_alloc_cluster_offset(bs, guest_offset, &alloc_cluster_offset,
+                                      &nb_clusters);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        /* Can't extend contiguous allocation */
+        if (nb_clusters == 0) {
+            *bytes = 0;
+            return 0;
+        }
     }
 
     /* !*host_offset would overwrite the image header and is reserved for "no
@@ -1206,6 +1500,11 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
      * nb_sectors: The number of sectors from the start of the first
      * newly allocated cluster to the end of the area that the write
      * request actually writes to (excluding COW at the end)
+     *
+     * cow_start_sectors, cow_end_sectors: The number of sectors from the start
+     * of the first newly allocated cluster to the start of the COW region
+     * before the request and to the end of the COW region after it. Without
+     * a full COW, this covers only the partially written subclusters.
      */
     int requested_sectors =
         (*bytes + offset_into_cluster(s, guest_offset))
@@ -1215,8 +1514,16 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
     int alloc_n_start = offset_into_cluster(s, guest_offset)
                         >> BDRV_SECTOR_BITS;
     int nb_sectors = MIN(requested_sectors, avail_sectors);
+    int cow_start_sectors = 0;
+    int cow_end_sectors = avail_sectors;
     QCowL2Meta *old_m = *m;
 
+    if (!full_cow) {
+        cow_start_sectors = alloc_n_start & ~(s->subcluster_sectors - 1);
+        cow_end_sectors = MIN(align_offset(nb_sectors, s->subcluster_sectors),
+                              avail_sectors);
+    }
+
     *m = g_malloc0(sizeof(**m));
 
     **m = (QCowL2Meta) {
@@ -1226,14 +1533,15 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
         .offset         = start_of_cluster(s, guest_offset),
         .nb_clusters    = nb_clusters,
         .nb_available   = nb_sectors,
+        .keep_old       = keep_old,
 
         .cow_start = {
-            .offset     = 0,
-            .nb_sectors = alloc_n_start,
+            .offset     = cow_start_sectors * BDRV_SECTOR_SIZE,
+            .nb_sectors = alloc_n_start - cow_start_sectors,
         },
         .cow_end = {
             .offset     = nb_sectors * BDRV_SECTOR_SIZE,
-            .nb_sectors = avail_sectors - nb_sectors,
+            .nb_sectors = cow_end_sectors - nb_sectors,
         },
     };
     qemu_co_queue_init(&(*m)->dependent_requests);
@@ -1460,7 +1768,28 @@ static int discard_single_l2(BlockDriverState *bs, uint64_t offset,
     for (i = 0; i < nb_clusters; i++) {
         uint64_t old_l2_entry;
 
-        old_l2_entry = be64_to_cpu(l2_table[l2_index + i]);
+        old_l2_entry = get_l2_entry(s, l2_table, l2_index + i);
+
+        if (has_subclusters(s)) {
+            /* Clusters with a host offset always need to be freed; without
+             * one, only the bitmap may need to change */
+            if (!(old_l2_entry & L2E_OFFSET_MASK)) {
+                uint64_t l2_bitmap = get_l2_bitmap(s, l2_table, l2_index + i);
+
+                if (full_discard ? l2_bitmap == 0
+                                 : (!bs->backing ||
+                                    l2_bitmap == QCOW_L2_BITMAP_ALL_ZEROES)) {
+                    continue;
+                }
+            }
+
+            qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
+            set_l2_entry(s, l2_table, l2_index + i, 0);
+            set_l2_bitmap(s, l2_table, l2_index + i,
+                          full_discard ? 0 : QCOW_L2_BITMAP_ALL_ZEROES);
+            qcow2_free_any_clusters(bs, old_l2_entry, 1, type);
+            continue;
+        }
 
         /*
          * If full_discard is false, make sure that a discarded area reads back
@@ -1560,13 +1889,14 @@ fail:
  * clusters.
  */
 static int zero_single_l2(BlockDriverState *bs, uint64_t offset,
-                          uint64_t nb_clusters)
+                          uint64_t nb_clusters, int flags)
 {
     BDRVQcow2State *s = bs->opaque;
     uint64_t *l2_table;
     int l2_index;
     int ret;
     int i;
+    bool unmap = !!(flags & BDRV_REQ_MAY_UNMAP);
 
     ret = get_cluster_table(bs, offset, &l2_table, &l2_index);
     if (ret < 0) {
@@ -1580,13 +1910,29 @@ static int zero_single_l2(BlockDriverState *bs, uint64_t offset,
     for (i = 0; i < nb_clusters; i++) {
         uint64_t old_offset;
 
-        old_offset = be64_to_cpu(l2_table[l2_index + i]);
+        old_offset = get_l2_entry(s, l2_table, l2_index + i);
 
         /* Update L2 entries */
         qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
-        if (old_offset & QCOW_OFLAG_COMPRESSED) {
+        if (has_subclusters(s)) {
+            /* Keep the host cluster (if any) for later writes unless we may
+             * unmap it, but make all subclusters read as zeros */
+            if ((old_offset & QCOW_OFLAG_COMPRESSED) ||
+                (unmap && (old_offset & L2E_OFFSET_MASK)))
+            {
+                set_l2_entry(s, l2_table, l2_index + i, 0);
+                qcow2_free_any_clusters(bs, old_offset, 1,
+                                        QCOW2_DISCARD_REQUEST);
+                s->alloc_stats.unmapped_clusters++;
+            }
+            set_l2_bitmap(s, l2_table, l2_index + i,
+                          QCOW_L2_BITMAP_ALL_ZEROES);
+        } else if ((old_offset & QCOW_OFLAG_COMPRESSED) ||
+                   (unmap && (old_offset & L2E_OFFSET_MASK)))
+        {
             l2_table[l2_index + i] = cpu_to_be64(QCOW_OFLAG_ZERO);
             qcow2_free_any_clusters(bs, old_offset, 1, QCOW2_DISCARD_REQUEST);
+            s->alloc_stats.unmapped_clusters++;
         } else {
             l2_table[l2_index + i] |= cpu_to_be64(QCOW_OFLAG_ZERO);
         }
@@ -1594,10 +1940,18 @@ static int zero_single_l2(BlockDriverState *bs, uint64_t offset,
 
     qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
 
+    s->alloc_stats.zero_clusters += nb_clusters;
     return nb_clusters;
 }
 
-int qcow2_zero_clusters(BlockDriverState *bs, uint64_t offset, int nb_sectors)
+/*
+ * Makes the given range read as zeros by setting the zero flag in its L2
+ * entries.  If flags contains BDRV_REQ_MAY_UNMAP, the host clusters are freed
+ * (which is passed to the image file as a discard request with
+ * pass-discard-request), otherwise they are kept for later writes.
+ */
+int qcow2_zero_clusters(BlockDriverState *bs, uint64_t offset, int nb_sectors,
+                        int flags)
 {
     BDRVQcow2State *s = bs->opaque;
     uint64_t nb_clusters;
@@ -1614,7 +1968,7 @@ int qcow2_zero_clusters(BlockDriverState *bs, uint64_t offset, int nb_sectors)
     s->cache_discards = true;
 
     while (nb_clusters > 0) {
-        ret = zero_single_l2(bs, offset, nb_clusters);
+        ret = zero_single_l2(bs, offset, nb_clusters, flags);
         if (ret < 0) {
             goto fail;
         }
@@ -1839,6 +2193,10 @@ int qcow2_expand_zero_clusters(BlockDriverState *bs,
     int ret;
     int i, j;
 
+    /* Images with extended L2 entries can't be downgraded, so they never need
+     * their zero clusters expanded */
+    assert(!has_subclusters(s));
+
     if (status_cb) {
         l1_entries = s->l1_size;
         for (i = 0; i < s->nb_snapshots; i++) {
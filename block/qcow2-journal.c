@@ -0,0 +1,647 @@
+/*
+ * qcow2 metadata journal
+ *
+ * Without a journal, qcow2 keeps its metadata consistent by writing dirty L2
+ * tables and refcount blocks in an order that can at worst leak clusters,
+ * which takes a disk flush between the two caches.  With a journal, all dirty
+ * tables of both caches are appended to the journal as a single entry, which
+ * is flushed once.  The tables stay in the cache as committed and are only
+ * written to their place in the image file when they are evicted or when the
+ * journal is emptied.  After a crash, replaying the journal on open restores
+ * a state in which every update that had been committed is complete.
+ *
+ * The journal is a sequence of entries behind a journal header.  The header
+ * records the sequence number of the first valid entry; entries that follow
+ * it with consecutive sequence numbers and a valid checksum are replayed.
+ * When the journal is about to fill up or a table that is in the journal is
+ * freed, all committed tables are written in place and flushed, and the
+ * journal is emptied (checkpointed) by bumping the sequence number in the
+ * header.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu-common.h"
+#include "block/block_int.h"
+#include "qemu/crc32c.h"
+#include "qcow2.h"
+#include "trace.h"
+
+#define QCOW2_JOURNAL_MAGIC       0x716a6864 /* "qjhd" */
+#define QCOW2_JOURNAL_ENTRY_MAGIC 0x716a656e /* "qjen" */
+
+typedef struct Qcow2JournalHeader {
+    uint32_t magic;
+    uint32_t checksum;
+    uint64_t sequence;
+} QEMU_PACKED Qcow2JournalHeader;
+
+/* An entry starts with this descriptor, padded to a full journal block, and
+ * is followed by the tables themselves; the whole entry is padded to a full
+ * journal block.  The checksum covers the whole entry with the checksum field
+ * set to zero. */
+typedef struct Qcow2JournalEntry {
+    uint32_t magic;
+    uint32_t checksum;
+    uint64_t sequence;
+    uint32_t length;
+    uint32_t nb_tables;
+    uint64_t table_offsets[];
+} QEMU_PACKED Qcow2JournalEntry;
+
+static size_t journal_desc_size(int nb_tables)
+{
+    return ROUND_UP(sizeof(Qcow2JournalEntry) + nb_tables * sizeof(uint64_t),
+                    QCOW2_JOURNAL_BLOCK_SIZE);
+}
+
+static size_t journal_entry_size(BDRVQcow2State *s, int nb_tables)
+{
+    return journal_desc_size(nb_tables) +
+           ROUND_UP((size_t)nb_tables * s->cluster_size,
+                    QCOW2_JOURNAL_BLOCK_SIZE);
+}
+
+static uint64_t journal_size_for_tables(BDRVQcow2State *s, int nb_tables)
+{
+    /* Journal header, entry descriptor and padding take at most four blocks */
+    return 4 * QCOW2_JOURNAL_BLOCK_SIZE +
+           (uint64_t)nb_tables * (s->cluster_size + sizeof(uint64_t));
+}
+
+/* Returns the maximum number of tables a single entry can hold */
+int qcow2_journal_max_tables(BDRVQcow2State *s)
+{
+    if (s->journal_size < 4 * QCOW2_JOURNAL_BLOCK_SIZE) {
+        return 0;
+    }
+    return (s->journal_size - 4 * QCOW2_JOURNAL_BLOCK_SIZE)
+           / (s->cluster_size + sizeof(uint64_t));
+}
+
+static int journal_write_header(BlockDriverState *bs, uint64_t sequence)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2JournalHeader *header;
+    int ret;
+
+    header = qemu_try_blockalign0(bs->file->bs, QCOW2_JOURNAL_BLOCK_SIZE);
+    if (header == NULL) {
+        return -ENOMEM;
+    }
+
+    header->magic = cpu_to_be32(QCOW2_JOURNAL_MAGIC);
+    header->sequence = cpu_to_be64(sequence);
+    header->checksum = cpu_to_be32(crc32c(0xffffffff, (uint8_t *) header,
+                                          sizeof(*header)));
+
+    ret = qcow2_pre_write_overlap_check(bs, QCOW2_OL_JOURNAL,
+                                        s->journal_offset,
+                                        QCOW2_JOURNAL_BLOCK_SIZE);
+    if (ret < 0) {
+        goto out;
+    }
+
+    ret = bdrv_pwrite_sync(bs->file->bs, s->journal_offset, header,
+                           QCOW2_JOURNAL_BLOCK_SIZE);
+out:
+    qemu_vfree(header);
+    return ret;
+}
+
+static void journal_reset(BDRVQcow2State *s, uint64_t sequence)
+{
+    s->journal_sequence = sequence;
+    s->journal_pos = QCOW2_JOURNAL_BLOCK_SIZE;
+    g_hash_table_remove_all(s->journal_tables);
+}
+
+/*
+ * Allocates a metadata journal of @size bytes (or a default size if @size is
+ * 0) in a freshly created image and enables it in the image header.
+ */
+int qcow2_journal_create(BlockDriverState *bs, uint64_t size, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t min_size;
+    int l2_tables, refcount_tables;
+    int64_t offset;
+    int ret;
+
+    assert(!has_journal(s));
+
+    /* The default metadata cache sizes must fit into a single entry */
+    l2_tables = MAX(DEFAULT_L2_CACHE_BYTE_SIZE / s->cluster_size,
+                    DEFAULT_L2_CACHE_CLUSTERS);
+    refcount_tables = MAX(l2_tables / DEFAULT_L2_REFCOUNT_SIZE_RATIO,
+                          MIN_REFCOUNT_CACHE_SIZE);
+    min_size = journal_size_for_tables(s, l2_tables + refcount_tables);
+
+    if (size == 0) {
+        size = MAX(QCOW2_JOURNAL_DEFAULT_SIZE, 2 * min_size);
+    }
+    size = ROUND_UP(size, MAX(s->cluster_size, QCOW2_JOURNAL_BLOCK_SIZE));
+
+    if (size < min_size) {
+        error_setg(errp, "The metadata journal must be at least %" PRIu64
+                   " bytes for this cluster size", min_size);
+        return -EINVAL;
+    }
+    if (size > QCOW2_JOURNAL_MAX_SIZE) {
+        error_setg(errp, "The metadata journal may not exceed %d bytes",
+                   QCOW2_JOURNAL_MAX_SIZE);
+        return -EINVAL;
+    }
+
+    offset = qcow2_alloc_clusters(bs, size);
+    if (offset < 0) {
+        error_setg_errno(errp, -offset, "Could not allocate metadata journal");
+        return offset;
+    }
+
+    /* Get the refcount update out before the journal takes over */
+    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not flush the refcount block "
+                         "cache");
+        return ret;
+    }
+
+    s->journal_offset = offset;
+    s->journal_size = size;
+
+    ret = journal_write_header(bs, 1);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write metadata journal "
+                         "header");
+        goto fail;
+    }
+
+    s->journal_tables = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                              g_free, NULL);
+    journal_reset(s, 1);
+
+    s->incompatible_features |= QCOW2_INCOMPAT_JOURNAL;
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not update qcow2 header");
+        s->incompatible_features &= ~QCOW2_INCOMPAT_JOURNAL;
+        goto fail;
+    }
+
+    return 0;
+
+fail:
+    s->journal_offset = 0;
+    s->journal_size = 0;
+    return ret;
+}
+
+/* Reads the sequence number of the first valid entry from the header */
+static int journal_read_header(BlockDriverState *bs, uint64_t *sequence,
+                               Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2JournalHeader header;
+    uint32_t checksum;
+    int ret;
+
+    ret = bdrv_pread(bs->file->bs, s->journal_offset, &header,
+                     sizeof(header));
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read metadata journal header");
+        return ret;
+    }
+
+    checksum = be32_to_cpu(header.checksum);
+    header.checksum = 0;
+    if (be32_to_cpu(header.magic) != QCOW2_JOURNAL_MAGIC ||
+        crc32c(0xffffffff, (uint8_t *) &header, sizeof(header)) != checksum)
+    {
+        error_setg(errp, "Metadata journal header is corrupted");
+        return -EINVAL;
+    }
+
+    *sequence = be64_to_cpu(header.sequence);
+    return 0;
+}
+
+/*
+ * Writes the tables of all valid entries, starting with the one numbered
+ * *@sequence, to their place in the image file.  On return, *@sequence is the
+ * number of the entry after the last valid one.  Returns the number of
+ * entries that were replayed, or -errno on error.
+ */
+static int journal_replay(BlockDriverState *bs, uint64_t *sequence,
+                          Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2JournalEntry *entry = NULL;
+    uint64_t pos;
+    uint32_t checksum, length, nb_tables;
+    int max_tables = qcow2_journal_max_tables(s);
+    int nb_entries = 0;
+    int i, ret;
+
+    entry = qemu_try_blockalign(bs->file->bs, QCOW2_JOURNAL_BLOCK_SIZE);
+    if (entry == NULL) {
+        error_setg(errp, "Could not allocate metadata journal buffer");
+        return -ENOMEM;
+    }
+
+    for (pos = QCOW2_JOURNAL_BLOCK_SIZE;
+         pos + QCOW2_JOURNAL_BLOCK_SIZE <= s->journal_size;
+         pos += length)
+    {
+        uint8_t *tables;
+
+        ret = bdrv_pread(bs->file->bs, s->journal_offset + pos, entry,
+                         QCOW2_JOURNAL_BLOCK_SIZE);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not read metadata journal");
+            goto out;
+        }
+
+        /* The first entry that doesn't follow the previous one ends the
+         * journal */
+        length = be32_to_cpu(entry->length);
+        nb_tables = be32_to_cpu(entry->nb_tables);
+        if (be32_to_cpu(entry->magic) != QCOW2_JOURNAL_ENTRY_MAGIC ||
+            be64_to_cpu(entry->sequence) != *sequence ||
+            nb_tables == 0 || nb_tables > max_tables ||
+            length != journal_entry_size(s, nb_tables) ||
+            length > s->journal_size - pos)
+        {
+            break;
+        }
+
+        qemu_vfree(entry);
+        entry = qemu_try_blockalign(bs->file->bs, length);
+        if (entry == NULL) {
+            error_setg(errp, "Could not allocate metadata journal buffer");
+            ret = -ENOMEM;
+            goto out;
+        }
+
+        ret = bdrv_pread(bs->file->bs, s->journal_offset + pos, entry, length);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not read metadata journal");
+            goto out;
+        }
+
+        /* A torn entry was never committed */
+        checksum = be32_to_cpu(entry->checksum);
+        entry->checksum = 0;
+        if (crc32c(0xffffffff, (uint8_t *) entry, length) != checksum) {
+            break;
+        }
+
+        if (bs->read_only) {
+            error_setg(errp, "The metadata journal of this image needs to be "
+                       "replayed; open it read/write once to do so");
+            ret = -EPERM;
+            goto out;
+        }
+
+        tables = (uint8_t *) entry + journal_desc_size(nb_tables);
+        for (i = 0; i < nb_tables; i++) {
+            uint64_t offset = be64_to_cpu(entry->table_offsets[i]);
+
+            if (offset_into_cluster(s, offset) ||
+                offset < s->cluster_size)
+            {
+                error_setg(errp, "Metadata journal entry %" PRIu64 " contains "
+                           "an invalid table offset", *sequence);
+                ret = -EINVAL;
+                goto out;
+            }
+
+            ret = qcow2_pre_write_overlap_check(bs,
+                    QCOW2_OL_ACTIVE_L2 | QCOW2_OL_REFCOUNT_BLOCK |
+                    QCOW2_OL_INACTIVE_L2, offset, s->cluster_size);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "Metadata journal entry %" PRIu64
+                                 " overlaps with other metadata", *sequence);
+                goto out;
+            }
+
+            ret = bdrv_pwrite(bs->file->bs, offset,
+                              tables + (size_t)i * s->cluster_size,
+                              s->cluster_size);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "Could not replay metadata "
+                                 "journal");
+                goto out;
+            }
+        }
+
+        nb_entries++;
+        (*sequence)++;
+    }
+
+    trace_qcow2_journal_replay(bs, nb_entries, *sequence);
+    ret = nb_entries;
+out:
+    qemu_vfree(entry);
+    return ret;
+}
+
+/*
+ * Replays all valid entries of the journal whose position and size have been
+ * read from the header extension.  Returns 0 on success and -errno on error.
+ */
+int qcow2_journal_open(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t sequence;
+    int ret;
+
+    s->journal_tables = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                              g_free, NULL);
+
+    ret = journal_read_header(bs, &sequence, errp);
+    if (ret < 0) {
+        return ret;
+    }
+    journal_reset(s, sequence);
+
+    /* Inactive images are not written to; the journal is replayed once they
+     * are activated and opened again */
+    if (s->flags & BDRV_O_INACTIVE) {
+        return 0;
+    }
+
+    ret = journal_replay(bs, &sequence, errp);
+    if (ret > 0) {
+        ret = bdrv_flush(bs->file->bs);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not replay metadata journal");
+            return ret;
+        }
+
+        ret = journal_write_header(bs, sequence);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not write metadata journal "
+                             "header");
+            return ret;
+        }
+        journal_reset(s, sequence);
+    }
+
+    return ret < 0 ? ret : 0;
+}
+
+void qcow2_journal_close(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (s->journal_tables) {
+        g_hash_table_destroy(s->journal_tables);
+        s->journal_tables = NULL;
+    }
+}
+
+/*
+ * Writes all committed tables to their place in the image file and empties
+ * the journal.  Tables that were modified again after their last commit
+ * can't be taken from the cache, so in that case the journal is replayed from
+ * the image file instead.  If anything fails, the journal stays valid and the
+ * next checkpoint tries again.
+ */
+static int journal_apply(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret;
+
+    if (s->journal_pos == QCOW2_JOURNAL_BLOCK_SIZE) {
+        return 0;
+    }
+
+    trace_qcow2_journal_checkpoint(bs, s->journal_sequence);
+
+    if (qcow2_cache_has_dirty_committed(s->refcount_block_cache) ||
+        qcow2_cache_has_dirty_committed(s->l2_table_cache))
+    {
+        Error *local_err = NULL;
+        uint64_t sequence;
+
+        ret = journal_read_header(bs, &sequence, &local_err);
+        if (ret == 0) {
+            ret = journal_replay(bs, &sequence, &local_err);
+        }
+        if (ret >= 0 && sequence != s->journal_sequence) {
+            error_setg(&local_err, "Metadata journal ends at entry %" PRIu64
+                       " instead of %" PRIu64, sequence, s->journal_sequence);
+            ret = -EIO;
+        }
+        if (ret < 0) {
+            error_report_err(local_err);
+            return ret;
+        }
+    } else {
+        ret = qcow2_cache_write_committed(bs, s->refcount_block_cache);
+        if (ret == 0) {
+            ret = qcow2_cache_write_committed(bs, s->l2_table_cache);
+        }
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    ret = bdrv_flush(bs->file->bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = journal_write_header(bs, s->journal_sequence);
+    if (ret < 0) {
+        return ret;
+    }
+
+    journal_reset(s, s->journal_sequence);
+    qcow2_cache_clear_committed(s->refcount_block_cache);
+    qcow2_cache_clear_committed(s->l2_table_cache);
+    return 0;
+}
+
+/*
+ * Commits all dirty tables, writes all tables in the journal to their place
+ * in the image file and empties the journal.
+ */
+int qcow2_journal_checkpoint(BlockDriverState *bs)
+{
+    int ret;
+
+    ret = qcow2_journal_commit(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return journal_apply(bs);
+}
+
+/*
+ * Called when the refcount of the cluster at @offset drops to zero.  If that
+ * cluster was a table in the journal, replaying the journal could overwrite
+ * whatever the cluster is reused for, so the journal is emptied.  Tables that
+ * are dirty now are left alone, the update that frees the cluster isn't
+ * complete yet.
+ */
+int qcow2_journal_cluster_freed(BlockDriverState *bs, uint64_t offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (!g_hash_table_lookup(s->journal_tables, &offset)) {
+        return 0;
+    }
+
+    return journal_apply(bs);
+}
+
+/*
+ * Writes all dirty L2 tables and refcount blocks to the journal as a single
+ * entry and flushes it.  The tables are written to their place in the image
+ * file later, see journal_apply().  This replaces flushing the metadata
+ * caches.
+ */
+int qcow2_journal_commit(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2JournalEntry *entry = NULL;
+    QEMUIOVector qiov;
+    uint64_t *offsets = NULL;
+    void **tables = NULL;
+    size_t desc_size, entry_size, max_size, padding;
+    uint32_t checksum;
+    int nb_tables, nb_refblocks, i;
+    int ret;
+
+    nb_refblocks = qcow2_cache_get_dirty(bs, s->refcount_block_cache,
+                                         NULL, NULL);
+    nb_tables = nb_refblocks + qcow2_cache_get_dirty(bs, s->l2_table_cache,
+                                                     NULL, NULL);
+    if (nb_tables == 0) {
+        return 0;
+    }
+    assert(nb_tables <= qcow2_journal_max_tables(s));
+
+    trace_qcow2_journal_commit(bs, nb_tables, s->journal_pos,
+                               s->journal_sequence);
+
+    desc_size = journal_desc_size(nb_tables);
+    entry_size = journal_entry_size(s, nb_tables);
+    padding = entry_size - desc_size - (size_t)nb_tables * s->cluster_size;
+
+    /* Space for the entry is normally left by the previous commit, unless
+     * emptying the journal failed then */
+    if (s->journal_pos + entry_size > s->journal_size) {
+        ret = journal_apply(bs);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    /* Guest data written for COW must be stable before the L2 entries that
+     * point to it */
+    if (qcow2_cache_get_depends_on_flush(s->l2_table_cache) ||
+        qcow2_cache_get_depends_on_flush(s->refcount_block_cache))
+    {
+        ret = bdrv_flush(bs->file->bs);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    /* The padding after the tables is taken from the end of the zeroed
+     * descriptor buffer */
+    entry = qemu_try_blockalign0(bs->file->bs,
+                                 desc_size + QCOW2_JOURNAL_BLOCK_SIZE);
+    offsets = g_new(uint64_t, nb_tables);
+    tables = g_new(void *, nb_tables);
+    if (entry == NULL) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    qcow2_cache_get_dirty(bs, s->refcount_block_cache, offsets, tables);
+    qcow2_cache_get_dirty(bs, s->l2_table_cache, offsets + nb_refblocks,
+                          tables + nb_refblocks);
+
+    entry->magic = cpu_to_be32(QCOW2_JOURNAL_ENTRY_MAGIC);
+    entry->sequence = cpu_to_be64(s->journal_sequence);
+    entry->length = cpu_to_be32(entry_size);
+    entry->nb_tables = cpu_to_be32(nb_tables);
+    for (i = 0; i < nb_tables; i++) {
+        entry->table_offsets[i] = cpu_to_be64(offsets[i]);
+    }
+
+    qemu_iovec_init(&qiov, nb_tables + 2);
+    qemu_iovec_add(&qiov, entry, desc_size);
+    checksum = crc32c(0xffffffff, (uint8_t *) entry, desc_size);
+    /* crc32c() inverts its result, which must be undone to continue it */
+    for (i = 0; i < nb_tables; i++) {
+        qemu_iovec_add(&qiov, tables[i], s->cluster_size);
+        checksum = crc32c(checksum ^ 0xffffffff, tables[i], s->cluster_size);
+    }
+    if (padding) {
+        qemu_iovec_add(&qiov, (uint8_t *) entry + desc_size, padding);
+        checksum = crc32c(checksum ^ 0xffffffff,
+                          (uint8_t *) entry + desc_size, padding);
+    }
+    entry->checksum = cpu_to_be32(checksum);
+
+    ret = qcow2_pre_write_overlap_check(bs, QCOW2_OL_JOURNAL,
+                                        s->journal_offset + s->journal_pos,
+                                        entry_size);
+    if (ret < 0) {
+        goto out_qiov;
+    }
+
+    ret = bdrv_pwritev(bs->file->bs, s->journal_offset + s->journal_pos,
+                       &qiov);
+    if (ret < 0) {
+        goto out_qiov;
+    }
+
+    ret = bdrv_flush(bs->file->bs);
+    if (ret < 0) {
+        goto out_qiov;
+    }
+
+    /* The entry is committed, its tables can't be freed without emptying the
+     * journal first */
+    s->journal_pos += entry_size;
+    s->journal_sequence++;
+    for (i = 0; i < nb_tables; i++) {
+        uint64_t *key = g_new(uint64_t, 1);
+        *key = offsets[i];
+        g_hash_table_replace(s->journal_tables, key, key);
+    }
+
+    /* Until the next checkpoint, a crash just replays the entry, so the
+     * tables need not be written in place yet */
+    qcow2_cache_mark_committed(s->refcount_block_cache);
+    qcow2_cache_mark_committed(s->l2_table_cache);
+
+    /* Empty the journal while no committed table is dirty, so that it can
+     * be done from the cache.  If this fails, the entry is still committed
+     * and the next commit tries again. */
+    max_size = journal_entry_size(s,
+        qcow2_cache_get_num_tables(s->refcount_block_cache) +
+        qcow2_cache_get_num_tables(s->l2_table_cache));
+    if (s->journal_pos + max_size > s->journal_size) {
+        journal_apply(bs);
+    }
+    ret = 0;
+
+out_qiov:
+    qemu_iovec_destroy(&qiov);
+out:
+    qemu_vfree(entry);
+    g_free(offsets);
+    g_free(tables);
+    return ret;
+}
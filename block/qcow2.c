@@ -62,6 +62,12 @@ typedef struct {
 #define  QCOW2_EXT_MAGIC_END 0
 #define  QCOW2_EXT_MAGIC_BACKING_FORMAT 0xE2792ACA
 #define  QCOW2_EXT_MAGIC_FEATURE_TABLE 0x6803f857
+#define  QCOW2_EXT_MAGIC_JOURNAL 0x4a4e4c31
+
+typedef struct {
+    uint64_t offset;
+    uint64_t size;
+} QEMU_PACKED Qcow2JournalHeaderExt;
 
 static int qcow2_probe(const uint8_t *buf, int buf_size, const char *filename)
 {
@@ -161,6 +167,30 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             }
             break;
 
+        case QCOW2_EXT_MAGIC_JOURNAL:
+        {
+            Qcow2JournalHeaderExt journal_ext;
+
+            if (ext.len != sizeof(journal_ext)) {
+                error_setg(errp, "ERROR: ext_journal: Invalid extension "
+                           "length");
+                return -EINVAL;
+            }
+            ret = bdrv_pread(bs->file->bs, offset, &journal_ext, ext.len);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "ERROR: ext_journal: "
+                                 "Could not read extension");
+                return ret;
+            }
+            s->journal_offset = be64_to_cpu(journal_ext.offset);
+            s->journal_size = be64_to_cpu(journal_ext.size);
+#ifdef DEBUG_EXT
+            printf("Qcow2: Got journal extension: offset=%" PRIu64
+                   " size=%" PRIu64 "\n", s->journal_offset, s->journal_size);
+#endif
+            break;
+        }
+
         default:
             /* unknown magic - save it in case we need to rewrite the header */
             {
@@ -332,14 +362,44 @@ int qcow2_mark_consistent(BlockDriverState *bs)
     return 0;
 }
 
+/* Writes all metadata to its place in the image file and empties the journal,
+ * so that metadata written directly to the image file can't be overwritten by
+ * replaying older journal entries */
+static int qcow2_empty_journal(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (!has_journal(s)) {
+        return 0;
+    }
+
+    return qcow2_journal_checkpoint(bs);
+}
+
 static int qcow2_check(BlockDriverState *bs, BdrvCheckResult *result,
                        BdrvCheckMode fix)
 {
-    int ret = qcow2_check_refcounts(bs, result, fix);
+    int ret;
+
+    if (fix) {
+        ret = qcow2_empty_journal(bs);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    ret = qcow2_check_refcounts(bs, result, fix);
     if (ret < 0) {
         return ret;
     }
 
+    if (fix) {
+        ret = qcow2_empty_journal(bs);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
     if (fix && result->check_errors == 0 && result->corruptions == 0) {
         ret = qcow2_mark_clean(bs);
         if (ret < 0) {
@@ -453,6 +513,11 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_BOOL,
             .help = "Check for unintended writes into an inactive L2 table",
         },
+        {
+            .name = QCOW2_OPT_OVERLAP_JOURNAL,
+            .type = QEMU_OPT_BOOL,
+            .help = "Check for unintended writes into the metadata journal",
+        },
         {
             .name = QCOW2_OPT_CACHE_SIZE,
             .type = QEMU_OPT_SIZE,
@@ -474,6 +539,12 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "Clean unused cache entries after this time (in seconds)",
         },
+        {
+            .name = QCOW2_OPT_PREALLOC_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Grow the image file in steps of this size when "
+                    "clusters are allocated at its end (0 to disable)",
+        },
         { /* end of list */ }
     },
 };
@@ -487,6 +558,7 @@ static const char *overlap_bool_option_names[QCOW2_OL_MAX_BITNR] = {
     [QCOW2_OL_SNAPSHOT_TABLE_BITNR] = QCOW2_OPT_OVERLAP_SNAPSHOT_TABLE,
     [QCOW2_OL_INACTIVE_L1_BITNR]    = QCOW2_OPT_OVERLAP_INACTIVE_L1,
     [QCOW2_OL_INACTIVE_L2_BITNR]    = QCOW2_OPT_OVERLAP_INACTIVE_L2,
+    [QCOW2_OL_JOURNAL_BITNR]        = QCOW2_OPT_OVERLAP_JOURNAL,
 };
 
 static void cache_clean_timer_cb(void *opaque)
@@ -598,6 +670,7 @@ typedef struct Qcow2ReopenState {
     int overlap_check;
     bool discard_passthrough[QCOW2_DISCARD_MAX];
     uint64_t cache_clean_interval;
+    uint64_t prealloc_size;
 } Qcow2ReopenState;
 
 static int qcow2_update_options_prepare(BlockDriverState *bs,
@@ -651,6 +724,17 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         goto fail;
     }
 
+    /* A journal commit writes all dirty tables in a single entry */
+    if (has_journal(s) &&
+        l2_cache_size + refcount_cache_size > qcow2_journal_max_tables(s))
+    {
+        error_setg(errp, "The metadata caches may not hold more than %d "
+                   "tables with a %" PRIu64 " byte metadata journal",
+                   qcow2_journal_max_tables(s), s->journal_size);
+        ret = -EINVAL;
+        goto fail;
+    }
+
     /* alloc new L2 table/refcount block cache, flush old one */
     if (s->l2_table_cache) {
         ret = qcow2_cache_flush(bs, s->l2_table_cache);
@@ -669,6 +753,17 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         }
     }
 
+    /* Committed tables that haven't been written in place yet would get lost
+     * with the old caches */
+    if (has_journal(s) && s->l2_table_cache) {
+        ret = qcow2_journal_checkpoint(bs);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Failed to empty the metadata "
+                             "journal");
+            goto fail;
+        }
+    }
+
     r->l2_table_cache = qcow2_cache_create(bs, l2_cache_size);
     r->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size);
     if (r->l2_table_cache == NULL || r->refcount_block_cache == NULL) {
@@ -756,6 +851,22 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
     r->discard_passthrough[QCOW2_DISCARD_OTHER] =
         qemu_opt_get_bool(opts, QCOW2_OPT_DISCARD_OTHER, false);
 
+    /* Preallocation step for the image file */
+    r->prealloc_size = qemu_opt_get_size(opts, QCOW2_OPT_PREALLOC_SIZE,
+                                         s->prealloc_size);
+    if (r->prealloc_size % s->cluster_size) {
+        error_setg(errp, QCOW2_OPT_PREALLOC_SIZE " must be a multiple of the "
+                   "cluster size");
+        ret = -EINVAL;
+        goto fail;
+    }
+    if (r->prealloc_size > QCOW2_MAX_PREALLOC_SIZE) {
+        error_setg(errp, QCOW2_OPT_PREALLOC_SIZE " may not exceed %d bytes",
+                   QCOW2_MAX_PREALLOC_SIZE);
+        ret = -EINVAL;
+        goto fail;
+    }
+
     ret = 0;
 fail:
     qemu_opts_del(opts);
@@ -790,6 +901,8 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
         s->cache_clean_interval = r->cache_clean_interval;
         cache_clean_timer_init(bs, bdrv_get_aio_context(bs));
     }
+
+    s->prealloc_size = r->prealloc_size;
 }
 
 static void qcow2_update_options_abort(BlockDriverState *bs,
@@ -982,8 +1095,24 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         bs->encrypted = 1;
     }
 
-    s->l2_bits = s->cluster_bits - 3; /* L2 is always one cluster */
+    if (has_subclusters(s) && s->cluster_bits < MIN_EXTL2_CLUSTER_BITS) {
+        error_setg(errp, "Extended L2 entries require a cluster size of at "
+                   "least %d bytes", 1 << MIN_EXTL2_CLUSTER_BITS);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    /* L2 is always one cluster */
+    s->l2_bits = s->cluster_bits - 3 - has_subclusters(s);
     s->l2_size = 1 << s->l2_bits;
+    if (has_subclusters(s)) {
+        s->subcluster_bits = s->cluster_bits -
+                            ctz32(QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER);
+    } else {
+        s->subcluster_bits = s->cluster_bits;
+    }
+    s->subcluster_size = 1 << s->subcluster_bits;
+    s->subcluster_sectors = 1 << (s->subcluster_bits - BDRV_SECTOR_BITS);
     /* 2^(s->refcount_order - 3) is the refcount width in bytes */
     s->refcount_block_bits = s->cluster_bits - (s->refcount_order - 3);
     s->refcount_block_size = 1 << s->refcount_block_bits;
@@ -1076,6 +1205,28 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         }
     }
 
+    /* read qcow2 extensions */
+    if (qcow2_read_extensions(bs, header.header_length, ext_end, NULL,
+        &local_err)) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    if (has_journal(s)) {
+        if (!s->journal_offset ||
+            s->journal_size < 2 * QCOW2_JOURNAL_BLOCK_SIZE ||
+            s->journal_size > QCOW2_JOURNAL_MAX_SIZE ||
+            s->journal_size % QCOW2_JOURNAL_BLOCK_SIZE ||
+            validate_table_offset(bs, s->journal_offset, s->journal_size, 1)
+            < 0)
+        {
+            error_setg(errp, "Invalid or missing metadata journal");
+            ret = -EINVAL;
+            goto fail;
+        }
+    }
+
     /* Parse driver-specific options */
     ret = qcow2_update_options(bs, options, flags, errp);
     if (ret < 0) {
@@ -1104,14 +1255,6 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     QLIST_INIT(&s->cluster_allocs);
     QTAILQ_INIT(&s->discards);
 
-    /* read qcow2 extensions */
-    if (qcow2_read_extensions(bs, header.header_length, ext_end, NULL,
-        &local_err)) {
-        error_propagate(errp, local_err);
-        ret = -EINVAL;
-        goto fail;
-    }
-
     /* read the backing file name */
     if (header.backing_file_offset != 0) {
         len = header.backing_file_size;
@@ -1141,6 +1284,14 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
+    /* Replay the metadata journal */
+    if (has_journal(s)) {
+        ret = qcow2_journal_open(bs, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
     /* Clear unknown autoclear feature bits */
     if (!bs->read_only && !(flags & BDRV_O_INACTIVE) && s->autoclear_features) {
         s->autoclear_features = 0;
@@ -1189,6 +1340,7 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     if (s->refcount_block_cache) {
         qcow2_cache_destroy(bs, s->refcount_block_cache);
     }
+    qcow2_journal_close(bs);
     g_free(s->cluster_cache);
     qemu_vfree(s->cluster_data);
     return ret;
@@ -1236,9 +1388,56 @@ static int qcow2_set_key(BlockDriverState *bs, const char *key)
     return 0;
 }
 
+/*
+ * Truncates the image file after the last used cluster if it was grown by
+ * qcow2_co_preallocate(), but never below its original length.
+ */
+static int qcow2_trim_preallocation(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int64_t file_end, data_end, i;
+    uint64_t refcount;
+    int ret;
+
+    if (!s->prealloc_start) {
+        return 0;
+    }
+
+    file_end = bdrv_getlength(bs->file->bs);
+    if (file_end < 0) {
+        return file_end;
+    }
+
+    data_end = s->prealloc_start;
+    for (i = size_to_clusters(s, file_end) - 1;
+         (i << s->cluster_bits) >= s->prealloc_start; i--)
+    {
+        ret = qcow2_get_refcount(bs, i, &refcount);
+        if (ret < 0) {
+            return ret;
+        }
+        if (refcount > 0) {
+            data_end = (i + 1) << s->cluster_bits;
+            break;
+        }
+    }
+
+    if (data_end < file_end) {
+        ret = bdrv_truncate(bs->file->bs, data_end);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    s->prealloc_start = 0;
+    s->prealloc_end = 0;
+    return 0;
+}
+
 static int qcow2_reopen_prepare(BDRVReopenState *state,
                                 BlockReopenQueue *queue, Error **errp)
 {
+    BDRVQcow2State *s = state->bs->opaque;
     Qcow2ReopenState *r;
     int ret;
 
@@ -1258,10 +1457,22 @@ static int qcow2_reopen_prepare(BDRVReopenState *state,
             goto fail;
         }
 
+        if (has_journal(s)) {
+            ret = qcow2_journal_checkpoint(state->bs);
+            if (ret < 0) {
+                goto fail;
+            }
+        }
+
         ret = qcow2_mark_clean(state->bs);
         if (ret < 0) {
             goto fail;
         }
+
+        ret = qcow2_trim_preallocation(state->bs);
+        if (ret < 0) {
+            goto fail;
+        }
     }
 
     return 0;
@@ -1305,6 +1516,7 @@ static void qcow2_join_options(QDict *options, QDict *old_options)
         qdict_del(old_options, QCOW2_OPT_OVERLAP_SNAPSHOT_TABLE);
         qdict_del(old_options, QCOW2_OPT_OVERLAP_INACTIVE_L1);
         qdict_del(old_options, QCOW2_OPT_OVERLAP_INACTIVE_L2);
+        qdict_del(old_options, QCOW2_OPT_OVERLAP_JOURNAL);
     }
 
     /* New total cache size overrides all old options */
@@ -1539,6 +1751,100 @@ fail:
     return ret;
 }
 
+/*
+ * Makes sure that the image file extends at least up to @end before newly
+ * allocated clusters are written there.  If it doesn't, the file is grown up
+ * to the next multiple of prealloc-size with a single write zeroes request,
+ * which the protocol driver can turn into fallocate(), so that the host file
+ * system allocates a large extent instead of extending the file for every
+ * cluster.  The unused part is cut off again in qcow2_inactivate().
+ *
+ * Failing to preallocate is not an error; the following write extends the
+ * file as usual, and preallocation stays disabled until the next reopen.
+ */
+static int coroutine_fn qcow2_co_preallocate(BlockDriverState *bs,
+                                             int64_t end)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int64_t file_end, start, prealloc_end;
+    int ret;
+
+    if (!s->prealloc_size || end <= s->prealloc_end) {
+        return 0;
+    }
+
+    /* Metadata may have been written after the end of the preallocated area
+     * in the meantime, so never zero anything before the current file end */
+    file_end = bdrv_getlength(bs->file->bs);
+    if (file_end < 0) {
+        return file_end;
+    }
+    if (end <= file_end) {
+        s->prealloc_end = file_end;
+        return 0;
+    }
+
+    start = QEMU_ALIGN_UP(file_end, BDRV_SECTOR_SIZE);
+    prealloc_end = QEMU_ALIGN_UP(end, s->prealloc_size);
+
+    trace_qcow2_preallocate(qemu_coroutine_self(), start, prealloc_end);
+    ret = bdrv_co_write_zeroes(bs->file->bs, start >> BDRV_SECTOR_BITS,
+                               (prealloc_end - start) >> BDRV_SECTOR_BITS, 0);
+    if (ret < 0) {
+        /* Clusters up to @end have been handed out, but prealloc_end still
+         * points before them.  The data write for this request may be in
+         * flight while the next allocating request runs; zeroing from the
+         * old file end then would overwrite it.  Stop preallocating instead
+         * of tracking which part of the file is still safe to zero. */
+        trace_qcow2_preallocate_failed(qemu_coroutine_self(), ret);
+        s->prealloc_size = 0;
+        return 0;
+    }
+
+    if (!s->prealloc_start) {
+        s->prealloc_start = file_end;
+    }
+    s->prealloc_end = prealloc_end;
+    s->alloc_stats.prealloc_ops++;
+    s->alloc_stats.prealloc_bytes += prealloc_end - start;
+
+    return 0;
+}
+
+/* Check whether the guest data of a write request can be written together
+ * with the COW regions of one of its allocations */
+static bool merge_cow(uint64_t offset, uint64_t bytes,
+                      QEMUIOVector *hd_qiov, QCowL2Meta *l2meta)
+{
+    QCowL2Meta *m;
+
+    for (m = l2meta; m != NULL; m = m->next) {
+        /* Nothing to merge with */
+        if (m->cow_start.nb_sectors == 0 && m->cow_end.nb_sectors == 0) {
+            continue;
+        }
+
+        /* The guest data must fill exactly the gap between both regions */
+        if (l2meta_cow_start(m) + m->cow_start.nb_sectors * BDRV_SECTOR_SIZE
+            != offset) {
+            continue;
+        }
+        if (m->offset + m->cow_end.offset != offset + bytes) {
+            continue;
+        }
+
+        /* Leave room for both COW regions in the I/O vector */
+        if (hd_qiov->niov > IOV_MAX - 2) {
+            continue;
+        }
+
+        m->data_qiov = hd_qiov;
+        return true;
+    }
+
+    return false;
+}
+
 static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
                            int64_t sector_num,
                            int remaining_sectors,
@@ -1585,6 +1891,15 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
 
         assert((cluster_offset & 511) == 0);
 
+        if (l2meta != NULL) {
+            ret = qcow2_co_preallocate(bs, ROUND_UP(cluster_offset +
+                        ((index_in_cluster + cur_nr_sectors) << 9),
+                        s->cluster_size));
+            if (ret < 0) {
+                goto fail;
+            }
+        }
+
         qemu_iovec_reset(&hd_qiov);
         qemu_iovec_concat(&hd_qiov, qiov, bytes_done,
             cur_nr_sectors * 512);
@@ -1626,16 +1941,21 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
             goto fail;
         }
 
-        qemu_co_mutex_unlock(&s->lock);
-        BLKDBG_EVENT(bs->file, BLKDBG_WRITE_AIO);
-        trace_qcow2_writev_data(qemu_coroutine_self(),
-                                (cluster_offset >> 9) + index_in_cluster);
-        ret = bdrv_co_writev(bs->file->bs,
-                             (cluster_offset >> 9) + index_in_cluster,
-                             cur_nr_sectors, &hd_qiov);
-        qemu_co_mutex_lock(&s->lock);
-        if (ret < 0) {
-            goto fail;
+        /* If the allocation needs COW, try to write the guest data along
+         * with the COW regions in qcow2_alloc_cluster_link_l2() instead */
+        if (!merge_cow(sector_num << BDRV_SECTOR_BITS,
+                       cur_nr_sectors * BDRV_SECTOR_SIZE, &hd_qiov, l2meta)) {
+            qemu_co_mutex_unlock(&s->lock);
+            BLKDBG_EVENT(bs->file, BLKDBG_WRITE_AIO);
+            trace_qcow2_writev_data(qemu_coroutine_self(),
+                                    (cluster_offset >> 9) + index_in_cluster);
+            ret = bdrv_co_writev(bs->file->bs,
+                                 (cluster_offset >> 9) + index_in_cluster,
+                                 cur_nr_sectors, &hd_qiov);
+            qemu_co_mutex_lock(&s->lock);
+            if (ret < 0) {
+                goto fail;
+            }
         }
 
         while (l2meta != NULL) {
@@ -1707,10 +2027,28 @@ static int qcow2_inactivate(BlockDriverState *bs)
                      strerror(-ret));
     }
 
+    if (result == 0 && has_journal(s)) {
+        ret = qcow2_journal_checkpoint(bs);
+        if (ret) {
+            result = ret;
+            error_report("Failed to empty the metadata journal: %s",
+                         strerror(-ret));
+        }
+    }
+
     if (result == 0) {
         qcow2_mark_clean(bs);
     }
 
+    if (result == 0) {
+        ret = qcow2_trim_preallocation(bs);
+        if (ret < 0) {
+            result = ret;
+            error_report("Failed to remove the preallocated area of the "
+                         "image file: %s", strerror(-ret));
+        }
+    }
+
     return result;
 }
 
@@ -1728,6 +2066,7 @@ static void qcow2_close(BlockDriverState *bs)
     cache_clean_timer_del(bs);
     qcow2_cache_destroy(bs, s->l2_table_cache);
     qcow2_cache_destroy(bs, s->refcount_block_cache);
+    qcow2_journal_close(bs);
 
     qcrypto_cipher_free(s->cipher);
     s->cipher = NULL;
@@ -1910,6 +2249,24 @@ int qcow2_update_header(BlockDriverState *bs)
         buflen -= ret;
     }
 
+    /* Metadata journal header extension */
+    if (has_journal(s)) {
+        Qcow2JournalHeaderExt journal_ext = {
+            .offset = cpu_to_be64(s->journal_offset),
+            .size   = cpu_to_be64(s->journal_size),
+        };
+
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_JOURNAL,
+                             &journal_ext, sizeof(journal_ext),
+                             buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        buf += ret;
+        buflen -= ret;
+    }
+
     /* Feature table */
     if (s->qcow_version >= 3) {
         Qcow2Feature features[] = {
@@ -1923,6 +2280,16 @@ int qcow2_update_header(BlockDriverState *bs)
                 .bit  = QCOW2_INCOMPAT_CORRUPT_BITNR,
                 .name = "corrupt bit",
             },
+            {
+                .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+                .bit  = QCOW2_INCOMPAT_EXTL2_BITNR,
+                .name = "extended L2 entries",
+            },
+            {
+                .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+                .bit  = QCOW2_INCOMPAT_JOURNAL_BITNR,
+                .name = "metadata journal",
+            },
             {
                 .type = QCOW2_FEAT_TYPE_COMPATIBLE,
                 .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
@@ -2071,7 +2438,7 @@ static int qcow2_create2(const char *filename, int64_t total_size,
                          const char *backing_file, const char *backing_format,
                          int flags, size_t cluster_size, PreallocMode prealloc,
                          QemuOpts *opts, int version, int refcount_order,
-                         Error **errp)
+                         uint64_t journal_size, Error **errp)
 {
     int cluster_bits;
     QDict *options;
@@ -2114,6 +2481,9 @@ static int qcow2_create2(const char *filename, int64_t total_size,
         uint64_t nreftablee, nrefblocke, nl1e, nl2e;
         int64_t aligned_total_size = align_offset(total_size, cluster_size);
         int refblock_bits, refblock_size;
+        /* L2 entry size in bytes */
+        int l2es = (flags & BLOCK_FLAG_EXTL2) ? 2 * sizeof(uint64_t)
+                                              : sizeof(uint64_t);
         /* refcount entry size in bytes */
         double rces = (1 << refcount_order) / 8.;
 
@@ -2126,11 +2496,11 @@ static int qcow2_create2(const char *filename, int64_t total_size,
 
         /* total size of L2 tables */
         nl2e = aligned_total_size / cluster_size;
-        nl2e = align_offset(nl2e, cluster_size / sizeof(uint64_t));
-        meta_size += nl2e * sizeof(uint64_t);
+        nl2e = align_offset(nl2e, cluster_size / l2es);
+        meta_size += nl2e * l2es;
 
         /* total size of L1 tables */
-        nl1e = nl2e * sizeof(uint64_t) / cluster_size;
+        nl1e = nl2e * l2es / cluster_size;
         nl1e = align_offset(nl1e, cluster_size / sizeof(uint64_t));
         meta_size += nl1e * sizeof(uint64_t);
 
@@ -2210,6 +2580,11 @@ static int qcow2_create2(const char *filename, int64_t total_size,
             cpu_to_be64(QCOW2_COMPAT_LAZY_REFCOUNTS);
     }
 
+    if (flags & BLOCK_FLAG_EXTL2) {
+        header->incompatible_features |=
+            cpu_to_be64(QCOW2_INCOMPAT_EXTL2);
+    }
+
     ret = blk_pwrite(blk, 0, header, cluster_size);
     g_free(header);
     if (ret < 0) {
@@ -2265,6 +2640,15 @@ static int qcow2_create2(const char *filename, int64_t total_size,
         goto out;
     }
 
+    /* Allocate the metadata journal (this updates the header again) */
+    if (flags & BLOCK_FLAG_JOURNAL) {
+        ret = qcow2_journal_create(blk_bs(blk), journal_size, &local_err);
+        if (ret < 0) {
+            error_propagate(errp, local_err);
+            goto out;
+        }
+    }
+
     /* Okay, now that we have a valid image, let's give it the right size */
     ret = blk_truncate(blk, total_size);
     if (ret < 0) {
@@ -2329,6 +2713,7 @@ static int qcow2_create(const char *filename, QemuOpts *opts, Error **errp)
     int version = 3;
     uint64_t refcount_bits = 16;
     int refcount_order;
+    uint64_t journal_size;
     Error *local_err = NULL;
     int ret;
 
@@ -2383,6 +2768,46 @@ static int qcow2_create(const char *filename, QemuOpts *opts, Error **errp)
         goto finish;
     }
 
+    if (qemu_opt_get_bool_del(opts, BLOCK_OPT_EXTL2, false)) {
+        flags |= BLOCK_FLAG_EXTL2;
+    }
+
+    if (flags & BLOCK_FLAG_EXTL2) {
+        if (version < 3) {
+            error_setg(errp, "Extended L2 entries are only supported with "
+                       "compatibility level 1.1 and above (use compat=1.1 "
+                       "or greater)");
+            ret = -EINVAL;
+            goto finish;
+        }
+        if (cluster_size < (1 << MIN_EXTL2_CLUSTER_BITS)) {
+            error_setg(errp, "Extended L2 entries are only supported with "
+                       "cluster sizes of at least %d bytes",
+                       1 << MIN_EXTL2_CLUSTER_BITS);
+            ret = -EINVAL;
+            goto finish;
+        }
+    }
+
+    if (qemu_opt_get_bool_del(opts, BLOCK_OPT_JOURNAL, false)) {
+        flags |= BLOCK_FLAG_JOURNAL;
+    }
+
+    journal_size = qemu_opt_get_size_del(opts, BLOCK_OPT_JOURNAL_SIZE, 0);
+    if (journal_size && !(flags & BLOCK_FLAG_JOURNAL)) {
+        error_setg(errp, "journal_size is only valid with a metadata journal");
+        ret = -EINVAL;
+        goto finish;
+    }
+
+    if (version < 3 && (flags & BLOCK_FLAG_JOURNAL)) {
+        error_setg(errp, "The metadata journal is only supported with "
+                   "compatibility level 1.1 and above (use compat=1.1 or "
+                   "greater)");
+        ret = -EINVAL;
+        goto finish;
+    }
+
     refcount_bits = qemu_opt_get_number_del(opts, BLOCK_OPT_REFCOUNT_BITS,
                                             refcount_bits);
     if (refcount_bits > 64 || !is_power_of_2(refcount_bits)) {
@@ -2404,7 +2829,7 @@ static int qcow2_create(const char *filename, QemuOpts *opts, Error **errp)
 
     ret = qcow2_create2(filename, size, backing_file, backing_fmt, flags,
                         cluster_size, prealloc, opts, version, refcount_order,
-                        &local_err);
+                        journal_size, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
     }
@@ -2416,21 +2841,115 @@ finish:
     return ret;
 }
 
+/*
+ * Zeroes a range without changing any L2 entries: areas that already read as
+ * zeros are skipped and allocated clusters that are not shared with a
+ * snapshot are zeroed in the image file, which the protocol driver can do
+ * with fallocate().  Returns -ENOTSUP if any part of the range needs to be
+ * written explicitly instead.
+ */
+static int coroutine_fn qcow2_co_zero_in_place(BlockDriverState *bs,
+                                               int64_t sector_num,
+                                               int nb_sectors, int flags)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t cluster_offset, refcount;
+    int64_t host_offset, i;
+    int cur_nr_sectors, index_in_cluster;
+    int ret;
+
+    while (nb_sectors > 0) {
+        cur_nr_sectors = nb_sectors;
+        ret = qcow2_get_cluster_offset(bs, sector_num << BDRV_SECTOR_BITS,
+                                       &cur_nr_sectors, &cluster_offset);
+        if (ret < 0) {
+            return ret;
+        }
+
+        switch (ret) {
+        case QCOW2_CLUSTER_UNALLOCATED:
+            if (bs->backing) {
+                return -ENOTSUP;
+            }
+            /* fall through */
+        case QCOW2_CLUSTER_ZERO:
+            s->alloc_stats.zero_skipped_bytes +=
+                (uint64_t)cur_nr_sectors << BDRV_SECTOR_BITS;
+            break;
+
+        case QCOW2_CLUSTER_NORMAL:
+            if (bs->encrypted) {
+                return -ENOTSUP;
+            }
+
+            index_in_cluster = sector_num & (s->cluster_sectors - 1);
+            host_offset = cluster_offset +
+                          (index_in_cluster << BDRV_SECTOR_BITS);
+
+            for (i = 0; i < index_in_cluster + cur_nr_sectors;
+                 i += s->cluster_sectors)
+            {
+                ret = qcow2_get_refcount(bs, (cluster_offset >> s->cluster_bits)
+                                             + i / s->cluster_sectors,
+                                         &refcount);
+                if (ret < 0) {
+                    return ret;
+                }
+                if (refcount != 1) {
+                    return -ENOTSUP;
+                }
+            }
+
+            ret = qcow2_pre_write_overlap_check(bs, 0, host_offset,
+                    (int64_t)cur_nr_sectors << BDRV_SECTOR_BITS);
+            if (ret < 0) {
+                return ret;
+            }
+
+            trace_qcow2_zero_in_place(qemu_coroutine_self(), host_offset,
+                                      cur_nr_sectors);
+            ret = bdrv_co_write_zeroes(bs->file->bs,
+                                       host_offset >> BDRV_SECTOR_BITS,
+                                       cur_nr_sectors, flags);
+            if (ret < 0) {
+                return ret;
+            }
+            s->alloc_stats.zero_host_bytes +=
+                (uint64_t)cur_nr_sectors << BDRV_SECTOR_BITS;
+            break;
+
+        default:
+            return -ENOTSUP;
+        }
+
+        sector_num += cur_nr_sectors;
+        nb_sectors -= cur_nr_sectors;
+    }
+
+    return 0;
+}
+
 static coroutine_fn int qcow2_co_write_zeroes(BlockDriverState *bs,
     int64_t sector_num, int nb_sectors, BdrvRequestFlags flags)
 {
     int ret;
     BDRVQcow2State *s = bs->opaque;
 
-    /* Emulate misaligned zero writes */
-    if (sector_num % s->cluster_sectors || nb_sectors % s->cluster_sectors) {
-        return -ENOTSUP;
+    qemu_co_mutex_lock(&s->lock);
+
+    /* Misaligned zero writes and images without zero clusters can still avoid
+     * allocating clusters and writing zeroed buffers */
+    if (sector_num % s->cluster_sectors || nb_sectors % s->cluster_sectors ||
+        s->qcow_version < 3)
+    {
+        ret = qcow2_co_zero_in_place(bs, sector_num, nb_sectors, flags);
+        qemu_co_mutex_unlock(&s->lock);
+        return ret;
     }
 
     /* Whatever is left can use real zero clusters */
-    qemu_co_mutex_lock(&s->lock);
     ret = qcow2_zero_clusters(bs, sector_num << BDRV_SECTOR_BITS,
-        nb_sectors);
+        nb_sectors, flags);
     qemu_co_mutex_unlock(&s->lock);
 
     return ret;
@@ -2492,6 +3011,61 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
 
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
+typedef struct QCow2CompressedWrite {
+    BlockDriverState *bs;
+    int64_t sector_num;
+    const uint8_t *buf;
+    int len;
+    int ret;
+} QCow2CompressedWrite;
+
+/*
+ * Allocates space for a compressed cluster and writes it.  This runs under
+ * s->lock like the allocation in qcow2_co_writev(), so that a concurrent
+ * qcow2_co_preallocate() can't zero the new cluster after it was written
+ * past the old end of the image file.
+ */
+static void coroutine_fn qcow2_co_write_compressed_entry(void *opaque)
+{
+    QCow2CompressedWrite *cw = opaque;
+    BlockDriverState *bs = cw->bs;
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t cluster_offset;
+    int ret;
+
+    qemu_co_mutex_lock(&s->lock);
+
+    cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
+        cw->sector_num << 9, cw->len);
+    if (!cluster_offset) {
+        ret = -EIO;
+        goto fail;
+    }
+    cluster_offset &= s->cluster_offset_mask;
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset, cw->len);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    ret = qcow2_co_preallocate(bs, ROUND_UP(cluster_offset + cw->len,
+                                            s->cluster_size));
+    if (ret < 0) {
+        goto fail;
+    }
+
+    qemu_co_mutex_unlock(&s->lock);
+
+    BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
+    ret = bdrv_pwrite(bs->file->bs, cluster_offset, cw->buf, cw->len);
+    cw->ret = ret < 0 ? ret : 0;
+    return;
+
+fail:
+    qemu_co_mutex_unlock(&s->lock);
+    cw->ret = ret;
+}
+
 static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
                                   const uint8_t *buf, int nb_sectors)
 {
@@ -2558,21 +3132,25 @@ static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
             goto fail;
         }
     } else {
-        cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
-            sector_num << 9, out_len);
-        if (!cluster_offset) {
-            ret = -EIO;
-            goto fail;
-        }
-        cluster_offset &= s->cluster_offset_mask;
+        QCow2CompressedWrite cw = {
+            .bs         = bs,
+            .sector_num = sector_num,
+            .buf        = out_buf,
+            .len        = out_len,
+            .ret        = -EINPROGRESS,
+        };
 
-        ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset, out_len);
-        if (ret < 0) {
-            goto fail;
+        if (qemu_in_coroutine()) {
+            qcow2_co_write_compressed_entry(&cw);
+        } else {
+            Coroutine *co = qemu_coroutine_create(
+                qcow2_co_write_compressed_entry);
+            qemu_coroutine_enter(co, &cw);
+            while (cw.ret == -EINPROGRESS) {
+                aio_poll(bdrv_get_aio_context(bs), true);
+            }
         }
-
-        BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
-        ret = bdrv_pwrite(bs->file->bs, cluster_offset, out_buf, out_len);
+        ret = cw.ret;
         if (ret < 0) {
             goto fail;
         }
@@ -2715,6 +3293,8 @@ static int make_completely_empty(BlockDriverState *bs)
     if (ret < 0) {
         goto fail;
     }
+    s->prealloc_start = 0;
+    s->prealloc_end = 0;
 
     return 0;
 
@@ -2741,13 +3321,14 @@ static int qcow2_make_empty(BlockDriverState *bs)
 
     l1_clusters = DIV_ROUND_UP(s->l1_size, s->cluster_size / sizeof(uint64_t));
 
-    if (s->qcow_version >= 3 && !s->snapshots &&
+    if (s->qcow_version >= 3 && !s->snapshots && !has_journal(s) &&
         3 + l1_clusters <= s->refcount_block_size) {
         /* The following function only works for qcow2 v3 images (it requires
-         * the dirty flag) and only as long as there are no snapshots (because
-         * it completely empties the image). Furthermore, the L1 table and three
-         * additional clusters (image header, refcount table, one refcount
-         * block) have to fit inside one refcount block. */
+         * the dirty flag) and only as long as there are no snapshots or
+         * metadata journal (because it completely empties the image).
+         * Furthermore, the L1 table and three additional clusters (image
+         * header, refcount table, one refcount block) have to fit inside one
+         * refcount block. */
         return make_completely_empty(bs);
     }
 
@@ -2831,6 +3412,10 @@ static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs)
                                   QCOW2_INCOMPAT_CORRUPT,
             .has_corrupt        = true,
             .refcount_bits      = s->refcount_bits,
+            .extended_l2        = has_subclusters(s),
+            .has_extended_l2    = has_subclusters(s),
+            .journal_size       = s->journal_size,
+            .has_journal_size   = has_journal(s),
         };
     } else {
         /* if this assertion fails, this probably means a new version was
@@ -2841,6 +3426,27 @@ static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs)
     return spec_info;
 }
 
+static BlockStatsSpecific *qcow2_get_specific_stats(const BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    BlockStatsSpecific *stats = g_new(BlockStatsSpecific, 1);
+
+    *stats = (BlockStatsSpecific){
+        .type    = BLOCK_STATS_SPECIFIC_KIND_QCOW2,
+        .u.qcow2 = g_new(BlockStatsSpecificQcow2, 1),
+    };
+    *stats->u.qcow2 = (BlockStatsSpecificQcow2){
+        .prealloc_operations = s->alloc_stats.prealloc_ops,
+        .prealloc_bytes      = s->alloc_stats.prealloc_bytes,
+        .zero_clusters       = s->alloc_stats.zero_clusters,
+        .unmapped_clusters   = s->alloc_stats.unmapped_clusters,
+        .zero_host_bytes     = s->alloc_stats.zero_host_bytes,
+        .zero_skipped_bytes  = s->alloc_stats.zero_skipped_bytes,
+    };
+
+    return stats;
+}
+
 #if 0
 static void dump_refcounts(BlockDriverState *bs)
 {
@@ -2922,6 +3528,16 @@ static int qcow2_downgrade(BlockDriverState *bs, int target_version,
         return -ENOTSUP;
     }
 
+    if (has_subclusters(s)) {
+        error_report("compat=0.10 does not support extended L2 entries");
+        return -ENOTSUP;
+    }
+
+    if (has_journal(s)) {
+        error_report("compat=0.10 does not support a metadata journal");
+        return -ENOTSUP;
+    }
+
     /* clear incompatible features */
     if (s->incompatible_features & QCOW2_INCOMPAT_DIRTY) {
         ret = qcow2_mark_clean(bs);
@@ -3090,6 +3706,27 @@ static int qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
                 error_report("Changing the cluster size is not supported");
                 return -ENOTSUP;
             }
+        } else if (!strcmp(desc->name, BLOCK_OPT_EXTL2)) {
+            if (qemu_opt_get_bool(opts, BLOCK_OPT_EXTL2, has_subclusters(s))
+                != has_subclusters(s))
+            {
+                error_report("Changing extended_l2 is not supported");
+                return -ENOTSUP;
+            }
+        } else if (!strcmp(desc->name, BLOCK_OPT_JOURNAL)) {
+            if (qemu_opt_get_bool(opts, BLOCK_OPT_JOURNAL, has_journal(s))
+                != has_journal(s))
+            {
+                error_report("Changing journal is not supported");
+                return -ENOTSUP;
+            }
+        } else if (!strcmp(desc->name, BLOCK_OPT_JOURNAL_SIZE)) {
+            if (qemu_opt_get_size(opts, BLOCK_OPT_JOURNAL_SIZE, s->journal_size)
+                != s->journal_size)
+            {
+                error_report("Changing journal_size is not supported");
+                return -ENOTSUP;
+            }
         } else if (!strcmp(desc->name, BLOCK_OPT_LAZY_REFCOUNTS)) {
             lazy_refcounts = qemu_opt_get_bool(opts, BLOCK_OPT_LAZY_REFCOUNTS,
                                                lazy_refcounts);
@@ -3141,6 +3778,15 @@ static int qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
             return -EINVAL;
         }
 
+        /* The refcount blocks are rewritten in place, so no journalled copy
+         * of an old refcount block may be replayed over them */
+        ret = qcow2_empty_journal(bs);
+        if (ret < 0) {
+            error_report("Failed to empty the metadata journal: %s",
+                         strerror(-ret));
+            return ret;
+        }
+
         helper_cb_info.current_operation = QCOW2_CHANGING_REFCOUNT_ORDER;
         ret = qcow2_change_refcount_order(bs, refcount_order,
                                           &qcow2_amend_helper_cb,
@@ -3149,6 +3795,13 @@ static int qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
             error_report_err(local_error);
             return ret;
         }
+
+        ret = qcow2_empty_journal(bs);
+        if (ret < 0) {
+            error_report("Failed to empty the metadata journal: %s",
+                         strerror(-ret));
+            return ret;
+        }
     }
 
     if (backing_file || backing_format) {
@@ -3315,6 +3968,21 @@ static QemuOptsList qcow2_create_opts = {
             .help = "Width of a reference count entry in bits",
             .def_value_str = "16"
         },
+        {
+            .name = BLOCK_OPT_EXTL2,
+            .type = QEMU_OPT_BOOL,
+            .help = "Extended L2 entries with subcluster allocation",
+        },
+        {
+            .name = BLOCK_OPT_JOURNAL,
+            .type = QEMU_OPT_BOOL,
+            .help = "Journal L2 table and refcount block updates",
+        },
+        {
+            .name = BLOCK_OPT_JOURNAL_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of the metadata journal",
+        },
         { /* end of list */ }
     }
 };
@@ -3351,6 +4019,7 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_snapshot_load_tmp = qcow2_snapshot_load_tmp,
     .bdrv_get_info          = qcow2_get_info,
     .bdrv_get_specific_info = qcow2_get_specific_info,
+    .bdrv_get_specific_stats = qcow2_get_specific_stats,
 
     .bdrv_save_vmstate    = qcow2_save_vmstate,
     .bdrv_load_vmstate    = qcow2_load_vmstate,
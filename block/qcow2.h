@@ -59,6 +59,17 @@
 /* The cluster reads as all zeros */
 #define QCOW_OFLAG_ZERO (1ULL << 0)
 
+/* Images with extended L2 entries split each cluster into this many
+ * subclusters.  An extended L2 entry is followed by a 64-bit bitmap whose
+ * low half has one "allocated" bit and whose high half has one "reads as
+ * zeros" bit per subcluster. */
+#define QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER 32
+#define QCOW_L2_BITMAP_ALL_ALLOC  ((1ULL << 32) - 1)
+#define QCOW_L2_BITMAP_ALL_ZEROES (QCOW_L2_BITMAP_ALL_ALLOC << 32)
+
+/* The smallest cluster size that still gives 512 byte subclusters */
+#define MIN_EXTL2_CLUSTER_BITS 14
+
 #define MIN_CLUSTER_BITS 9
 #define MAX_CLUSTER_BITS 21
 
@@ -68,6 +79,15 @@
 /* Must be at least 4 to cover all cases of refcount table growth */
 #define MIN_REFCOUNT_CACHE_SIZE 4 /* clusters */
 
+/* The metadata journal is made of blocks of this size; the first one holds
+ * the journal header */
+#define QCOW2_JOURNAL_BLOCK_SIZE 4096
+
+/* Default and maximum size of the metadata journal.  The maximum bounds the
+ * time needed to replay the journal on open. */
+#define QCOW2_JOURNAL_DEFAULT_SIZE (4 * 1024 * 1024)
+#define QCOW2_JOURNAL_MAX_SIZE (256 * 1024 * 1024)
+
 /* Whichever is more */
 #define DEFAULT_L2_CACHE_CLUSTERS 8 /* clusters */
 #define DEFAULT_L2_CACHE_BYTE_SIZE 1048576 /* bytes */
@@ -78,6 +98,10 @@
 
 #define DEFAULT_CLUSTER_SIZE 65536
 
+/* Upper limit for the prealloc-size option, so that growing the image file
+ * is a single write zeroes request */
+#define QCOW2_MAX_PREALLOC_SIZE (1024 * 1024 * 1024)
+
 
 #define QCOW2_OPT_LAZY_REFCOUNTS "lazy-refcounts"
 #define QCOW2_OPT_DISCARD_REQUEST "pass-discard-request"
@@ -93,10 +117,12 @@
 #define QCOW2_OPT_OVERLAP_SNAPSHOT_TABLE "overlap-check.snapshot-table"
 #define QCOW2_OPT_OVERLAP_INACTIVE_L1 "overlap-check.inactive-l1"
 #define QCOW2_OPT_OVERLAP_INACTIVE_L2 "overlap-check.inactive-l2"
+#define QCOW2_OPT_OVERLAP_JOURNAL "overlap-check.journal"
 #define QCOW2_OPT_CACHE_SIZE "cache-size"
 #define QCOW2_OPT_L2_CACHE_SIZE "l2-cache-size"
 #define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
 #define QCOW2_OPT_CACHE_CLEAN_INTERVAL "cache-clean-interval"
+#define QCOW2_OPT_PREALLOC_SIZE "prealloc-size"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -180,11 +206,17 @@ enum {
 enum {
     QCOW2_INCOMPAT_DIRTY_BITNR   = 0,
     QCOW2_INCOMPAT_CORRUPT_BITNR = 1,
+    QCOW2_INCOMPAT_EXTL2_BITNR   = 4,
+    QCOW2_INCOMPAT_JOURNAL_BITNR = 5,
     QCOW2_INCOMPAT_DIRTY         = 1 << QCOW2_INCOMPAT_DIRTY_BITNR,
     QCOW2_INCOMPAT_CORRUPT       = 1 << QCOW2_INCOMPAT_CORRUPT_BITNR,
+    QCOW2_INCOMPAT_EXTL2         = 1 << QCOW2_INCOMPAT_EXTL2_BITNR,
+    QCOW2_INCOMPAT_JOURNAL       = 1 << QCOW2_INCOMPAT_JOURNAL_BITNR,
 
     QCOW2_INCOMPAT_MASK          = QCOW2_INCOMPAT_DIRTY
-                                 | QCOW2_INCOMPAT_CORRUPT,
+                                 | QCOW2_INCOMPAT_CORRUPT
+                                 | QCOW2_INCOMPAT_EXTL2
+                                 | QCOW2_INCOMPAT_JOURNAL,
 };
 
 /* Compatible feature bits */
@@ -217,6 +249,16 @@ typedef struct Qcow2DiscardRegion {
     QTAILQ_ENTRY(Qcow2DiscardRegion) next;
 } Qcow2DiscardRegion;
 
+/* Counters reported by query-blockstats */
+typedef struct Qcow2AllocStats {
+    uint64_t prealloc_ops;      /* number of times the file was grown */
+    uint64_t prealloc_bytes;    /* bytes added to the file by them */
+    uint64_t zero_clusters;     /* clusters zeroed in their L2 entries */
+    uint64_t unmapped_clusters; /* ...of which were deallocated */
+    uint64_t zero_host_bytes;   /* bytes zeroed in the image file */
+    uint64_t zero_skipped_bytes; /* bytes that already read as zeroes */
+} Qcow2AllocStats;
+
 typedef uint64_t Qcow2GetRefcountFunc(const void *refcount_array,
                                       uint64_t index);
 typedef void Qcow2SetRefcountFunc(void *refcount_array,
@@ -226,6 +268,9 @@ typedef struct BDRVQcow2State {
     int cluster_bits;
     int cluster_size;
     int cluster_sectors;
+    int subcluster_bits;
+    int subcluster_size;
+    int subcluster_sectors;
     int l2_bits;
     int l2_size;
     int l1_size;
@@ -293,6 +338,20 @@ typedef struct BDRVQcow2State {
      * override) */
     char *image_backing_file;
     char *image_backing_format;
+
+    /* Metadata journal, see qcow2-journal.c */
+    uint64_t journal_offset;
+    uint64_t journal_size;
+    uint64_t journal_pos;       /* where the next entry will be written */
+    uint64_t journal_sequence;  /* sequence number of the next entry */
+    GHashTable *journal_tables; /* offsets of tables in the journal */
+
+    /* Preallocation of the image file, see qcow2_co_preallocate() */
+    uint64_t prealloc_size;
+    int64_t prealloc_start;     /* file length before preallocating, or 0 */
+    int64_t prealloc_end;       /* the file is known to be this long */
+
+    Qcow2AllocStats alloc_stats;
 } BDRVQcow2State;
 
 typedef struct Qcow2COWRegion {
@@ -327,6 +386,13 @@ typedef struct QCowL2Meta
     /** Number of newly allocated clusters */
     int nb_clusters;
 
+    /**
+     * The write goes to a cluster that is already allocated and owned by
+     * this image, but to subclusters that aren't allocated yet.  No new host
+     * cluster is allocated in this case and the old one must not be freed.
+     */
+    bool keep_old;
+
     /**
      * Requests that overlap with this allocation and wait to be restarted
      * when the allocating request has completed.
@@ -345,6 +411,13 @@ typedef struct QCowL2Meta
      */
     Qcow2COWRegion cow_end;
 
+    /**
+     * The I/O vector with the data from the guest write request.  If
+     * non-NULL, it is written together with the data of @cow_start and
+     * @cow_end in a single write operation.
+     */
+    QEMUIOVector *data_qiov;
+
     /** Pointer to next L2Meta of the same write request */
     struct QCowL2Meta *next;
 
@@ -367,8 +440,9 @@ typedef enum QCow2MetadataOverlap {
     QCOW2_OL_SNAPSHOT_TABLE_BITNR = 5,
     QCOW2_OL_INACTIVE_L1_BITNR    = 6,
     QCOW2_OL_INACTIVE_L2_BITNR    = 7,
+    QCOW2_OL_JOURNAL_BITNR        = 8,
 
-    QCOW2_OL_MAX_BITNR            = 8,
+    QCOW2_OL_MAX_BITNR            = 9,
 
     QCOW2_OL_NONE           = 0,
     QCOW2_OL_MAIN_HEADER    = (1 << QCOW2_OL_MAIN_HEADER_BITNR),
@@ -381,12 +455,13 @@ typedef enum QCow2MetadataOverlap {
     /* NOTE: Checking overlaps with inactive L2 tables will result in bdrv
      * reads. */
     QCOW2_OL_INACTIVE_L2    = (1 << QCOW2_OL_INACTIVE_L2_BITNR),
+    QCOW2_OL_JOURNAL        = (1 << QCOW2_OL_JOURNAL_BITNR),
 } QCow2MetadataOverlap;
 
 /* Perform all overlap checks which can be done in constant time */
 #define QCOW2_OL_CONSTANT \
     (QCOW2_OL_MAIN_HEADER | QCOW2_OL_ACTIVE_L1 | QCOW2_OL_REFCOUNT_TABLE | \
-     QCOW2_OL_SNAPSHOT_TABLE)
+     QCOW2_OL_SNAPSHOT_TABLE | QCOW2_OL_JOURNAL)
 
 /* Perform all overlap checks which don't require disk access */
 #define QCOW2_OL_CACHED \
@@ -413,6 +488,16 @@ static inline int64_t offset_into_cluster(BDRVQcow2State *s, int64_t offset)
     return offset & (s->cluster_size - 1);
 }
 
+static inline int64_t start_of_subcluster(BDRVQcow2State *s, int64_t offset)
+{
+    return offset & ~(s->subcluster_size - 1);
+}
+
+static inline int64_t offset_into_subcluster(BDRVQcow2State *s, int64_t offset)
+{
+    return offset & (s->subcluster_size - 1);
+}
+
 static inline uint64_t size_to_clusters(BDRVQcow2State *s, uint64_t size)
 {
     return (size + (s->cluster_size - 1)) >> s->cluster_bits;
@@ -445,6 +530,61 @@ static inline uint64_t qcow2_max_refcount_clusters(BDRVQcow2State *s)
     return QCOW_MAX_REFTABLE_SIZE >> s->cluster_bits;
 }
 
+static inline bool has_subclusters(BDRVQcow2State *s)
+{
+    return s->incompatible_features & QCOW2_INCOMPAT_EXTL2;
+}
+
+/* Size of an L2 entry in bytes (including the subcluster bitmap, if any) */
+static inline int l2_entry_size(BDRVQcow2State *s)
+{
+    return has_subclusters(s) ? 2 * sizeof(uint64_t) : sizeof(uint64_t);
+}
+
+static inline uint64_t get_l2_entry(BDRVQcow2State *s, uint64_t *l2_table,
+                                    int idx)
+{
+    return be64_to_cpu(l2_table[idx << has_subclusters(s)]);
+}
+
+static inline void set_l2_entry(BDRVQcow2State *s, uint64_t *l2_table,
+                                int idx, uint64_t entry)
+{
+    l2_table[idx << has_subclusters(s)] = cpu_to_be64(entry);
+}
+
+static inline uint64_t get_l2_bitmap(BDRVQcow2State *s, uint64_t *l2_table,
+                                     int idx)
+{
+    assert(has_subclusters(s));
+    return be64_to_cpu(l2_table[(idx << 1) + 1]);
+}
+
+static inline void set_l2_bitmap(BDRVQcow2State *s, uint64_t *l2_table,
+                                 int idx, uint64_t bitmap)
+{
+    assert(has_subclusters(s));
+    l2_table[(idx << 1) + 1] = cpu_to_be64(bitmap);
+}
+
+static inline int offset_to_sc_index(BDRVQcow2State *s, int64_t offset)
+{
+    return (offset >> s->subcluster_bits) &
+           (QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER - 1);
+}
+
+/* Bitmap of the "allocated" bits of subclusters [first, first + count) */
+static inline uint64_t qcow2_sc_alloc_mask(int first, int count)
+{
+    assert(first >= 0 && count >= 0 &&
+           first + count <= QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER);
+    if (count == 0) {
+        return 0;
+    }
+    return (QCOW_L2_BITMAP_ALL_ALLOC >>
+            (QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER - count)) << first;
+}
+
 static inline int qcow2_get_cluster_type(uint64_t l2_entry)
 {
     if (l2_entry & QCOW_OFLAG_COMPRESSED) {
@@ -458,6 +598,31 @@ static inline int qcow2_get_cluster_type(uint64_t l2_entry)
     }
 }
 
+/*
+ * Type of subcluster sc_index of a cluster in an image with extended L2
+ * entries.  Compressed clusters can't be split and always report the type of
+ * the whole cluster.
+ */
+static inline int qcow2_get_subcluster_type(uint64_t l2_entry,
+                                            uint64_t l2_bitmap,
+                                            int sc_index)
+{
+    if (l2_entry & QCOW_OFLAG_COMPRESSED) {
+        return QCOW2_CLUSTER_COMPRESSED;
+    } else if (l2_bitmap & (1ULL << (sc_index + 32))) {
+        return QCOW2_CLUSTER_ZERO;
+    } else if (l2_bitmap & (1ULL << sc_index)) {
+        return QCOW2_CLUSTER_NORMAL;
+    } else {
+        return QCOW2_CLUSTER_UNALLOCATED;
+    }
+}
+
+static inline bool has_journal(BDRVQcow2State *s)
+{
+    return s->incompatible_features & QCOW2_INCOMPAT_JOURNAL;
+}
+
 /* Check whether refcounts are eager or lazy */
 static inline bool qcow2_need_accurate_refcounts(BDRVQcow2State *s)
 {
@@ -554,7 +719,8 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m);
 int qcow2_discard_clusters(BlockDriverState *bs, uint64_t offset,
     int nb_sectors, enum qcow2_discard_type type, bool full_discard);
-int qcow2_zero_clusters(BlockDriverState *bs, uint64_t offset, int nb_sectors);
+int qcow2_zero_clusters(BlockDriverState *bs, uint64_t offset, int nb_sectors,
+                        int flags);
 
 int qcow2_expand_zero_clusters(BlockDriverState *bs,
                                BlockDriverAmendStatusCB *status_cb,
@@ -576,6 +742,15 @@ int qcow2_snapshot_load_tmp(BlockDriverState *bs,
 void qcow2_free_snapshots(BlockDriverState *bs);
 int qcow2_read_snapshots(BlockDriverState *bs);
 
+/* qcow2-journal.c functions */
+int qcow2_journal_create(BlockDriverState *bs, uint64_t size, Error **errp);
+int qcow2_journal_open(BlockDriverState *bs, Error **errp);
+void qcow2_journal_close(BlockDriverState *bs);
+int qcow2_journal_max_tables(BDRVQcow2State *s);
+int qcow2_journal_commit(BlockDriverState *bs);
+int qcow2_journal_checkpoint(BlockDriverState *bs);
+int qcow2_journal_cluster_freed(BlockDriverState *bs, uint64_t offset);
+
 /* qcow2-cache.c functions */
 Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables);
 int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c);
@@ -586,6 +761,14 @@ int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c);
 int qcow2_cache_set_dependency(BlockDriverState *bs, Qcow2Cache *c,
     Qcow2Cache *dependency);
 void qcow2_cache_depends_on_flush(Qcow2Cache *c);
+bool qcow2_cache_get_depends_on_flush(Qcow2Cache *c);
+int qcow2_cache_get_dirty(BlockDriverState *bs, Qcow2Cache *c,
+    uint64_t *offsets, void **tables);
+void qcow2_cache_mark_committed(Qcow2Cache *c);
+bool qcow2_cache_has_dirty_committed(Qcow2Cache *c);
+int qcow2_cache_write_committed(BlockDriverState *bs, Qcow2Cache *c);
+void qcow2_cache_clear_committed(Qcow2Cache *c);
+int qcow2_cache_get_num_tables(Qcow2Cache *c);
 
 void qcow2_cache_clean_unused(BlockDriverState *bs, Qcow2Cache *c);
 int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c);
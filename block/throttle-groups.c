@@ -51,21 +51,40 @@
  * bdrv_set_aio_context()). Therefore in this file a thread will
  * access some other BDS's timers only after verifying that that BDS
  * has throttled requests in the queue.
+ *
+ * Members of a group can live in different AioContexts. Each BDS's
+ * throttled requests are only ever woken up from its own AioContext,
+ * through its timers; other threads just arm those timers, which is
+ * safe because timer_mod() is thread-safe and kicks the AioContext
+ * that owns the timer.
+ *
+ * Members with pending requests are not served in plain round-robin
+ * order but by weighted fair queuing: every request that is let
+ * through advances the virtual time of its BDS by an amount inversely
+ * proportional to the BDS's weight, and the next request is taken from
+ * the BDS with the lowest virtual time. With equal weights this is
+ * round-robin again; with different weights each member gets a share
+ * of the group's limits proportional to its weight when they compete.
  */
 typedef struct ThrottleGroup {
     char *name; /* This is constant during the lifetime of the group */
 
-    QemuMutex lock; /* This lock protects the following four fields */
+    QemuMutex lock; /* This lock protects the following five fields */
     ThrottleState ts;
     QLIST_HEAD(, BlockDriverState) head;
     BlockDriverState *tokens[2];
     bool any_timer_armed[2];
+    /* Virtual start time of the last request let through */
+    uint64_t vclock[2];
 
     /* These two are protected by the global throttle_groups_lock */
     unsigned refcount;
     QTAILQ_ENTRY(ThrottleGroup) list;
 } ThrottleGroup;
 
+/* Virtual time taken by one request of a member with weight 1 */
+#define THROTTLE_GROUP_VTIME_SCALE (1ULL << 32)
+
 static QemuMutex throttle_groups_lock;
 static QTAILQ_HEAD(, ThrottleGroup) throttle_groups =
     QTAILQ_HEAD_INITIALIZER(throttle_groups);
@@ -166,8 +185,9 @@ static BlockDriverState *throttle_group_next_bs(BlockDriverState *bs)
     return next;
 }
 
-/* Return the next BlockDriverState in the round-robin sequence with
- * pending I/O requests.
+/* Return the BlockDriverState with pending I/O requests that has the
+ * lowest virtual time. Members with the same virtual time are picked
+ * in round-robin order, starting after the current token.
  *
  * This assumes that tg->lock is held.
  *
@@ -180,27 +200,48 @@ static BlockDriverState *next_throttle_token(BlockDriverState *bs,
                                              bool is_write)
 {
     ThrottleGroup *tg = container_of(bs->throttle_state, ThrottleGroup, ts);
-    BlockDriverState *token, *start;
-
-    start = token = tg->tokens[is_write];
-
-    /* get next bs round in round robin style */
-    token = throttle_group_next_bs(token);
-    while (token != start && !token->pending_reqs[is_write]) {
-        token = throttle_group_next_bs(token);
-    }
+    BlockDriverState *token = NULL, *iter, *start;
+
+    start = iter = tg->tokens[is_write];
+    do {
+        iter = throttle_group_next_bs(iter);
+        if (iter->pending_reqs[is_write] &&
+            (!token || iter->throttle_vtime[is_write] <
+                       token->throttle_vtime[is_write])) {
+            token = iter;
+        }
+    } while (iter != start);
 
-    /* If no IO are queued for scheduling on the next round robin token
-     * then decide the token is the current bs because chances are
-     * the current bs get the current request queued.
+    /* If no IO are queued for scheduling then decide the token is the
+     * current bs because chances are the current bs get the current
+     * request queued.
      */
-    if (token == start && !token->pending_reqs[is_write]) {
+    if (!token) {
         token = bs;
     }
 
     return token;
 }
 
+/* Charge a request that is let through to the virtual time of its
+ * BlockDriverState. A member that was idle restarts from the group's
+ * virtual clock, so it cannot save up credit while it has no I/O.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @bs:        the BlockDriverState whose request is executed
+ * @is_write:  the type of operation (read/write)
+ */
+static void throttle_group_charge(BlockDriverState *bs, bool is_write)
+{
+    ThrottleGroup *tg = container_of(bs->throttle_state, ThrottleGroup, ts);
+    uint64_t start = MAX(bs->throttle_vtime[is_write], tg->vclock[is_write]);
+
+    tg->vclock[is_write] = start;
+    bs->throttle_vtime[is_write] =
+        start + THROTTLE_GROUP_VTIME_SCALE / bs->throttle_weight;
+}
+
 /* Check if the next I/O request for a BlockDriverState needs to be
  * throttled or not. If there's no timer set in this group, set one
  * and update the token accordingly.
@@ -306,6 +347,7 @@ void coroutine_fn throttle_group_co_io_limits_intercept(BlockDriverState *bs,
 
     /* The I/O will be executed, so do the accounting */
     throttle_account(bs->throttle_state, is_write, bytes);
+    throttle_group_charge(bs, is_write);
 
     /* Schedule the next request */
     schedule_next_request(bs, is_write);
@@ -353,6 +395,22 @@ void throttle_group_get_config(BlockDriverState *bs, ThrottleConfig *cfg)
     qemu_mutex_unlock(&tg->lock);
 }
 
+/* Set the share of the group's limits that a BlockDriverState gets when
+ * it competes with the other members.
+ *
+ * @bs:     a BlockDriverState that is member of the group
+ * @weight: the new weight, between 1 and THROTTLE_GROUP_MAX_WEIGHT
+ */
+void throttle_group_set_weight(BlockDriverState *bs, unsigned weight)
+{
+    ThrottleGroup *tg = container_of(bs->throttle_state, ThrottleGroup, ts);
+
+    assert(weight > 0 && weight <= THROTTLE_GROUP_MAX_WEIGHT);
+    qemu_mutex_lock(&tg->lock);
+    bs->throttle_weight = weight;
+    qemu_mutex_unlock(&tg->lock);
+}
+
 /* ThrottleTimers callback. This wakes up a request that was waiting
  * because it had been throttled.
  *
@@ -431,6 +489,10 @@ void throttle_group_register_bs(BlockDriverState *bs, const char *groupname)
                          write_timer_cb,
                          bs);
 
+    for (i = 0; i < 2; i++) {
+        bs->throttle_vtime[i] = tg->vclock[i];
+    }
+
     qemu_mutex_unlock(&tg->lock);
 }
 
@@ -475,6 +537,55 @@ void throttle_group_unregister_bs(BlockDriverState *bs)
     bs->throttle_state = NULL;
 }
 
+/* Remove the timers of a BlockDriverState from its AioContext, before
+ * the BDS moves to another one. The caller must have drained the BDS.
+ *
+ * A timer may still be armed for a BDS without throttled requests,
+ * for example because another member picked it as the next token
+ * right before the drain. Destroying it would leave the group waiting
+ * for a timer that never fires, stalling the members that live in
+ * other AioContexts, so schedule the next request elsewhere instead.
+ *
+ * @bs: the BlockDriverState whose timers are detached
+ */
+void throttle_group_detach_aio_context(BlockDriverState *bs)
+{
+    ThrottleTimers *tt = &bs->throttle_timers;
+    ThrottleGroup *tg = container_of(bs->throttle_state, ThrottleGroup, ts);
+    bool was_armed[2];
+    int i;
+
+    assert(bs->pending_reqs[0] == 0 && bs->pending_reqs[1] == 0);
+
+    qemu_mutex_lock(&tg->lock);
+    for (i = 0; i < 2; i++) {
+        was_armed[i] = timer_pending(tt->timers[i]);
+    }
+    throttle_timers_detach_aio_context(tt);
+    for (i = 0; i < 2; i++) {
+        if (was_armed[i]) {
+            tg->any_timer_armed[i] = false;
+            schedule_next_request(bs, i);
+        }
+    }
+    qemu_mutex_unlock(&tg->lock);
+}
+
+/* Create the timers of a BlockDriverState in its new AioContext.
+ *
+ * @bs:          the BlockDriverState whose timers are attached
+ * @new_context: the new AioContext
+ */
+void throttle_group_attach_aio_context(BlockDriverState *bs,
+                                       AioContext *new_context)
+{
+    ThrottleGroup *tg = container_of(bs->throttle_state, ThrottleGroup, ts);
+
+    qemu_mutex_lock(&tg->lock);
+    throttle_timers_attach_aio_context(&bs->throttle_timers, new_context);
+    qemu_mutex_unlock(&tg->lock);
+}
+
 static void throttle_groups_init(void)
 {
     qemu_mutex_init(&throttle_groups_lock);
@@ -2623,7 +2623,9 @@ void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
                                bool has_iops_size,
                                int64_t iops_size,
                                bool has_group,
-                               const char *group, Error **errp)
+                               const char *group,
+                               bool has_group_weight,
+                               int64_t group_weight, Error **errp)
 {
     ThrottleConfig cfg;
     BlockDriverState *bs;
@@ -2701,6 +2703,13 @@ void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
         goto out;
     }
 
+    if (has_group_weight &&
+        (group_weight < 1 || group_weight > THROTTLE_GROUP_MAX_WEIGHT)) {
+        error_setg(errp, "group-weight must be between 1 and %d",
+                   THROTTLE_GROUP_MAX_WEIGHT);
+        goto out;
+    }
+
     if (throttle_enabled(&cfg)) {
         /* Enable I/O limits if they're not enabled yet, otherwise
          * just update the throttling group. */
@@ -2711,6 +2720,9 @@ void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
         }
         /* Set the new throttling configuration */
         bdrv_set_io_limits(bs, &cfg);
+        if (has_group_weight) {
+            throttle_group_set_weight(bs, group_weight);
+        }
     } else if (bs->throttle_state) {
         /* If all throttling settings are set to 0, disable I/O limits */
         bdrv_io_limits_disable(bs);
@@ -2720,6 +2732,41 @@ out:
     aio_context_release(aio_context);
 }
 
+void qmp_block_latency_histogram_set(const char *device,
+                                     bool has_min_latency_ns,
+                                     uint64_t min_latency_ns,
+                                     bool has_bins, uint32_t bins,
+                                     Error **errp)
+{
+    BlockBackend *blk;
+    BlockAcctStats *stats;
+    BlockLatencyHistogram *hist;
+    AioContext *aio_context;
+
+    blk = blk_by_name(device);
+    if (!blk) {
+        error_set(errp, ERROR_CLASS_DEVICE_NOT_FOUND,
+                  "Device '%s' not found", device);
+        return;
+    }
+
+    aio_context = blk_get_aio_context(blk);
+    aio_context_acquire(aio_context);
+
+    stats = blk_get_stats(blk);
+    hist = &stats->histogram[BLOCK_ACCT_READ];
+    if (!has_min_latency_ns) {
+        min_latency_ns = hist->bins ? hist->min_ns
+                                    : BLOCK_LATENCY_HISTOGRAM_MIN_NS;
+    }
+    if (!has_bins) {
+        bins = hist->bins ? hist->nbins : BLOCK_LATENCY_HISTOGRAM_BINS;
+    }
+    block_latency_histogram_set(stats, min_latency_ns, bins, errp);
+
+    aio_context_release(aio_context);
+}
+
 void qmp_block_dirty_bitmap_add(const char *node, const char *name,
                                 bool has_granularity, uint32_t granularity,
                                 Error **errp)
@@ -0,0 +1,617 @@
+/*
+ * vhost-user-blk backend
+ *
+ * Serves a disk image (any format the QEMU block layer opens) to a
+ * vhost-user-blk device.  Requests are submitted straight from the guest
+ * buffers, and the virtqueues can be busy-polled instead of waiting for
+ * guest notifications.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <getopt.h>
+#include <sched.h>
+#include <sys/un.h>
+#include "qemu-common.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qstring.h"
+#include "qemu/error-report.h"
+#include "qemu/iov.h"
+#include "qemu/main-loop.h"
+#include "qemu/sockets.h"
+#include "qemu/timer.h"
+#include "qom/object_interfaces.h"
+#include "block/block.h"
+#include "sysemu/block-backend.h"
+#include "standard-headers/linux/virtio_blk.h"
+
+#include "contrib/libvhost-user/libvhost-user.h"
+
+#define VUB_DEFAULT_SOCKET_PATH  "/tmp/vhost-user-blk.sock"
+#define VUB_SEG_MAX              126
+
+typedef struct VubDev {
+    VuDev parent;
+    BlockBackend *blk;
+    const char *serial;
+    bool read_only;
+    int listen_fd;
+    bool connected;
+    /* one VubWatch per fd watched for libvhost-user */
+    GHashTable *watches;
+    /* busy-poll the queues for this long after the last request */
+    int64_t poll_ns;
+    int64_t poll_deadline;
+} VubDev;
+
+typedef struct VubWatch {
+    VubDev *vdev;
+    int fd;
+    vu_watch_cb cb;
+    void *data;
+} VubWatch;
+
+typedef struct VubReq {
+    VuVirtqElement elem;
+    VubDev *vdev;
+    VuVirtq *vq;
+    struct virtio_blk_outhdr out;
+    uint8_t *status;
+    QEMUIOVector qiov;
+    size_t in_len;
+} VubReq;
+
+static bool vub_quit;
+
+static void vub_panic_cb(VuDev *vu_dev, const char *buf)
+{
+    error_report("vhost-user-blk: %s", buf);
+}
+
+static void vub_watch_handler(void *opaque)
+{
+    VubWatch *w = opaque;
+
+    w->cb(&w->vdev->parent, VU_WATCH_IN, w->data);
+}
+
+static void vub_set_watch(VuDev *vu_dev, int fd, int condition,
+                          vu_watch_cb cb, void *data)
+{
+    VubDev *vdev = container_of(vu_dev, VubDev, parent);
+    VubWatch *w = g_new0(VubWatch, 1);
+
+    w->vdev = vdev;
+    w->fd = fd;
+    w->cb = cb;
+    w->data = data;
+    g_hash_table_replace(vdev->watches, GINT_TO_POINTER(fd), w);
+    qemu_set_fd_handler(fd, vub_watch_handler, NULL, w);
+}
+
+static void vub_remove_watch(VuDev *vu_dev, int fd)
+{
+    VubDev *vdev = container_of(vu_dev, VubDev, parent);
+
+    qemu_set_fd_handler(fd, NULL, NULL, NULL);
+    g_hash_table_remove(vdev->watches, GINT_TO_POINTER(fd));
+}
+
+static void vub_req_complete(VubReq *req, uint8_t status)
+{
+    VuDev *vu_dev = &req->vdev->parent;
+
+    *req->status = status;
+    vu_queue_push(vu_dev, req->vq, &req->elem, req->in_len + 1);
+    vu_queue_notify(vu_dev, req->vq);
+    free(req);
+}
+
+static void vub_rw_complete(void *opaque, int ret)
+{
+    VubReq *req = opaque;
+
+    vub_req_complete(req, ret ? VIRTIO_BLK_S_IOERR : VIRTIO_BLK_S_OK);
+}
+
+static void vub_submit_rw(VubReq *req, bool is_write)
+{
+    VubDev *vdev = req->vdev;
+    uint64_t sector = le64toh(req->out.sector);
+    size_t size = req->qiov.size;
+
+    if (size % BDRV_SECTOR_SIZE ||
+        sector + size / BDRV_SECTOR_SIZE > blk_nb_sectors(vdev->blk)) {
+        vub_req_complete(req, VIRTIO_BLK_S_IOERR);
+        return;
+    }
+
+    if (is_write) {
+        blk_aio_writev(vdev->blk, sector, &req->qiov,
+                       size / BDRV_SECTOR_SIZE, vub_rw_complete, req);
+    } else {
+        req->in_len = size;
+        blk_aio_readv(vdev->blk, sector, &req->qiov,
+                      size / BDRV_SECTOR_SIZE, vub_rw_complete, req);
+    }
+}
+
+static void vub_handle_req(VubReq *req)
+{
+    VubDev *vdev = req->vdev;
+    struct iovec *out_iov = req->elem.out_sg;
+    struct iovec *in_iov = req->elem.in_sg;
+    unsigned out_num = req->elem.out_num;
+    unsigned in_num = req->elem.in_num;
+    struct iovec *last;
+    uint32_t type;
+
+    if (out_num < 1 || in_num < 1 ||
+        iov_to_buf(out_iov, out_num, 0, &req->out,
+                   sizeof(req->out)) != sizeof(req->out)) {
+        error_report("vhost-user-blk: invalid request header");
+        vu_queue_push(&vdev->parent, req->vq, &req->elem, 0);
+        vu_queue_notify(&vdev->parent, req->vq);
+        free(req);
+        return;
+    }
+    iov_discard_front(&out_iov, &out_num, sizeof(req->out));
+
+    /* The status byte ends the last writable buffer, in guest memory */
+    last = &in_iov[in_num - 1];
+    req->status = (uint8_t *)last->iov_base + last->iov_len - 1;
+    iov_discard_back(in_iov, &in_num, 1);
+
+    type = le32toh(req->out.type);
+    switch (type & ~VIRTIO_BLK_T_BARRIER) {
+    case VIRTIO_BLK_T_IN:
+        qemu_iovec_init_external(&req->qiov, in_iov, in_num);
+        vub_submit_rw(req, false);
+        break;
+    case VIRTIO_BLK_T_OUT:
+        if (vdev->read_only) {
+            vub_req_complete(req, VIRTIO_BLK_S_IOERR);
+            break;
+        }
+        qemu_iovec_init_external(&req->qiov, out_iov, out_num);
+        vub_submit_rw(req, true);
+        break;
+    case VIRTIO_BLK_T_FLUSH:
+        blk_aio_flush(vdev->blk, vub_rw_complete, req);
+        break;
+    case VIRTIO_BLK_T_GET_ID:
+        req->in_len = iov_from_buf(in_iov, in_num, 0, vdev->serial,
+                                   MIN(strlen(vdev->serial),
+                                       VIRTIO_BLK_ID_BYTES));
+        vub_req_complete(req, VIRTIO_BLK_S_OK);
+        break;
+    default:
+        vub_req_complete(req, VIRTIO_BLK_S_UNSUPP);
+        break;
+    }
+}
+
+static bool vub_process_vq(VubDev *vdev, VuVirtq *vq)
+{
+    VuDev *vu_dev = &vdev->parent;
+    bool progress = false;
+    VubReq *req;
+
+    while ((req = vu_queue_pop(vu_dev, vq, sizeof(VubReq)))) {
+        req->vdev = vdev;
+        req->vq = vq;
+        req->in_len = 0;
+        vub_handle_req(req);
+        progress = true;
+    }
+
+    return progress;
+}
+
+static void vub_queue_handler(VuDev *vu_dev, int idx)
+{
+    VubDev *vdev = container_of(vu_dev, VubDev, parent);
+    VuVirtq *vq = vu_get_queue(vu_dev, idx);
+
+    vub_process_vq(vdev, vq);
+
+    if (vdev->poll_ns) {
+        /* Take over from guest notifications until the queues go idle */
+        vu_queue_set_notification(vu_dev, vq, 0);
+        vdev->poll_deadline = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) +
+                              vdev->poll_ns;
+    }
+}
+
+/* Returns true while the queues are being polled. */
+static bool vub_poll(VubDev *vdev)
+{
+    VuDev *vu_dev = &vdev->parent;
+    int64_t now;
+    bool progress = false;
+    int i;
+
+    if (!vdev->poll_deadline) {
+        return false;
+    }
+
+    for (i = 0; i < VHOST_MAX_NR_VIRTQUEUE; i++) {
+        VuVirtq *vq = vu_get_queue(vu_dev, i);
+
+        if (vq->started && vq->handler) {
+            progress |= vub_process_vq(vdev, vq);
+        }
+    }
+
+    now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    if (progress) {
+        vdev->poll_deadline = now + vdev->poll_ns;
+        return true;
+    }
+    if (now < vdev->poll_deadline) {
+        return true;
+    }
+
+    /* Idle: go back to notifications, then catch what raced with that */
+    vdev->poll_deadline = 0;
+    for (i = 0; i < VHOST_MAX_NR_VIRTQUEUE; i++) {
+        VuVirtq *vq = vu_get_queue(vu_dev, i);
+
+        if (vq->started && vq->handler) {
+            vu_queue_set_notification(vu_dev, vq, 1);
+            if (vub_process_vq(vdev, vq)) {
+                vub_queue_handler(vu_dev, i);
+            }
+        }
+    }
+
+    return vdev->poll_deadline != 0;
+}
+
+static uint64_t vub_get_features(VuDev *vu_dev)
+{
+    VubDev *vdev = container_of(vu_dev, VubDev, parent);
+    uint64_t features;
+
+    features = 1ull << VIRTIO_BLK_F_SEG_MAX |
+               1ull << VIRTIO_BLK_F_BLK_SIZE |
+               1ull << VIRTIO_BLK_F_TOPOLOGY |
+               1ull << VIRTIO_BLK_F_FLUSH |
+               1ull << VIRTIO_BLK_F_CONFIG_WCE |
+               1ull << VIRTIO_BLK_F_MQ |
+               1ull << VIRTIO_F_VERSION_1 |
+               1ull << VIRTIO_RING_F_INDIRECT_DESC |
+               1ull << VIRTIO_RING_F_EVENT_IDX;
+
+    if (vdev->read_only) {
+        features |= 1ull << VIRTIO_BLK_F_RO;
+    }
+
+    return features;
+}
+
+static void vub_queue_set_started(VuDev *vu_dev, int idx, bool started)
+{
+    VuVirtq *vq = vu_get_queue(vu_dev, idx);
+
+    vu_set_queue_handler(vu_dev, vq, started ? vub_queue_handler : NULL);
+}
+
+static int vub_get_config(VuDev *vu_dev, uint8_t *config, uint32_t len)
+{
+    VubDev *vdev = container_of(vu_dev, VubDev, parent);
+    struct virtio_blk_config blkcfg;
+
+    if (len > sizeof(blkcfg)) {
+        return -1;
+    }
+
+    memset(&blkcfg, 0, sizeof(blkcfg));
+    blkcfg.capacity = htole64(blk_nb_sectors(vdev->blk));
+    blkcfg.seg_max = htole32(VUB_SEG_MAX);
+    blkcfg.blk_size = htole32(BDRV_SECTOR_SIZE);
+    blkcfg.min_io_size = htole16(1);
+    blkcfg.opt_io_size = htole32(1);
+    blkcfg.wce = blk_enable_write_cache(vdev->blk);
+    memcpy(config, &blkcfg, len);
+
+    return 0;
+}
+
+static int vub_set_config(VuDev *vu_dev, const uint8_t *data,
+                          uint32_t offset, uint32_t size)
+{
+    VubDev *vdev = container_of(vu_dev, VubDev, parent);
+
+    /* only the write cache mode can be changed */
+    if (offset != offsetof(struct virtio_blk_config, wce) || size != 1) {
+        return -1;
+    }
+
+    blk_set_enable_write_cache(vdev->blk, data[0] != 0);
+
+    return 0;
+}
+
+static const VuDevIface vub_iface = {
+    .get_features = vub_get_features,
+    .queue_set_started = vub_queue_set_started,
+    .get_config = vub_get_config,
+    .set_config = vub_set_config,
+};
+
+static void vub_disconnect(VubDev *vdev)
+{
+    if (!vdev->connected) {
+        return;
+    }
+
+    /* Finish what was submitted while guest memory is still mapped; the
+     * inflight area lets the next backend resubmit anything else.
+     */
+    blk_drain(vdev->blk);
+
+    qemu_set_fd_handler(vdev->parent.sock, NULL, NULL, NULL);
+    vu_deinit(&vdev->parent);
+    vdev->poll_deadline = 0;
+    vdev->connected = false;
+}
+
+static void vub_dispatch(void *opaque)
+{
+    VubDev *vdev = opaque;
+
+    if (!vu_dispatch(&vdev->parent) || vdev->parent.broken) {
+        error_report("vhost-user-blk: client disconnected");
+        vub_disconnect(vdev);
+    }
+}
+
+static void vub_accept(void *opaque)
+{
+    VubDev *vdev = opaque;
+    int fd;
+
+    fd = qemu_accept(vdev->listen_fd, NULL, NULL);
+    if (fd < 0) {
+        error_report("vhost-user-blk: accept: %s", strerror(errno));
+        return;
+    }
+
+    if (vdev->connected) {
+        /* one device per backend */
+        close(fd);
+        return;
+    }
+
+    vu_init(&vdev->parent, fd, vub_panic_cb, vub_set_watch,
+            vub_remove_watch, &vub_iface);
+    vdev->connected = true;
+    qemu_set_fd_handler(fd, vub_dispatch, NULL, vdev);
+}
+
+static int vub_listen(const char *path)
+{
+    struct sockaddr_un un;
+    int fd;
+
+    fd = qemu_socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        error_report("socket: %s", strerror(errno));
+        return -1;
+    }
+
+    memset(&un, 0, sizeof(un));
+    un.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(un.sun_path)) {
+        error_report("socket path too long: %s", path);
+        goto fail;
+    }
+    pstrcpy(un.sun_path, sizeof(un.sun_path), path);
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr *)&un, sizeof(un)) < 0) {
+        error_report("bind %s: %s", path, strerror(errno));
+        goto fail;
+    }
+
+    if (listen(fd, 1) < 0) {
+        error_report("listen: %s", strerror(errno));
+        goto fail;
+    }
+
+    return fd;
+
+fail:
+    close(fd);
+    return -1;
+}
+
+static void vub_watch_free(gpointer data)
+{
+    g_free(data);
+}
+
+static void termsig_handler(int signum)
+{
+    vub_quit = true;
+    qemu_notify_event();
+}
+
+static void usage(const char *name)
+{
+    printf(
+"Usage: %s [OPTIONS] FILE\n"
+"Serve FILE to a vhost-user-blk device\n"
+"\n"
+"  -h, --help                display this help and exit\n"
+"  -s, --socket-path=PATH    listen on PATH (default '"
+                             VUB_DEFAULT_SOCKET_PATH "')\n"
+"  -f, --format=FORMAT       set image format (raw, qcow2, ...)\n"
+"  -r, --read-only           export read-only\n"
+"  -n, --nocache             disable host cache\n"
+"      --aio=MODE            set AIO mode (native or threads)\n"
+"  -S, --serial=SERIAL       disk serial number reported to the guest\n"
+"  -p, --poll-us=US          busy-poll the virtqueues for US microseconds\n"
+"                            after the last request (default 0, off)\n"
+"  -c, --cpu=CPU             pin the process to host CPU\n"
+"\n"
+"The device side is\n"
+"  -chardev socket,id=CHR,path=PATH[,reconnect=SECONDS]\n"
+"  -device vhost-user-blk-pci,chardev=CHR[,num-queues=N]\n"
+"with guest RAM shared (e.g. -object memory-backend-file,share=on).\n",
+    name);
+}
+
+enum {
+    VUB_OPT_AIO = 256,
+};
+
+int main(int argc, char **argv)
+{
+    const char *sopt = "hs:f:rnS:p:c:";
+    struct option lopt[] = {
+        { "help", no_argument, NULL, 'h' },
+        { "socket-path", required_argument, NULL, 's' },
+        { "format", required_argument, NULL, 'f' },
+        { "read-only", no_argument, NULL, 'r' },
+        { "nocache", no_argument, NULL, 'n' },
+        { "aio", required_argument, NULL, VUB_OPT_AIO },
+        { "serial", required_argument, NULL, 'S' },
+        { "poll-us", required_argument, NULL, 'p' },
+        { "cpu", required_argument, NULL, 'c' },
+        { NULL, 0, NULL, 0 }
+    };
+    const char *socket_path = VUB_DEFAULT_SOCKET_PATH;
+    const char *fmt = NULL;
+    QDict *options = NULL;
+    int flags = BDRV_O_RDWR | BDRV_O_CACHE_WB;
+    Error *local_err = NULL;
+    struct sigaction sa_sigterm;
+    VubDev vdev = { 0 };
+    unsigned long val;
+    int ch;
+
+    vdev.serial = "";
+
+    memset(&sa_sigterm, 0, sizeof(sa_sigterm));
+    sa_sigterm.sa_handler = termsig_handler;
+    sigaction(SIGTERM, &sa_sigterm, NULL);
+    sigaction(SIGINT, &sa_sigterm, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    module_call_init(MODULE_INIT_QOM);
+    qemu_init_exec_dir(argv[0]);
+
+    while ((ch = getopt_long(argc, argv, sopt, lopt, NULL)) != -1) {
+        switch (ch) {
+        case 'h':
+            usage(argv[0]);
+            exit(EXIT_SUCCESS);
+        case 's':
+            socket_path = optarg;
+            break;
+        case 'f':
+            fmt = optarg;
+            break;
+        case 'r':
+            vdev.read_only = true;
+            flags &= ~BDRV_O_RDWR;
+            break;
+        case 'n':
+            if (bdrv_parse_cache_flags("none", &flags) == -1) {
+                error_report("Invalid cache mode");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case VUB_OPT_AIO:
+            if (!strcmp(optarg, "native")) {
+                flags |= BDRV_O_NATIVE_AIO;
+            } else if (strcmp(optarg, "threads")) {
+                error_report("invalid aio mode '%s'", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'S':
+            vdev.serial = optarg;
+            break;
+        case 'p':
+            if (qemu_strtoul(optarg, NULL, 0, &val) < 0) {
+                error_report("Invalid poll time '%s'", optarg);
+                exit(EXIT_FAILURE);
+            }
+            vdev.poll_ns = val * SCALE_US;
+            break;
+        case 'c': {
+            cpu_set_t cpus;
+
+            if (qemu_strtoul(optarg, NULL, 0, &val) < 0 ||
+                val >= CPU_SETSIZE) {
+                error_report("Invalid cpu '%s'", optarg);
+                exit(EXIT_FAILURE);
+            }
+            CPU_ZERO(&cpus);
+            CPU_SET(val, &cpus);
+            if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0) {
+                error_report("sched_setaffinity: %s", strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+            break;
+        }
+        default:
+            usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if (qemu_init_main_loop(&local_err)) {
+        error_report_err(local_err);
+        exit(EXIT_FAILURE);
+    }
+    bdrv_init();
+    atexit(bdrv_close_all);
+
+    if (fmt) {
+        options = qdict_new();
+        qdict_put(options, "driver", qstring_from_str(fmt));
+    }
+    vdev.blk = blk_new_open("vub", argv[optind], NULL, options, flags,
+                            &local_err);
+    if (!vdev.blk) {
+        error_reportf_err(local_err, "Failed to open '%s': ", argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+    blk_set_enable_write_cache(vdev.blk, !!(flags & BDRV_O_CACHE_WB));
+
+    vdev.listen_fd = vub_listen(socket_path);
+    if (vdev.listen_fd < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    vdev.watches = g_hash_table_new_full(NULL, NULL, NULL, vub_watch_free);
+    qemu_set_fd_handler(vdev.listen_fd, vub_accept, NULL, &vdev);
+
+    while (!vub_quit) {
+        bool polling = vub_poll(&vdev);
+
+        main_loop_wait(polling);
+    }
+
+    vub_disconnect(&vdev);
+    qemu_set_fd_handler(vdev.listen_fd, NULL, NULL, NULL);
+    close(vdev.listen_fd);
+    unlink(socket_path);
+    g_hash_table_destroy(vdev.watches);
+    blk_unref(vdev.blk);
+
+    return 0;
+}
@@ -1178,10 +1178,23 @@ static void register_multipage(AddressSpaceDispatch *d,
     phys_page_set(d, start_addr >> TARGET_PAGE_BITS, num_pages, section_index);
 }
 
+static AddressSpaceDispatch *address_space_dispatch_new(AddressSpace *as);
+
+/* The new dispatch table is only created once memory.c reports a change
+ * in the address space; unchanged address spaces keep their old table.
+ */
+static AddressSpaceDispatch *address_space_next_dispatch(AddressSpace *as)
+{
+    if (!as->next_dispatch) {
+        as->next_dispatch = address_space_dispatch_new(as);
+    }
+    return as->next_dispatch;
+}
+
 static void mem_add(MemoryListener *listener, MemoryRegionSection *section)
 {
     AddressSpace *as = container_of(listener, AddressSpace, dispatch_listener);
-    AddressSpaceDispatch *d = as->next_dispatch;
+    AddressSpaceDispatch *d = address_space_next_dispatch(as);
     MemoryRegionSection now = *section, remain = *section;
     Int128 page_size = int128_make64(TARGET_PAGE_SIZE);
 
@@ -2347,9 +2360,8 @@ static void io_mem_init(void)
                           NULL, UINT64_MAX);
 }
 
-static void mem_begin(MemoryListener *listener)
+static AddressSpaceDispatch *address_space_dispatch_new(AddressSpace *as)
 {
-    AddressSpace *as = container_of(listener, AddressSpace, dispatch_listener);
     AddressSpaceDispatch *d = g_new0(AddressSpaceDispatch, 1);
     uint16_t n;
 
@@ -2364,7 +2376,17 @@ static void mem_begin(MemoryListener *listener)
 
     d->phys_map  = (PhysPageEntry) { .ptr = PHYS_MAP_NODE_NIL, .skip = 1 };
     d->as = as;
-    as->next_dispatch = d;
+    return d;
+}
+
+/* Sections that go away only matter if nothing else is added, so that the
+ * address space ends up with an empty table rather than a stale one.
+ */
+static void mem_del(MemoryListener *listener, MemoryRegionSection *section)
+{
+    AddressSpace *as = container_of(listener, AddressSpace, dispatch_listener);
+
+    address_space_next_dispatch(as);
 }
 
 static void address_space_dispatch_free(AddressSpaceDispatch *d)
@@ -2379,6 +2401,14 @@ static void mem_commit(MemoryListener *listener)
     AddressSpaceDispatch *cur = as->dispatch;
     AddressSpaceDispatch *next = as->next_dispatch;
 
+    if (!next) {
+        if (cur) {
+            return;
+        }
+        next = address_space_dispatch_new(as);
+    }
+    as->next_dispatch = NULL;
+
     phys_page_compact_all(next, next->map.nodes_nb);
 
     atomic_rcu_set(&as->dispatch, next);
@@ -2401,6 +2431,10 @@ static void tcg_commit(MemoryListener *listener)
      * may have split the RCU critical section.
      */
     d = atomic_rcu_read(&cpuas->as->dispatch);
+    if (d == cpuas->memory_dispatch) {
+        /* This address space did not change, the TLB is still valid.  */
+        return;
+    }
     cpuas->memory_dispatch = d;
     tlb_flush(cpuas->cpu, 1);
 }
@@ -2408,10 +2442,11 @@ static void tcg_commit(MemoryListener *listener)
 void address_space_init_dispatch(AddressSpace *as)
 {
     as->dispatch = NULL;
+    as->next_dispatch = NULL;
     as->dispatch_listener = (MemoryListener) {
-        .begin = mem_begin,
         .commit = mem_commit,
         .region_add = mem_add,
+        .region_del = mem_del,
         .region_nop = mem_add,
         .priority = 0,
     };
@@ -2837,53 +2872,82 @@ void cpu_flush_icache_range(hwaddr start, int len)
                                            start, NULL, len, FLUSH_CACHE);
 }
 
-typedef struct {
+#define BOUNCE_BUFFER_MAGIC 0xb4017ceb4ffe12edULL
+
+/* Allocated by address_space_map for regions that are not directly
+ * accessible; the caller only sees @buffer.
+ */
+typedef struct BounceBuffer {
+    uint64_t magic;
     MemoryRegion *mr;
-    void *buffer;
     hwaddr addr;
-    hwaddr len;
-    bool in_use;
+    size_t len;
+    QLIST_ENTRY(BounceBuffer) link;
+    uint8_t buffer[];
 } BounceBuffer;
 
-static BounceBuffer bounce;
+static void address_space_add_bounce_buffer(AddressSpace *as,
+                                            BounceBuffer *bounce)
+{
+    if (xen_enabled()) {
+        qemu_mutex_lock(&as->map_client_list_lock);
+        QLIST_INSERT_HEAD(&as->bounce_buffers, bounce, link);
+        qemu_mutex_unlock(&as->map_client_list_lock);
+    }
+}
 
-typedef struct MapClient {
-    QEMUBH *bh;
-    QLIST_ENTRY(MapClient) link;
-} MapClient;
+/* The Xen map cache aborts on pointers it does not know, so look for
+ * bounce buffers before asking it.
+ */
+static BounceBuffer *address_space_find_bounce_buffer(AddressSpace *as,
+                                                      void *buffer)
+{
+    BounceBuffer *bounce;
 
-QemuMutex map_client_list_lock;
-static QLIST_HEAD(map_client_list, MapClient) map_client_list
-    = QLIST_HEAD_INITIALIZER(map_client_list);
+    if (!xen_enabled() || !atomic_read(&as->bounce_buffer_size)) {
+        return NULL;
+    }
+    qemu_mutex_lock(&as->map_client_list_lock);
+    QLIST_FOREACH(bounce, &as->bounce_buffers, link) {
+        if (bounce->buffer == buffer) {
+            QLIST_REMOVE(bounce, link);
+            break;
+        }
+    }
+    qemu_mutex_unlock(&as->map_client_list_lock);
+    return bounce;
+}
 
-static void cpu_unregister_map_client_do(MapClient *client)
+static void address_space_unregister_map_client_do(AddressSpaceMapClient *client)
 {
     QLIST_REMOVE(client, link);
     g_free(client);
 }
 
-static void cpu_notify_map_clients_locked(void)
+static void address_space_notify_map_clients_locked(AddressSpace *as)
 {
-    MapClient *client;
+    AddressSpaceMapClient *client;
 
-    while (!QLIST_EMPTY(&map_client_list)) {
-        client = QLIST_FIRST(&map_client_list);
+    while (!QLIST_EMPTY(&as->map_client_list)) {
+        client = QLIST_FIRST(&as->map_client_list);
         qemu_bh_schedule(client->bh);
-        cpu_unregister_map_client_do(client);
+        address_space_unregister_map_client_do(client);
     }
 }
 
-void cpu_register_map_client(QEMUBH *bh)
+void address_space_register_map_client(AddressSpace *as, QEMUBH *bh)
 {
-    MapClient *client = g_malloc(sizeof(*client));
+    AddressSpaceMapClient *client = g_malloc(sizeof(*client));
 
-    qemu_mutex_lock(&map_client_list_lock);
+    qemu_mutex_lock(&as->map_client_list_lock);
     client->bh = bh;
-    QLIST_INSERT_HEAD(&map_client_list, client, link);
-    if (!atomic_read(&bounce.in_use)) {
-        cpu_notify_map_clients_locked();
+    QLIST_INSERT_HEAD(&as->map_client_list, client, link);
+    /* Write map_client_list before reading bounce_buffer_size. */
+    smp_mb();
+    if (atomic_read(&as->bounce_buffer_size) < as->max_bounce_buffer_size) {
+        address_space_notify_map_clients_locked(as);
     }
-    qemu_mutex_unlock(&map_client_list_lock);
+    qemu_mutex_unlock(&as->map_client_list_lock);
 }
 
 void cpu_exec_init_all(void)
@@ -2891,28 +2955,27 @@ void cpu_exec_init_all(void)
     qemu_mutex_init(&ram_list.mutex);
     io_mem_init();
     memory_map_init();
-    qemu_mutex_init(&map_client_list_lock);
 }
 
-void cpu_unregister_map_client(QEMUBH *bh)
+void address_space_unregister_map_client(AddressSpace *as, QEMUBH *bh)
 {
-    MapClient *client;
+    AddressSpaceMapClient *client;
 
-    qemu_mutex_lock(&map_client_list_lock);
-    QLIST_FOREACH(client, &map_client_list, link) {
+    qemu_mutex_lock(&as->map_client_list_lock);
+    QLIST_FOREACH(client, &as->map_client_list, link) {
         if (client->bh == bh) {
-            cpu_unregister_map_client_do(client);
+            address_space_unregister_map_client_do(client);
             break;
         }
     }
-    qemu_mutex_unlock(&map_client_list_lock);
+    qemu_mutex_unlock(&as->map_client_list_lock);
 }
 
-static void cpu_notify_map_clients(void)
+static void address_space_notify_map_clients(AddressSpace *as)
 {
-    qemu_mutex_lock(&map_client_list_lock);
-    cpu_notify_map_clients_locked();
-    qemu_mutex_unlock(&map_client_list_lock);
+    qemu_mutex_lock(&as->map_client_list_lock);
+    address_space_notify_map_clients_locked(as);
+    qemu_mutex_unlock(&as->map_client_list_lock);
 }
 
 bool address_space_access_valid(AddressSpace *as, hwaddr addr, int len, bool is_write)
@@ -2942,8 +3005,8 @@ bool address_space_access_valid(AddressSpace *as, hwaddr addr, int len, bool is_
  * May map a subset of the requested range, given by and returned in *plen.
  * May return NULL if resources needed to perform the mapping are exhausted.
  * Use only for reads OR writes - not for read-modify-write operations.
- * Use cpu_register_map_client() to know when retrying the map operation is
- * likely to succeed.
+ * Use address_space_register_map_client() to know when retrying the map
+ * operation is likely to succeed.
  */
 void *address_space_map(AddressSpace *as,
                         hwaddr addr,
@@ -2966,26 +3029,46 @@ void *address_space_map(AddressSpace *as,
     mr = address_space_translate(as, addr, &xlat, &l, is_write);
 
     if (!memory_access_is_direct(mr, is_write)) {
-        if (atomic_xchg(&bounce.in_use, true)) {
-            rcu_read_unlock();
-            return NULL;
+        size_t used = atomic_read(&as->bounce_buffer_size);
+        BounceBuffer *bounce;
+
+        /* Reserve as much of the remaining budget as the request needs */
+        for (;;) {
+            size_t alloc = MIN(as->max_bounce_buffer_size - MIN(used,
+                               as->max_bounce_buffer_size), l);
+            size_t actual;
+
+            if (alloc == 0) {
+                rcu_read_unlock();
+                *plen = 0;
+                return NULL;
+            }
+            actual = atomic_cmpxchg(&as->bounce_buffer_size, used,
+                                    used + alloc);
+            if (actual == used) {
+                l = alloc;
+                break;
+            }
+            used = actual;
         }
-        /* Avoid unbounded allocations */
-        l = MIN(l, TARGET_PAGE_SIZE);
-        bounce.buffer = qemu_memalign(TARGET_PAGE_SIZE, l);
-        bounce.addr = addr;
-        bounce.len = l;
+
+        bounce = g_malloc(l + sizeof(BounceBuffer));
+        bounce->magic = BOUNCE_BUFFER_MAGIC;
+        bounce->addr = addr;
+        bounce->len = l;
 
         memory_region_ref(mr);
-        bounce.mr = mr;
+        bounce->mr = mr;
+        address_space_add_bounce_buffer(as, bounce);
         if (!is_write) {
             address_space_read(as, addr, MEMTXATTRS_UNSPECIFIED,
-                               bounce.buffer, l);
+                               bounce->buffer, l);
         }
 
         rcu_read_unlock();
+        atomic_add(&as->dma_bounced_bytes, l);
         *plen = l;
-        return bounce.buffer;
+        return bounce->buffer;
     }
 
     base = xlat;
@@ -3010,6 +3093,7 @@ void *address_space_map(AddressSpace *as,
     *plen = done;
     ptr = qemu_ram_ptr_length(mr->ram_block, raddr + base, plen);
     rcu_read_unlock();
+    atomic_add(&as->dma_direct_bytes, *plen);
 
     return ptr;
 }
@@ -3021,12 +3105,15 @@ void *address_space_map(AddressSpace *as,
 void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
                          int is_write, hwaddr access_len)
 {
-    if (buffer != bounce.buffer) {
-        MemoryRegion *mr;
-        ram_addr_t addr1;
+    MemoryRegion *mr = NULL;
+    ram_addr_t addr1;
+    BounceBuffer *bounce;
 
+    bounce = address_space_find_bounce_buffer(as, buffer);
+    if (!bounce) {
         mr = qemu_ram_addr_from_host(buffer, &addr1);
-        assert(mr != NULL);
+    }
+    if (mr != NULL) {
         if (is_write) {
             invalidate_and_set_dirty(mr, addr1, access_len);
         }
@@ -3036,15 +3123,24 @@ void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
         memory_region_unref(mr);
         return;
     }
+
+    if (!bounce) {
+        bounce = container_of(buffer, BounceBuffer, buffer);
+    }
+    assert(bounce->magic == BOUNCE_BUFFER_MAGIC);
+
     if (is_write) {
-        address_space_write(as, bounce.addr, MEMTXATTRS_UNSPECIFIED,
-                            bounce.buffer, access_len);
-    }
-    qemu_vfree(bounce.buffer);
-    bounce.buffer = NULL;
-    memory_region_unref(bounce.mr);
-    atomic_mb_set(&bounce.in_use, false);
-    cpu_notify_map_clients();
+        address_space_write(as, bounce->addr, MEMTXATTRS_UNSPECIFIED,
+                            bounce->buffer, access_len);
+    }
+
+    atomic_sub(&as->bounce_buffer_size, bounce->len);
+    bounce->magic = ~BOUNCE_BUFFER_MAGIC;
+    memory_region_unref(bounce->mr);
+    g_free(bounce);
+    /* Write bounce_buffer_size before reading map_client_list. */
+    smp_mb();
+    address_space_notify_map_clients(as);
 }
 
 void *cpu_physical_memory_map(hwaddr addr,
@@ -274,6 +274,21 @@ STEXI
 @item info mtree
 @findex mtree
 Show memory tree.
+ETEXI
+
+    {
+        .name       = "dma",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show DMA mapping statistics",
+        .mhandler.cmd = hmp_info_dma,
+    },
+
+STEXI
+@item info dma
+@findex dma
+Show, for each address space, how many bytes DMA mapped directly and how
+many went through bounce buffers, and the bounce buffer usage.
 ETEXI
 
     {
@@ -558,6 +573,34 @@ STEXI
 @item info migrate_parameters
 @findex migrate_parameters
 Show current migration parameters.
+ETEXI
+
+    {
+        .name       = "dirty_rate",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the result of the last dirty page rate measurement",
+        .mhandler.cmd = hmp_info_dirty_rate,
+    },
+
+STEXI
+@item info dirty_rate
+@findex dirty_rate
+Show the result of the last dirty page rate measurement.
+ETEXI
+
+    {
+        .name       = "vcpu_dirty_limit",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the dirty page rate limits of the vCPUs",
+        .mhandler.cmd = hmp_info_vcpu_dirty_limit,
+    },
+
+STEXI
+@item info vcpu_dirty_limit
+@findex vcpu_dirty_limit
+Show the dirty page rate limits of the vCPUs.
 ETEXI
 
     {
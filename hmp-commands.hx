@@ -1008,7 +1008,7 @@ ETEXI
 
     {
         .name       = "migrate_set_parameter",
-        .args_type  = "parameter:s,value:i",
+        .args_type  = "parameter:s,value:s",
         .params     = "parameter value",
         .help       = "Set the parameter for migration",
         .mhandler.cmd = hmp_migrate_set_parameter,
@@ -1036,6 +1036,54 @@ STEXI
 @findex migrate_start_postcopy
 Switch in-progress migration to postcopy mode. Ignored after the end of
 migration (or once already in postcopy).
+ETEXI
+
+    {
+        .name       = "calc_dirty_rate",
+        .args_type  = "calc_time:i,sample_pages:i?",
+        .params     = "calc_time [sample_pages]",
+        .help       = "start measuring the guest dirty page rate for"
+                      " calc_time seconds, sampling sample_pages pages per GB",
+        .mhandler.cmd = hmp_calc_dirty_rate,
+    },
+
+STEXI
+@item calc_dirty_rate @var{calc_time} [@var{sample_pages}]
+@findex calc_dirty_rate
+Start measuring how fast the guest dirties its memory over @var{calc_time}
+seconds. Use @code{info dirty_rate} to see the result.
+ETEXI
+
+    {
+        .name       = "set_vcpu_dirty_limit",
+        .args_type  = "dirty_rate:i,cpu_index:i?",
+        .params     = "dirty_rate [cpu_index]",
+        .help       = "limit the dirty page rate of a vCPU (all vCPUs if"
+                      " cpu_index is omitted) to dirty_rate MB/s",
+        .mhandler.cmd = hmp_set_vcpu_dirty_limit,
+    },
+
+STEXI
+@item set_vcpu_dirty_limit @var{dirty_rate} [@var{cpu_index}]
+@findex set_vcpu_dirty_limit
+Throttle vCPU @var{cpu_index}, or all vCPUs, whenever it dirties memory
+faster than @var{dirty_rate} MB/s. Requires KVM with
+@option{-machine kvm-dirty-ring-size}.
+ETEXI
+
+    {
+        .name       = "cancel_vcpu_dirty_limit",
+        .args_type  = "cpu_index:i?",
+        .params     = "[cpu_index]",
+        .help       = "remove the dirty page rate limit of a vCPU (all vCPUs"
+                      " if cpu_index is omitted)",
+        .mhandler.cmd = hmp_cancel_vcpu_dirty_limit,
+    },
+
+STEXI
+@item cancel_vcpu_dirty_limit [@var{cpu_index}]
+@findex cancel_vcpu_dirty_limit
+Remove the dirty page rate limit of vCPU @var{cpu_index}, or of all vCPUs.
 ETEXI
 
     {
@@ -285,6 +285,18 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, " %s: %" PRId64,
             MigrationParameter_lookup[MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT],
             params->x_cpu_throttle_increment);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_MAPPED_RAM_THREADS],
+            params->x_mapped_ram_threads);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_VCPU_DIRTY_LIMIT],
+            params->x_vcpu_dirty_limit);
+        monitor_printf(mon, " %s: %s",
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_COMPRESS_METHOD],
+            MigrationCompressMethod_lookup[params->x_compress_method]);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_LOAD_THREADS],
+            params->x_load_threads);
         monitor_printf(mon, "\n");
     }
 
@@ -1234,17 +1246,35 @@ void hmp_migrate_set_capability(Monitor *mon, const QDict *qdict)
 void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
 {
     const char *param = qdict_get_str(qdict, "parameter");
-    int value = qdict_get_int(qdict, "value");
+    const char *valuestr = qdict_get_str(qdict, "value");
+    int64_t value = 0;
+    int compress_method = 0;
     Error *err = NULL;
     bool has_compress_level = false;
     bool has_compress_threads = false;
     bool has_decompress_threads = false;
     bool has_x_cpu_throttle_initial = false;
     bool has_x_cpu_throttle_increment = false;
+    bool has_x_mapped_ram_threads = false;
+    bool has_x_vcpu_dirty_limit = false;
+    bool has_x_compress_method = false;
+    bool has_x_load_threads = false;
     int i;
 
     for (i = 0; i < MIGRATION_PARAMETER__MAX; i++) {
         if (strcmp(param, MigrationParameter_lookup[i]) == 0) {
+            if (i == MIGRATION_PARAMETER_X_COMPRESS_METHOD) {
+                compress_method =
+                    qapi_enum_parse(MigrationCompressMethod_lookup, valuestr,
+                                    MIGRATION_COMPRESS_METHOD__MAX, -1, &err);
+                if (err) {
+                    break;
+                }
+            } else if (qemu_strtoll(valuestr, NULL, 10, &value) < 0) {
+                error_setg(&err, QERR_INVALID_PARAMETER_VALUE, "value",
+                           "an integer");
+                break;
+            }
             switch (i) {
             case MIGRATION_PARAMETER_COMPRESS_LEVEL:
                 has_compress_level = true;
@@ -1261,12 +1291,28 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
             case MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT:
                 has_x_cpu_throttle_increment = true;
                 break;
+            case MIGRATION_PARAMETER_X_MAPPED_RAM_THREADS:
+                has_x_mapped_ram_threads = true;
+                break;
+            case MIGRATION_PARAMETER_X_VCPU_DIRTY_LIMIT:
+                has_x_vcpu_dirty_limit = true;
+                break;
+            case MIGRATION_PARAMETER_X_COMPRESS_METHOD:
+                has_x_compress_method = true;
+                break;
+            case MIGRATION_PARAMETER_X_LOAD_THREADS:
+                has_x_load_threads = true;
+                break;
             }
             qmp_migrate_set_parameters(has_compress_level, value,
                                        has_compress_threads, value,
                                        has_decompress_threads, value,
                                        has_x_cpu_throttle_initial, value,
                                        has_x_cpu_throttle_increment, value,
+                                       has_x_mapped_ram_threads, value,
+                                       has_x_vcpu_dirty_limit, value,
+                                       has_x_compress_method, compress_method,
+                                       has_x_load_threads, value,
                                        &err);
             break;
         }
@@ -1305,6 +1351,89 @@ void hmp_migrate_start_postcopy(Monitor *mon, const QDict *qdict)
     hmp_handle_error(mon, &err);
 }
 
+void hmp_calc_dirty_rate(Monitor *mon, const QDict *qdict)
+{
+    int64_t calc_time = qdict_get_int(qdict, "calc_time");
+    bool has_sample_pages = qdict_haskey(qdict, "sample_pages");
+    int64_t sample_pages = qdict_get_try_int(qdict, "sample_pages", 0);
+    Error *err = NULL;
+
+    qmp_calc_dirty_rate(calc_time, has_sample_pages, sample_pages, &err);
+    if (err) {
+        hmp_handle_error(mon, &err);
+        return;
+    }
+    monitor_printf(mon, "Measuring the dirty page rate for %" PRId64
+                   " seconds, use 'info dirty_rate' to see the result\n",
+                   calc_time);
+}
+
+void hmp_info_dirty_rate(Monitor *mon, const QDict *qdict)
+{
+    DirtyRateInfo *info = qmp_query_dirty_rate(NULL);
+    DirtyRateVcpuList *rate;
+
+    monitor_printf(mon, "Status: %s\n", DirtyRateStatus_lookup[info->status]);
+    if (info->status == DIRTY_RATE_STATUS_UNSTARTED) {
+        goto out;
+    }
+    monitor_printf(mon, "Start time: %" PRId64 " s\n", info->start_time);
+    monitor_printf(mon, "Calculation time: %" PRId64 " s\n", info->calc_time);
+    monitor_printf(mon, "Sample pages: %" PRId64 " per GB\n",
+                   info->sample_pages);
+    if (info->has_dirty_rate) {
+        monitor_printf(mon, "Dirty rate: %" PRId64 " MB/s\n",
+                       info->dirty_rate);
+    }
+    for (rate = info->vcpu_dirty_rate; rate; rate = rate->next) {
+        monitor_printf(mon, "vCPU %" PRId64 " dirty rate: %" PRId64 " MB/s\n",
+                       rate->value->cpu_index, rate->value->dirty_rate);
+    }
+
+out:
+    qapi_free_DirtyRateInfo(info);
+}
+
+void hmp_set_vcpu_dirty_limit(Monitor *mon, const QDict *qdict)
+{
+    int64_t dirty_rate = qdict_get_int(qdict, "dirty_rate");
+    bool has_cpu_index = qdict_haskey(qdict, "cpu_index");
+    int64_t cpu_index = qdict_get_try_int(qdict, "cpu_index", -1);
+    Error *err = NULL;
+
+    qmp_set_vcpu_dirty_limit(has_cpu_index, cpu_index, dirty_rate, &err);
+    hmp_handle_error(mon, &err);
+}
+
+void hmp_cancel_vcpu_dirty_limit(Monitor *mon, const QDict *qdict)
+{
+    bool has_cpu_index = qdict_haskey(qdict, "cpu_index");
+    int64_t cpu_index = qdict_get_try_int(qdict, "cpu_index", -1);
+    Error *err = NULL;
+
+    qmp_cancel_vcpu_dirty_limit(has_cpu_index, cpu_index, &err);
+    hmp_handle_error(mon, &err);
+}
+
+void hmp_info_vcpu_dirty_limit(Monitor *mon, const QDict *qdict)
+{
+    DirtyLimitInfoList *list = qmp_query_vcpu_dirty_limit(NULL);
+    DirtyLimitInfoList *entry;
+
+    if (!list) {
+        monitor_printf(mon, "No dirty page rate limit set\n");
+        return;
+    }
+    for (entry = list; entry; entry = entry->next) {
+        monitor_printf(mon, "vCPU %" PRId64 ": limit %" PRId64
+                       " MB/s, current %" PRId64 " MB/s, throttle %" PRId64
+                       "%%\n", entry->value->cpu_index,
+                       entry->value->limit_rate, entry->value->current_rate,
+                       entry->value->throttle_percentage);
+    }
+    qapi_free_DirtyLimitInfoList(list);
+}
+
 void hmp_set_password(Monitor *mon, const QDict *qdict)
 {
     const char *protocol  = qdict_get_str(qdict, "protocol");
@@ -1429,7 +1558,9 @@ void hmp_block_set_io_throttle(Monitor *mon, const QDict *qdict)
                               false, /* No default I/O size */
                               0,
                               false,
-                              NULL, &err);
+                              NULL,
+                              false,
+                              0, &err);
     hmp_handle_error(mon, &err);
 }
 
@@ -18,9 +18,14 @@
  * Usage: add options:
  *      -drive file=<file>,if=none,id=<drive_id>
  *      -device nvme,drive=<drive_id>,serial=<serial>,id=<id[optional]>
+ *
+ * I/O queues can be moved out of the main loop with:
+ *      -object iothread,id=<iothread_id>
+ *      -device nvme,...,iothread=<iothread_id>
  */
 
 #include "qemu/osdep.h"
+#include "qemu/bitmap.h"
 #include <hw/block/block.h>
 #include <hw/hw.h>
 #include <hw/pci/msix.h>
@@ -28,6 +33,7 @@
 #include "sysemu/sysemu.h"
 #include "qapi/visitor.h"
 #include "sysemu/block-backend.h"
+#include "sysemu/iothread.h"
 
 #include "nvme.h"
 
@@ -67,17 +73,119 @@ static uint8_t nvme_sq_empty(NvmeSQueue *sq)
     return sq->head == sq->tail;
 }
 
+static AioContext *nvme_queue_ctx(NvmeCtrl *n, uint16_t qid)
+{
+    return qid ? n->ctx : qemu_get_aio_context();
+}
+
+static void nvme_irq_raise(NvmeCtrl *n, NvmeCQueue *cq)
+{
+    if (msix_enabled(&(n->parent_obj))) {
+        msix_notify(&(n->parent_obj), cq->vector);
+    } else {
+        pci_irq_pulse(&n->parent_obj);
+    }
+}
+
+static void nvme_irq_bh(void *opaque)
+{
+    NvmeCtrl *n = opaque;
+    unsigned long pending;
+    unsigned i, cqid;
+
+    for (i = 0; i < BITS_TO_LONGS(n->num_queues); i++) {
+        pending = atomic_xchg(&n->irq_pending[i], 0);
+        while (pending) {
+            cqid = i * BITS_PER_LONG + ctzl(pending);
+            pending &= pending - 1;
+            if (n->cq[cqid] && n->cq[cqid]->irq_enabled) {
+                nvme_irq_raise(n, n->cq[cqid]);
+            }
+        }
+    }
+}
+
 static void nvme_isr_notify(NvmeCtrl *n, NvmeCQueue *cq)
 {
     if (cq->irq_enabled) {
-        if (msix_enabled(&(n->parent_obj))) {
-            msix_notify(&(n->parent_obj), cq->vector);
+        if (nvme_queue_ctx(n, cq->cqid) != qemu_get_aio_context()) {
+            /* MSI-X and INTx need the BQL, which an IOThread can't take */
+            set_bit_atomic(cq->cqid, n->irq_pending);
+            qemu_bh_schedule(n->irq_bh);
         } else {
-            pci_irq_pulse(&n->parent_obj);
+            nvme_irq_raise(n, cq);
         }
     }
 }
 
+static void nvme_cq_irq_timer(void *opaque)
+{
+    NvmeCQueue *cq = opaque;
+
+    cq->irq_pending_cqes = 0;
+    nvme_isr_notify(cq->ctrl, cq);
+}
+
+/* Interrupt Coalescing: delay the interrupt until more than THR entries
+ * are posted or TIME * 100us have elapsed, whichever comes first.  Only
+ * I/O completion queues whose vector has coalescing enabled take part.
+ */
+static void nvme_cq_notify(NvmeCtrl *n, NvmeCQueue *cq, unsigned posted)
+{
+    uint32_t intc = atomic_read(&n->features.int_coalescing);
+    uint8_t thr = NVME_INTC_THR(intc);
+    uint8_t time = NVME_INTC_TIME(intc);
+
+    if (!cq->coalesce || !thr || !time) {
+        nvme_isr_notify(n, cq);
+        return;
+    }
+
+    cq->irq_pending_cqes += posted;
+    if (cq->irq_pending_cqes > thr) {
+        cq->irq_pending_cqes = 0;
+        timer_del(cq->irq_timer);
+        nvme_isr_notify(n, cq);
+    } else if (cq->irq_pending_cqes && !timer_pending(cq->irq_timer)) {
+        timer_mod(cq->irq_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                  time * 100 * SCALE_US);
+    }
+}
+
+/* Shadow doorbells: the guest writes new tail/head values to memory and
+ * only rings the MMIO doorbell when it moves past the EventIdx we publish.
+ */
+static void nvme_update_sq_tail(NvmeCtrl *n, NvmeSQueue *sq)
+{
+    uint32_t tail;
+
+    pci_dma_read(&n->parent_obj, sq->db_addr, &tail, sizeof(tail));
+    tail = le32_to_cpu(tail);
+    if (tail < sq->size) {
+        sq->tail = tail;
+    }
+}
+
+static void nvme_update_sq_eventidx(NvmeCtrl *n, NvmeSQueue *sq)
+{
+    uint32_t ei = cpu_to_le32(sq->tail);
+
+    pci_dma_write(&n->parent_obj, sq->ei_addr, &ei, sizeof(ei));
+}
+
+static void nvme_update_cq_head(NvmeCtrl *n, NvmeCQueue *cq)
+{
+    uint32_t head;
+
+    pci_dma_read(&n->parent_obj, cq->db_addr, &head, sizeof(head));
+    head = le32_to_cpu(head);
+    if (head < cq->size) {
+        cq->head = head;
+    }
+    head = cpu_to_le32(cq->head);
+    pci_dma_write(&n->parent_obj, cq->ei_addr, &head, sizeof(head));
+}
+
 static uint16_t nvme_map_prp(QEMUSGList *qsg, uint64_t prp1, uint64_t prp2,
     uint32_t len, NvmeCtrl *n)
 {
@@ -143,6 +251,95 @@ static uint16_t nvme_map_prp(QEMUSGList *qsg, uint64_t prp1, uint64_t prp2,
     return NVME_INVALID_FIELD | NVME_DNR;
 }
 
+/* Bound the number of segments so that a looping list cannot stall us */
+#define NVME_SGL_MAX_SEGMENTS   256
+
+static uint16_t nvme_map_sgl(QEMUSGList *qsg, NvmeSglDescriptor *sgl,
+    uint32_t len, NvmeCtrl *n)
+{
+    NvmeSglDescriptor segment[32];
+    NvmeSglDescriptor desc = *sgl;
+    uint32_t nsgld, chunk, dlen, i;
+    unsigned nseg = 0;
+    uint64_t addr;
+    uint16_t status;
+    bool last = false;
+
+    pci_dma_sglist_init(qsg, &n->parent_obj, 1);
+
+    switch (NVME_SGL_TYPE(desc.type)) {
+    case NVME_SGL_DESCR_TYPE_DATA_BLOCK:
+        if (le32_to_cpu(desc.len) < len) {
+            status = NVME_DATA_SGL_LEN_INVALID;
+            goto unmap;
+        }
+        qemu_sglist_add(qsg, le64_to_cpu(desc.addr), len);
+        return NVME_SUCCESS;
+    case NVME_SGL_DESCR_TYPE_SEGMENT:
+    case NVME_SGL_DESCR_TYPE_LAST_SEGMENT:
+        break;
+    default:
+        status = NVME_SGL_DESCR_TYPE_INVALID;
+        goto unmap;
+    }
+
+    while (!last) {
+        last = NVME_SGL_TYPE(desc.type) == NVME_SGL_DESCR_TYPE_LAST_SEGMENT;
+        addr = le64_to_cpu(desc.addr);
+        nsgld = le32_to_cpu(desc.len) / sizeof(NvmeSglDescriptor);
+        if (!nsgld || le32_to_cpu(desc.len) % sizeof(NvmeSglDescriptor)) {
+            status = NVME_INVALID_SGL_SEG_DESCR;
+            goto unmap;
+        }
+        if (++nseg > NVME_SGL_MAX_SEGMENTS) {
+            status = NVME_INVALID_NUM_SGL_DESCRS;
+            goto unmap;
+        }
+
+        while (nsgld) {
+            chunk = MIN(nsgld, ARRAY_SIZE(segment));
+            pci_dma_read(&n->parent_obj, addr, segment,
+                         chunk * sizeof(NvmeSglDescriptor));
+            addr += chunk * sizeof(NvmeSglDescriptor);
+            nsgld -= chunk;
+
+            for (i = 0; i < chunk; i++) {
+                uint8_t type = NVME_SGL_TYPE(segment[i].type);
+
+                /* The last descriptor of a Segment points to the next one */
+                if (!last && !nsgld && i == chunk - 1) {
+                    if (type != NVME_SGL_DESCR_TYPE_SEGMENT &&
+                        type != NVME_SGL_DESCR_TYPE_LAST_SEGMENT) {
+                        status = NVME_INVALID_SGL_SEG_DESCR;
+                        goto unmap;
+                    }
+                    desc = segment[i];
+                    break;
+                }
+                if (type != NVME_SGL_DESCR_TYPE_DATA_BLOCK) {
+                    status = NVME_SGL_DESCR_TYPE_INVALID;
+                    goto unmap;
+                }
+                dlen = MIN(le32_to_cpu(segment[i].len), len);
+                if (dlen) {
+                    qemu_sglist_add(qsg, le64_to_cpu(segment[i].addr), dlen);
+                    len -= dlen;
+                }
+            }
+        }
+    }
+
+    if (len) {
+        status = NVME_DATA_SGL_LEN_INVALID;
+        goto unmap;
+    }
+    return NVME_SUCCESS;
+
+ unmap:
+    qemu_sglist_destroy(qsg);
+    return status | NVME_DNR;
+}
+
 static uint16_t nvme_dma_read_prp(NvmeCtrl *n, uint8_t *ptr, uint32_t len,
     uint64_t prp1, uint64_t prp2)
 {
@@ -164,6 +361,11 @@ static void nvme_post_cqes(void *opaque)
     NvmeCQueue *cq = opaque;
     NvmeCtrl *n = cq->ctrl;
     NvmeRequest *req, *next;
+    unsigned posted = 0;
+
+    if (cq->db_addr) {
+        nvme_update_cq_head(n, cq);
+    }
 
     QTAILQ_FOREACH_SAFE(req, &cq->req_list, entry, next) {
         NvmeSQueue *sq;
@@ -183,8 +385,9 @@ static void nvme_post_cqes(void *opaque)
         pci_dma_write(&n->parent_obj, addr, (void *)&req->cqe,
             sizeof(req->cqe));
         QTAILQ_INSERT_TAIL(&sq->req_list, req, entry);
+        posted++;
     }
-    nvme_isr_notify(n, cq);
+    nvme_cq_notify(n, cq, posted);
 }
 
 static void nvme_enqueue_req_completion(NvmeCQueue *cq, NvmeRequest *req)
@@ -192,7 +395,7 @@ static void nvme_enqueue_req_completion(NvmeCQueue *cq, NvmeRequest *req)
     assert(cq->cqid == req->sq->cqid);
     QTAILQ_REMOVE(&req->sq->out_req_list, req, entry);
     QTAILQ_INSERT_TAIL(&cq->req_list, req, entry);
-    timer_mod(cq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+    qemu_bh_schedule(cq->bh);
 }
 
 static void nvme_rw_cb(void *opaque, int ret)
@@ -234,6 +437,7 @@ static uint16_t nvme_rw(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
     uint64_t slba = le64_to_cpu(rw->slba);
     uint64_t prp1 = le64_to_cpu(rw->prp1);
     uint64_t prp2 = le64_to_cpu(rw->prp2);
+    uint16_t status;
 
     uint8_t lba_index  = NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas);
     uint8_t data_shift = ns->id_ns.lbaf[lba_index].ds;
@@ -247,9 +451,25 @@ static uint16_t nvme_rw(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
         return NVME_LBA_RANGE | NVME_DNR;
     }
 
-    if (nvme_map_prp(&req->qsg, prp1, prp2, data_size, n)) {
+    switch (NVME_CMD_FLAGS_PSDT(rw->flags)) {
+    case NVME_PSDT_PRP:
+        status = nvme_map_prp(&req->qsg, prp1, prp2, data_size, n);
+        break;
+    case NVME_PSDT_SGL_MPTR_CONTIGUOUS:
+    case NVME_PSDT_SGL_MPTR_SGL: {
+        NvmeSglDescriptor sgl;
+
+        memcpy(&sgl, &rw->prp1, sizeof(sgl));
+        status = nvme_map_sgl(&req->qsg, &sgl, data_size, n);
+        break;
+    }
+    default:
+        status = NVME_INVALID_FIELD | NVME_DNR;
+        break;
+    }
+    if (status) {
         block_acct_invalid(blk_get_stats(n->conf.blk), acct);
-        return NVME_INVALID_FIELD | NVME_DNR;
+        return status;
     }
 
     assert((nlb << data_shift) == req->qsg.size);
@@ -287,8 +507,7 @@ static uint16_t nvme_io_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
 static void nvme_free_sq(NvmeSQueue *sq, NvmeCtrl *n)
 {
     n->sq[sq->sqid] = NULL;
-    timer_del(sq->timer);
-    timer_free(sq->timer);
+    qemu_bh_delete(sq->bh);
     g_free(sq->io_req);
     if (sq->sqid) {
         g_free(sq);
@@ -350,7 +569,12 @@ static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
         sq->io_req[i].sq = sq;
         QTAILQ_INSERT_TAIL(&(sq->req_list), &sq->io_req[i], entry);
     }
-    sq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_process_sq, sq);
+    sq->bh = aio_bh_new(nvme_queue_ctx(n, sqid), nvme_process_sq, sq);
+    sq->db_addr = sq->ei_addr = 0;
+    if (sqid && n->dbbuf_dbs) {
+        sq->db_addr = n->dbbuf_dbs + (sqid << 3);
+        sq->ei_addr = n->dbbuf_eis + (sqid << 3);
+    }
 
     assert(n->cq[cqid]);
     cq = n->cq[cqid];
@@ -392,8 +616,11 @@ static uint16_t nvme_create_sq(NvmeCtrl *n, NvmeCmd *cmd)
 static void nvme_free_cq(NvmeCQueue *cq, NvmeCtrl *n)
 {
     n->cq[cq->cqid] = NULL;
-    timer_del(cq->timer);
-    timer_free(cq->timer);
+    qemu_bh_delete(cq->bh);
+    if (cq->irq_timer) {
+        timer_del(cq->irq_timer);
+        timer_free(cq->irq_timer);
+    }
     msix_vector_unuse(&n->parent_obj, cq->vector);
     if (cq->cqid) {
         g_free(cq);
@@ -433,7 +660,20 @@ static void nvme_init_cq(NvmeCQueue *cq, NvmeCtrl *n, uint64_t dma_addr,
     QTAILQ_INIT(&cq->sq_list);
     msix_vector_use(&n->parent_obj, cq->vector);
     n->cq[cqid] = cq;
-    cq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_post_cqes, cq);
+    cq->bh = aio_bh_new(nvme_queue_ctx(n, cqid), nvme_post_cqes, cq);
+    cq->db_addr = cq->ei_addr = 0;
+    cq->coalesce = false;
+    cq->irq_pending_cqes = 0;
+    cq->irq_timer = NULL;
+    if (cqid) {
+        if (n->dbbuf_dbs) {
+            cq->db_addr = n->dbbuf_dbs + (cqid << 3) + (1 << 2);
+            cq->ei_addr = n->dbbuf_eis + (cqid << 3) + (1 << 2);
+        }
+        cq->coalesce = !NVME_INTVC_CD(n->features.int_vector_config[vector]);
+        cq->irq_timer = aio_timer_new(n->ctx, QEMU_CLOCK_VIRTUAL, SCALE_NS,
+                                      nvme_cq_irq_timer, cq);
+    }
 }
 
 static uint16_t nvme_create_cq(NvmeCtrl *n, NvmeCmd *cmd)
@@ -493,6 +733,7 @@ static uint16_t nvme_identify(NvmeCtrl *n, NvmeCmd *cmd)
 static uint16_t nvme_get_feature(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
 {
     uint32_t dw10 = le32_to_cpu(cmd->cdw10);
+    uint32_t dw11 = le32_to_cpu(cmd->cdw11);
     uint32_t result;
 
     switch (dw10) {
@@ -502,6 +743,15 @@ static uint16_t nvme_get_feature(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
     case NVME_NUMBER_OF_QUEUES:
         result = cpu_to_le32((n->num_queues - 1) | ((n->num_queues - 1) << 16));
         break;
+    case NVME_INTERRUPT_COALESCING:
+        result = cpu_to_le32(n->features.int_coalescing);
+        break;
+    case NVME_INTERRUPT_VECTOR_CONF:
+        if (NVME_INTVC_IV(dw11) > n->num_queues) {
+            return NVME_INVALID_FIELD | NVME_DNR;
+        }
+        result = cpu_to_le32(n->features.int_vector_config[NVME_INTVC_IV(dw11)]);
+        break;
     default:
         return NVME_INVALID_FIELD | NVME_DNR;
     }
@@ -523,12 +773,62 @@ static uint16_t nvme_set_feature(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
         req->cqe.result =
             cpu_to_le32((n->num_queues - 1) | ((n->num_queues - 1) << 16));
         break;
+    case NVME_INTERRUPT_COALESCING:
+        atomic_set(&n->features.int_coalescing, dw11 & 0xffff);
+        break;
+    case NVME_INTERRUPT_VECTOR_CONF: {
+        uint16_t iv = NVME_INTVC_IV(dw11);
+        int i;
+
+        if (iv > n->num_queues) {
+            return NVME_INVALID_FIELD | NVME_DNR;
+        }
+        n->features.int_vector_config[iv] = dw11 & 0x1ffff;
+        for (i = 1; i < n->num_queues; i++) {
+            if (n->cq[i] && n->cq[i]->vector == iv) {
+                n->cq[i]->coalesce = !NVME_INTVC_CD(dw11);
+            }
+        }
+        break;
+    }
     default:
         return NVME_INVALID_FIELD | NVME_DNR;
     }
     return NVME_SUCCESS;
 }
 
+static uint16_t nvme_dbbuf_config(NvmeCtrl *n, NvmeCmd *cmd)
+{
+    uint64_t dbs_addr = le64_to_cpu(cmd->prp1);
+    uint64_t eis_addr = le64_to_cpu(cmd->prp2);
+    int i;
+
+    if (!dbs_addr || dbs_addr & (n->page_size - 1) ||
+        !eis_addr || eis_addr & (n->page_size - 1)) {
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    /* The admin queue keeps using the MMIO doorbells */
+    n->dbbuf_dbs = dbs_addr;
+    n->dbbuf_eis = eis_addr;
+    for (i = 1; i < n->num_queues; i++) {
+        NvmeSQueue *sq = n->sq[i];
+        NvmeCQueue *cq = n->cq[i];
+
+        if (sq) {
+            sq->db_addr = dbs_addr + (i << 3);
+            sq->ei_addr = eis_addr + (i << 3);
+            nvme_update_sq_eventidx(n, sq);
+        }
+        if (cq) {
+            cq->db_addr = dbs_addr + (i << 3) + (1 << 2);
+            cq->ei_addr = eis_addr + (i << 3) + (1 << 2);
+            nvme_update_cq_head(n, cq);
+        }
+    }
+    return NVME_SUCCESS;
+}
+
 static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
 {
     switch (cmd->opcode) {
@@ -546,6 +846,8 @@ static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
         return nvme_set_feature(n, cmd, req);
     case NVME_ADM_CMD_GET_FEATURES:
         return nvme_get_feature(n, cmd, req);
+    case NVME_ADM_CMD_DBBUF_CONFIG:
+        return nvme_dbbuf_config(n, cmd);
     default:
         return NVME_INVALID_OPCODE | NVME_DNR;
     }
@@ -562,6 +864,10 @@ static void nvme_process_sq(void *opaque)
     NvmeCmd cmd;
     NvmeRequest *req;
 
+    if (sq->db_addr) {
+        nvme_update_sq_tail(n, sq);
+    }
+
     while (!(nvme_sq_empty(sq) || QTAILQ_EMPTY(&sq->req_list))) {
         addr = sq->dma_addr + sq->head * n->sqe_size;
         pci_dma_read(&n->parent_obj, addr, (void *)&cmd, sizeof(cmd));
@@ -573,12 +879,26 @@ static void nvme_process_sq(void *opaque)
         memset(&req->cqe, 0, sizeof(req->cqe));
         req->cqe.cid = cmd.cid;
 
-        status = sq->sqid ? nvme_io_cmd(n, &cmd, req) :
-            nvme_admin_cmd(n, &cmd, req);
+        if (sq->sqid) {
+            status = nvme_io_cmd(n, &cmd, req);
+        } else {
+            /* Admin commands touch the I/O queues */
+            aio_context_acquire(n->ctx);
+            status = nvme_admin_cmd(n, &cmd, req);
+            aio_context_release(n->ctx);
+        }
         if (status != NVME_NO_COMPLETE) {
             req->status = status;
             nvme_enqueue_req_completion(cq, req);
         }
+
+        if (sq->db_addr && nvme_sq_empty(sq)) {
+            /* Ask for a doorbell write, then catch up with the shadow
+             * doorbell in case the guest raced with us.
+             */
+            nvme_update_sq_eventidx(n, sq);
+            nvme_update_sq_tail(n, sq);
+        }
     }
 }
 
@@ -586,6 +906,7 @@ static void nvme_clear_ctrl(NvmeCtrl *n)
 {
     int i;
 
+    aio_context_acquire(n->ctx);
     for (i = 0; i < n->num_queues; i++) {
         if (n->sq[i] != NULL) {
             nvme_free_sq(n->sq[i], n);
@@ -597,7 +918,15 @@ static void nvme_clear_ctrl(NvmeCtrl *n)
         }
     }
 
+    /* Doorbells rung before the reset must not apply to new queues */
+    bitmap_zero(n->db_pending, 2 * n->num_queues);
+    n->dbbuf_dbs = n->dbbuf_eis = 0;
+
     blk_flush(n->conf.blk);
+    if (n->iothread) {
+        blk_set_aio_context(n->conf.blk, qemu_get_aio_context());
+    }
+    aio_context_release(n->ctx);
     n->bar.cc = 0;
 }
 
@@ -628,6 +957,9 @@ static int nvme_start_ctrl(NvmeCtrl *n)
     nvme_init_sq(&n->admin_sq, n, n->bar.asq, 0, 0,
         NVME_AQA_ASQS(n->bar.aqa) + 1);
 
+    if (n->iothread) {
+        blk_set_aio_context(n->conf.blk, n->ctx);
+    }
     return 0;
 }
 
@@ -731,9 +1063,9 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
         if (start_sqs) {
             NvmeSQueue *sq;
             QTAILQ_FOREACH(sq, &cq->sq_list, entry) {
-                timer_mod(sq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+                qemu_bh_schedule(sq->bh);
             }
-            timer_mod(cq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+            qemu_bh_schedule(cq->bh);
         }
 
         if (cq->tail != cq->head) {
@@ -754,7 +1086,7 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
         }
 
         sq->tail = new_tail;
-        timer_mod(sq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+        qemu_bh_schedule(sq->bh);
     }
 }
 
@@ -764,11 +1096,70 @@ static void nvme_mmio_write(void *opaque, hwaddr addr, uint64_t data,
     NvmeCtrl *n = (NvmeCtrl *)opaque;
     if (addr < sizeof(n->bar)) {
         nvme_write_bar(n, addr, data, size);
-    } else if (addr >= 0x1000) {
-        nvme_process_db(n, addr, data);
     }
 }
 
+/* Applies the doorbell values that vCPUs have posted since the last run.
+ * The admin queue's doorbells are handled in the main loop by db_bh, the
+ * others in the I/O queues' AioContext by io_db_bh.
+ */
+static void nvme_process_posted_dbs(NvmeCtrl *n, unsigned long mask,
+                                    unsigned first_word, unsigned last_word)
+{
+    unsigned long pending;
+    unsigned i, idx;
+
+    for (i = first_word; i <= last_word; i++) {
+        pending = atomic_fetch_and(&n->db_pending[i], ~mask) & mask;
+        mask = ~0UL;
+        while (pending) {
+            idx = i * BITS_PER_LONG + ctzl(pending);
+            pending &= pending - 1;
+            nvme_process_db(n, 0x1000 + (idx << 2),
+                            atomic_read(&n->db_values[idx]));
+        }
+    }
+}
+
+static void nvme_db_bh(void *opaque)
+{
+    NvmeCtrl *n = opaque;
+
+    nvme_process_posted_dbs(n, 0x3, 0, 0);
+}
+
+static void nvme_io_db_bh(void *opaque)
+{
+    NvmeCtrl *n = opaque;
+
+    nvme_process_posted_dbs(n, ~0x3UL, 0,
+                            BITS_TO_LONGS(2 * n->num_queues) - 1);
+}
+
+static uint64_t nvme_db_read(void *opaque, hwaddr addr, unsigned size)
+{
+    return 0;
+}
+
+/* Doorbell writes are dispatched without the BQL.  They only record the
+ * new value; a doorbell that is rung several times before the bottom half
+ * runs is processed once, with the last value written.
+ */
+static void nvme_db_write(void *opaque, hwaddr addr, uint64_t data,
+    unsigned size)
+{
+    NvmeCtrl *n = (NvmeCtrl *)opaque;
+    unsigned idx = addr >> 2;
+
+    if (addr & ((1 << 2) - 1) || idx >= 2 * n->num_queues) {
+        return;
+    }
+
+    atomic_set(&n->db_values[idx], data & 0xffff);
+    set_bit_atomic(idx, n->db_pending);
+    qemu_bh_schedule(idx < 2 ? n->db_bh : n->io_db_bh);
+}
+
 static const MemoryRegionOps nvme_mmio_ops = {
     .read = nvme_mmio_read,
     .write = nvme_mmio_write,
@@ -779,6 +1170,16 @@ static const MemoryRegionOps nvme_mmio_ops = {
     },
 };
 
+static const MemoryRegionOps nvme_db_ops = {
+    .read = nvme_db_read,
+    .write = nvme_db_write,
+    .endianness = DEVICE_LITTLE_ENDIAN,
+    .impl = {
+        .min_access_size = 2,
+        .max_access_size = 8,
+    },
+};
+
 static int nvme_init(PCIDevice *pci_dev)
 {
     NvmeCtrl *n = NVME(pci_dev);
@@ -803,6 +1204,11 @@ static int nvme_init(PCIDevice *pci_dev)
     }
     blkconf_blocksizes(&n->conf);
 
+    /* Queue 0 is the admin queue; each queue needs an MSI-X vector */
+    if (n->num_queues < 2 || n->num_queues > 2048) {
+        return -1;
+    }
+
     pci_conf = pci_dev->config;
     pci_conf[PCI_INTERRUPT_PIN] = 1;
     pci_config_set_prog_interface(pci_dev->config, 0x2);
@@ -810,16 +1216,34 @@ static int nvme_init(PCIDevice *pci_dev)
     pcie_endpoint_cap_init(&n->parent_obj, 0x80);
 
     n->num_namespaces = 1;
-    n->num_queues = 64;
     n->reg_size = pow2ceil(0x1004 + 2 * (n->num_queues + 1) * 4);
     n->ns_size = bs_size / (uint64_t)n->num_namespaces;
 
     n->namespaces = g_new0(NvmeNamespace, n->num_namespaces);
     n->sq = g_new0(NvmeSQueue *, n->num_queues);
     n->cq = g_new0(NvmeCQueue *, n->num_queues);
+    n->db_values = g_new0(uint16_t, 2 * n->num_queues);
+    n->db_pending = bitmap_new(2 * n->num_queues);
+    n->irq_pending = bitmap_new(n->num_queues);
+    n->features.int_vector_config = g_new(uint32_t, n->num_queues + 1);
+    for (i = 0; i <= n->num_queues; i++) {
+        n->features.int_vector_config[i] = i;
+    }
 
-    memory_region_init_io(&n->iomem, OBJECT(n), &nvme_mmio_ops, n,
-                          "nvme", n->reg_size);
+    n->ctx = n->iothread ? iothread_get_aio_context(n->iothread) :
+                           qemu_get_aio_context();
+    n->db_bh = qemu_bh_new(nvme_db_bh, n);
+    n->io_db_bh = aio_bh_new(n->ctx, nvme_io_db_bh, n);
+    n->irq_bh = qemu_bh_new(nvme_irq_bh, n);
+
+    memory_region_init(&n->iomem, OBJECT(n), "nvme", n->reg_size);
+    memory_region_init_io(&n->ctrl_mem, OBJECT(n), &nvme_mmio_ops, n,
+                          "nvme-ctrl", 0x1000);
+    memory_region_add_subregion(&n->iomem, 0, &n->ctrl_mem);
+    memory_region_init_io(&n->db_mem, OBJECT(n), &nvme_db_ops, n,
+                          "nvme-db", n->reg_size - 0x1000);
+    memory_region_clear_global_locking(&n->db_mem);
+    memory_region_add_subregion(&n->iomem, 0x1000, &n->db_mem);
     pci_register_bar(&n->parent_obj, 0,
         PCI_BASE_ADDRESS_SPACE_MEMORY | PCI_BASE_ADDRESS_MEM_TYPE_64,
         &n->iomem);
@@ -834,12 +1258,13 @@ static int nvme_init(PCIDevice *pci_dev)
     id->ieee[0] = 0x00;
     id->ieee[1] = 0x02;
     id->ieee[2] = 0xb3;
-    id->oacs = cpu_to_le16(0);
+    id->oacs = cpu_to_le16(NVME_OACS_DBBUF);
     id->frmw = 7 << 1;
     id->lpa = 1 << 0;
     id->sqes = (0x6 << 4) | 0x6;
     id->cqes = (0x4 << 4) | 0x4;
     id->nn = cpu_to_le32(n->num_namespaces);
+    id->sgls = cpu_to_le32(NVME_SGLS_SUPPORTED);
     id->psd[0].mp = cpu_to_le16(0x9c4);
     id->psd[0].enlat = cpu_to_le32(0x10);
     id->psd[0].exlat = cpu_to_le32(0x4);
@@ -880,6 +1305,13 @@ static void nvme_exit(PCIDevice *pci_dev)
     NvmeCtrl *n = NVME(pci_dev);
 
     nvme_clear_ctrl(n);
+    qemu_bh_delete(n->db_bh);
+    qemu_bh_delete(n->io_db_bh);
+    qemu_bh_delete(n->irq_bh);
+    g_free(n->features.int_vector_config);
+    g_free(n->irq_pending);
+    g_free(n->db_pending);
+    g_free(n->db_values);
     g_free(n->namespaces);
     g_free(n->cq);
     g_free(n->sq);
@@ -889,6 +1321,7 @@ static void nvme_exit(PCIDevice *pci_dev)
 static Property nvme_props[] = {
     DEFINE_BLOCK_PROPERTIES(NvmeCtrl, conf),
     DEFINE_PROP_STRING("serial", NvmeCtrl, serial),
+    DEFINE_PROP_UINT32("num_queues", NvmeCtrl, num_queues, 64),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -920,6 +1353,10 @@ static void nvme_instance_init(Object *obj)
 {
     NvmeCtrl *s = NVME(obj);
 
+    object_property_add_link(obj, "iothread", TYPE_IOTHREAD,
+                             (Object **)&s->iothread,
+                             qdev_prop_allow_set_link_before_realize,
+                             OBJ_PROP_LINK_UNREF_ON_RELEASE, NULL);
     device_add_bootindex_property(obj, &s->conf.bootindex,
                                   "bootindex", "/namespace@1,0",
                                   DEVICE(obj), &error_abort);
@@ -115,6 +115,11 @@ void vhost_net_ack_features(struct vhost_net *net, uint64_t features)
     vhost_ack_features(&net->dev, vhost_net_get_feature_bits(net), features);
 }
 
+uint64_t vhost_net_get_acked_features(VHostNetState *net)
+{
+    return net->dev.acked_features;
+}
+
 uint64_t vhost_net_get_max_queues(VHostNetState *net)
 {
     return net->dev.max_queues;
@@ -170,6 +175,7 @@ struct vhost_net *vhost_net_init(VhostNetOptions *options)
     if (r < 0) {
         goto fail;
     }
+    net->dev.inflight = options->inflight;
     if (backend_kernel) {
         if (!qemu_has_vnet_hdr_len(options->net_backend,
                                sizeof(struct virtio_net_hdr_mrg_rxbuf))) {
@@ -410,6 +416,14 @@ int vhost_set_vring_enable(NetClientState *nc, int enable)
     return 0;
 }
 
+/* The guest reset the device, nothing it had queued is in flight anymore */
+void vhost_net_reset_inflight(NetClientState *nc)
+{
+    if (nc && nc->info->type == NET_CLIENT_OPTIONS_KIND_VHOST_USER) {
+        vhost_user_reset_inflight(nc);
+    }
+}
+
 #else
 uint64_t vhost_net_get_max_queues(VHostNetState *net)
 {
@@ -446,6 +460,11 @@ void vhost_net_ack_features(struct vhost_net *net, uint64_t features)
 {
 }
 
+uint64_t vhost_net_get_acked_features(VHostNetState *net)
+{
+    return 0;
+}
+
 bool vhost_net_virtqueue_pending(VHostNetState *net, int idx)
 {
     return false;
@@ -470,4 +489,8 @@ int vhost_set_vring_enable(NetClientState *nc, int enable)
 {
     return 0;
 }
+
+void vhost_net_reset_inflight(NetClientState *nc)
+{
+}
 #endif
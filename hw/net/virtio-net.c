@@ -31,6 +31,11 @@
 #define MAC_TABLE_ENTRIES    64
 #define MAX_VLAN    (1 << 12)   /* Per 802.1Q definition */
 
+/* TX buffers popped from the ring at once */
+#define VIRTIO_NET_TX_BATCH  32
+/* Per-queue TX scratch; always enough for one worst-case packet */
+#define VIRTIO_NET_TX_SG     (2 * VIRTQUEUE_MAX_SIZE + 1)
+
 /*
  * Calculate the number of bytes up to and including the given 'field' of
  * 'container'.
@@ -383,6 +388,7 @@ static RxFilterInfo *virtio_net_query_rxfilter(NetClientState *nc)
 static void virtio_net_reset(VirtIODevice *vdev)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
+    int i;
 
     /* Reset back to compatibility mode */
     n->promisc = 1;
@@ -406,6 +412,10 @@ static void virtio_net_reset(VirtIODevice *vdev)
     memcpy(&n->mac[0], &n->nic->conf->macaddr, sizeof(n->mac));
     qemu_format_nic_info_str(qemu_get_queue(n->nic), n->mac);
     memset(n->vlans, 0, MAX_VLAN >> 3);
+
+    for (i = 0; i < n->max_queues; i++) {
+        vhost_net_reset_inflight(qemu_get_subqueue(n->nic, i)->peer);
+    }
 }
 
 static void peer_test_vnet_hdr(VirtIONet *n)
@@ -1089,7 +1099,12 @@ static int receive_filter(VirtIONet *n, const uint8_t *buf, int size)
     return 0;
 }
 
-static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t size)
+/*
+ * Copy one packet into the RX ring.  The used entries are filled after
+ * the *filled already pending ones and left for the caller to flush.
+ */
+static ssize_t virtio_net_do_receive(NetClientState *nc, const uint8_t *buf,
+                                     size_t size, unsigned *filled)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
@@ -1167,13 +1182,13 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
          * Otherwise, drop it. */
         if (!n->mergeable_rx_bufs && offset < size) {
             virtqueue_discard(q->rx_vq, elem, total);
-            g_free(elem);
+            virtqueue_free_element(q->rx_vq, elem);
             return size;
         }
 
         /* signal other side */
-        virtqueue_fill(q->rx_vq, elem, total, i++);
-        g_free(elem);
+        virtqueue_fill(q->rx_vq, elem, total, *filled + i++);
+        virtqueue_free_element(q->rx_vq, elem);
     }
 
     if (mhdr_cnt) {
@@ -1183,12 +1198,65 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
                      &mhdr.num_buffers, sizeof mhdr.num_buffers);
     }
 
-    virtqueue_flush(q->rx_vq, i);
-    virtio_notify(vdev, q->rx_vq);
-
+    *filled += i;
     return size;
 }
 
+static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t size)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(qemu_get_nic_opaque(nc));
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    unsigned filled = 0;
+    ssize_t ret;
+
+    ret = virtio_net_do_receive(nc, buf, size, &filled);
+    if (filled) {
+        virtqueue_flush(q->rx_vq, filled);
+        virtio_notify(vdev, q->rx_vq);
+    }
+    return ret;
+}
+
+/* Several packets per used ring update and guest notification */
+static int virtio_net_receive_batch(NetClientState *nc,
+                                    const NetPacketIOV *pkts, int count)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(qemu_get_nic_opaque(nc));
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    uint8_t *bounce = NULL;
+    size_t bounce_size = 0;
+    unsigned filled = 0;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        const uint8_t *buf;
+        size_t size;
+
+        if (pkts[i].iovcnt == 1) {
+            buf = pkts[i].iov[0].iov_base;
+            size = pkts[i].iov[0].iov_len;
+        } else {
+            size = iov_size(pkts[i].iov, pkts[i].iovcnt);
+            if (size > bounce_size) {
+                bounce = g_realloc(bounce, size);
+                bounce_size = size;
+            }
+            iov_to_buf(pkts[i].iov, pkts[i].iovcnt, 0, bounce, size);
+            buf = bounce;
+        }
+        if (virtio_net_do_receive(nc, buf, size, &filled) == 0) {
+            break;
+        }
+    }
+    g_free(bounce);
+
+    if (filled) {
+        virtqueue_flush(q->rx_vq, filled);
+        virtio_notify(vdev, q->rx_vq);
+    }
+    return i;
+}
+
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q);
 
 static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
@@ -1200,7 +1268,7 @@ static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
     virtqueue_push(q->tx_vq, q->async_tx.elem, 0);
     virtio_notify(vdev, q->tx_vq);
 
-    g_free(q->async_tx.elem);
+    virtqueue_free_element(q->tx_vq, q->async_tx.elem);
     q->async_tx.elem = NULL;
 
     virtio_queue_set_notification(q->tx_vq, 1);
@@ -1212,7 +1280,11 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 {
     VirtIONet *n = q->n;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
-    VirtQueueElement *elem;
+    VirtQueueElement *elems[VIRTIO_NET_TX_BATCH], *elem;
+    VirtQueueElement *pkt_elems[VIRTIO_NET_TX_BATCH];
+    struct virtio_net_hdr_mrg_rxbuf mhdr[VIRTIO_NET_TX_BATCH];
+    NetPacketIOV pkts[VIRTIO_NET_TX_BATCH];
+    unsigned int num_elems = 0, next = 0, done = 0;
     int32_t num_packets = 0;
     int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
     if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
@@ -1224,78 +1296,140 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
         return num_packets;
     }
 
-    for (;;) {
-        ssize_t ret;
-        unsigned int out_num;
-        struct iovec sg[VIRTQUEUE_MAX_SIZE], sg2[VIRTQUEUE_MAX_SIZE + 1], *out_sg;
-        struct virtio_net_hdr_mrg_rxbuf mhdr;
-
-        elem = virtqueue_pop(q->tx_vq, sizeof(VirtQueueElement));
-        if (!elem) {
-            break;
-        }
+    while (num_packets < n->tx_burst) {
+        unsigned int npkts = 0, sg_used = 0;
+        int i, sent;
 
-        out_num = elem->out_num;
-        out_sg = elem->out_sg;
-        if (out_num < 1) {
-            error_report("virtio-net header not in first element");
-            exit(1);
+        if (next == num_elems) {
+            num_elems = virtqueue_pop_batch(q->tx_vq, sizeof(VirtQueueElement),
+                                            (void **)elems,
+                                            MIN(ARRAY_SIZE(elems),
+                                                n->tx_burst - num_packets));
+            next = 0;
+            if (!num_elems) {
+                break;
+            }
         }
 
-        if (n->has_vnet_hdr) {
-            if (iov_to_buf(out_sg, out_num, 0, &mhdr, n->guest_hdr_len) <
-                n->guest_hdr_len) {
-                error_report("virtio-net header incorrect");
+        /* Prepare as many popped buffers as the scratch space holds */
+        while (next < num_elems) {
+            struct iovec *out_sg, *sg;
+            unsigned int out_num, need = 0;
+            bool swap = n->has_vnet_hdr && n->needs_vnet_hdr_swap;
+            bool strip = n->host_hdr_len != n->guest_hdr_len;
+
+            elem = elems[next];
+            out_num = elem->out_num;
+            out_sg = elem->out_sg;
+            if (out_num < 1) {
+                error_report("virtio-net header not in first element");
                 exit(1);
             }
-            if (n->needs_vnet_hdr_swap) {
-                virtio_net_hdr_swap(vdev, (void *) &mhdr);
-                sg2[0].iov_base = &mhdr;
-                sg2[0].iov_len = n->guest_hdr_len;
-                out_num = iov_copy(&sg2[1], ARRAY_SIZE(sg2) - 1,
+
+            if (swap) {
+                need += out_num + 1;
+            }
+            if (strip) {
+                need += MIN(2 * (out_num + 1), VIRTQUEUE_MAX_SIZE);
+            }
+            if (sg_used + need > VIRTIO_NET_TX_SG) {
+                break;
+            }
+
+            if (n->has_vnet_hdr) {
+                if (iov_to_buf(out_sg, out_num, 0, &mhdr[npkts],
+                               n->guest_hdr_len) < n->guest_hdr_len) {
+                    error_report("virtio-net header incorrect");
+                    exit(1);
+                }
+                if (swap) {
+                    sg = q->tx_sg + sg_used;
+                    virtio_net_hdr_swap(vdev, (void *) &mhdr[npkts]);
+                    sg[0].iov_base = &mhdr[npkts];
+                    sg[0].iov_len = n->guest_hdr_len;
+                    out_num = iov_copy(&sg[1], MIN(out_num, VIRTQUEUE_MAX_SIZE),
+                                       out_sg, out_num,
+                                       n->guest_hdr_len, -1);
+                    if (out_num == VIRTQUEUE_MAX_SIZE) {
+                        /* Keep completions in ring order: drop it alone */
+                        if (npkts) {
+                            break;
+                        }
+                        virtqueue_fill(q->tx_vq, elem, 0, done++);
+                        virtqueue_free_element(q->tx_vq, elem);
+                        next++;
+                        num_packets++;
+                        continue;
+                    }
+                    out_num += 1;
+                    out_sg = sg;
+                    sg_used += out_num;
+                }
+            }
+            /*
+             * If host wants to see the guest header as is, we can
+             * pass it on unchanged. Otherwise, copy just the parts
+             * that host is interested in.
+             */
+            assert(n->host_hdr_len <= n->guest_hdr_len);
+            if (strip) {
+                unsigned int max = MIN(2 * out_num, VIRTQUEUE_MAX_SIZE);
+                unsigned sg_num;
+
+                sg = q->tx_sg + sg_used;
+                sg_num = iov_copy(sg, max, out_sg, out_num,
+                                  0, n->host_hdr_len);
+                sg_num += iov_copy(sg + sg_num, max - sg_num,
                                    out_sg, out_num,
                                    n->guest_hdr_len, -1);
-                if (out_num == VIRTQUEUE_MAX_SIZE) {
-                    goto drop;
-		}
-                out_num += 1;
-                out_sg = sg2;
-	    }
-        }
-        /*
-         * If host wants to see the guest header as is, we can
-         * pass it on unchanged. Otherwise, copy just the parts
-         * that host is interested in.
-         */
-        assert(n->host_hdr_len <= n->guest_hdr_len);
-        if (n->host_hdr_len != n->guest_hdr_len) {
-            unsigned sg_num = iov_copy(sg, ARRAY_SIZE(sg),
-                                       out_sg, out_num,
-                                       0, n->host_hdr_len);
-            sg_num += iov_copy(sg + sg_num, ARRAY_SIZE(sg) - sg_num,
-                             out_sg, out_num,
-                             n->guest_hdr_len, -1);
-            out_num = sg_num;
-            out_sg = sg;
+                out_num = sg_num;
+                out_sg = sg;
+                sg_used += sg_num;
+            }
+
+            pkts[npkts].iov = out_sg;
+            pkts[npkts].iovcnt = out_num;
+            pkt_elems[npkts++] = elem;
+            next++;
         }
 
-        ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
-                                      out_sg, out_num, virtio_net_tx_complete);
-        if (ret == 0) {
-            virtio_queue_set_notification(q->tx_vq, 0);
-            q->async_tx.elem = elem;
-            return -EBUSY;
+        if (!npkts) {
+            continue;
         }
 
-drop:
-        virtqueue_push(q->tx_vq, elem, 0);
-        virtio_notify(vdev, q->tx_vq);
-        g_free(elem);
+        sent = qemu_sendv_packet_batch_async(qemu_get_subqueue(n->nic,
+                                                               queue_index),
+                                             pkts, npkts,
+                                             virtio_net_tx_complete);
+        for (i = 0; i < sent; i++) {
+            virtqueue_fill(q->tx_vq, pkt_elems[i], 0, done++);
+            virtqueue_free_element(q->tx_vq, pkt_elems[i]);
+        }
+        num_packets += sent;
 
-        if (++num_packets >= n->tx_burst) {
+        if (sent < npkts) {
+            virtio_queue_set_notification(q->tx_vq, 0);
+            q->async_tx.elem = pkt_elems[sent];
+            /* Hand back what was popped behind it, last first */
+            while (num_elems > next) {
+                elem = elems[--num_elems];
+                virtqueue_discard(q->tx_vq, elem, 0);
+                virtqueue_free_element(q->tx_vq, elem);
+            }
+            while (npkts > sent + 1) {
+                elem = pkt_elems[--npkts];
+                virtqueue_discard(q->tx_vq, elem, 0);
+                virtqueue_free_element(q->tx_vq, elem);
+            }
+            num_packets = -EBUSY;
             break;
         }
     }
+
+    if (done) {
+        virtqueue_flush(q->tx_vq, done);
+        virtio_notify(vdev, q->tx_vq);
+    }
     return num_packets;
 }
 
@@ -1425,6 +1559,7 @@ static void virtio_net_add_queue(VirtIONet *n, int index)
         n->vqs[index].tx_bh = qemu_bh_new(virtio_net_tx_bh, &n->vqs[index]);
     }
 
+    n->vqs[index].tx_sg = g_new(struct iovec, VIRTIO_NET_TX_SG);
     n->vqs[index].tx_waiting = 0;
     n->vqs[index].n = n;
 }
@@ -1444,6 +1579,8 @@ static void virtio_net_del_queue(VirtIONet *n, int index)
     } else {
         qemu_bh_delete(q->tx_bh);
     }
+    g_free(q->tx_sg);
+    q->tx_sg = NULL;
     virtio_del_queue(vdev, index * 2 + 1);
 }
 
@@ -1690,6 +1827,7 @@ static NetClientInfo net_virtio_info = {
     .size = sizeof(NICState),
     .can_receive = virtio_net_can_receive,
     .receive = virtio_net_receive,
+    .receive_iov_batch = virtio_net_receive_batch,
     .link_status_changed = virtio_net_set_link_status,
     .query_rx_filter = virtio_net_query_rxfilter,
 };
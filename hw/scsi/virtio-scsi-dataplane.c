@@ -21,15 +21,104 @@
 #include "hw/virtio/virtio-access.h"
 #include "stdio.h"
 
+static void virtio_scsi_forward_bh(void *opaque)
+{
+    VirtIOSCSIIOThread *t = opaque;
+    VirtIOSCSI *s = t->s;
+    VirtIOSCSIReq *req, *next;
+    QSLIST_HEAD(, VirtIOSCSIReq) forwarded;
+    QTAILQ_HEAD(, VirtIOSCSIReq) reqs = QTAILQ_HEAD_INITIALIZER(reqs);
+
+    QSLIST_MOVE_ATOMIC(&forwarded, &t->forwarded);
+
+    /* The list was built LIFO; restore submission order.  The two link
+     * fields share storage, so unlink before inserting.
+     */
+    while ((req = QSLIST_FIRST(&forwarded))) {
+        QSLIST_REMOVE_HEAD(&forwarded, forward);
+        QTAILQ_INSERT_HEAD(&reqs, req, next);
+    }
+
+    QTAILQ_FOREACH_SAFE(req, &reqs, next, next) {
+        if (!virtio_scsi_handle_forwarded_cmd_req(s, req)) {
+            QTAILQ_REMOVE(&reqs, req, next);
+        }
+    }
+    QTAILQ_FOREACH_SAFE(req, &reqs, next, next) {
+        virtio_scsi_handle_cmd_req_submit(s, req);
+    }
+}
+
+static void virtio_scsi_add_iothread(VirtIOSCSI *s, IOThread *iothread)
+{
+    VirtIOSCSIIOThread *t = &s->iothreads[s->num_iothreads++];
+
+    object_ref(OBJECT(iothread));
+    t->s = s;
+    t->iothread = iothread;
+    t->ctx = iothread_get_aio_context(iothread);
+    t->forward_bh = aio_bh_new(t->ctx, virtio_scsi_forward_bh, t);
+    QSLIST_INIT(&t->forwarded);
+}
+
 /* Context: QEMU global mutex held */
-void virtio_scsi_set_iothread(VirtIOSCSI *s, IOThread *iothread)
+void virtio_scsi_set_iothread(VirtIOSCSI *s, Error **errp)
 {
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
     VirtIOSCSICommon *vs = VIRTIO_SCSI_COMMON(s);
+    gchar **ids = NULL;
+    int n, i;
 
     assert(!s->ctx);
-    s->ctx = iothread_get_aio_context(vs->conf.iothread);
+
+    if (vs->conf.iothread && vs->conf.iothreads) {
+        error_setg(errp, "iothread and iothreads are mutually exclusive");
+        return;
+    }
+
+    if (vs->conf.iothreads) {
+        ids = g_strsplit(vs->conf.iothreads, ":", -1);
+        n = g_strv_length(ids);
+    } else {
+        n = 1;
+    }
+    if (n == 0) {
+        error_setg(errp, "iothreads must name at least one IOThread");
+        g_strfreev(ids);
+        return;
+    }
+
+    s->iothreads = g_new0(VirtIOSCSIIOThread, n);
+    if (!ids) {
+        virtio_scsi_add_iothread(s, vs->conf.iothread);
+    }
+    for (i = 0; ids && i < n; i++) {
+        Object *obj = object_resolve_path_component(object_get_objects_root(),
+                                                    ids[i]);
+        IOThread *iothread = (IOThread *)object_dynamic_cast(obj,
+                                                             TYPE_IOTHREAD);
+
+        if (!iothread) {
+            error_setg(errp, "Cannot find IOThread '%s'", ids[i]);
+            g_strfreev(ids);
+            virtio_scsi_dataplane_cleanup(s);
+            return;
+        }
+        virtio_scsi_add_iothread(s, iothread);
+    }
+    g_strfreev(ids);
+
+    /* The control and event queues stay in the first IOThread, request
+     * queues are spread round-robin.  When another context is acquired
+     * on top of s->ctx, s->ctx is always taken first.
+     */
+    s->ctx = s->iothreads[0].ctx;
+    s->queues[0].ctx = s->ctx;
+    s->queues[1].ctx = s->ctx;
+    for (i = 0; i < vs->conf.num_queues; i++) {
+        s->queues[i + 2].ctx = s->iothreads[i % s->num_iothreads].ctx;
+    }
 
     /* Don't try if transport does not support notifiers. */
     if (!k->set_guest_notifiers || !k->set_host_notifier) {
@@ -39,10 +128,53 @@ void virtio_scsi_set_iothread(VirtIOSCSI *s, IOThread *iothread)
     }
 }
 
+/* Context: QEMU global mutex held */
+void virtio_scsi_dataplane_cleanup(VirtIOSCSI *s)
+{
+    int i;
+
+    for (i = 0; i < s->num_iothreads; i++) {
+        qemu_bh_delete(s->iothreads[i].forward_bh);
+        object_unref(OBJECT(s->iothreads[i].iothread));
+    }
+    g_free(s->iothreads);
+    s->iothreads = NULL;
+    s->num_iothreads = 0;
+    s->ctx = NULL;
+}
+
+/* LUNs are spread across the IOThreads by target and LUN number.  Each
+ * BlockBackend can only be used from one AioContext, so all commands for
+ * a LUN run there no matter which queue the guest picked.
+ */
+AioContext *virtio_scsi_dataplane_lun_ctx(VirtIOSCSI *s, SCSIDevice *sd)
+{
+    return s->iothreads[(sd->id + sd->lun) % s->num_iothreads].ctx;
+}
+
+/* Hand a command popped in one IOThread to the one that owns its LUN */
+void virtio_scsi_dataplane_forward(VirtIOSCSI *s, VirtIOSCSIReq *req,
+                                   AioContext *ctx)
+{
+    int i;
+
+    for (i = 0; i < s->num_iothreads; i++) {
+        VirtIOSCSIIOThread *t = &s->iothreads[i];
+
+        if (t->ctx == ctx) {
+            QSLIST_INSERT_HEAD_ATOMIC(&t->forwarded, req, forward);
+            qemu_bh_schedule(t->forward_bh);
+            return;
+        }
+    }
+    abort();
+}
+
 static int virtio_scsi_vring_init(VirtIOSCSI *s, VirtQueue *vq, int n)
 {
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    AioContext *ctx = s->queues[n].ctx;
     int rc;
 
     /* Set up virtqueue notify */
@@ -54,7 +186,9 @@ static int virtio_scsi_vring_init(VirtIOSCSI *s, VirtQueue *vq, int n)
         return rc;
     }
 
-    virtio_queue_aio_set_host_notifier_handler(vq, s->ctx, true, true);
+    aio_context_acquire(ctx);
+    virtio_queue_aio_set_host_notifier_handler(vq, ctx, true, true);
+    aio_context_release(ctx);
     return 0;
 }
 
@@ -65,16 +199,24 @@ void virtio_scsi_dataplane_notify(VirtIODevice *vdev, VirtIOSCSIReq *req)
     }
 }
 
-/* assumes s->ctx held */
+static void virtio_scsi_clear_vring(VirtIOSCSI *s, VirtQueue *vq, int n)
+{
+    AioContext *ctx = s->queues[n].ctx;
+
+    aio_context_acquire(ctx);
+    virtio_queue_aio_set_host_notifier_handler(vq, ctx, false, false);
+    aio_context_release(ctx);
+}
+
 static void virtio_scsi_clear_aio(VirtIOSCSI *s)
 {
     VirtIOSCSICommon *vs = VIRTIO_SCSI_COMMON(s);
     int i;
 
-    virtio_queue_aio_set_host_notifier_handler(vs->ctrl_vq, s->ctx, false, false);
-    virtio_queue_aio_set_host_notifier_handler(vs->event_vq, s->ctx, false, false);
+    virtio_scsi_clear_vring(s, vs->ctrl_vq, 0);
+    virtio_scsi_clear_vring(s, vs->event_vq, 1);
     for (i = 0; i < vs->conf.num_queues; i++) {
-        virtio_queue_aio_set_host_notifier_handler(vs->cmd_vqs[i], s->ctx, false, false);
+        virtio_scsi_clear_vring(s, vs->cmd_vqs[i], i + 2);
     }
 }
 
@@ -104,7 +246,6 @@ void virtio_scsi_dataplane_start(VirtIOSCSI *s)
         goto fail_guest_notifiers;
     }
 
-    aio_context_acquire(s->ctx);
     rc = virtio_scsi_vring_init(s, vs->ctrl_vq, 0);
     if (rc) {
         goto fail_vrings;
@@ -122,12 +263,18 @@ void virtio_scsi_dataplane_start(VirtIOSCSI *s)
 
     s->dataplane_starting = false;
     s->dataplane_started = true;
-    aio_context_release(s->ctx);
+
+    /* The kick that started dataplane was not processed, and more requests
+     * may have arrived before the notifiers were in place.
+     */
+    for (i = 0; i < vs->conf.num_queues + 2; i++) {
+        event_notifier_set(virtio_queue_get_host_notifier(
+                               virtio_get_queue(VIRTIO_DEVICE(s), i)));
+    }
     return;
 
 fail_vrings:
     virtio_scsi_clear_aio(s);
-    aio_context_release(s->ctx);
     for (i = 0; i < vs->conf.num_queues + 2; i++) {
         k->set_host_notifier(qbus->parent, i, false);
     }
@@ -163,7 +310,10 @@ void virtio_scsi_dataplane_stop(VirtIOSCSI *s)
 
     virtio_scsi_clear_aio(s);
 
-    blk_drain_all(); /* ensure there are no in-flight requests */
+    /* ensure there are no in-flight requests; this also runs the forward
+     * BHs, which live in the same contexts as the LUNs
+     */
+    blk_drain_all();
 
     aio_context_release(s->ctx);
 
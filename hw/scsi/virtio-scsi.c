@@ -64,14 +64,17 @@ static void virtio_scsi_complete_req(VirtIOSCSIReq *req)
     VirtIOSCSI *s = req->dev;
     VirtQueue *vq = req->vq;
     VirtIODevice *vdev = VIRTIO_DEVICE(s);
+    VirtIOSCSIQueue *q = &s->queues[virtio_get_queue_index(vq)];
 
     qemu_iovec_from_buf(&req->resp_iov, 0, &req->resp, req->resp_size);
+    qemu_mutex_lock(&q->lock);
     virtqueue_push(vq, &req->elem, req->qsgl.size + req->resp_iov.size);
     if (s->dataplane_started) {
         virtio_scsi_dataplane_notify(vdev, req);
     } else {
         virtio_notify(vdev, vq);
     }
+    qemu_mutex_unlock(&q->lock);
 
     if (req->sreq) {
         req->sreq->hba_private = NULL;
@@ -170,9 +173,12 @@ static int virtio_scsi_parse_req(VirtIOSCSIReq *req,
 static VirtIOSCSIReq *virtio_scsi_pop_req(VirtIOSCSI *s, VirtQueue *vq)
 {
     VirtIOSCSICommon *vs = (VirtIOSCSICommon *)s;
+    VirtIOSCSIQueue *q = &s->queues[virtio_get_queue_index(vq)];
     VirtIOSCSIReq *req;
 
+    qemu_mutex_lock(&q->lock);
     req = virtqueue_pop(vq, sizeof(VirtIOSCSIReq) + vs->cdb_size);
+    qemu_mutex_unlock(&q->lock);
     if (!req) {
         return NULL;
     }
@@ -188,7 +194,7 @@ static void virtio_scsi_save_request(QEMUFile *f, SCSIRequest *sreq)
 
     assert(n < vs->conf.num_queues);
     qemu_put_be32s(f, &n);
-    qemu_put_virtqueue_element(f, &req->elem);
+    qemu_put_virtqueue_element(VIRTIO_DEVICE(vs), f, &req->elem);
 }
 
 static void *virtio_scsi_load_request(QEMUFile *f, SCSIRequest *sreq)
@@ -201,7 +207,8 @@ static void *virtio_scsi_load_request(QEMUFile *f, SCSIRequest *sreq)
 
     qemu_get_be32s(f, &n);
     assert(n < vs->conf.num_queues);
-    req = qemu_get_virtqueue_element(f, sizeof(VirtIOSCSIReq) + vs->cdb_size);
+    req = qemu_get_virtqueue_element(VIRTIO_DEVICE(vs), f,
+                                     sizeof(VirtIOSCSIReq) + vs->cdb_size);
     virtio_scsi_init_req(s, vs->cmd_vqs[n], req);
 
     if (virtio_scsi_parse_req(req, sizeof(VirtIOSCSICmdReq) + vs->cdb_size,
@@ -238,17 +245,14 @@ static void virtio_scsi_cancel_notify(Notifier *notifier, void *data)
 /* Return 0 if the request is ready to be completed and return to guest;
  * -EINPROGRESS if the request is submitted and will be completed later, in the
  *  case of async cancellation. */
-static int virtio_scsi_do_tmf(VirtIOSCSI *s, VirtIOSCSIReq *req)
+static int virtio_scsi_do_tmf_locked(VirtIOSCSI *s, VirtIOSCSIReq *req,
+                                     SCSIDevice *d)
 {
-    SCSIDevice *d = virtio_scsi_device_find(s, req->req.tmf.lun);
     SCSIRequest *r, *next;
     BusChild *kid;
     int target;
     int ret = 0;
 
-    if (s->dataplane_started && d) {
-        assert(blk_get_aio_context(d->conf.blk) == s->ctx);
-    }
     /* Here VIRTIO_SCSI_S_OK means "FUNCTION COMPLETE".  */
     req->resp.tmf.response = VIRTIO_SCSI_S_OK;
 
@@ -350,7 +354,16 @@ static int virtio_scsi_do_tmf(VirtIOSCSI *s, VirtIOSCSIReq *req)
         QTAILQ_FOREACH(kid, &s->bus.qbus.children, sibling) {
              d = SCSI_DEVICE(kid->child);
              if (d->channel == 0 && d->id == target) {
+                AioContext *ctx = NULL;
+
+                if (s->dataplane_started) {
+                    ctx = blk_get_aio_context(d->conf.blk);
+                    aio_context_acquire(ctx);
+                }
                 qdev_reset_all(&d->qdev);
+                if (ctx) {
+                    aio_context_release(ctx);
+                }
              }
         }
         s->resetting--;
@@ -373,6 +386,27 @@ fail:
     return ret;
 }
 
+/* The LUN may live in another IOThread than the control queue.  Its
+ * cancellation callbacks run there too, so hold its AioContext while
+ * walking the request list and counting the outstanding cancellations.
+ */
+static int virtio_scsi_do_tmf(VirtIOSCSI *s, VirtIOSCSIReq *req)
+{
+    SCSIDevice *d = virtio_scsi_device_find(s, req->req.tmf.lun);
+    AioContext *ctx = NULL;
+    int ret;
+
+    if (s->dataplane_started && d) {
+        ctx = blk_get_aio_context(d->conf.blk);
+        aio_context_acquire(ctx);
+    }
+    ret = virtio_scsi_do_tmf_locked(s, req, d);
+    if (ctx) {
+        aio_context_release(ctx);
+    }
+    return ret;
+}
+
 void virtio_scsi_handle_ctrl_req(VirtIOSCSI *s, VirtIOSCSIReq *req)
 {
     VirtIODevice *vdev = (VirtIODevice *)s;
@@ -507,6 +541,25 @@ static void virtio_scsi_fail_cmd_req(VirtIOSCSIReq *req)
     virtio_scsi_complete_cmd_req(req);
 }
 
+static bool virtio_scsi_handle_cmd_req_new(VirtIOSCSI *s, VirtIOSCSIReq *req,
+                                           SCSIDevice *d)
+{
+    req->sreq = scsi_req_new(d, req->req.cmd.tag,
+                             virtio_scsi_get_lun(req->req.cmd.lun),
+                             req->req.cmd.cdb, req);
+
+    if (req->sreq->cmd.mode != SCSI_XFER_NONE
+        && (req->sreq->cmd.mode != req->mode ||
+            req->sreq->cmd.xfer > req->qsgl.size)) {
+        req->resp.cmd.response = VIRTIO_SCSI_S_OVERRUN;
+        virtio_scsi_complete_cmd_req(req);
+        return false;
+    }
+    scsi_req_ref(req->sreq);
+    blk_io_plug(d->conf.blk);
+    return true;
+}
+
 bool virtio_scsi_handle_cmd_req_prepare(VirtIOSCSI *s, VirtIOSCSIReq *req)
 {
     VirtIOSCSICommon *vs = &s->parent_obj;
@@ -531,22 +584,28 @@ bool virtio_scsi_handle_cmd_req_prepare(VirtIOSCSI *s, VirtIOSCSIReq *req)
         return false;
     }
     if (s->dataplane_started) {
-        assert(blk_get_aio_context(d->conf.blk) == s->ctx);
+        AioContext *ctx = blk_get_aio_context(d->conf.blk);
+
+        if (ctx != s->queues[virtio_get_queue_index(req->vq)].ctx) {
+            virtio_scsi_dataplane_forward(s, req, ctx);
+            return false;
+        }
     }
-    req->sreq = scsi_req_new(d, req->req.cmd.tag,
-                             virtio_scsi_get_lun(req->req.cmd.lun),
-                             req->req.cmd.cdb, req);
+    return virtio_scsi_handle_cmd_req_new(s, req, d);
+}
 
-    if (req->sreq->cmd.mode != SCSI_XFER_NONE
-        && (req->sreq->cmd.mode != req->mode ||
-            req->sreq->cmd.xfer > req->qsgl.size)) {
-        req->resp.cmd.response = VIRTIO_SCSI_S_OVERRUN;
+/* Context: AioContext of the LUN, after virtio_scsi_dataplane_forward */
+bool virtio_scsi_handle_forwarded_cmd_req(VirtIOSCSI *s, VirtIOSCSIReq *req)
+{
+    SCSIDevice *d = virtio_scsi_device_find(s, req->req.cmd.lun);
+
+    /* The LUN may have been unplugged in the meantime */
+    if (!d) {
+        req->resp.cmd.response = VIRTIO_SCSI_S_BAD_TARGET;
         virtio_scsi_complete_cmd_req(req);
         return false;
     }
-    scsi_req_ref(req->sreq);
-    blk_io_plug(d->conf.blk);
-    return true;
+    return virtio_scsi_handle_cmd_req_new(s, req, d);
 }
 
 void virtio_scsi_handle_cmd_req_submit(VirtIOSCSI *s, VirtIOSCSIReq *req)
@@ -774,14 +833,16 @@ static void virtio_scsi_hotplug(HotplugHandler *hotplug_dev, DeviceState *dev,
 
     if (s->ctx && !s->dataplane_disabled) {
         VirtIOSCSIBlkChangeNotifier *insert_notifier, *remove_notifier;
+        AioContext *ctx;
 
         if (blk_op_is_blocked(sd->conf.blk, BLOCK_OP_TYPE_DATAPLANE, errp)) {
             return;
         }
         blk_op_block_all(sd->conf.blk, s->blocker);
-        aio_context_acquire(s->ctx);
-        blk_set_aio_context(sd->conf.blk, s->ctx);
-        aio_context_release(s->ctx);
+        ctx = virtio_scsi_dataplane_lun_ctx(s, sd);
+        aio_context_acquire(ctx);
+        blk_set_aio_context(sd->conf.blk, ctx);
+        aio_context_release(ctx);
 
         insert_notifier = g_new0(VirtIOSCSIBlkChangeNotifier, 1);
         insert_notifier->n.notify = virtio_scsi_blk_insert_notifier;
@@ -890,18 +951,16 @@ void virtio_scsi_common_realize(DeviceState *dev, Error **errp,
         s->cmd_vqs[i] = virtio_add_queue(vdev, VIRTIO_SCSI_VQ_SIZE,
                                          cmd);
     }
-
-    if (s->conf.iothread) {
-        virtio_scsi_set_iothread(VIRTIO_SCSI(s), s->conf.iothread);
-    }
 }
 
 static void virtio_scsi_device_realize(DeviceState *dev, Error **errp)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
     VirtIOSCSI *s = VIRTIO_SCSI(dev);
+    VirtIOSCSICommon *vs = VIRTIO_SCSI_COMMON(dev);
     static int virtio_scsi_id;
     Error *err = NULL;
+    int i;
 
     virtio_scsi_common_realize(dev, &err, virtio_scsi_handle_ctrl,
                                virtio_scsi_handle_event,
@@ -911,6 +970,19 @@ static void virtio_scsi_device_realize(DeviceState *dev, Error **errp)
         return;
     }
 
+    s->queues = g_new0(VirtIOSCSIQueue, vs->conf.num_queues + 2);
+    for (i = 0; i < vs->conf.num_queues + 2; i++) {
+        qemu_mutex_init(&s->queues[i].lock);
+    }
+
+    if (vs->conf.iothread || vs->conf.iothreads) {
+        virtio_scsi_set_iothread(s, &err);
+        if (err != NULL) {
+            error_propagate(errp, err);
+            return;
+        }
+    }
+
     scsi_bus_new(&s->bus, sizeof(s->bus), dev,
                  &virtio_scsi_scsi_info, vdev->bus_name);
     /* override default SCSI bus hotplug-handler, with virtio-scsi's one */
@@ -955,8 +1027,15 @@ void virtio_scsi_common_unrealize(DeviceState *dev, Error **errp)
 static void virtio_scsi_device_unrealize(DeviceState *dev, Error **errp)
 {
     VirtIOSCSI *s = VIRTIO_SCSI(dev);
+    VirtIOSCSICommon *vs = VIRTIO_SCSI_COMMON(dev);
+    int i;
 
     error_free(s->blocker);
+    virtio_scsi_dataplane_cleanup(s);
+    for (i = 0; i < vs->conf.num_queues + 2; i++) {
+        qemu_mutex_destroy(&s->queues[i].lock);
+    }
+    g_free(s->queues);
 
     unregister_savevm(dev, "virtio-scsi", s);
     virtio_scsi_common_unrealize(dev, errp);
@@ -972,6 +1051,7 @@ static Property virtio_scsi_properties[] = {
                                            VIRTIO_SCSI_F_HOTPLUG, true),
     DEFINE_PROP_BIT("param_change", VirtIOSCSI, host_features,
                                                 VIRTIO_SCSI_F_CHANGE, true),
+    DEFINE_PROP_STRING("iothreads", VirtIOSCSI, parent_obj.conf.iothreads),
     DEFINE_PROP_END_OF_LIST(),
 };
 
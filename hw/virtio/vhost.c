@@ -922,10 +922,14 @@ static void vhost_virtqueue_stop(struct vhost_dev *dev,
 
     r = dev->vhost_ops->vhost_get_vring_base(dev, &state);
     if (r < 0) {
-        fprintf(stderr, "vhost VQ %d ring restore failed: %d\n", idx, r);
-        fflush(stderr);
+        /* The backend went away: resume from what it has completed,
+         * anything it had in flight is resubmitted on reconnect. */
+        error_report("vhost VQ %d ring restore failed: %d", idx, r);
+        virtio_queue_restore_last_avail_idx(vdev, idx);
+        r = 0;
+    } else {
+        virtio_queue_set_last_avail_idx(vdev, idx, state.num);
     }
-    virtio_queue_set_last_avail_idx(vdev, idx, state.num);
     virtio_queue_invalidate_signalled_used(vdev, idx);
 
     /* In the cross-endian case, we need to reset the vring endianness to
@@ -1204,6 +1208,8 @@ uint64_t vhost_get_features(struct vhost_dev *hdev, const int *feature_bits,
         }
         bit++;
     }
+    /* Rings are handed to the backend in the split layout only. */
+    features &= ~(1ULL << VIRTIO_F_RING_PACKED);
     return features;
 }
 
@@ -1220,6 +1226,82 @@ void vhost_ack_features(struct vhost_dev *hdev, const int *feature_bits,
     }
 }
 
+void vhost_dev_reset_inflight(struct vhost_inflight *inflight)
+{
+    if (inflight->addr) {
+        memset(inflight->addr, 0, inflight->size);
+    }
+}
+
+void vhost_dev_free_inflight(struct vhost_inflight *inflight)
+{
+    if (inflight->addr) {
+        munmap(inflight->addr, inflight->size);
+        close(inflight->fd);
+    }
+    inflight->addr = NULL;
+    inflight->fd = -1;
+    inflight->size = 0;
+    inflight->offset = 0;
+    inflight->queue_size = 0;
+}
+
+int vhost_dev_get_config(struct vhost_dev *hdev, uint8_t *config,
+                         uint32_t config_len)
+{
+    assert(hdev->vhost_ops);
+
+    if (!hdev->vhost_ops->vhost_get_config) {
+        return -ENOTSUP;
+    }
+
+    return hdev->vhost_ops->vhost_get_config(hdev, config, config_len);
+}
+
+int vhost_dev_set_config(struct vhost_dev *hdev, const uint8_t *data,
+                         uint32_t offset, uint32_t size)
+{
+    assert(hdev->vhost_ops);
+
+    if (!hdev->vhost_ops->vhost_set_config) {
+        return -ENOTSUP;
+    }
+
+    return hdev->vhost_ops->vhost_set_config(hdev, data, offset, size);
+}
+
+/* Hand the inflight region to the backend, allocating it the first time.
+ * The region outlives the backend connection, a restarted backend finds
+ * in it the requests its predecessor had not completed.
+ */
+static int vhost_dev_set_inflight(struct vhost_dev *hdev, VirtIODevice *vdev)
+{
+    struct vhost_inflight *inflight = hdev->inflight;
+    uint16_t queue_size = virtio_queue_get_num(vdev, hdev->vq_index);
+    int r;
+
+    if (!inflight || !hdev->vhost_ops->vhost_get_inflight_fd) {
+        return 0;
+    }
+
+    if (inflight->addr && inflight->queue_size != queue_size) {
+        vhost_dev_free_inflight(inflight);
+    }
+    if (!inflight->addr) {
+        r = hdev->vhost_ops->vhost_get_inflight_fd(hdev, queue_size,
+                                                   inflight);
+        if (r < 0) {
+            return r;
+        }
+        if (!inflight->addr) {
+            /* the backend does not track inflight descriptors */
+            return 0;
+        }
+    }
+
+    return hdev->vhost_ops->vhost_set_inflight_fd(hdev, inflight);
+}
+
 /* Host notifiers must be enabled at this point. */
 int vhost_dev_start(struct vhost_dev *hdev, VirtIODevice *vdev)
 {
@@ -1236,6 +1318,10 @@ int vhost_dev_start(struct vhost_dev *hdev, VirtIODevice *vdev)
         r = -errno;
         goto fail_mem;
     }
+    r = vhost_dev_set_inflight(hdev, vdev);
+    if (r < 0) {
+        goto fail_mem;
+    }
     for (i = 0; i < hdev->nvqs; ++i) {
         r = vhost_virtqueue_start(hdev,
                                   vdev,
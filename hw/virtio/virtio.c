@@ -57,6 +57,52 @@ typedef struct VRingUsed
     VRingUsedElem ring[0];
 } VRingUsed;
 
+typedef struct VRingPackedDesc
+{
+    uint64_t addr;
+    uint32_t len;
+    uint16_t id;
+    uint16_t flags;
+} VRingPackedDesc;
+
+typedef struct VRingPackedDescEvent
+{
+    uint16_t off_wrap;
+    uint16_t flags;
+} VRingPackedDescEvent;
+
+/* A completed buffer waiting for virtqueue_flush on a packed ring */
+typedef struct VRingPackedUsedElem
+{
+    uint16_t id;
+    uint16_t ndescs;
+    uint32_t len;
+} VRingPackedUsedElem;
+
+/* Areas of guest memory a virtqueue is made of.  For the packed layout
+ * "avail" and "used" hold the driver and device event suppression
+ * structures. */
+enum {
+    VRING_AREA_DESC,
+    VRING_AREA_AVAIL,
+    VRING_AREA_USED,
+    VRING_NUM_AREAS,
+};
+
+/* Host mapping of a ring area.  ptr is NULL when the area is not backed
+ * by a single RAM region and must go through the address space. */
+typedef struct VRingMemoryRegionCache {
+    MemoryRegion *mr;
+    hwaddr offset;
+    hwaddr len;
+    void *ptr;
+} VRingMemoryRegionCache;
+
+typedef struct VRingMemoryRegionCaches {
+    struct rcu_head rcu;
+    VRingMemoryRegionCache area[VRING_NUM_AREAS];
+} VRingMemoryRegionCaches;
+
 typedef struct VRing
 {
     unsigned int num;
@@ -65,8 +111,15 @@ typedef struct VRing
     hwaddr desc;
     hwaddr avail;
     hwaddr used;
+    /* Rebuilt whenever the addresses above or the memory map change */
+    VRingMemoryRegionCaches *caches;
 } VRing;
 
+/* Elements kept for reuse per queue, and the scatter-gather entries they
+ * have room for.  Larger elements are allocated and freed normally. */
+#define VIRTQUEUE_ELEM_POOL_MAX 64
+#define VIRTQUEUE_ELEM_POOL_SG  64
+
 struct VirtQueue
 {
     VRing vring;
@@ -79,6 +132,13 @@ struct VirtQueue
 
     uint16_t used_idx;
 
+    /* Packed ring only: wrap counters of last_avail_idx and used_idx */
+    bool last_avail_wrap_counter;
+    bool used_wrap_counter;
+
+    /* Packed ring only: buffers filled but not yet flushed */
+    VRingPackedUsedElem *used_elems;
+
     /* Last used index value we have signalled on */
     uint16_t signalled_used;
 
@@ -92,14 +152,210 @@ struct VirtQueue
 
     int inuse;
 
+    /* Recycled elements, all elem_pool_size bytes large */
+    VirtQueueElement *elem_pool[VIRTQUEUE_ELEM_POOL_MAX];
+    unsigned int elem_pool_len;
+    size_t elem_pool_size;
+
     uint16_t vector;
     void (*handle_output)(VirtIODevice *vdev, VirtQueue *vq);
     VirtIODevice *vdev;
     EventNotifier guest_notifier;
     EventNotifier host_notifier;
+    /* host_notifier can be kicked by virtio_queue_notify_nolock() */
+    bool host_notifier_enabled;
     QLIST_ENTRY(VirtQueue) node;
 };
 
+static void virtio_free_region_cache(VRingMemoryRegionCaches *caches)
+{
+    int i;
+
+    for (i = 0; i < VRING_NUM_AREAS; i++) {
+        if (caches->area[i].mr) {
+            memory_region_unref(caches->area[i].mr);
+        }
+    }
+    g_free(caches);
+}
+
+static void vring_cache_init(VRingMemoryRegionCache *cache, hwaddr addr,
+                             hwaddr len, bool is_write)
+{
+    MemoryRegionSection section;
+
+    if (!len) {
+        return;
+    }
+    section = memory_region_find(get_system_memory(), addr, len);
+    if (!section.mr) {
+        return;
+    }
+    if (!memory_region_is_ram(section.mr) ||
+        int128_lt(section.size, int128_make64(len)) ||
+        (is_write && section.readonly)) {
+        memory_region_unref(section.mr);
+        return;
+    }
+    cache->mr = section.mr;
+    cache->offset = section.offset_within_region;
+    cache->len = len;
+    cache->ptr = memory_region_get_ram_ptr(section.mr) +
+                 section.offset_within_region;
+}
+
+static void virtio_init_region_cache(VirtIODevice *vdev, int n)
+{
+    VirtQueue *vq = &vdev->vq[n];
+    VRingMemoryRegionCaches *old = vq->vring.caches;
+    VRingMemoryRegionCaches *new = NULL;
+    bool packed = virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED);
+    /* used_event and avail_event trail the split rings */
+    hwaddr event_size = packed ? 0 : sizeof(uint16_t);
+
+    if (vq->vring.num && vq->vring.desc) {
+        new = g_new0(VRingMemoryRegionCaches, 1);
+        vring_cache_init(&new->area[VRING_AREA_DESC], vq->vring.desc,
+                         virtio_queue_get_desc_size(vdev, n), packed);
+        vring_cache_init(&new->area[VRING_AREA_AVAIL], vq->vring.avail,
+                         virtio_queue_get_avail_size(vdev, n) + event_size,
+                         false);
+        vring_cache_init(&new->area[VRING_AREA_USED], vq->vring.used,
+                         virtio_queue_get_used_size(vdev, n) + event_size,
+                         true);
+    }
+
+    atomic_rcu_set(&vq->vring.caches, new);
+    if (old) {
+        call_rcu(old, virtio_free_region_cache, rcu);
+    }
+}
+
+static void virtio_memory_listener_commit(MemoryListener *listener)
+{
+    VirtIODevice *vdev = container_of(listener, VirtIODevice, listener);
+    int i;
+
+    for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        if (vdev->vq[i].vring.caches || vdev->vq[i].vring.desc) {
+            virtio_init_region_cache(vdev, i);
+        }
+    }
+}
+
+static hwaddr vring_area_addr(VirtQueue *vq, int area)
+{
+    switch (area) {
+    case VRING_AREA_DESC:
+        return vq->vring.desc;
+    case VRING_AREA_AVAIL:
+        return vq->vring.avail;
+    default:
+        return vq->vring.used;
+    }
+}
+
+/* Called within rcu_read_lock().  Returns NULL if [off, off + len) of
+ * the area has no host mapping. */
+static inline VRingMemoryRegionCache *vring_get_cache(VirtQueue *vq, int area,
+                                                      hwaddr off, hwaddr len)
+{
+    VRingMemoryRegionCaches *caches = atomic_rcu_read(&vq->vring.caches);
+    VRingMemoryRegionCache *cache;
+
+    if (!caches) {
+        return NULL;
+    }
+    cache = &caches->area[area];
+    if (!cache->ptr || off + len > cache->len) {
+        return NULL;
+    }
+    return cache;
+}
+
+static inline void vring_read(VirtQueue *vq, int area, hwaddr off,
+                              void *buf, hwaddr len)
+{
+    VRingMemoryRegionCache *cache;
+
+    rcu_read_lock();
+    cache = vring_get_cache(vq, area, off, len);
+    if (likely(cache)) {
+        memcpy(buf, cache->ptr + off, len);
+    } else {
+        address_space_read(&address_space_memory,
+                           vring_area_addr(vq, area) + off,
+                           MEMTXATTRS_UNSPECIFIED, buf, len);
+    }
+    rcu_read_unlock();
+}
+
+static inline void vring_write(VirtQueue *vq, int area, hwaddr off,
+                               const void *buf, hwaddr len)
+{
+    VRingMemoryRegionCache *cache;
+
+    rcu_read_lock();
+    cache = vring_get_cache(vq, area, off, len);
+    if (likely(cache)) {
+        memcpy(cache->ptr + off, buf, len);
+        memory_region_set_dirty(cache->mr, cache->offset + off, len);
+    } else {
+        address_space_write(&address_space_memory,
+                            vring_area_addr(vq, area) + off,
+                            MEMTXATTRS_UNSPECIFIED, buf, len);
+    }
+    rcu_read_unlock();
+}
+
+static inline uint16_t vring_lduw(VirtQueue *vq, int area, hwaddr off)
+{
+    VRingMemoryRegionCache *cache;
+    uint16_t val;
+
+    rcu_read_lock();
+    cache = vring_get_cache(vq, area, off, sizeof(val));
+    if (likely(cache)) {
+        val = virtio_lduw_p(vq->vdev, cache->ptr + off);
+    } else {
+        val = virtio_lduw_phys(vq->vdev, vring_area_addr(vq, area) + off);
+    }
+    rcu_read_unlock();
+    return val;
+}
+
+static inline void vring_stw(VirtQueue *vq, int area, hwaddr off,
+                             uint16_t val)
+{
+    VRingMemoryRegionCache *cache;
+
+    rcu_read_lock();
+    cache = vring_get_cache(vq, area, off, sizeof(val));
+    if (likely(cache)) {
+        virtio_stw_p(vq->vdev, cache->ptr + off, val);
+        memory_region_set_dirty(cache->mr, cache->offset + off, sizeof(val));
+    } else {
+        virtio_stw_phys(vq->vdev, vring_area_addr(vq, area) + off, val);
+    }
+    rcu_read_unlock();
+}
+
+static inline void vring_stl(VirtQueue *vq, int area, hwaddr off,
+                             uint32_t val)
+{
+    VRingMemoryRegionCache *cache;
+
+    rcu_read_lock();
+    cache = vring_get_cache(vq, area, off, sizeof(val));
+    if (likely(cache)) {
+        virtio_stl_p(vq->vdev, cache->ptr + off, val);
+        memory_region_set_dirty(cache->mr, cache->offset + off, sizeof(val));
+    } else {
+        virtio_stl_phys(vq->vdev, vring_area_addr(vq, area) + off, val);
+    }
+    rcu_read_unlock();
+}
+
 /* virt queue functions */
 void virtio_queue_update_rings(VirtIODevice *vdev, int n)
 {
@@ -109,17 +365,35 @@ void virtio_queue_update_rings(VirtIODevice *vdev, int n)
         /* not yet setup -> nothing to do */
         return;
     }
-    vring->avail = vring->desc + vring->num * sizeof(VRingDesc);
-    vring->used = vring_align(vring->avail +
-                              offsetof(VRingAvail, ring[vring->num]),
-                              vring->align);
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        /* Driver and device event suppression areas follow the ring */
+        vring->avail = vring->desc + vring->num * sizeof(VRingPackedDesc);
+        vring->used = vring_align(vring->avail + sizeof(VRingPackedDescEvent),
+                                  vring->align);
+    } else {
+        vring->avail = vring->desc + vring->num * sizeof(VRingDesc);
+        vring->used = vring_align(vring->avail +
+                                  offsetof(VRingAvail, ring[vring->num]),
+                                  vring->align);
+    }
+    virtio_init_region_cache(vdev, n);
 }
 
-static void vring_desc_read(VirtIODevice *vdev, VRingDesc *desc,
+/* Indirect tables are not cached and are read through the address space */
+static void vring_desc_read(VirtQueue *vq, VRingDesc *desc,
                             hwaddr desc_pa, int i)
 {
-    address_space_read(&address_space_memory, desc_pa + i * sizeof(VRingDesc),
-                       MEMTXATTRS_UNSPECIFIED, (void *)desc, sizeof(VRingDesc));
+    VirtIODevice *vdev = vq->vdev;
+
+    if (desc_pa == vq->vring.desc) {
+        vring_read(vq, VRING_AREA_DESC, i * sizeof(VRingDesc),
+                   desc, sizeof(VRingDesc));
+    } else {
+        address_space_read(&address_space_memory,
+                           desc_pa + i * sizeof(VRingDesc),
+                           MEMTXATTRS_UNSPECIFIED, (void *)desc,
+                           sizeof(VRingDesc));
+    }
     virtio_tswap64s(vdev, &desc->addr);
     virtio_tswap32s(vdev, &desc->len);
     virtio_tswap16s(vdev, &desc->flags);
@@ -128,24 +402,19 @@ static void vring_desc_read(VirtIODevice *vdev, VRingDesc *desc,
 
 static inline uint16_t vring_avail_flags(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, flags);
-    return virtio_lduw_phys(vq->vdev, pa);
+    return vring_lduw(vq, VRING_AREA_AVAIL, offsetof(VRingAvail, flags));
 }
 
 static inline uint16_t vring_avail_idx(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, idx);
-    vq->shadow_avail_idx = virtio_lduw_phys(vq->vdev, pa);
+    vq->shadow_avail_idx = vring_lduw(vq, VRING_AREA_AVAIL,
+                                      offsetof(VRingAvail, idx));
     return vq->shadow_avail_idx;
 }
 
 static inline uint16_t vring_avail_ring(VirtQueue *vq, int i)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, ring[i]);
-    return virtio_lduw_phys(vq->vdev, pa);
+    return vring_lduw(vq, VRING_AREA_AVAIL, offsetof(VRingAvail, ring[i]));
 }
 
 static inline uint16_t vring_get_used_event(VirtQueue *vq)
@@ -156,59 +425,164 @@ static inline uint16_t vring_get_used_event(VirtQueue *vq)
 static inline void vring_used_write(VirtQueue *vq, VRingUsedElem *uelem,
                                     int i)
 {
-    hwaddr pa;
     virtio_tswap32s(vq->vdev, &uelem->id);
     virtio_tswap32s(vq->vdev, &uelem->len);
-    pa = vq->vring.used + offsetof(VRingUsed, ring[i]);
-    address_space_write(&address_space_memory, pa, MEMTXATTRS_UNSPECIFIED,
-                       (void *)uelem, sizeof(VRingUsedElem));
+    vring_write(vq, VRING_AREA_USED, offsetof(VRingUsed, ring[i]),
+                uelem, sizeof(VRingUsedElem));
 }
 
 static uint16_t vring_used_idx(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, idx);
-    return virtio_lduw_phys(vq->vdev, pa);
+    return vring_lduw(vq, VRING_AREA_USED, offsetof(VRingUsed, idx));
 }
 
 static inline void vring_used_idx_set(VirtQueue *vq, uint16_t val)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, idx);
-    virtio_stw_phys(vq->vdev, pa, val);
+    vring_stw(vq, VRING_AREA_USED, offsetof(VRingUsed, idx), val);
     vq->used_idx = val;
 }
 
 static inline void vring_used_flags_set_bit(VirtQueue *vq, int mask)
 {
-    VirtIODevice *vdev = vq->vdev;
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, flags);
-    virtio_stw_phys(vdev, pa, virtio_lduw_phys(vdev, pa) | mask);
+    hwaddr off = offsetof(VRingUsed, flags);
+
+    vring_stw(vq, VRING_AREA_USED, off,
+              vring_lduw(vq, VRING_AREA_USED, off) | mask);
 }
 
 static inline void vring_used_flags_unset_bit(VirtQueue *vq, int mask)
 {
-    VirtIODevice *vdev = vq->vdev;
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, flags);
-    virtio_stw_phys(vdev, pa, virtio_lduw_phys(vdev, pa) & ~mask);
+    hwaddr off = offsetof(VRingUsed, flags);
+
+    vring_stw(vq, VRING_AREA_USED, off,
+              vring_lduw(vq, VRING_AREA_USED, off) & ~mask);
 }
 
 static inline void vring_set_avail_event(VirtQueue *vq, uint16_t val)
 {
-    hwaddr pa;
     if (!vq->notification) {
         return;
     }
-    pa = vq->vring.used + offsetof(VRingUsed, ring[vq->vring.num]);
-    virtio_stw_phys(vq->vdev, pa, val);
+    vring_stw(vq, VRING_AREA_USED, offsetof(VRingUsed, ring[vq->vring.num]),
+              val);
+}
+
+static void vring_packed_desc_read(VirtQueue *vq, VRingPackedDesc *desc,
+                                   hwaddr desc_pa, int i)
+{
+    VirtIODevice *vdev = vq->vdev;
+
+    if (desc_pa == vq->vring.desc) {
+        vring_read(vq, VRING_AREA_DESC, i * sizeof(VRingPackedDesc),
+                   desc, sizeof(VRingPackedDesc));
+    } else {
+        address_space_read(&address_space_memory,
+                           desc_pa + i * sizeof(VRingPackedDesc),
+                           MEMTXATTRS_UNSPECIFIED, (void *)desc,
+                           sizeof(VRingPackedDesc));
+    }
+    virtio_tswap64s(vdev, &desc->addr);
+    virtio_tswap32s(vdev, &desc->len);
+    virtio_tswap16s(vdev, &desc->id);
+    virtio_tswap16s(vdev, &desc->flags);
+}
+
+static inline uint16_t vring_packed_desc_flags(VirtQueue *vq, int i)
+{
+    return vring_lduw(vq, VRING_AREA_DESC, i * sizeof(VRingPackedDesc) +
+                      offsetof(VRingPackedDesc, flags));
+}
+
+static inline bool vring_packed_desc_is_avail(uint16_t flags, bool wrap_counter)
+{
+    bool avail = !!(flags & (1 << VRING_PACKED_DESC_F_AVAIL));
+    bool used = !!(flags & (1 << VRING_PACKED_DESC_F_USED));
+
+    return avail != used && avail == wrap_counter;
+}
+
+/* Write everything but the flags, which hand the descriptor to the driver */
+static inline void vring_packed_used_write(VirtQueue *vq,
+                                           const VRingPackedUsedElem *uelem,
+                                           int i)
+{
+    hwaddr off = i * sizeof(VRingPackedDesc);
+
+    vring_stl(vq, VRING_AREA_DESC, off + offsetof(VRingPackedDesc, len),
+              uelem->len);
+    vring_stw(vq, VRING_AREA_DESC, off + offsetof(VRingPackedDesc, id),
+              uelem->id);
+}
+
+static inline void vring_packed_used_flags_set(VirtQueue *vq,
+                                               const VRingPackedUsedElem *uelem,
+                                               int i, bool wrap_counter)
+{
+    uint16_t flags = 0;
+
+    if (wrap_counter) {
+        flags |= (1 << VRING_PACKED_DESC_F_AVAIL) |
+                 (1 << VRING_PACKED_DESC_F_USED);
+    }
+    if (uelem->len) {
+        flags |= VRING_DESC_F_WRITE;
+    }
+    vring_stw(vq, VRING_AREA_DESC, i * sizeof(VRingPackedDesc) +
+              offsetof(VRingPackedDesc, flags), flags);
+}
+
+/* The driver event suppression structure lives at the "avail" address */
+static inline void vring_packed_driver_event(VirtQueue *vq,
+                                             VRingPackedDescEvent *e)
+{
+    e->flags = vring_lduw(vq, VRING_AREA_AVAIL,
+                          offsetof(VRingPackedDescEvent, flags));
+    /* Make sure off_wrap is read after flags. */
+    smp_rmb();
+    e->off_wrap = vring_lduw(vq, VRING_AREA_AVAIL,
+                             offsetof(VRingPackedDescEvent, off_wrap));
+}
+
+/* ... and the device event suppression structure at the "used" address */
+static inline void vring_packed_set_avail_event(VirtQueue *vq)
+{
+    uint16_t off_wrap;
+
+    if (!vq->notification) {
+        return;
+    }
+    off_wrap = vq->last_avail_idx |
+               vq->last_avail_wrap_counter << VRING_PACKED_EVENT_F_WRAP_CTR;
+    vring_stw(vq, VRING_AREA_USED, offsetof(VRingPackedDescEvent, off_wrap),
+              off_wrap);
+}
+
+static inline void vring_packed_device_flags_set(VirtQueue *vq, uint16_t flags)
+{
+    vring_stw(vq, VRING_AREA_USED, offsetof(VRingPackedDescEvent, flags),
+              flags);
+}
+
+static void virtio_queue_packed_set_notification(VirtQueue *vq, int enable)
+{
+    if (!enable) {
+        vring_packed_device_flags_set(vq, VRING_PACKED_EVENT_FLAG_DISABLE);
+    } else if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_packed_set_avail_event(vq);
+        /* Expose the event offset before enabling it. */
+        smp_wmb();
+        vring_packed_device_flags_set(vq, VRING_PACKED_EVENT_FLAG_DESC);
+    } else {
+        vring_packed_device_flags_set(vq, VRING_PACKED_EVENT_FLAG_ENABLE);
+    }
 }
 
 void virtio_queue_set_notification(VirtQueue *vq, int enable)
 {
     vq->notification = enable;
-    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        virtio_queue_packed_set_notification(vq, enable);
+    } else if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
         vring_set_avail_event(vq, vring_avail_idx(vq));
     } else if (enable) {
         vring_used_flags_unset_bit(vq, VRING_USED_F_NO_NOTIFY);
@@ -226,10 +600,21 @@ int virtio_queue_ready(VirtQueue *vq)
     return vq->vring.avail != 0;
 }
 
+static int virtio_queue_packed_empty(VirtQueue *vq)
+{
+    uint16_t flags = vring_packed_desc_flags(vq, vq->last_avail_idx);
+
+    return !vring_packed_desc_is_avail(flags, vq->last_avail_wrap_counter);
+}
+
 /* Fetch avail_idx from VQ memory only when we really need to know if
  * guest has added some buffers. */
 int virtio_queue_empty(VirtQueue *vq)
 {
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        return virtio_queue_packed_empty(vq);
+    }
+
     if (vq->shadow_avail_idx != vq->last_avail_idx) {
         return 0;
     }
@@ -263,7 +648,16 @@ static void virtqueue_unmap_sg(VirtQueue *vq, const VirtQueueElement *elem,
 void virtqueue_discard(VirtQueue *vq, const VirtQueueElement *elem,
                        unsigned int len)
 {
-    vq->last_avail_idx--;
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        if (vq->last_avail_idx < elem->ndescs) {
+            vq->last_avail_idx += vq->vring.num;
+            vq->last_avail_wrap_counter ^= 1;
+        }
+        vq->last_avail_idx -= elem->ndescs;
+    } else {
+        vq->last_avail_idx--;
+    }
+    vq->inuse--;
     virtqueue_unmap_sg(vq, elem, len);
 }
 
@@ -276,6 +670,15 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
 
     virtqueue_unmap_sg(vq, elem, len);
 
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        /* Where the element lands depends on the ones before it, so the
+         * descriptor is only written by virtqueue_flush. */
+        vq->used_elems[idx].id = elem->index;
+        vq->used_elems[idx].ndescs = elem->ndescs;
+        vq->used_elems[idx].len = len;
+        return;
+    }
+
     idx = (idx + vq->used_idx) % vq->vring.num;
 
     uelem.id = elem->index;
@@ -283,9 +686,52 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
     vring_used_write(vq, &uelem, idx);
 }
 
+static void virtqueue_packed_flush(VirtQueue *vq, unsigned int count)
+{
+    unsigned int i, idx = vq->used_idx;
+    bool wrap_counter = vq->used_wrap_counter;
+
+    if (!count) {
+        return;
+    }
+
+    /* The first descriptor is handed over last, so that the driver
+     * sees the whole batch at once. */
+    for (i = 0; i < count; i++) {
+        vring_packed_used_write(vq, &vq->used_elems[i], idx);
+        if (i) {
+            smp_wmb();
+            vring_packed_used_flags_set(vq, &vq->used_elems[i], idx,
+                                        wrap_counter);
+        }
+        idx += vq->used_elems[i].ndescs;
+        if (idx >= vq->vring.num) {
+            idx -= vq->vring.num;
+            wrap_counter ^= 1;
+        }
+    }
+    smp_wmb();
+    vring_packed_used_flags_set(vq, &vq->used_elems[0], vq->used_idx,
+                                vq->used_wrap_counter);
+
+    if (wrap_counter != vq->used_wrap_counter) {
+        vq->signalled_used_valid = false;
+    }
+    vq->used_idx = idx;
+    vq->used_wrap_counter = wrap_counter;
+    vq->inuse -= count;
+}
+
 void virtqueue_flush(VirtQueue *vq, unsigned int count)
 {
     uint16_t old, new;
+
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        trace_virtqueue_flush(vq, count);
+        virtqueue_packed_flush(vq, count);
+        return;
+    }
+
     /* Make sure buffer is written before we update index. */
     smp_wmb();
     trace_virtqueue_flush(vq, count);
@@ -340,7 +786,7 @@ static unsigned int virtqueue_get_head(VirtQueue *vq, unsigned int idx)
     return head;
 }
 
-static unsigned virtqueue_read_next_desc(VirtIODevice *vdev, VRingDesc *desc,
+static unsigned virtqueue_read_next_desc(VirtQueue *vq, VRingDesc *desc,
                                          hwaddr desc_pa, unsigned int max)
 {
     unsigned int next;
@@ -360,10 +806,97 @@ static unsigned virtqueue_read_next_desc(VirtIODevice *vdev, VRingDesc *desc,
         exit(1);
     }
 
-    vring_desc_read(vdev, desc, desc_pa, next);
+    vring_desc_read(vq, desc, desc_pa, next);
     return next;
 }
 
+static void virtqueue_packed_get_avail_bytes(VirtQueue *vq,
+                                             unsigned int *in_bytes,
+                                             unsigned int *out_bytes,
+                                             unsigned max_in_bytes,
+                                             unsigned max_out_bytes)
+{
+    unsigned int idx = vq->last_avail_idx;
+    bool wrap_counter = vq->last_avail_wrap_counter;
+    unsigned int total_bufs, in_total, out_total;
+
+    total_bufs = in_total = out_total = 0;
+    while (total_bufs < vq->vring.num &&
+           vring_packed_desc_is_avail(vring_packed_desc_flags(vq, idx),
+                                      wrap_counter)) {
+        unsigned int max, ndescs = 1;
+        bool indirect = false;
+        VRingPackedDesc desc;
+        hwaddr desc_pa;
+        int i;
+
+        /* Read the descriptor only after its flags. */
+        smp_rmb();
+        max = vq->vring.num;
+        i = idx;
+        desc_pa = vq->vring.desc;
+        vring_packed_desc_read(vq, &desc, desc_pa, i);
+
+        if (desc.flags & VRING_DESC_F_INDIRECT) {
+            if (desc.len % sizeof(VRingPackedDesc)) {
+                error_report("Invalid size for indirect buffer table");
+                exit(1);
+            }
+
+            /* loop over the indirect descriptor table */
+            indirect = true;
+            max = desc.len / sizeof(VRingPackedDesc);
+            desc_pa = desc.addr;
+            i = 0;
+            vring_packed_desc_read(vq, &desc, desc_pa, i);
+        }
+
+        for (;;) {
+            if (desc.flags & VRING_DESC_F_WRITE) {
+                in_total += desc.len;
+            } else {
+                out_total += desc.len;
+            }
+            if (in_total >= max_in_bytes && out_total >= max_out_bytes) {
+                goto done;
+            }
+
+            if (indirect) {
+                if (++i == max) {
+                    break;
+                }
+            } else {
+                if (!(desc.flags & VRING_DESC_F_NEXT)) {
+                    break;
+                }
+                /* If we've got too many, that implies a descriptor loop. */
+                if (total_bufs + ++ndescs > max) {
+                    error_report("Looped descriptor");
+                    exit(1);
+                }
+                if (++i == max) {
+                    i = 0;
+                }
+            }
+            vring_packed_desc_read(vq, &desc, desc_pa, i);
+        }
+
+        total_bufs += ndescs;
+        idx += ndescs;
+        if (idx >= vq->vring.num) {
+            idx -= vq->vring.num;
+            wrap_counter ^= 1;
+        }
+    }
+done:
+    if (in_bytes) {
+        *in_bytes = in_total;
+    }
+    if (out_bytes) {
+        *out_bytes = out_total;
+    }
+}
+
 void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
                                unsigned int *out_bytes,
                                unsigned max_in_bytes, unsigned max_out_bytes)
@@ -371,11 +904,16 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
     unsigned int idx;
     unsigned int total_bufs, in_total, out_total;
 
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        virtqueue_packed_get_avail_bytes(vq, in_bytes, out_bytes,
+                                         max_in_bytes, max_out_bytes);
+        return;
+    }
+
     idx = vq->last_avail_idx;
 
     total_bufs = in_total = out_total = 0;
     while (virtqueue_num_heads(vq, idx)) {
-        VirtIODevice *vdev = vq->vdev;
         unsigned int max, num_bufs, indirect = 0;
         VRingDesc desc;
         hwaddr desc_pa;
@@ -385,7 +923,7 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
         num_bufs = total_bufs;
         i = virtqueue_get_head(vq, idx++);
         desc_pa = vq->vring.desc;
-        vring_desc_read(vdev, &desc, desc_pa, i);
+        vring_desc_read(vq, &desc, desc_pa, i);
 
         if (desc.flags & VRING_DESC_F_INDIRECT) {
             if (desc.len % sizeof(VRingDesc)) {
@@ -404,7 +942,7 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
             max = desc.len / sizeof(VRingDesc);
             desc_pa = desc.addr;
             num_bufs = i = 0;
-            vring_desc_read(vdev, &desc, desc_pa, i);
+            vring_desc_read(vq, &desc, desc_pa, i);
         }
 
         do {
@@ -422,7 +960,7 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
             if (in_total >= max_in_bytes && out_total >= max_out_bytes) {
                 goto done;
             }
-        } while ((i = virtqueue_read_next_desc(vdev, &desc, desc_pa, max)) != max);
+        } while ((i = virtqueue_read_next_desc(vq, &desc, desc_pa, max)) != max);
 
         if (!indirect)
             total_bufs = num_bufs;
@@ -514,18 +1052,29 @@ void virtqueue_map(VirtQueueElement *elem)
                         VIRTQUEUE_MAX_SIZE, 0);
 }
 
-void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_num)
+/* Bytes needed for an element of sz bytes with num_sg mappings */
+static size_t virtqueue_element_size(size_t sz, unsigned num_sg)
 {
-    VirtQueueElement *elem;
+    size_t addr_end = QEMU_ALIGN_UP(sz, __alignof__(hwaddr)) +
+                      num_sg * sizeof(hwaddr);
+
+    return QEMU_ALIGN_UP(addr_end, __alignof__(struct iovec)) +
+           num_sg * sizeof(struct iovec);
+}
+
+static void *virtqueue_init_element(void *mem, size_t alloc_size, size_t sz,
+                                    unsigned out_num, unsigned in_num)
+{
+    VirtQueueElement *elem = mem;
     size_t in_addr_ofs = QEMU_ALIGN_UP(sz, __alignof__(elem->in_addr[0]));
     size_t out_addr_ofs = in_addr_ofs + in_num * sizeof(elem->in_addr[0]);
     size_t out_addr_end = out_addr_ofs + out_num * sizeof(elem->out_addr[0]);
     size_t in_sg_ofs = QEMU_ALIGN_UP(out_addr_end, __alignof__(elem->in_sg[0]));
     size_t out_sg_ofs = in_sg_ofs + in_num * sizeof(elem->in_sg[0]);
-    size_t out_sg_end = out_sg_ofs + out_num * sizeof(elem->out_sg[0]);
 
     assert(sz >= sizeof(VirtQueueElement));
-    elem = g_malloc(out_sg_end);
+    assert(out_sg_ofs + out_num * sizeof(elem->out_sg[0]) <= alloc_size);
+    elem->alloc_size = alloc_size;
     elem->out_num = out_num;
     elem->in_num = in_num;
     elem->in_addr = (void *)elem + in_addr_ofs;
@@ -535,11 +1084,87 @@ void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_num)
     return elem;
 }
 
-void *virtqueue_pop(VirtQueue *vq, size_t sz)
+void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_num)
+{
+    size_t alloc_size = virtqueue_element_size(sz, out_num + in_num);
+
+    return virtqueue_init_element(g_malloc(alloc_size), alloc_size, sz,
+                                  out_num, in_num);
+}
+
+static void virtqueue_elem_pool_drain(VirtQueue *vq)
+{
+    while (vq->elem_pool_len) {
+        g_free(vq->elem_pool[--vq->elem_pool_len]);
+    }
+}
+
+/* Like virtqueue_alloc_element, but small elements come from the queue's
+ * pool and are sized so that virtqueue_free_element can recycle them. */
+static void *virtqueue_pool_alloc_element(VirtQueue *vq, size_t sz,
+                                          unsigned out_num, unsigned in_num)
+{
+    size_t pool_size;
+    void *mem;
+
+    if (out_num + in_num > VIRTQUEUE_ELEM_POOL_SG) {
+        return virtqueue_alloc_element(sz, out_num, in_num);
+    }
+
+    pool_size = virtqueue_element_size(sz, VIRTQUEUE_ELEM_POOL_SG);
+    if (pool_size != vq->elem_pool_size) {
+        virtqueue_elem_pool_drain(vq);
+        vq->elem_pool_size = pool_size;
+    }
+    if (vq->elem_pool_len) {
+        mem = vq->elem_pool[--vq->elem_pool_len];
+    } else {
+        mem = g_malloc(pool_size);
+    }
+    return virtqueue_init_element(mem, pool_size, sz, out_num, in_num);
+}
+
+void virtqueue_free_element(VirtQueue *vq, void *opaque)
+{
+    VirtQueueElement *elem = opaque;
+
+    if (!elem) {
+        return;
+    }
+    if (elem->alloc_size == vq->elem_pool_size &&
+        vq->elem_pool_len < VIRTQUEUE_ELEM_POOL_MAX) {
+        vq->elem_pool[vq->elem_pool_len++] = elem;
+    } else {
+        g_free(elem);
+    }
+}
+
+/* Copy what a pop has collected and mapped into a new element */
+static VirtQueueElement *virtqueue_new_element(VirtQueue *vq, size_t sz,
+                                               hwaddr *addr,
+                                               struct iovec *iov,
+                                               unsigned out_num,
+                                               unsigned in_num)
+{
+    VirtQueueElement *elem;
+    unsigned i;
+
+    elem = virtqueue_pool_alloc_element(vq, sz, out_num, in_num);
+    for (i = 0; i < out_num; i++) {
+        elem->out_addr[i] = addr[i];
+        elem->out_sg[i] = iov[i];
+    }
+    for (i = 0; i < in_num; i++) {
+        elem->in_addr[i] = addr[out_num + i];
+        elem->in_sg[i] = iov[out_num + i];
+    }
+    return elem;
+}
+
+static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
 {
     unsigned int i, head, max;
     hwaddr desc_pa = vq->vring.desc;
-    VirtIODevice *vdev = vq->vdev;
     VirtQueueElement *elem;
     unsigned out_num, in_num;
     hwaddr addr[VIRTQUEUE_MAX_SIZE];
@@ -559,11 +1184,8 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
     max = vq->vring.num;
 
     i = head = virtqueue_get_head(vq, vq->last_avail_idx++);
-    if (virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
-        vring_set_avail_event(vq, vq->last_avail_idx);
-    }
 
-    vring_desc_read(vdev, &desc, desc_pa, i);
+    vring_desc_read(vq, &desc, desc_pa, i);
     if (desc.flags & VRING_DESC_F_INDIRECT) {
         if (desc.len % sizeof(VRingDesc)) {
             error_report("Invalid size for indirect buffer table");
@@ -574,7 +1196,7 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
         max = desc.len / sizeof(VRingDesc);
         desc_pa = desc.addr;
         i = 0;
-        vring_desc_read(vdev, &desc, desc_pa, i);
+        vring_desc_read(vq, &desc, desc_pa, i);
     }
 
     /* Collect all the descriptors */
@@ -596,18 +1218,113 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
             error_report("Looped descriptor");
             exit(1);
         }
-    } while ((i = virtqueue_read_next_desc(vdev, &desc, desc_pa, max)) != max);
+    } while ((i = virtqueue_read_next_desc(vq, &desc, desc_pa, max)) != max);
 
     /* Now copy what we have collected and mapped */
-    elem = virtqueue_alloc_element(sz, out_num, in_num);
+    elem = virtqueue_new_element(vq, sz, addr, iov, out_num, in_num);
     elem->index = head;
-    for (i = 0; i < out_num; i++) {
-        elem->out_addr[i] = addr[i];
-        elem->out_sg[i] = iov[i];
+    elem->ndescs = 1;
+
+    vq->inuse++;
+
+    trace_virtqueue_pop(vq, elem, elem->in_num, elem->out_num);
+    return elem;
+}
+
+static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
+{
+    unsigned int i, max, ndescs = 1;
+    hwaddr desc_pa = vq->vring.desc;
+    VirtQueueElement *elem;
+    unsigned out_num, in_num;
+    hwaddr addr[VIRTQUEUE_MAX_SIZE];
+    struct iovec iov[VIRTQUEUE_MAX_SIZE];
+    VRingPackedDesc desc;
+    bool indirect = false;
+    uint16_t id;
+
+    if (virtio_queue_packed_empty(vq)) {
+        return NULL;
     }
-    for (i = 0; i < in_num; i++) {
-        elem->in_addr[i] = addr[out_num + i];
-        elem->in_sg[i] = iov[out_num + i];
+    /* Read the descriptor only after its flags said it is available. */
+    smp_rmb();
+
+    /* When we start there are none of either input nor output. */
+    out_num = in_num = 0;
+
+    max = vq->vring.num;
+
+    i = vq->last_avail_idx;
+    vring_packed_desc_read(vq, &desc, desc_pa, i);
+    id = desc.id;
+    if (desc.flags & VRING_DESC_F_INDIRECT) {
+        if (desc.len % sizeof(VRingPackedDesc)) {
+            error_report("Invalid size for indirect buffer table");
+            exit(1);
+        }
+
+        /* loop over the indirect descriptor table */
+        indirect = true;
+        max = desc.len / sizeof(VRingPackedDesc);
+        desc_pa = desc.addr;
+        i = 0;
+        vring_packed_desc_read(vq, &desc, desc_pa, i);
+    }
+
+    /* Collect all the descriptors.  Unlike the split ring there is no next
+     * field: a chain occupies consecutive ring slots, and an indirect
+     * table is used in its entirety. */
+    for (;;) {
+        if (desc.flags & VRING_DESC_F_WRITE) {
+            virtqueue_map_desc(&in_num, addr + out_num, iov + out_num,
+                               VIRTQUEUE_MAX_SIZE - out_num, true,
+                               desc.addr, desc.len);
+        } else {
+            if (in_num) {
+                error_report("Incorrect order for descriptors");
+                exit(1);
+            }
+            virtqueue_map_desc(&out_num, addr, iov,
+                               VIRTQUEUE_MAX_SIZE, false, desc.addr, desc.len);
+        }
+
+        /* If we've got too many, that implies a descriptor loop. */
+        if ((in_num + out_num) > max) {
+            error_report("Looped descriptor");
+            exit(1);
+        }
+
+        if (indirect) {
+            if (++i == max) {
+                break;
+            }
+        } else {
+            if (!(desc.flags & VRING_DESC_F_NEXT)) {
+                break;
+            }
+            if (++ndescs > max) {
+                error_report("Looped descriptor");
+                exit(1);
+            }
+            if (++i == max) {
+                i = 0;
+            }
+        }
+        vring_packed_desc_read(vq, &desc, desc_pa, i);
+        if (!indirect) {
+            /* The buffer id is only required in the last descriptor */
+            id = desc.id;
+        }
+    }
+
+    elem = virtqueue_new_element(vq, sz, addr, iov, out_num, in_num);
+    elem->index = id;
+    elem->ndescs = ndescs;
+
+    vq->last_avail_idx += ndescs;
+    if (vq->last_avail_idx >= vq->vring.num) {
+        vq->last_avail_idx -= vq->vring.num;
+        vq->last_avail_wrap_counter ^= 1;
     }
 
     vq->inuse++;
@@ -616,6 +1333,58 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
     return elem;
 }
 
+/* Tell the driver how far we got, if it asked to be told */
+static void virtqueue_update_avail_event(VirtQueue *vq)
+{
+    if (!virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        return;
+    }
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        vring_packed_set_avail_event(vq);
+    } else {
+        vring_set_avail_event(vq, vq->last_avail_idx);
+    }
+}
+
+void *virtqueue_pop(VirtQueue *vq, size_t sz)
+{
+    void *elem;
+
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        elem = virtqueue_packed_pop(vq, sz);
+    } else {
+        elem = virtqueue_split_pop(vq, sz);
+    }
+    if (elem) {
+        virtqueue_update_avail_event(vq);
+    }
+    return elem;
+}
+
+/* Pop up to max elements, publishing the avail event only once */
+unsigned int virtqueue_pop_batch(VirtQueue *vq, size_t sz, void **elems,
+                                 unsigned int max)
+{
+    bool packed = virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED);
+    unsigned int n;
+
+    rcu_read_lock();
+    for (n = 0; n < max; n++) {
+        elems[n] = packed ? virtqueue_packed_pop(vq, sz)
+                          : virtqueue_split_pop(vq, sz);
+        if (!elems[n]) {
+            break;
+        }
+    }
+    if (n) {
+        virtqueue_update_avail_event(vq);
+    }
+    rcu_read_unlock();
+
+    trace_virtqueue_pop_batch(vq, n);
+    return n;
+}
+
 /* Reading and writing a structure directly to QEMUFile is *awful*, but
  * it is what QEMU has always done by mistake.  We can change it sooner
  * or later by bumping the version number of the affected vm states.
@@ -633,7 +1402,7 @@ typedef struct VirtQueueElementOld {
     struct iovec out_sg[VIRTQUEUE_MAX_SIZE];
 } VirtQueueElementOld;
 
-void *qemu_get_virtqueue_element(QEMUFile *f, size_t sz)
+void *qemu_get_virtqueue_element(VirtIODevice *vdev, QEMUFile *f, size_t sz)
 {
     VirtQueueElement *elem;
     VirtQueueElementOld data;
@@ -643,6 +1412,13 @@ void *qemu_get_virtqueue_element(QEMUFile *f, size_t sz)
 
     elem = virtqueue_alloc_element(sz, data.out_num, data.in_num);
     elem->index = data.index;
+    elem->ndescs = 1;
+
+    /* Host features are used here because guest features are not loaded
+     * yet when devices restore their in-flight requests. */
+    if (virtio_host_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        elem->ndescs = qemu_get_be16(f);
+    }
 
     for (i = 0; i < elem->in_num; i++) {
         elem->in_addr[i] = data.in_addr[i];
@@ -668,7 +1444,8 @@ void *qemu_get_virtqueue_element(QEMUFile *f, size_t sz)
     return elem;
 }
 
-void qemu_put_virtqueue_element(QEMUFile *f, VirtQueueElement *elem)
+void qemu_put_virtqueue_element(VirtIODevice *vdev, QEMUFile *f,
+                                VirtQueueElement *elem)
 {
     VirtQueueElementOld data;
     int i;
@@ -697,6 +1474,10 @@ void qemu_put_virtqueue_element(QEMUFile *f, VirtQueueElement *elem)
         data.out_sg[i].iov_len = elem->out_sg[i].iov_len;
     }
     qemu_put_buffer(f, (uint8_t *)&data, sizeof(VirtQueueElementOld));
+
+    if (virtio_host_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        qemu_put_be16(f, elem->ndescs);
+    }
 }
 
 /* virtio device */
@@ -802,11 +1583,14 @@ void virtio_reset(void *opaque)
         vdev->vq[i].last_avail_idx = 0;
         vdev->vq[i].shadow_avail_idx = 0;
         vdev->vq[i].used_idx = 0;
+        vdev->vq[i].last_avail_wrap_counter = true;
+        vdev->vq[i].used_wrap_counter = true;
         virtio_queue_set_vector(vdev, i, VIRTIO_NO_VECTOR);
         vdev->vq[i].signalled_used = 0;
         vdev->vq[i].signalled_used_valid = false;
         vdev->vq[i].notification = true;
         vdev->vq[i].vring.num = vdev->vq[i].vring.num_default;
+        virtio_init_region_cache(vdev, i);
     }
 }
 
@@ -1016,6 +1800,7 @@ void virtio_queue_set_rings(VirtIODevice *vdev, int n, hwaddr desc,
     vdev->vq[n].vring.desc = desc;
     vdev->vq[n].vring.avail = avail;
     vdev->vq[n].vring.used = used;
+    virtio_init_region_cache(vdev, n);
 }
 
 void virtio_queue_set_num(VirtIODevice *vdev, int n, int num)
@@ -1029,6 +1814,7 @@ void virtio_queue_set_num(VirtIODevice *vdev, int n, int num)
         return;
     }
     vdev->vq[n].vring.num = num;
+    virtio_init_region_cache(vdev, n);
 }
 
 VirtQueue *virtio_vector_first_queue(VirtIODevice *vdev, uint16_t vector)
@@ -1101,6 +1887,35 @@ void virtio_queue_notify(VirtIODevice *vdev, int n)
     virtio_queue_notify_vq(&vdev->vq[n]);
 }
 
+/* Like virtio_queue_notify, but can be called without the BQL.  If the
+ * queue has a host notifier, kick it the same way KVM's ioeventfd would;
+ * otherwise take the BQL and run the handler directly.
+ */
+void virtio_queue_notify_nolock(VirtIODevice *vdev, int n)
+{
+    VirtQueue *vq = &vdev->vq[n];
+    bool locked;
+
+    if (atomic_mb_read(&vq->host_notifier_enabled)) {
+        event_notifier_set(&vq->host_notifier);
+        /* If the notifier was disabled concurrently, the kick may have
+         * come after the final flush; repeat it the slow way.
+         */
+        if (atomic_mb_read(&vq->host_notifier_enabled)) {
+            return;
+        }
+    }
+
+    locked = qemu_mutex_iothread_locked();
+    if (!locked) {
+        qemu_mutex_lock_iothread();
+    }
+    virtio_queue_notify_vq(vq);
+    if (!locked) {
+        qemu_mutex_unlock_iothread();
+    }
+}
+
 uint16_t virtio_queue_vector(VirtIODevice *vdev, int n)
 {
     return n < VIRTIO_QUEUE_MAX ? vdev->vq[n].vector :
@@ -1141,6 +1956,9 @@ VirtQueue *virtio_add_queue(VirtIODevice *vdev, int queue_size,
     vdev->vq[i].vring.num_default = queue_size;
     vdev->vq[i].vring.align = VIRTIO_PCI_VRING_ALIGN;
     vdev->vq[i].handle_output = handle_output;
+    vdev->vq[i].last_avail_wrap_counter = true;
+    vdev->vq[i].used_wrap_counter = true;
+    vdev->vq[i].used_elems = g_new0(VRingPackedUsedElem, VIRTQUEUE_MAX_SIZE);
 
     return &vdev->vq[i];
 }
@@ -1153,6 +1971,10 @@ void virtio_del_queue(VirtIODevice *vdev, int n)
 
     vdev->vq[n].vring.num = 0;
     vdev->vq[n].vring.num_default = 0;
+    virtio_init_region_cache(vdev, n);
+    virtqueue_elem_pool_drain(&vdev->vq[n]);
+    g_free(vdev->vq[n].used_elems);
+    vdev->vq[n].used_elems = NULL;
 }
 
 void virtio_irq(VirtQueue *vq)
@@ -1162,6 +1984,40 @@ void virtio_irq(VirtQueue *vq)
     virtio_notify_vector(vq->vdev, vq->vector);
 }
 
+static bool vring_packed_need_event(VirtQueue *vq, uint16_t off_wrap,
+                                    uint16_t new, uint16_t old)
+{
+    int off = off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+
+    /* An event offset from the previous lap lies before index 0 */
+    if (vq->used_wrap_counter != off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR) {
+        off -= vq->vring.num;
+    }
+    return vring_need_event(off, new, old);
+}
+
+static bool virtio_packed_should_notify(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VRingPackedDescEvent e;
+    uint16_t old, new;
+    bool v;
+
+    vring_packed_driver_event(vq, &e);
+
+    v = vq->signalled_used_valid;
+    vq->signalled_used_valid = true;
+    old = vq->signalled_used;
+    new = vq->signalled_used = vq->used_idx;
+
+    if (e.flags == VRING_PACKED_EVENT_FLAG_DISABLE) {
+        return false;
+    } else if (e.flags != VRING_PACKED_EVENT_FLAG_DESC ||
+               !virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        return true;
+    }
+    return !v || vring_packed_need_event(vq, e.off_wrap, new, old);
+}
+
 bool virtio_should_notify(VirtIODevice *vdev, VirtQueue *vq)
 {
     uint16_t old, new;
@@ -1174,6 +2030,10 @@ bool virtio_should_notify(VirtIODevice *vdev, VirtQueue *vq)
         return true;
     }
 
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        return virtio_packed_should_notify(vdev, vq);
+    }
+
     if (!virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
         return !(vring_avail_flags(vq) & VRING_AVAIL_F_NO_INTERRUPT);
     }
@@ -1232,6 +2092,13 @@ static bool virtio_virtqueue_needed(void *opaque)
     return virtio_host_has_feature(vdev, VIRTIO_F_VERSION_1);
 }
 
+static bool virtio_packed_virtqueue_needed(void *opaque)
+{
+    VirtIODevice *vdev = opaque;
+
+    return virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED);
+}
+
 static bool virtio_ringsize_needed(void *opaque)
 {
     VirtIODevice *vdev = opaque;
@@ -1278,6 +2145,31 @@ static const VMStateDescription vmstate_virtio_virtqueues = {
     }
 };
 
+static const VMStateDescription vmstate_packed_virtqueue = {
+    .name = "packed_virtqueue_state",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_BOOL(last_avail_wrap_counter, struct VirtQueue),
+        VMSTATE_UINT16(used_idx, struct VirtQueue),
+        VMSTATE_BOOL(used_wrap_counter, struct VirtQueue),
+        VMSTATE_INT32(inuse, struct VirtQueue),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_virtio_packed_virtqueues = {
+    .name = "virtio/packed_virtqueues",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = &virtio_packed_virtqueue_needed,
+    .fields = (VMStateField[]) {
+        VMSTATE_STRUCT_VARRAY_POINTER_KNOWN(vq, struct VirtIODevice,
+                      VIRTIO_QUEUE_MAX, 0, vmstate_packed_virtqueue, VirtQueue),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_ringsize = {
     .name = "ringsize_state",
     .version_id = 1,
@@ -1382,6 +2274,7 @@ static const VMStateDescription vmstate_virtio = {
         &vmstate_virtio_64bit_features,
         &vmstate_virtio_virtqueues,
         &vmstate_virtio_ringsize,
+        &vmstate_virtio_packed_virtqueues,
         &vmstate_virtio_extra_state,
         NULL
     }
@@ -1581,7 +2474,13 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
     }
 
     for (i = 0; i < num; i++) {
-        if (vdev->vq[i].vring.desc) {
+        /* Ring addresses and the layout are only final now */
+        virtio_init_region_cache(vdev, i);
+
+        /* The packed ring has no indexes in guest memory to check against;
+         * its state came in the virtio/packed_virtqueues subsection. */
+        if (vdev->vq[i].vring.desc &&
+            !virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
             uint16_t nheads;
             nheads = vring_avail_idx(&vdev->vq[i]) - vdev->vq[i].last_avail_idx;
             /* Check it isn't doing strange things with descriptor numbers. */
@@ -1603,7 +2502,13 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
 
 void virtio_cleanup(VirtIODevice *vdev)
 {
+    int i;
+
     qemu_del_vm_change_state_handler(vdev->vmstate);
+    for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        virtqueue_elem_pool_drain(&vdev->vq[i]);
+        g_free(vdev->vq[i].used_elems);
+    }
     g_free(vdev->config);
     g_free(vdev->vq);
     g_free(vdev->vector_queues);
@@ -1707,12 +2612,18 @@ hwaddr virtio_queue_get_desc_size(VirtIODevice *vdev, int n)
 
 hwaddr virtio_queue_get_avail_size(VirtIODevice *vdev, int n)
 {
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        return sizeof(VRingPackedDescEvent);
+    }
     return offsetof(VRingAvail, ring) +
         sizeof(uint16_t) * vdev->vq[n].vring.num;
 }
 
 hwaddr virtio_queue_get_used_size(VirtIODevice *vdev, int n)
 {
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        return sizeof(VRingPackedDescEvent);
+    }
     return offsetof(VRingUsed, ring) +
         sizeof(VRingUsedElem) * vdev->vq[n].vring.num;
 }
@@ -1734,6 +2645,27 @@ void virtio_queue_set_last_avail_idx(VirtIODevice *vdev, int n, uint16_t idx)
     vdev->vq[n].shadow_avail_idx = idx;
 }
 
+/* The backend that owned the ring is gone and took its view of the avail
+ * index with it.  Everything up to the used index has certainly been
+ * consumed, so restart from there.
+ */
+void virtio_queue_restore_last_avail_idx(VirtIODevice *vdev, int n)
+{
+    VirtQueue *vq = &vdev->vq[n];
+
+    if (!vq->vring.desc) {
+        return;
+    }
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        vq->last_avail_idx = vq->used_idx;
+        vq->last_avail_wrap_counter = vq->used_wrap_counter;
+    } else {
+        vq->used_idx = vring_used_idx(vq);
+        vq->last_avail_idx = vq->used_idx;
+    }
+    vq->shadow_avail_idx = vq->last_avail_idx;
+}
+
 void virtio_queue_invalidate_signalled_used(VirtIODevice *vdev, int n)
 {
     vdev->vq[n].signalled_used_valid = false;
@@ -1823,6 +2755,37 @@ EventNotifier *virtio_queue_get_host_notifier(VirtQueue *vq)
     return &vq->host_notifier;
 }
 
+/* Must be called with the host notifier set up and its consumer (fd
+ * handler, dataplane or vhost) in place.
+ */
+void virtio_queue_set_host_notifier_enabled(VirtQueue *vq, bool enabled)
+{
+    atomic_mb_set(&vq->host_notifier_enabled, enabled);
+}
+
+typedef struct VirtQueueHostNotifierFree {
+    struct rcu_head rcu;
+    EventNotifier e;
+} VirtQueueHostNotifierFree;
+
+static void virtio_queue_host_notifier_free(VirtQueueHostNotifierFree *f)
+{
+    event_notifier_cleanup(&f->e);
+    g_free(f);
+}
+
+/* virtio_queue_notify_nolock() runs in an RCU critical section and may
+ * still be writing to the notifier, so close it after a grace period.
+ */
+void virtio_queue_host_notifier_cleanup(VirtQueue *vq)
+{
+    VirtQueueHostNotifierFree *f = g_new(VirtQueueHostNotifierFree, 1);
+
+    assert(!vq->host_notifier_enabled);
+    f->e = vq->host_notifier;
+    call_rcu(f, virtio_queue_host_notifier_free, rcu);
+}
+
 void virtio_device_set_child_bus_name(VirtIODevice *vdev, char *bus_name)
 {
     g_free(vdev->bus_name);
@@ -1848,6 +2811,9 @@ static void virtio_device_realize(DeviceState *dev, Error **errp)
         error_propagate(errp, err);
         return;
     }
+
+    vdev->listener.commit = virtio_memory_listener_commit;
+    memory_listener_register(&vdev->listener, &address_space_memory);
 }
 
 static void virtio_device_unrealize(DeviceState *dev, Error **errp)
@@ -1855,6 +2821,15 @@ static void virtio_device_unrealize(DeviceState *dev, Error **errp)
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
     VirtioDeviceClass *vdc = VIRTIO_DEVICE_GET_CLASS(dev);
     Error *err = NULL;
+    int i;
+
+    memory_listener_unregister(&vdev->listener);
+    for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        if (vdev->vq[i].vring.caches) {
+            call_rcu(vdev->vq[i].vring.caches, virtio_free_region_cache, rcu);
+            vdev->vq[i].vring.caches = NULL;
+        }
+    }
 
     virtio_bus_device_unplugged(vdev);
 
@@ -44,6 +44,20 @@ struct BlockAcctTimedStats {
     QSLIST_ENTRY(BlockAcctTimedStats) entries;
 };
 
+/* Log-scale latency histogram: bin 0 counts latencies below min_ns,
+ * bin i latencies in [min_ns << (i - 1), min_ns << i) and the last bin
+ * everything that did not fit in the others.
+ */
+typedef struct BlockLatencyHistogram {
+    uint64_t min_ns;
+    unsigned nbins;
+    uint64_t *bins;     /* NULL if the histogram is disabled */
+} BlockLatencyHistogram;
+
+#define BLOCK_LATENCY_HISTOGRAM_MIN_NS   1000
+#define BLOCK_LATENCY_HISTOGRAM_BINS     24
+#define BLOCK_LATENCY_HISTOGRAM_MAX_BINS 64
+
 typedef struct BlockAcctStats {
     uint64_t nr_bytes[BLOCK_MAX_IOTYPE];
     uint64_t nr_ops[BLOCK_MAX_IOTYPE];
@@ -53,6 +67,7 @@ typedef struct BlockAcctStats {
     uint64_t merged[BLOCK_MAX_IOTYPE];
     int64_t last_access_time_ns;
     QSLIST_HEAD(, BlockAcctTimedStats) intervals;
+    BlockLatencyHistogram histogram[BLOCK_MAX_IOTYPE];
     bool account_invalid;
     bool account_failed;
 } BlockAcctStats;
@@ -76,6 +91,10 @@ void block_acct_failed(BlockAcctStats *stats, BlockAcctCookie *cookie);
 void block_acct_invalid(BlockAcctStats *stats, enum BlockAcctType type);
 void block_acct_merge_done(BlockAcctStats *stats, enum BlockAcctType type,
                            int num_requests);
+bool block_latency_histogram_set(BlockAcctStats *stats, uint64_t min_ns,
+                                 unsigned nbins, Error **errp);
+uint64_t block_latency_histogram_boundary(BlockLatencyHistogram *hist,
+                                          unsigned i);
 int64_t block_acct_idle_time_ns(BlockAcctStats *stats);
 double block_acct_queue_depth(BlockAcctTimedStats *stats,
                               enum BlockAcctType type);
@@ -40,6 +40,8 @@
 #define BLOCK_FLAG_ENCRYPT          1
 #define BLOCK_FLAG_COMPAT6          4
 #define BLOCK_FLAG_LAZY_REFCOUNTS   8
+#define BLOCK_FLAG_EXTL2            16
+#define BLOCK_FLAG_JOURNAL          32
 
 #define BLOCK_OPT_SIZE              "size"
 #define BLOCK_OPT_ENCRYPT           "encryption"
@@ -57,6 +59,9 @@
 #define BLOCK_OPT_NOCOW             "nocow"
 #define BLOCK_OPT_OBJECT_SIZE       "object_size"
 #define BLOCK_OPT_REFCOUNT_BITS     "refcount_bits"
+#define BLOCK_OPT_EXTL2             "extended_l2"
+#define BLOCK_OPT_JOURNAL           "journal"
+#define BLOCK_OPT_JOURNAL_SIZE      "journal_size"
 
 #define BLOCK_PROBE_BUF_SIZE        512
 
@@ -214,6 +219,7 @@ struct BlockDriver {
                                   Error **errp);
     int (*bdrv_get_info)(BlockDriverState *bs, BlockDriverInfo *bdi);
     ImageInfoSpecific *(*bdrv_get_specific_info)(BlockDriverState *bs);
+    BlockStatsSpecific *(*bdrv_get_specific_stats)(const BlockDriverState *bs);
 
     int (*bdrv_save_vmstate)(BlockDriverState *bs, QEMUIOVector *qiov,
                              int64_t pos);
@@ -421,6 +427,8 @@ struct BlockDriverState {
     ThrottleState *throttle_state;
     ThrottleTimers throttle_timers;
     unsigned       pending_reqs[2];
+    unsigned       throttle_weight;
+    uint64_t       throttle_vtime[2];
     QLIST_ENTRY(BlockDriverState) round_robin;
 
     /* Offset after the highest byte written to */
@@ -487,6 +495,7 @@ struct BlockBackendRootState {
 
     char *throttle_group;
     ThrottleState *throttle_state;
+    unsigned throttle_weight;
 };
 
 static inline BlockDriverState *backing_bs(BlockDriverState *bs)
@@ -28,6 +28,10 @@
 #include "qemu/throttle.h"
 #include "block/block_int.h"
 
+/* Share of the group given to a member relative to the other members */
+#define THROTTLE_GROUP_DEFAULT_WEIGHT 100
+#define THROTTLE_GROUP_MAX_WEIGHT     10000
+
 const char *throttle_group_get_name(BlockDriverState *bs);
 
 ThrottleState *throttle_group_incref(const char *name);
@@ -36,9 +40,15 @@ void throttle_group_unref(ThrottleState *ts);
 void throttle_group_config(BlockDriverState *bs, ThrottleConfig *cfg);
 void throttle_group_get_config(BlockDriverState *bs, ThrottleConfig *cfg);
 
+void throttle_group_set_weight(BlockDriverState *bs, unsigned weight);
+
 void throttle_group_register_bs(BlockDriverState *bs, const char *groupname);
 void throttle_group_unregister_bs(BlockDriverState *bs);
 
+void throttle_group_detach_aio_context(BlockDriverState *bs);
+void throttle_group_attach_aio_context(BlockDriverState *bs,
+                                       AioContext *new_context);
+
 void coroutine_fn throttle_group_co_io_limits_intercept(BlockDriverState *bs,
                                                         unsigned int bytes,
                                                         bool is_write);
@@ -31,6 +31,7 @@
 #include "qemu/notify.h"
 #include "qom/object.h"
 #include "qemu/rcu.h"
+#include "qemu/thread.h"
 #include "qemu/typedefs.h"
 
 #define MAX_PHYS_ADDR_SPACE_BITS 62
@@ -215,6 +216,7 @@ struct MemoryListener {
     void (*log_stop)(MemoryListener *listener, MemoryRegionSection *section,
                      int old, int new);
     void (*log_sync)(MemoryListener *listener, MemoryRegionSection *section);
+    void (*log_clear)(MemoryListener *listener, MemoryRegionSection *section);
     void (*log_global_start)(MemoryListener *listener);
     void (*log_global_stop)(MemoryListener *listener);
     void (*eventfd_add)(MemoryListener *listener, MemoryRegionSection *section,
@@ -234,6 +236,13 @@ struct MemoryListener {
 /**
  * AddressSpace: describes a mapping of addresses to #MemoryRegion objects
  */
+#define DEFAULT_MAX_BOUNCE_BUFFER_SIZE 4096
+
+typedef struct AddressSpaceMapClient {
+    QEMUBH *bh;
+    QLIST_ENTRY(AddressSpaceMapClient) link;
+} AddressSpaceMapClient;
+
 struct AddressSpace {
     /* All fields are private. */
     struct rcu_head rcu;
@@ -251,6 +260,25 @@ struct AddressSpace {
     struct AddressSpaceDispatch *next_dispatch;
     MemoryListener dispatch_listener;
 
+    /* Bytes of bounce buffers that address_space_map may hand out for
+     * regions that cannot be accessed directly.
+     */
+    size_t max_bounce_buffer_size;
+    /* Total size of bounce buffers currently allocated, atomically
+     * accessed.
+     */
+    size_t bounce_buffer_size;
+    /* Waiters for bounce buffer space, see address_space_map() */
+    QemuMutex map_client_list_lock;
+    QLIST_HEAD(, AddressSpaceMapClient) map_client_list;
+    /* Outstanding bounce buffers, under map_client_list_lock.  Only
+     * needed under Xen, where host pointers cannot be checked cheaply.
+     */
+    QLIST_HEAD(, BounceBuffer) bounce_buffers;
+    /* Bytes mapped by address_space_map, atomically accessed */
+    uint64_t dma_direct_bytes;
+    uint64_t dma_bounced_bytes;
+
     QTAILQ_ENTRY(AddressSpace) address_spaces_link;
 };
 
@@ -754,6 +782,23 @@ void memory_region_set_dirty(MemoryRegion *mr, hwaddr addr,
  */
 bool memory_region_test_and_clear_dirty(MemoryRegion *mr, hwaddr addr,
                                         hwaddr size, unsigned client);
+
+/**
+ * memory_region_clear_dirty_bitmap: Re-arm dirty logging for a range of
+ *                                   a memory region.
+ *
+ * Some accelerators (e.g. KVM with manual dirty log protection) do not
+ * reset their own dirty log when it is synchronized.  Instead, the pages
+ * stay writable until this function tells the listeners that the dirty
+ * information for the range has been consumed, so that it can be cleared
+ * and write-protected again in small chunks.
+ *
+ * @mr: the memory region being cleared.
+ * @start: the address (relative to the start of the region) of the range.
+ * @len: the length of the range.
+ */
+void memory_region_clear_dirty_bitmap(MemoryRegion *mr, hwaddr start,
+                                      hwaddr len);
 /**
  * memory_region_sync_dirty_bitmap: Synchronize a region's dirty bitmap with
  *                                  any external TLBs (e.g. kvm)
@@ -1132,6 +1177,9 @@ void memory_listener_unregister(MemoryListener *listener);
 
 /**
  * memory_global_dirty_log_start: begin dirty logging for all regions
+ *
+ * Calls nest: logging stays enabled until each caller (e.g. migration and
+ * dirty page rate measurement) has called memory_global_dirty_log_stop().
  */
 void memory_global_dirty_log_start(void);
 
@@ -1142,6 +1190,12 @@ void memory_global_dirty_log_stop(void);
 
 void mtree_info(fprintf_function mon_printf, void *f);
 
+/**
+ * address_space_dma_info: print bounce buffer usage and the number of
+ * bytes mapped directly and through bounce buffers, per address space.
+ */
+void address_space_dma_info(fprintf_function mon_printf, void *f);
+
 /**
  * memory_region_dispatch_read: perform a read directly to the specified
  * MemoryRegion.
@@ -1348,8 +1402,10 @@ bool address_space_access_valid(AddressSpace *as, hwaddr addr, int len, bool is_
  * May map a subset of the requested range, given by and returned in @plen.
  * May return %NULL if resources needed to perform the mapping are exhausted.
  * Use only for reads OR writes - not for read-modify-write operations.
- * Use cpu_register_map_client() to know when retrying the map operation is
- * likely to succeed.
+ * Regions that are not directly accessible RAM are bounced through a
+ * temporary buffer; @as limits the total size of those buffers.
+ * Use address_space_register_map_client() to know when retrying the map
+ * operation is likely to succeed.
  *
  * @as: #AddressSpace to be accessed
  * @addr: address within that address space
@@ -1373,6 +1429,24 @@ void *address_space_map(AddressSpace *as, hwaddr addr,
 void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
                          int is_write, hwaddr access_len);
 
+/* address_space_register_map_client: wait for bounce buffer space
+ *
+ * Schedules @bh once a bounce buffer of @as has been released, or
+ * right away if none is in use.  Callers whose address_space_map()
+ * returned %NULL use this to retry without polling.
+ *
+ * @as: #AddressSpace the failed mapping was made in
+ * @bh: bottom half to schedule
+ */
+void address_space_register_map_client(AddressSpace *as, QEMUBH *bh);
+
+/* address_space_unregister_map_client: cancel a previous registration
+ *
+ * @as: #AddressSpace passed to address_space_register_map_client()
+ * @bh: bottom half passed to address_space_register_map_client()
+ */
+void address_space_unregister_map_client(AddressSpace *as, QEMUBH *bh);
+
 
 /* Internal functions, part of the implementation of address_space_read.  */
 MemTxResult address_space_read_continue(AddressSpace *as, hwaddr addr,
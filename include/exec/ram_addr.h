@@ -36,6 +36,17 @@ struct RAMBlock {
     /* RCU-enabled, writes protected by the ramlist lock */
     QLIST_ENTRY(RAMBlock) next;
     int fd;
+    /* Layout of the block in an x-mapped-ram migration file; file_bmap
+     * has a bit set for each page present in the file.
+     */
+    unsigned long *file_bmap;
+    off_t bitmap_offset;
+    off_t pages_offset;
+    /* One bit per chunk of the block whose dirty log must be cleared in
+     * the accelerator before any of its pages is migrated again.  Only
+     * used by the migration thread.
+     */
+    unsigned long *clear_bmap;
 };
 
 static inline bool offset_in_ramblock(RAMBlock *b, ram_addr_t offset)
@@ -35,6 +35,18 @@ struct vhost_log {
     vhost_log_chunk_t *log;
 };
 
+/* Descriptors the backend has taken off a ring but not yet completed,
+ * kept in memory shared with the backend so that they survive a backend
+ * restart.  Owned by the device model, the backend decides the layout.
+ */
+struct vhost_inflight {
+    int fd;
+    void *addr;
+    uint64_t size;
+    uint64_t offset;
+    uint16_t queue_size;
+};
+
 struct vhost_memory;
 struct vhost_dev {
     MemoryListener memory_listener;
@@ -60,6 +72,7 @@ struct vhost_dev {
     const VhostOps *vhost_ops;
     void *opaque;
     struct vhost_log *log;
+    struct vhost_inflight *inflight;
     QLIST_ENTRY(vhost_dev) entry;
 };
 
@@ -85,4 +98,15 @@ uint64_t vhost_get_features(struct vhost_dev *hdev, const int *feature_bits,
 void vhost_ack_features(struct vhost_dev *hdev, const int *feature_bits,
                         uint64_t features);
 bool vhost_has_free_slot(void);
+
+void vhost_dev_reset_inflight(struct vhost_inflight *inflight);
+void vhost_dev_free_inflight(struct vhost_inflight *inflight);
+
+/* Device configuration space held by the backend, for devices whose
+ * backend owns the device state (e.g. the capacity of a disk).
+ */
+int vhost_dev_get_config(struct vhost_dev *hdev, uint8_t *config,
+                         uint32_t config_len);
+int vhost_dev_set_config(struct vhost_dev *hdev, const uint8_t *data,
+                         uint32_t offset, uint32_t size);
 #endif
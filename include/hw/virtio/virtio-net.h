@@ -49,6 +49,8 @@ typedef struct VirtIONetQueue {
     struct {
         VirtQueueElement *elem;
     } async_tx;
+    /* Scatter lists of the TX packets handed to the backend as a batch */
+    struct iovec *tx_sg;
     struct VirtIONet *n;
 } VirtIONetQueue;
 
@@ -53,9 +53,11 @@ struct VirtIOSCSIConf {
     char *wwpn;
     uint32_t boot_tpgt;
     IOThread *iothread;
+    char *iothreads;
 };
 
 struct VirtIOSCSI;
+struct VirtIOSCSIReq;
 
 typedef struct VirtIOSCSICommon {
     VirtIODevice parent_obj;
@@ -75,6 +77,24 @@ typedef struct VirtIOSCSIBlkChangeNotifier {
     QTAILQ_ENTRY(VirtIOSCSIBlkChangeNotifier) next;
 } VirtIOSCSIBlkChangeNotifier;
 
+typedef struct VirtIOSCSIQueue {
+    /* AioContext that pops requests from the virtqueue */
+    AioContext *ctx;
+    /* Requests can complete in a different IOThread than the one that
+     * popped them, so pushes to the used ring are serialized here.
+     */
+    QemuMutex lock;
+} VirtIOSCSIQueue;
+
+typedef struct VirtIOSCSIIOThread {
+    struct VirtIOSCSI *s;
+    IOThread *iothread;
+    AioContext *ctx;
+    QEMUBH *forward_bh;
+    /* Requests popped by other IOThreads for the LUNs that live here */
+    QSLIST_HEAD(, VirtIOSCSIReq) forwarded;
+} VirtIOSCSIIOThread;
+
 typedef struct VirtIOSCSI {
     VirtIOSCSICommon parent_obj;
 
@@ -83,7 +103,10 @@ typedef struct VirtIOSCSI {
     bool events_dropped;
 
     /* Fields for dataplane below */
-    AioContext *ctx; /* one iothread per virtio-scsi-pci for now */
+    AioContext *ctx; /* runs the control and event queues */
+    VirtIOSCSIIOThread *iothreads;
+    int num_iothreads;
+    VirtIOSCSIQueue *queues; /* indexed by virtqueue number */
 
     QTAILQ_HEAD(, VirtIOSCSIBlkChangeNotifier) insert_notifiers;
     QTAILQ_HEAD(, VirtIOSCSIBlkChangeNotifier) remove_notifiers;
@@ -115,6 +138,9 @@ typedef struct VirtIOSCSIReq {
 
         /* Used for cancellation of request during TMFs */
         int remaining;
+
+        /* Used to hand the request over to the IOThread of its LUN */
+        QSLIST_ENTRY(VirtIOSCSIReq) forward;
     };
 
     SCSIRequest *sreq;
@@ -142,13 +168,18 @@ void virtio_scsi_common_realize(DeviceState *dev, Error **errp,
 void virtio_scsi_common_unrealize(DeviceState *dev, Error **errp);
 void virtio_scsi_handle_ctrl_req(VirtIOSCSI *s, VirtIOSCSIReq *req);
 bool virtio_scsi_handle_cmd_req_prepare(VirtIOSCSI *s, VirtIOSCSIReq *req);
+bool virtio_scsi_handle_forwarded_cmd_req(VirtIOSCSI *s, VirtIOSCSIReq *req);
 void virtio_scsi_handle_cmd_req_submit(VirtIOSCSI *s, VirtIOSCSIReq *req);
 void virtio_scsi_init_req(VirtIOSCSI *s, VirtQueue *vq, VirtIOSCSIReq *req);
 void virtio_scsi_free_req(VirtIOSCSIReq *req);
 void virtio_scsi_push_event(VirtIOSCSI *s, SCSIDevice *dev,
                             uint32_t event, uint32_t reason);
 
-void virtio_scsi_set_iothread(VirtIOSCSI *s, IOThread *iothread);
+void virtio_scsi_set_iothread(VirtIOSCSI *s, Error **errp);
+void virtio_scsi_dataplane_cleanup(VirtIOSCSI *s);
+AioContext *virtio_scsi_dataplane_lun_ctx(VirtIOSCSI *s, SCSIDevice *sd);
+void virtio_scsi_dataplane_forward(VirtIOSCSI *s, VirtIOSCSIReq *req,
+                                   AioContext *ctx);
 void virtio_scsi_dataplane_start(VirtIOSCSI *s);
 void virtio_scsi_dataplane_stop(VirtIOSCSI *s);
 void virtio_scsi_dataplane_notify(VirtIODevice *vdev, VirtIOSCSIReq *req);
@@ -0,0 +1,48 @@
+/*
+ * Migration page compression codecs
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#ifndef QEMU_MIGRATION_COMPRESS_H
+#define QEMU_MIGRATION_COMPRESS_H
+
+#include "qapi-types.h"
+
+/* Per-thread compression state, e.g. the LZO work memory */
+typedef struct MigrationCompressCtx MigrationCompressCtx;
+
+/* Return true if @method was compiled in */
+bool migration_compress_supported(MigrationCompressMethod method);
+
+/*
+ * Return the maximum compressed size of @len bytes with @method, or with
+ * any supported method if @method is MIGRATION_COMPRESS_METHOD__MAX.
+ */
+size_t migration_compress_bound(MigrationCompressMethod method, size_t len);
+
+MigrationCompressCtx *migration_compress_ctx_new(MigrationCompressMethod method,
+                                                 int level);
+void migration_compress_ctx_free(MigrationCompressCtx *ctx);
+
+/*
+ * Compress @len bytes from @src into @dst, which has room for @dst_len
+ * bytes.  Every call is independent: no dictionary is carried over from
+ * one page to the next.
+ *
+ * Returns the compressed size, or -1 on error.
+ */
+ssize_t migration_compress(MigrationCompressCtx *ctx, uint8_t *dst,
+                           size_t dst_len, const uint8_t *src, size_t len);
+
+/*
+ * Decompress @len bytes from @src into @dst, which has room for @dst_len
+ * bytes.
+ *
+ * Returns the decompressed size, or -1 on error.
+ */
+ssize_t migration_decompress(MigrationCompressMethod method, uint8_t *dst,
+                             size_t dst_len, const uint8_t *src, size_t len);
+
+#endif
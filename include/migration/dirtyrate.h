@@ -0,0 +1,24 @@
+/*
+ * Dirty page rate measurement and per-vCPU dirty page rate limits
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#ifndef QEMU_MIGRATION_DIRTYRATE_H
+#define QEMU_MIGRATION_DIRTYRATE_H
+
+/*
+ * Limit the dirty page rate of every vCPU to @limit MB/s on behalf of
+ * migration.  Does nothing if the limit is already applied.  Called with
+ * the iothread lock held.
+ */
+void dirtylimit_migration_start(uint64_t limit);
+
+/*
+ * Replace the limits set by dirtylimit_migration_start(), if any, with the
+ * ones set by the user.  Called with the iothread lock held.
+ */
+void dirtylimit_migration_stop(void);
+
+#endif
@@ -197,6 +197,15 @@ void fd_start_incoming_migration(const char *path, Error **errp);
 
 void fd_start_outgoing_migration(MigrationState *s, const char *fdname, Error **errp);
 
+void file_start_incoming_migration(const char *path, Error **errp);
+
+void file_start_outgoing_migration(MigrationState *s, const char *path,
+                                   Error **errp);
+
+int file_open_pages_fd(QEMUFile *f, bool direct, Error **errp);
+int file_write_at(int fd, const void *buf, size_t len, off_t pos);
+int file_read_at(int fd, void *buf, size_t len, off_t pos);
+
 void rdma_start_outgoing_migration(void *opaque, const char *host_port, Error **errp);
 
 void rdma_start_incoming_migration(const char *host_port, Error **errp);
@@ -223,6 +232,9 @@ void migrate_compress_threads_create(void);
 void migrate_compress_threads_join(void);
 void migrate_decompress_threads_create(void);
 void migrate_decompress_threads_join(void);
+void migrate_load_threads_create(void);
+void migrate_load_threads_join(void);
+void ram_prefault_incoming(void);
 uint64_t ram_bytes_remaining(void);
 uint64_t ram_bytes_transferred(void);
 uint64_t ram_bytes_total(void);
@@ -267,6 +279,11 @@ void migrate_del_blocker(Error *reason);
 
 bool migrate_postcopy_ram(void);
 bool migrate_zero_blocks(void);
+bool migrate_use_mapped_ram(void);
+bool migrate_use_direct_io(void);
+int migrate_mapped_ram_threads(void);
+bool migrate_dirty_limit(void);
+int64_t migrate_vcpu_dirty_limit(void);
 
 bool migrate_auto_converge(void);
 
@@ -281,8 +298,10 @@ int64_t xbzrle_cache_resize(int64_t new_size);
 
 bool migrate_use_compression(void);
 int migrate_compress_level(void);
+MigrationCompressMethod migrate_compress_method(void);
 int migrate_compress_threads(void);
 int migrate_decompress_threads(void);
+int migrate_load_threads(void);
 bool migrate_use_events(void);
 
 /* Sending on the return path - generic and then for each message type */
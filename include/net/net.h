@@ -45,6 +45,7 @@ typedef void (NetPoll)(NetClientState *, bool enable);
 typedef int (NetCanReceive)(NetClientState *);
 typedef ssize_t (NetReceive)(NetClientState *, const uint8_t *, size_t);
 typedef ssize_t (NetReceiveIOV)(NetClientState *, const struct iovec *, int);
+typedef int (NetReceiveIOVBatch)(NetClientState *, const NetPacketIOV *, int);
 typedef void (NetCleanup) (NetClientState *);
 typedef void (LinkStatusChanged)(NetClientState *);
 typedef void (NetClientDestructor)(NetClientState *);
@@ -64,6 +65,9 @@ typedef struct NetClientInfo {
     NetReceive *receive;
     NetReceive *receive_raw;
     NetReceiveIOV *receive_iov;
+    /* Optional; returns the number of packets consumed, stopping where
+     * receive_iov would have returned 0 */
+    NetReceiveIOVBatch *receive_iov_batch;
     NetCanReceive *can_receive;
     NetCleanup *cleanup;
     LinkStatusChanged *link_status_changed;
@@ -79,6 +83,16 @@ typedef struct NetClientInfo {
     SetVnetBE *set_vnet_be;
 } NetClientInfo;
 
+/* virtio-net header handling provided by a netfilter (filter-gro) on
+ * behalf of a backend that has no header support of its own.
+ */
+typedef struct NetVnetHdrEmulation {
+    bool enabled;       /* a filter adds and strips the headers */
+    bool active;        /* the peer asked for headers */
+    int len;
+    bool csum, tso4, tso6, ecn;
+} NetVnetHdrEmulation;
+
 struct NetClientState {
     NetClientInfo *info;
     int link_down;
@@ -93,6 +107,7 @@ struct NetClientState {
     unsigned int queue_index;
     unsigned rxfilter_notify_enabled:1;
     QTAILQ_HEAD(NetFilterHead, NetFilterState) filters;
+    NetVnetHdrEmulation vnet_hdr_emu;
 };
 
 typedef struct NICState {
@@ -130,6 +145,8 @@ ssize_t qemu_sendv_packet(NetClientState *nc, const struct iovec *iov,
                           int iovcnt);
 ssize_t qemu_sendv_packet_async(NetClientState *nc, const struct iovec *iov,
                                 int iovcnt, NetPacketSent *sent_cb);
+int qemu_sendv_packet_batch_async(NetClientState *nc, const NetPacketIOV *pkts,
+                                  int count, NetPacketSent *sent_cb);
 void qemu_send_packet(NetClientState *nc, const uint8_t *buf, int size);
 ssize_t qemu_send_packet_raw(NetClientState *nc, const uint8_t *buf, int size);
 ssize_t qemu_send_packet_async(NetClientState *nc, const uint8_t *buf,
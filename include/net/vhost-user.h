@@ -13,5 +13,6 @@
 
 struct vhost_net;
 struct vhost_net *vhost_user_get_vhost_net(NetClientState *nc);
+void vhost_user_reset_inflight(NetClientState *nc);
 
 #endif /* VHOST_USER_H_ */
@@ -74,6 +74,8 @@ struct CharDriverState {
     void (*chr_set_echo)(struct CharDriverState *chr, bool echo);
     void (*chr_set_fe_open)(struct CharDriverState *chr, int fe_open);
     void (*chr_fe_event)(struct CharDriverState *chr, int event);
+    int (*chr_wait_connected)(struct CharDriverState *chr, Error **errp);
+    void (*chr_disconnect)(struct CharDriverState *chr);
     void *opaque;
     char *label;
     char *filename;
@@ -305,6 +307,25 @@ int qemu_chr_fe_get_msgfds(CharDriverState *s, int *fds, int num);
  */
 int qemu_chr_fe_set_msgfds(CharDriverState *s, int *fds, int num);
 
+/**
+ * @qemu_chr_wait_connected:
+ *
+ * Block until a connection-oriented backend has a peer, accepting or
+ * connecting synchronously as needed.  Other backends return at once.
+ *
+ * Returns: -1 if the connection could not be established, 0 on success.
+ */
+int qemu_chr_wait_connected(CharDriverState *chr, Error **errp);
+
+/**
+ * @qemu_chr_disconnect:
+ *
+ * Drop the current peer of a connection-oriented backend.  A listening
+ * socket goes back to accepting, a client with reconnect= set schedules
+ * a new connection attempt.  Other backends ignore the request.
+ */
+void qemu_chr_disconnect(CharDriverState *chr);
+
 /**
  * @qemu_chr_fe_claim:
  *
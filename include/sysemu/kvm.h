@@ -214,6 +214,14 @@ int kvm_has_many_ioeventfds(void);
 int kvm_has_gsi_routing(void);
 int kvm_has_intx_set_mask(void);
 
+/**
+ * kvm_dirty_ring_enabled:
+ *
+ * Returns: true if KVM reports dirty pages through per-vCPU rings, so that
+ * CPUState::dirty_pages is maintained.
+ */
+bool kvm_dirty_ring_enabled(void);
+
 int kvm_init_vcpu(CPUState *cpu);
 int kvm_cpu_exec(CPUState *cpu);
 
@@ -20,6 +20,10 @@ typedef struct KVMSlot
     void *ram;
     int slot;
     int flags;
+    /* Dirty log fetched by the last KVM_GET_DIRTY_LOG and not yet cleared
+     * (only used with manual dirty log protection).
+     */
+    unsigned long *dirty_bmap;
 } KVMSlot;
 
 typedef struct KVMMemoryListener {
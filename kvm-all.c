@@ -60,6 +60,7 @@
 #endif
 
 #define KVM_MSI_HASHTAB_SIZE    256
+#define KVM_MAX_ADDRESS_SPACES  2
 
 struct KVMState
 {
@@ -80,6 +81,10 @@ struct KVMState
 #endif
     int many_ioeventfds;
     int intx_set_mask;
+    bool manual_dirty_log_protect;
+    /* Entries in each vcpu's dirty ring, 0 if the dirty bitmap is used */
+    uint32_t dirty_ring_size;
+    uint32_t dirty_ring_bytes;
     /* The man page (and posix) say ioctl numbers are signed int, but
      * they're not.  Linux, glibc and *BSD all treat ioctl numbers as
      * unsigned, and treating them as signed here can break things */
@@ -94,6 +99,8 @@ struct KVMState
     QTAILQ_HEAD(msi_hashtab, KVMMSIRoute) msi_hashtab[KVM_MSI_HASHTAB_SIZE];
 #endif
     KVMMemoryListener memory_listener;
+    /* Memory listener of each KVM address space, indexed by as_id */
+    KVMMemoryListener *as_listeners[KVM_MAX_ADDRESS_SPACES];
 };
 
 KVMState *kvm_state;
@@ -275,6 +282,19 @@ int kvm_init_vcpu(CPUState *cpu)
             (void *)cpu->kvm_run + s->coalesced_mmio * PAGE_SIZE;
     }
 
+    if (s->dirty_ring_size) {
+        cpu->kvm_dirty_gfns = mmap(NULL, s->dirty_ring_bytes,
+                                   PROT_READ | PROT_WRITE, MAP_SHARED,
+                                   cpu->kvm_fd,
+                                   PAGE_SIZE * KVM_DIRTY_LOG_PAGE_OFFSET);
+        if (cpu->kvm_dirty_gfns == MAP_FAILED) {
+            ret = -errno;
+            cpu->kvm_dirty_gfns = NULL;
+            DPRINTF("mmap'ing vcpu dirty ring failed\n");
+            goto err;
+        }
+    }
+
     ret = kvm_arch_init_vcpu(cpu);
 err:
     return ret;
@@ -376,6 +396,136 @@ static int kvm_get_dirty_pages_log_range(MemoryRegionSection *section,
 
 #define ALIGN(x, y)  (((x)+(y)-1) & ~((y)-1))
 
+/*
+ * Dirty ring support
+ *
+ * With KVM_CAP_DIRTY_LOG_RING each vcpu pushes the pages it dirties to its
+ * own ring instead of a per-slot bitmap, so that dirty pages can also be
+ * accounted to the vcpu that wrote them.  Rings are harvested with the
+ * iothread lock held, either when the dirty log is synced or when a vcpu
+ * exits because its ring is full.
+ */
+static inline bool dirty_gfn_is_dirtied(struct kvm_dirty_gfn *gfn)
+{
+    return atomic_read(&gfn->flags) == KVM_DIRTY_GFN_F_DIRTY;
+}
+
+static inline void dirty_gfn_set_collected(struct kvm_dirty_gfn *gfn)
+{
+    /* The entry must be consumed before handing it back to KVM */
+    smp_mb();
+    atomic_set(&gfn->flags, KVM_DIRTY_GFN_F_RESET);
+}
+
+static void kvm_dirty_ring_mark_page(KVMState *s, uint32_t as_id,
+                                     uint32_t slot_id, uint64_t offset)
+{
+    KVMMemoryListener *kml;
+    KVMSlot *mem;
+    ram_addr_t ram_addr;
+    uint64_t psize = getpagesize();
+
+    if (as_id >= KVM_MAX_ADDRESS_SPACES || slot_id >= s->nr_slots) {
+        return;
+    }
+    kml = s->as_listeners[as_id];
+    if (!kml) {
+        return;
+    }
+    mem = &kml->slots[slot_id];
+    if (!mem->memory_size || offset * psize >= mem->memory_size) {
+        return;
+    }
+    if (!qemu_ram_addr_from_host(mem->ram + offset * psize, &ram_addr)) {
+        return;
+    }
+    cpu_physical_memory_set_dirty_range(ram_addr, psize,
+                                        tcg_enabled() ? DIRTY_CLIENTS_ALL
+                                                      : DIRTY_CLIENTS_NOCODE);
+}
+
+static uint32_t kvm_dirty_ring_reap_one(KVMState *s, CPUState *cpu)
+{
+    struct kvm_dirty_gfn *dirty_gfns = cpu->kvm_dirty_gfns, *cur;
+    uint32_t fetch = cpu->kvm_fetch_index;
+    uint32_t count = 0;
+
+    while (count < s->dirty_ring_size) {
+        cur = &dirty_gfns[fetch & (s->dirty_ring_size - 1)];
+        if (!dirty_gfn_is_dirtied(cur)) {
+            break;
+        }
+        smp_rmb();
+        kvm_dirty_ring_mark_page(s, cur->slot >> 16, cur->slot & 0xffff,
+                                 cur->offset);
+        dirty_gfn_set_collected(cur);
+        fetch++;
+        count++;
+    }
+    cpu->kvm_fetch_index = fetch;
+    cpu->dirty_pages += count;
+
+    return count;
+}
+
+/* Must be called with the iothread lock held */
+static uint64_t kvm_dirty_ring_reap(KVMState *s)
+{
+    CPUState *cpu;
+    uint64_t total = 0;
+    int ret;
+
+    CPU_FOREACH(cpu) {
+        if (cpu->kvm_dirty_gfns) {
+            total += kvm_dirty_ring_reap_one(s, cpu);
+        }
+    }
+
+    if (total) {
+        ret = kvm_vm_ioctl(s, KVM_RESET_DIRTY_RINGS);
+        if (ret < 0) {
+            error_report("%s: KVM_RESET_DIRTY_RINGS failed: %s", __func__,
+                         strerror(-ret));
+            abort();
+        }
+    }
+    trace_kvm_dirty_ring_reap(total);
+
+    return total;
+}
+
+static int kvm_dirty_ring_init(KVMState *s, uint32_t ring_size)
+{
+    uint64_t ring_bytes = (uint64_t)ring_size * sizeof(struct kvm_dirty_gfn);
+    int max_bytes, ret;
+
+    max_bytes = kvm_vm_check_extension(s, KVM_CAP_DIRTY_LOG_RING);
+    if (max_bytes <= 0) {
+        error_report("KVM dirty ring not supported by the host kernel");
+        return -EINVAL;
+    }
+    if (ring_bytes > max_bytes) {
+        error_report("KVM dirty ring size %" PRIu32 " too big (maximum is %zu)",
+                     ring_size, max_bytes / sizeof(struct kvm_dirty_gfn));
+        return -EINVAL;
+    }
+
+    ret = kvm_vm_enable_cap(s, KVM_CAP_DIRTY_LOG_RING, 0, ring_bytes);
+    if (ret < 0) {
+        error_report("Enabling of KVM dirty ring failed: %s", strerror(-ret));
+        return ret;
+    }
+
+    s->dirty_ring_size = ring_size;
+    s->dirty_ring_bytes = ring_bytes;
+    return 0;
+}
+
+bool kvm_dirty_ring_enabled(void)
+{
+    return kvm_state && kvm_state->dirty_ring_size;
+}
+
 /**
  * kvm_physical_sync_dirty_bitmap - Grab dirty bitmap from kernel space
  * This function updates qemu's dirty bitmap using
@@ -391,12 +541,18 @@ static int kvm_physical_sync_dirty_bitmap(KVMMemoryListener *kml,
     KVMState *s = kvm_state;
     unsigned long size, allocated_size = 0;
     struct kvm_dirty_log d = {};
+    void *buf = NULL;
     KVMSlot *mem;
     int ret = 0;
     hwaddr start_addr = section->offset_within_address_space;
     hwaddr end_addr = start_addr + int128_get64(section->size);
 
-    d.dirty_bitmap = NULL;
+    if (s->dirty_ring_size) {
+        /* Rings are not per slot; harvest everything */
+        kvm_dirty_ring_reap(s);
+        return 0;
+    }
+
     while (start_addr < end_addr) {
         mem = kvm_lookup_overlapping_slot(kml, start_addr, end_addr);
         if (mem == NULL) {
@@ -417,13 +573,25 @@ static int kvm_physical_sync_dirty_bitmap(KVMMemoryListener *kml,
          */
         size = ALIGN(((mem->memory_size) >> TARGET_PAGE_BITS),
                      /*HOST_LONG_BITS*/ 64) / 8;
-        if (!d.dirty_bitmap) {
-            d.dirty_bitmap = g_malloc(size);
-        } else if (size > allocated_size) {
-            d.dirty_bitmap = g_realloc(d.dirty_bitmap, size);
+        if (s->manual_dirty_log_protect) {
+            /* The log is not reset by KVM_GET_DIRTY_LOG; remember what
+             * was fetched so that kvm_physical_log_clear() only re-protects
+             * pages whose dirtiness has already been reported.
+             */
+            if (!mem->dirty_bmap) {
+                mem->dirty_bmap = g_malloc0(size);
+            }
+            d.dirty_bitmap = mem->dirty_bmap;
+        } else {
+            if (!buf) {
+                buf = g_malloc(size);
+            } else if (size > allocated_size) {
+                buf = g_realloc(buf, size);
+            }
+            allocated_size = size;
+            memset(buf, 0, allocated_size);
+            d.dirty_bitmap = buf;
         }
-        allocated_size = size;
-        memset(d.dirty_bitmap, 0, allocated_size);
 
         d.slot = mem->slot | (kml->as_id << 16);
         if (kvm_vm_ioctl(s, KVM_GET_DIRTY_LOG, &d) == -1) {
@@ -435,7 +603,89 @@ static int kvm_physical_sync_dirty_bitmap(KVMMemoryListener *kml,
         kvm_get_dirty_pages_log_range(section, d.dirty_bitmap);
         start_addr = mem->start_addr + mem->memory_size;
     }
-    g_free(d.dirty_bitmap);
+    g_free(buf);
+
+    return ret;
+}
+
+/**
+ * kvm_physical_log_clear - Clear and write-protect part of the dirty log
+ *
+ * With manual dirty log protection, pages reported dirty by
+ * KVM_GET_DIRTY_LOG stay writable until they are explicitly cleared.
+ * Doing that lazily, one chunk at a time right before the chunk is
+ * migrated, avoids write-protecting all of guest memory at every sync.
+ *
+ * Only the pages that were reported by the last sync are cleared;
+ * pages dirtied after it must stay set in the kernel bitmap.
+ */
+static int kvm_physical_log_clear(KVMMemoryListener *kml,
+                                  MemoryRegionSection *section)
+{
+    KVMState *s = kvm_state;
+    struct kvm_clear_dirty_log d = {};
+    uint64_t psize = getpagesize();
+    hwaddr start = section->offset_within_address_space;
+    hwaddr end = start + int128_get64(section->size);
+    KVMSlot *mem;
+    int ret = 0;
+
+    if (!s->manual_dirty_log_protect) {
+        return 0;
+    }
+
+    while (start < end) {
+        uint64_t slot_pages, first, last, bmap_start, bmap_npages, i;
+        unsigned long *bmap_clear;
+
+        mem = kvm_lookup_overlapping_slot(kml, start, end);
+        if (mem == NULL) {
+            break;
+        }
+        if (!mem->dirty_bmap) {
+            /* Never synced, so there is nothing to clear */
+            start = mem->start_addr + mem->memory_size;
+            continue;
+        }
+
+        slot_pages = mem->memory_size / psize;
+        first = (MAX(start, mem->start_addr) - mem->start_addr) / psize;
+        last = DIV_ROUND_UP(MIN(end, mem->start_addr + mem->memory_size) -
+                            mem->start_addr, psize);
+
+        /* KVM wants the range to be 64-page aligned, except at the end
+         * of the slot.  Bits outside [first, last) are left at zero, so
+         * those pages are untouched.
+         */
+        bmap_start = first & ~63ULL;
+        bmap_npages = MIN(ALIGN(last - bmap_start, 64), slot_pages - bmap_start);
+
+        bmap_clear = bitmap_new(bmap_npages);
+        for (i = find_next_bit(mem->dirty_bmap, last, first); i < last;
+             i = find_next_bit(mem->dirty_bmap, last, i + 1)) {
+            set_bit(i - bmap_start, bmap_clear);
+        }
+
+        if (!bitmap_empty(bmap_clear, bmap_npages)) {
+            d.slot = mem->slot | (kml->as_id << 16);
+            d.first_page = bmap_start;
+            d.num_pages = bmap_npages;
+            d.dirty_bitmap = bmap_clear;
+            if (kvm_vm_ioctl(s, KVM_CLEAR_DIRTY_LOG, &d) == -1) {
+                DPRINTF("ioctl failed %d\n", errno);
+                ret = -1;
+            } else {
+                bitmap_clear(mem->dirty_bmap, first, last - first);
+            }
+        }
+        trace_kvm_clear_dirty_log(mem->slot, first, last - first);
+        g_free(bmap_clear);
+
+        if (ret < 0) {
+            break;
+        }
+        start = mem->start_addr + mem->memory_size;
+    }
 
     return ret;
 }
@@ -691,6 +941,8 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
 
         /* unregister the overlapping slot */
         mem->memory_size = 0;
+        g_free(mem->dirty_bmap);
+        mem->dirty_bmap = NULL;
         err = kvm_set_user_memory_region(kml, mem);
         if (err) {
             fprintf(stderr, "%s: error unregistering overlapping slot: %s\n",
@@ -819,6 +1071,20 @@ static void kvm_log_sync(MemoryListener *listener,
     }
 }
 
+static void kvm_log_clear(MemoryListener *listener,
+                          MemoryRegionSection *section)
+{
+    KVMMemoryListener *kml = container_of(listener, KVMMemoryListener, listener);
+    int r;
+
+    r = kvm_physical_log_clear(kml, section);
+    if (r < 0) {
+        error_report("%s: kvm log clear failed: %s", __func__,
+                     strerror(errno));
+        abort();
+    }
+}
+
 static void kvm_mem_ioeventfd_add(MemoryListener *listener,
                                   MemoryRegionSection *section,
                                   bool match_data, uint64_t data,
@@ -895,6 +1161,8 @@ void kvm_memory_listener_register(KVMState *s, KVMMemoryListener *kml,
 
     kml->slots = g_malloc0(s->nr_slots * sizeof(KVMSlot));
     kml->as_id = as_id;
+    assert(as_id < KVM_MAX_ADDRESS_SPACES);
+    s->as_listeners[as_id] = kml;
 
     for (i = 0; i < s->nr_slots; i++) {
         kml->slots[i].slot = i;
@@ -905,6 +1173,7 @@ void kvm_memory_listener_register(KVMState *s, KVMMemoryListener *kml,
     kml->listener.log_start = kvm_log_start;
     kml->listener.log_stop = kvm_log_stop;
     kml->listener.log_sync = kvm_log_sync;
+    kml->listener.log_clear = kvm_log_clear;
     kml->listener.priority = 10;
 
     memory_listener_register(&kml->listener, as);
@@ -1642,6 +1911,31 @@ static int kvm_init(MachineState *ms)
     kvm_ioeventfd_any_length_allowed =
         (kvm_check_extension(s, KVM_CAP_IOEVENTFD_ANY_LENGTH) > 0);
 
+    if (machine_kvm_dirty_ring_size(ms)) {
+        ret = kvm_dirty_ring_init(s, machine_kvm_dirty_ring_size(ms));
+        if (ret < 0) {
+            goto err;
+        }
+    }
+
+    /* With manual protection, KVM_GET_DIRTY_LOG neither resets the log
+     * nor write-protects the reported pages; this is done in chunks by
+     * KVM_CLEAR_DIRTY_LOG when the migration code is about to send them.
+     * It does not apply to the dirty ring.
+     */
+    if (!s->dirty_ring_size &&
+        (kvm_check_extension(s, KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2) &
+         KVM_DIRTY_LOG_MANUAL_PROTECT_ENABLE)) {
+        ret = kvm_vm_enable_cap(s, KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2, 0,
+                                KVM_DIRTY_LOG_MANUAL_PROTECT_ENABLE);
+        if (ret < 0) {
+            error_report("Enabling of KVM dirty log manual protection "
+                         "failed: %s", strerror(-ret));
+        } else {
+            s->manual_dirty_log_protect = true;
+        }
+    }
+
     ret = kvm_arch_init(ms, s);
     if (ret < 0) {
         goto err;
@@ -1916,6 +2210,13 @@ int kvm_cpu_exec(CPUState *cpu)
                 break;
             }
             break;
+        case KVM_EXIT_DIRTY_RING_FULL:
+            DPRINTF("dirty ring full\n");
+            qemu_mutex_lock_iothread();
+            kvm_dirty_ring_reap(kvm_state);
+            qemu_mutex_unlock_iothread();
+            ret = 0;
+            break;
         default:
             DPRINTF("kvm_arch_handle_exit\n");
             ret = kvm_arch_handle_exit(cpu, run);
@@ -59,6 +59,11 @@ int kvm_cpu_exec(CPUState *cpu)
     abort();
 }
 
+bool kvm_dirty_ring_enabled(void)
+{
+    return false;
+}
+
 int kvm_has_sync_mmu(void)
 {
     return 0;
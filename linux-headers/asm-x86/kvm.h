@@ -105,6 +105,7 @@ struct kvm_ioapic_state {
 #define KVM_IRQCHIP_PIC_SLAVE    1
 #define KVM_IRQCHIP_IOAPIC       2
 #define KVM_NR_IRQCHIPS          3
+#define KVM_DIRTY_LOG_PAGE_OFFSET 64
 
 #define KVM_RUN_X86_SMM		 (1 << 0)
 
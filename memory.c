@@ -36,6 +36,7 @@ static unsigned memory_region_transaction_depth;
 static bool memory_region_update_pending;
 static bool ioeventfd_update_pending;
 static bool global_dirty_log = false;
+static unsigned global_dirty_log_users;
 
 static QTAILQ_HEAD(memory_listeners, MemoryListener) memory_listeners
     = QTAILQ_HEAD_INITIALIZER(memory_listeners);
@@ -289,6 +290,25 @@ static void flatview_destroy(FlatView *view)
     g_free(view);
 }
 
+static bool flatview_equal(FlatView *a, FlatView *b)
+{
+    unsigned i;
+
+    if (a == b) {
+        return true;
+    }
+    if (a->nr != b->nr) {
+        return false;
+    }
+    for (i = 0; i < a->nr; i++) {
+        if (!flatrange_equal(&a->ranges[i], &b->ranges[i])
+            || a->ranges[i].dirty_log_mask != b->ranges[i].dirty_log_mask) {
+            return false;
+        }
+    }
+    return true;
+}
+
 static void flatview_ref(FlatView *view)
 {
     atomic_inc(&view->ref);
@@ -696,6 +716,54 @@ static void render_memory_region(FlatView *view,
     }
 }
 
+/* Find the region that the FlatView of an address space rooted at @mr
+ * really depends on.  Most address spaces are a chain of containers and
+ * aliases wrapped around a shared region (e.g. one bus master alias per
+ * PCI device on top of system memory); skipping the wrappers lets them
+ * all share a single FlatView.  A wrapper can only be skipped if rendering
+ * through it is a no-op: it must sit at address zero, must not be read-only
+ * and must not clip what it contains.  Returns NULL if the view is empty.
+ */
+static MemoryRegion *memory_region_get_flatview_root(MemoryRegion *mr)
+{
+    while (mr->enabled) {
+        if (mr->addr || mr->readonly) {
+            return mr;
+        }
+        if (mr->alias) {
+            if (!mr->alias_offset && !mr->alias->addr
+                && int128_ge(mr->size, mr->alias->size)) {
+                mr = mr->alias;
+                continue;
+            }
+        } else if (!mr->terminates) {
+            MemoryRegion *child, *next = NULL;
+            unsigned found = 0;
+
+            QTAILQ_FOREACH(child, &mr->subregions, subregions_link) {
+                if (child->enabled) {
+                    if (++found > 1) {
+                        next = NULL;
+                        break;
+                    }
+                    if (!child->addr && int128_ge(mr->size, child->size)) {
+                        next = child;
+                    }
+                }
+            }
+            if (found == 0) {
+                return NULL;
+            }
+            if (next) {
+                mr = next;
+                continue;
+            }
+        }
+        return mr;
+    }
+    return NULL;
+}
+
 /* Render a memory topology into a list of disjoint absolute ranges. */
 static FlatView *generate_memory_topology(MemoryRegion *mr)
 {
@@ -875,13 +943,28 @@ static void address_space_update_topology_pass(AddressSpace *as,
 }
 
 
-static void address_space_update_topology(AddressSpace *as)
+/* @views caches the FlatViews generated during this transaction, keyed by
+ * the region returned by memory_region_get_flatview_root().
+ */
+static void address_space_update_topology(AddressSpace *as, GHashTable *views)
 {
+    MemoryRegion *root = memory_region_get_flatview_root(as->root);
     FlatView *old_view = address_space_get_flatview(as);
-    FlatView *new_view = generate_memory_topology(as->root);
+    FlatView *new_view = g_hash_table_lookup(views, root);
 
-    address_space_update_topology_pass(as, old_view, new_view, false);
-    address_space_update_topology_pass(as, old_view, new_view, true);
+    if (!new_view) {
+        new_view = generate_memory_topology(root);
+        g_hash_table_insert(views, root, new_view);
+    }
+    flatview_ref(new_view);
+
+    /* Listeners only hear about address spaces whose view changed; in
+     * particular, the dispatch tables of the others are kept as they are.
+     */
+    if (!flatview_equal(old_view, new_view)) {
+        address_space_update_topology_pass(as, old_view, new_view, false);
+        address_space_update_topology_pass(as, old_view, new_view, true);
+    }
 
     /* Writes are protected by the BQL.  */
     atomic_rcu_set(&as->current_map, new_view);
@@ -913,18 +996,23 @@ static void memory_region_clear_pending(void)
 void memory_region_transaction_commit(void)
 {
     AddressSpace *as;
+    GHashTable *views;
 
     assert(memory_region_transaction_depth);
     --memory_region_transaction_depth;
     if (!memory_region_transaction_depth) {
         if (memory_region_update_pending) {
+            views = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                                          (GDestroyNotify) flatview_unref);
+
             MEMORY_LISTENER_CALL_GLOBAL(begin, Forward);
 
             QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
-                address_space_update_topology(as);
+                address_space_update_topology(as, views);
             }
 
             MEMORY_LISTENER_CALL_GLOBAL(commit, Forward);
+            g_hash_table_destroy(views);
         } else if (ioeventfd_update_pending) {
             QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
                 address_space_update_ioeventfds(as);
@@ -1582,9 +1670,15 @@ void memory_region_set_dirty(MemoryRegion *mr, hwaddr addr,
 bool memory_region_test_and_clear_dirty(MemoryRegion *mr, hwaddr addr,
                                         hwaddr size, unsigned client)
 {
+    bool dirty;
+
     assert(mr->ram_block);
-    return cpu_physical_memory_test_and_clear_dirty(
+    dirty = cpu_physical_memory_test_and_clear_dirty(
                 memory_region_get_ram_addr(mr) + addr, size, client);
+    if (dirty) {
+        memory_region_clear_dirty_bitmap(mr, addr, size);
+    }
+    return dirty;
 }
 
 
@@ -1604,6 +1698,58 @@ void memory_region_sync_dirty_bitmap(MemoryRegion *mr)
     }
 }
 
+void memory_region_clear_dirty_bitmap(MemoryRegion *mr, hwaddr start,
+                                      hwaddr len)
+{
+    MemoryListener *listener;
+    AddressSpace *as;
+    FlatView *view;
+    FlatRange *fr;
+    bool needed = false;
+
+    QTAILQ_FOREACH(listener, &memory_listeners, link) {
+        if (listener->log_clear) {
+            needed = true;
+            break;
+        }
+    }
+    if (!needed) {
+        return;
+    }
+
+    QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+        view = address_space_get_flatview(as);
+        FOR_EACH_FLAT_RANGE(fr, view) {
+            MemoryRegionSection section;
+            hwaddr sec_start, sec_end;
+
+            if (fr->mr != mr || !fr->dirty_log_mask) {
+                continue;
+            }
+
+            sec_start = MAX(fr->offset_in_region, start);
+            sec_end = MIN(fr->offset_in_region + int128_get64(fr->addr.size),
+                          start + len);
+            if (sec_start >= sec_end) {
+                continue;
+            }
+
+            section = (MemoryRegionSection) {
+                .mr = mr,
+                .address_space = as,
+                .offset_within_region = sec_start,
+                .size = int128_make64(sec_end - sec_start),
+                .offset_within_address_space =
+                    int128_get64(fr->addr.start) +
+                    (sec_start - fr->offset_in_region),
+                .readonly = fr->readonly,
+            };
+            MEMORY_LISTENER_CALL(log_clear, Forward, &section);
+        }
+        flatview_unref(view);
+    }
+}
+
 void memory_region_set_readonly(MemoryRegion *mr, bool readonly)
 {
     if (mr->readonly != readonly) {
@@ -1628,8 +1774,10 @@ void memory_region_reset_dirty(MemoryRegion *mr, hwaddr addr,
                                hwaddr size, unsigned client)
 {
     assert(mr->ram_block);
-    cpu_physical_memory_test_and_clear_dirty(
-        memory_region_get_ram_addr(mr) + addr, size, client);
+    if (cpu_physical_memory_test_and_clear_dirty(
+            memory_region_get_ram_addr(mr) + addr, size, client)) {
+        memory_region_clear_dirty_bitmap(mr, addr, size);
+    }
 }
 
 int memory_region_get_fd(MemoryRegion *mr)
@@ -2119,6 +2267,9 @@ void address_space_sync_dirty_bitmap(AddressSpace *as)
 
 void memory_global_dirty_log_start(void)
 {
+    if (global_dirty_log_users++) {
+        return;
+    }
     global_dirty_log = true;
 
     MEMORY_LISTENER_CALL_GLOBAL(log_global_start, Forward);
@@ -2131,6 +2282,9 @@ void memory_global_dirty_log_start(void)
 
 void memory_global_dirty_log_stop(void)
 {
+    if (!global_dirty_log_users || --global_dirty_log_users) {
+        return;
+    }
     global_dirty_log = false;
 
     /* Refresh DIRTY_LOG_MIGRATION bit.  */
@@ -2224,6 +2378,13 @@ void address_space_init(AddressSpace *as, MemoryRegion *root, const char *name)
     flatview_init(as->current_map);
     as->ioeventfd_nb = 0;
     as->ioeventfds = NULL;
+    as->max_bounce_buffer_size = DEFAULT_MAX_BOUNCE_BUFFER_SIZE;
+    as->bounce_buffer_size = 0;
+    qemu_mutex_init(&as->map_client_list_lock);
+    QLIST_INIT(&as->map_client_list);
+    QLIST_INIT(&as->bounce_buffers);
+    as->dma_direct_bytes = 0;
+    as->dma_bounced_bytes = 0;
     QTAILQ_INSERT_TAIL(&address_spaces, as, address_spaces_link);
     as->name = g_strdup(name ? name : "anonymous");
     address_space_init_dispatch(as);
@@ -2242,6 +2403,10 @@ static void do_address_space_destroy(AddressSpace *as)
         assert(listener->address_space_filter != as);
     }
 
+    assert(atomic_read(&as->bounce_buffer_size) == 0);
+    assert(QLIST_EMPTY(&as->map_client_list));
+    qemu_mutex_destroy(&as->map_client_list_lock);
+
     flatview_unref(as->current_map);
     g_free(as->name);
     g_free(as->ioeventfds);
@@ -2425,6 +2590,22 @@ void mtree_info(fprintf_function mon_printf, void *f)
     }
 }
 
+void address_space_dma_info(fprintf_function mon_printf, void *f)
+{
+    AddressSpace *as;
+
+    QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+        mon_printf(f, "address-space: %s\n", as->name);
+        mon_printf(f, "  bounce buffers: %zu/%zu bytes in use\n",
+                   atomic_read(&as->bounce_buffer_size),
+                   as->max_bounce_buffer_size);
+        mon_printf(f, "  direct: %" PRIu64 " bytes, bounced: %" PRIu64
+                   " bytes\n",
+                   atomic_read(&as->dma_direct_bytes),
+                   atomic_read(&as->dma_bounced_bytes));
+    }
+}
+
 static const TypeInfo memory_region_info = {
     .parent             = TYPE_OBJECT,
     .name               = TYPE_MEMORY_REGION,
@@ -0,0 +1,253 @@
+/*
+ * Migration page compression codecs
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu/osdep.h"
+#include <zlib.h>
+#ifdef CONFIG_LZO
+#include <lzo/lzo1x.h>
+#endif
+#ifdef CONFIG_SNAPPY
+#include <snappy-c.h>
+#endif
+#ifdef CONFIG_LZ4
+#include <lz4.h>
+#endif
+#include "qemu-common.h"
+#include "migration/compress.h"
+
+typedef struct MigrationCompressOps {
+    size_t (*bound)(size_t len);
+    size_t wrkmem_size;
+    ssize_t (*compress)(MigrationCompressCtx *ctx, uint8_t *dst,
+                        size_t dst_len, const uint8_t *src, size_t len);
+    ssize_t (*decompress)(uint8_t *dst, size_t dst_len,
+                          const uint8_t *src, size_t len);
+} MigrationCompressOps;
+
+struct MigrationCompressCtx {
+    const MigrationCompressOps *ops;
+    int level;
+    void *wrkmem;
+};
+
+static size_t zlib_bound(size_t len)
+{
+    return compressBound(len);
+}
+
+static ssize_t zlib_compress(MigrationCompressCtx *ctx, uint8_t *dst,
+                             size_t dst_len, const uint8_t *src, size_t len)
+{
+    uLongf blen = dst_len;
+
+    if (compress2(dst, &blen, src, len, ctx->level) != Z_OK) {
+        return -1;
+    }
+    return blen;
+}
+
+static ssize_t zlib_decompress(uint8_t *dst, size_t dst_len,
+                               const uint8_t *src, size_t len)
+{
+    uLongf dlen = dst_len;
+
+    if (uncompress(dst, &dlen, src, len) != Z_OK) {
+        return -1;
+    }
+    return dlen;
+}
+
+static const MigrationCompressOps zlib_ops = {
+    .bound = zlib_bound,
+    .compress = zlib_compress,
+    .decompress = zlib_decompress,
+};
+
+#ifdef CONFIG_LZO
+static size_t lzo_bound(size_t len)
+{
+    /* See the LZO FAQ; incompressible data grows by a small amount */
+    return len + len / 16 + 64 + 3;
+}
+
+static ssize_t lzo_compress(MigrationCompressCtx *ctx, uint8_t *dst,
+                            size_t dst_len, const uint8_t *src, size_t len)
+{
+    lzo_uint blen = dst_len;
+
+    if (dst_len < lzo_bound(len) ||
+        lzo1x_1_compress(src, len, dst, &blen, ctx->wrkmem) != LZO_E_OK) {
+        return -1;
+    }
+    return blen;
+}
+
+static ssize_t lzo_decompress(uint8_t *dst, size_t dst_len,
+                              const uint8_t *src, size_t len)
+{
+    lzo_uint dlen = dst_len;
+
+    if (lzo1x_decompress_safe(src, len, dst, &dlen, NULL) != LZO_E_OK) {
+        return -1;
+    }
+    return dlen;
+}
+
+static const MigrationCompressOps lzo_ops = {
+    .bound = lzo_bound,
+    .wrkmem_size = LZO1X_1_MEM_COMPRESS,
+    .compress = lzo_compress,
+    .decompress = lzo_decompress,
+};
+#endif
+
+#ifdef CONFIG_SNAPPY
+static size_t snappy_bound(size_t len)
+{
+    return snappy_max_compressed_length(len);
+}
+
+static ssize_t snappy_compress_page(MigrationCompressCtx *ctx, uint8_t *dst,
+                                    size_t dst_len, const uint8_t *src,
+                                    size_t len)
+{
+    size_t blen = dst_len;
+
+    if (snappy_compress((const char *)src, len, (char *)dst,
+                        &blen) != SNAPPY_OK) {
+        return -1;
+    }
+    return blen;
+}
+
+static ssize_t snappy_decompress_page(uint8_t *dst, size_t dst_len,
+                                      const uint8_t *src, size_t len)
+{
+    size_t dlen = dst_len;
+
+    if (snappy_uncompress((const char *)src, len, (char *)dst,
+                          &dlen) != SNAPPY_OK) {
+        return -1;
+    }
+    return dlen;
+}
+
+static const MigrationCompressOps snappy_ops = {
+    .bound = snappy_bound,
+    .compress = snappy_compress_page,
+    .decompress = snappy_decompress_page,
+};
+#endif
+
+#ifdef CONFIG_LZ4
+static size_t lz4_bound(size_t len)
+{
+    return LZ4_compressBound(len);
+}
+
+static ssize_t lz4_compress(MigrationCompressCtx *ctx, uint8_t *dst,
+                            size_t dst_len, const uint8_t *src, size_t len)
+{
+    int blen;
+
+    blen = LZ4_compress_default((const char *)src, (char *)dst, len, dst_len);
+    return blen > 0 ? blen : -1;
+}
+
+static ssize_t lz4_decompress(uint8_t *dst, size_t dst_len,
+                              const uint8_t *src, size_t len)
+{
+    int dlen;
+
+    dlen = LZ4_decompress_safe((const char *)src, (char *)dst, len, dst_len);
+    return dlen >= 0 ? dlen : -1;
+}
+
+static const MigrationCompressOps lz4_ops = {
+    .bound = lz4_bound,
+    .compress = lz4_compress,
+    .decompress = lz4_decompress,
+};
+#endif
+
+static const MigrationCompressOps *
+compress_ops[MIGRATION_COMPRESS_METHOD__MAX] = {
+    [MIGRATION_COMPRESS_METHOD_ZLIB] = &zlib_ops,
+#ifdef CONFIG_LZO
+    [MIGRATION_COMPRESS_METHOD_LZO] = &lzo_ops,
+#endif
+#ifdef CONFIG_SNAPPY
+    [MIGRATION_COMPRESS_METHOD_SNAPPY] = &snappy_ops,
+#endif
+#ifdef CONFIG_LZ4
+    [MIGRATION_COMPRESS_METHOD_LZ4] = &lz4_ops,
+#endif
+};
+
+bool migration_compress_supported(MigrationCompressMethod method)
+{
+    return method < MIGRATION_COMPRESS_METHOD__MAX && compress_ops[method];
+}
+
+size_t migration_compress_bound(MigrationCompressMethod method, size_t len)
+{
+    size_t bound = 0;
+    int i;
+
+    if (method != MIGRATION_COMPRESS_METHOD__MAX) {
+        return compress_ops[method]->bound(len);
+    }
+    for (i = 0; i < MIGRATION_COMPRESS_METHOD__MAX; i++) {
+        if (compress_ops[i]) {
+            bound = MAX(bound, compress_ops[i]->bound(len));
+        }
+    }
+    return bound;
+}
+
+MigrationCompressCtx *migration_compress_ctx_new(MigrationCompressMethod method,
+                                                 int level)
+{
+    MigrationCompressCtx *ctx = g_new0(MigrationCompressCtx, 1);
+
+    assert(migration_compress_supported(method));
+#ifdef CONFIG_LZO
+    if (method == MIGRATION_COMPRESS_METHOD_LZO) {
+        lzo_init();
+    }
+#endif
+    ctx->ops = compress_ops[method];
+    ctx->level = level;
+    if (ctx->ops->wrkmem_size) {
+        ctx->wrkmem = g_malloc(ctx->ops->wrkmem_size);
+    }
+    return ctx;
+}
+
+void migration_compress_ctx_free(MigrationCompressCtx *ctx)
+{
+    if (ctx) {
+        g_free(ctx->wrkmem);
+        g_free(ctx);
+    }
+}
+
+ssize_t migration_compress(MigrationCompressCtx *ctx, uint8_t *dst,
+                           size_t dst_len, const uint8_t *src, size_t len)
+{
+    return ctx->ops->compress(ctx, dst, dst_len, src, len);
+}
+
+ssize_t migration_decompress(MigrationCompressMethod method, uint8_t *dst,
+                             size_t dst_len, const uint8_t *src, size_t len)
+{
+    if (!migration_compress_supported(method)) {
+        return -1;
+    }
+    return compress_ops[method]->decompress(dst, dst_len, src, len);
+}
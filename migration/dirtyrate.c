@@ -0,0 +1,550 @@
+/*
+ * Dirty page rate measurement and per-vCPU dirty page rate limits
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu/osdep.h"
+#include <zlib.h>
+#include "qemu-common.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qerror.h"
+#include "qmp-commands.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "qemu/main-loop.h"
+#include "qemu/rcu_queue.h"
+#include "qom/cpu.h"
+#include "sysemu/sysemu.h"
+#include "sysemu/kvm.h"
+#include "exec/memory.h"
+#include "exec/address-spaces.h"
+#include "exec/ram_addr.h"
+#include "migration/dirtyrate.h"
+#include "trace.h"
+
+#define DIRTYRATE_MIN_CALC_TIME         1
+#define DIRTYRATE_MAX_CALC_TIME         60
+#define DIRTYRATE_MIN_SAMPLE_PAGES      128
+#define DIRTYRATE_MAX_SAMPLE_PAGES      4096
+#define DIRTYRATE_DEFAULT_SAMPLE_PAGES  512
+
+/* How often the dirty limit controller re-evaluates the vCPU rates */
+#define DIRTYLIMIT_PERIOD_MS            1000
+
+static uint64_t dirty_bytes_to_mbps(uint64_t bytes, int64_t ms)
+{
+    if (ms <= 0) {
+        return 0;
+    }
+    return bytes * 1000 / ms / (1024 * 1024);
+}
+
+/*
+ * Dirty page rate measurement.
+ *
+ * The guest-wide rate is estimated by hashing a random sample of pages of
+ * every RAMBlock, and counting how many of them changed at the end of the
+ * measurement.  This works with every accelerator, and does not need dirty
+ * logging.  Counting per vCPU needs the accelerator to tell which vCPU
+ * dirtied a page, which only the KVM dirty ring does.
+ */
+
+typedef struct DirtyRateBlock {
+    char *idstr;
+    ram_addr_t used_length;
+    unsigned int npages;
+    ram_addr_t *offsets;
+    uint32_t *hashes;
+} DirtyRateBlock;
+
+static struct {
+    QemuThread thread;
+    bool thread_created;
+    /* Fields below are protected by the iothread lock */
+    DirtyRateStatus status;
+    int64_t start_time;
+    int64_t calc_time;
+    int64_t sample_pages;
+    int64_t dirty_rate;
+    int nr_vcpus;
+    int64_t *vcpu_index;
+    int64_t *vcpu_rate;
+} dirtyrate;
+
+static uint32_t dirtyrate_hash_page(RAMBlock *block, ram_addr_t offset)
+{
+    return crc32(0, block->host + offset, TARGET_PAGE_SIZE);
+}
+
+/* Called with rcu_read_lock held */
+static DirtyRateBlock *dirtyrate_sample_blocks(int64_t sample_pages,
+                                               int *nr_blocks)
+{
+    DirtyRateBlock *blocks = NULL;
+    RAMBlock *block;
+    int n = 0;
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        DirtyRateBlock *b;
+        uint64_t total = block->used_length >> TARGET_PAGE_BITS;
+        uint64_t npages;
+        unsigned int i;
+
+        if (!total) {
+            continue;
+        }
+        /* sample_pages per GB, but at least one page of every block */
+        npages = (block->used_length * sample_pages) >> 30;
+        npages = MIN(MAX(npages, 1), total);
+
+        blocks = g_renew(DirtyRateBlock, blocks, n + 1);
+        b = &blocks[n++];
+        b->idstr = g_strdup(block->idstr);
+        b->used_length = block->used_length;
+        b->npages = npages;
+        b->offsets = g_new(ram_addr_t, npages);
+        b->hashes = g_new(uint32_t, npages);
+        for (i = 0; i < npages; i++) {
+            b->offsets[i] = (ram_addr_t)(g_random_int() % total)
+                            << TARGET_PAGE_BITS;
+            b->hashes[i] = dirtyrate_hash_page(block, b->offsets[i]);
+        }
+    }
+
+    *nr_blocks = n;
+    return blocks;
+}
+
+/* Called with rcu_read_lock held; returns the estimated dirty bytes */
+static uint64_t dirtyrate_compare_blocks(DirtyRateBlock *blocks,
+                                         int nr_blocks)
+{
+    uint64_t dirty_bytes = 0;
+    RAMBlock *block;
+    int i;
+
+    for (i = 0; i < nr_blocks; i++) {
+        DirtyRateBlock *b = &blocks[i];
+        uint64_t changed = 0;
+        unsigned int j;
+
+        QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+            if (!strcmp(block->idstr, b->idstr)) {
+                break;
+            }
+        }
+        /* Skip blocks that were removed or resized meanwhile */
+        if (!block || block->used_length != b->used_length) {
+            continue;
+        }
+        for (j = 0; j < b->npages; j++) {
+            if (dirtyrate_hash_page(block, b->offsets[j]) != b->hashes[j]) {
+                changed++;
+            }
+        }
+        dirty_bytes += changed * b->used_length / b->npages;
+    }
+
+    return dirty_bytes;
+}
+
+static void dirtyrate_free_blocks(DirtyRateBlock *blocks, int nr_blocks)
+{
+    int i;
+
+    for (i = 0; i < nr_blocks; i++) {
+        g_free(blocks[i].idstr);
+        g_free(blocks[i].offsets);
+        g_free(blocks[i].hashes);
+    }
+    g_free(blocks);
+}
+
+static void *dirtyrate_thread(void *opaque)
+{
+    bool per_vcpu = kvm_dirty_ring_enabled();
+    uint64_t *vcpu_start = NULL;
+    DirtyRateBlock *blocks;
+    int nr_blocks, i;
+    int64_t start_ms, elapsed_ms;
+    uint64_t dirty_bytes;
+    CPUState *cpu;
+
+    rcu_register_thread();
+
+    qemu_mutex_lock_iothread();
+    rcu_read_lock();
+    blocks = dirtyrate_sample_blocks(dirtyrate.sample_pages, &nr_blocks);
+    rcu_read_unlock();
+
+    if (per_vcpu) {
+        memory_global_dirty_log_start();
+        /* Reap what is already in the rings so it isn't counted */
+        address_space_sync_dirty_bitmap(&address_space_memory);
+        vcpu_start = g_new0(uint64_t, max_cpus);
+        CPU_FOREACH(cpu) {
+            vcpu_start[cpu->cpu_index] = cpu->dirty_pages;
+        }
+    }
+    start_ms = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    qemu_mutex_unlock_iothread();
+
+    g_usleep(dirtyrate.calc_time * 1000 * 1000);
+
+    qemu_mutex_lock_iothread();
+    elapsed_ms = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - start_ms;
+
+    g_free(dirtyrate.vcpu_index);
+    g_free(dirtyrate.vcpu_rate);
+    dirtyrate.vcpu_index = NULL;
+    dirtyrate.vcpu_rate = NULL;
+    dirtyrate.nr_vcpus = 0;
+    if (per_vcpu) {
+        address_space_sync_dirty_bitmap(&address_space_memory);
+        dirtyrate.vcpu_index = g_new(int64_t, max_cpus);
+        dirtyrate.vcpu_rate = g_new(int64_t, max_cpus);
+        CPU_FOREACH(cpu) {
+            uint64_t pages = cpu->dirty_pages - vcpu_start[cpu->cpu_index];
+
+            i = dirtyrate.nr_vcpus++;
+            dirtyrate.vcpu_index[i] = cpu->cpu_index;
+            dirtyrate.vcpu_rate[i] =
+                dirty_bytes_to_mbps(pages * TARGET_PAGE_SIZE, elapsed_ms);
+        }
+        memory_global_dirty_log_stop();
+        g_free(vcpu_start);
+    }
+
+    rcu_read_lock();
+    dirty_bytes = dirtyrate_compare_blocks(blocks, nr_blocks);
+    rcu_read_unlock();
+    dirtyrate_free_blocks(blocks, nr_blocks);
+
+    dirtyrate.dirty_rate = dirty_bytes_to_mbps(dirty_bytes, elapsed_ms);
+    dirtyrate.status = DIRTY_RATE_STATUS_MEASURED;
+    trace_dirtyrate_calc(dirtyrate.dirty_rate, elapsed_ms);
+    qemu_mutex_unlock_iothread();
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+void qmp_calc_dirty_rate(int64_t calc_time, bool has_sample_pages,
+                         int64_t sample_pages, Error **errp)
+{
+    if (dirtyrate.status == DIRTY_RATE_STATUS_MEASURING) {
+        error_setg(errp, "A dirty page rate measurement is already running");
+        return;
+    }
+    if (calc_time < DIRTYRATE_MIN_CALC_TIME ||
+        calc_time > DIRTYRATE_MAX_CALC_TIME) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "calc-time",
+                   "an integer in the range of 1 to 60");
+        return;
+    }
+    if (!has_sample_pages) {
+        sample_pages = DIRTYRATE_DEFAULT_SAMPLE_PAGES;
+    } else if (sample_pages < DIRTYRATE_MIN_SAMPLE_PAGES ||
+               sample_pages > DIRTYRATE_MAX_SAMPLE_PAGES) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "sample-pages",
+                   "an integer in the range of 128 to 4096");
+        return;
+    }
+
+    /* The previous measurement has completed, reclaim its thread */
+    if (dirtyrate.thread_created) {
+        qemu_thread_join(&dirtyrate.thread);
+    }
+
+    dirtyrate.status = DIRTY_RATE_STATUS_MEASURING;
+    dirtyrate.start_time = qemu_clock_get_ms(QEMU_CLOCK_HOST) / 1000;
+    dirtyrate.calc_time = calc_time;
+    dirtyrate.sample_pages = sample_pages;
+    qemu_thread_create(&dirtyrate.thread, "dirtyrate", dirtyrate_thread,
+                       NULL, QEMU_THREAD_JOINABLE);
+    dirtyrate.thread_created = true;
+}
+
+DirtyRateInfo *qmp_query_dirty_rate(Error **errp)
+{
+    DirtyRateInfo *info = g_new0(DirtyRateInfo, 1);
+    DirtyRateVcpuList *head = NULL, **tail = &head;
+    int i;
+
+    info->status = dirtyrate.status;
+    info->start_time = dirtyrate.start_time;
+    info->calc_time = dirtyrate.calc_time;
+    info->sample_pages = dirtyrate.sample_pages;
+
+    if (dirtyrate.status != DIRTY_RATE_STATUS_MEASURED) {
+        return info;
+    }
+
+    info->has_dirty_rate = true;
+    info->dirty_rate = dirtyrate.dirty_rate;
+    for (i = 0; i < dirtyrate.nr_vcpus; i++) {
+        DirtyRateVcpuList *entry = g_new0(DirtyRateVcpuList, 1);
+
+        entry->value = g_new0(DirtyRateVcpu, 1);
+        entry->value->cpu_index = dirtyrate.vcpu_index[i];
+        entry->value->dirty_rate = dirtyrate.vcpu_rate[i];
+        *tail = entry;
+        tail = &entry->next;
+    }
+    info->has_vcpu_dirty_rate = head != NULL;
+    info->vcpu_dirty_rate = head;
+
+    return info;
+}
+
+/*
+ * Per-vCPU dirty page rate limits.
+ *
+ * Every DIRTYLIMIT_PERIOD_MS the dirty rings are reaped and the dirty page
+ * rate of each vCPU over the period is computed.  A vCPU above its limit
+ * gets a throttle percentage from cpu_throttle_set_vcpu(), sized so that
+ * the rate it would reach unthrottled is brought down to the limit; the
+ * other vCPUs keep running at full speed.
+ *
+ * All of the state below is protected by the iothread lock.
+ */
+
+typedef struct VcpuDirtyLimit {
+    uint64_t limit;         /* MB/s, 0 if the vCPU is not limited */
+    uint64_t rate;          /* MB/s over the last period */
+    uint64_t last_pages;    /* cpu->dirty_pages at the start of the period */
+    uint64_t user_limit;    /* limit to restore when migration is done */
+} VcpuDirtyLimit;
+
+static struct {
+    VcpuDirtyLimit *vcpu;   /* indexed by cpu_index */
+    int nr_limited;
+    bool by_migration;
+    QEMUTimer *timer;
+    int64_t last_time;
+} dirtylimit;
+
+static void dirtylimit_adjust(CPUState *cpu, VcpuDirtyLimit *v)
+{
+    int pct = atomic_read(&cpu->throttle_percentage);
+    uint64_t unthrottled;
+    int target;
+
+    /* The rate the vCPU would reach if it were not sleeping */
+    unthrottled = v->rate * 100 / (100 - pct);
+    if (unthrottled <= v->limit) {
+        target = 0;
+    } else {
+        target = 100 - v->limit * 100 / unthrottled;
+    }
+
+    /* Throttle up at once, but back off gradually to avoid oscillating */
+    if (target < pct) {
+        target = (pct + target) / 2;
+    }
+
+    if (target != pct) {
+        trace_dirtylimit_adjust(cpu->cpu_index, v->rate, v->limit, target);
+        cpu_throttle_set_vcpu(cpu, target);
+    }
+}
+
+static void dirtylimit_update_rates(int64_t now)
+{
+    int64_t period = now - dirtylimit.last_time;
+    CPUState *cpu;
+
+    address_space_sync_dirty_bitmap(&address_space_memory);
+    CPU_FOREACH(cpu) {
+        VcpuDirtyLimit *v = &dirtylimit.vcpu[cpu->cpu_index];
+        uint64_t pages = cpu->dirty_pages - v->last_pages;
+
+        v->last_pages = cpu->dirty_pages;
+        v->rate = dirty_bytes_to_mbps(pages * TARGET_PAGE_SIZE, period);
+    }
+    dirtylimit.last_time = now;
+}
+
+static void dirtylimit_timer_tick(void *opaque)
+{
+    int64_t now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    CPUState *cpu;
+
+    dirtylimit_update_rates(now);
+    CPU_FOREACH(cpu) {
+        VcpuDirtyLimit *v = &dirtylimit.vcpu[cpu->cpu_index];
+
+        if (v->limit) {
+            dirtylimit_adjust(cpu, v);
+        }
+    }
+
+    timer_mod(dirtylimit.timer, now + DIRTYLIMIT_PERIOD_MS);
+}
+
+static VcpuDirtyLimit *dirtylimit_vcpu(CPUState *cpu)
+{
+    if (!dirtylimit.vcpu) {
+        dirtylimit.vcpu = g_new0(VcpuDirtyLimit, max_cpus);
+    }
+    return &dirtylimit.vcpu[cpu->cpu_index];
+}
+
+static void dirtylimit_set_vcpu(CPUState *cpu, uint64_t limit)
+{
+    VcpuDirtyLimit *v = dirtylimit_vcpu(cpu);
+
+    if (!v->limit && limit) {
+        dirtylimit.nr_limited++;
+    } else if (v->limit && !limit) {
+        dirtylimit.nr_limited--;
+        cpu_throttle_set_vcpu(cpu, 0);
+    }
+    v->limit = limit;
+}
+
+/* Start or stop the controller depending on whether any vCPU is limited */
+static void dirtylimit_state_update(void)
+{
+    int64_t now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+
+    if (dirtylimit.nr_limited && !dirtylimit.timer) {
+        memory_global_dirty_log_start();
+        /* Pages dirtied before the limit was set don't count */
+        dirtylimit.last_time = now;
+        dirtylimit_update_rates(now);
+        dirtylimit.timer = timer_new_ms(QEMU_CLOCK_REALTIME,
+                                        dirtylimit_timer_tick, NULL);
+        timer_mod(dirtylimit.timer, now + DIRTYLIMIT_PERIOD_MS);
+    } else if (!dirtylimit.nr_limited && dirtylimit.timer) {
+        timer_del(dirtylimit.timer);
+        timer_free(dirtylimit.timer);
+        dirtylimit.timer = NULL;
+        memory_global_dirty_log_stop();
+    }
+}
+
+/* While migration limits the vCPUs, only record the limit for later */
+static void dirtylimit_set_user(CPUState *cpu, uint64_t limit)
+{
+    if (dirtylimit.by_migration) {
+        dirtylimit_vcpu(cpu)->user_limit = limit;
+    } else {
+        dirtylimit_set_vcpu(cpu, limit);
+    }
+}
+
+static void dirtylimit_set(bool has_cpu_index, int64_t cpu_index,
+                           uint64_t limit, Error **errp)
+{
+    CPUState *cpu;
+
+    if (!kvm_dirty_ring_enabled()) {
+        error_setg(errp, "Dirty page rate limits require KVM with "
+                   "-machine kvm-dirty-ring-size");
+        return;
+    }
+
+    if (has_cpu_index) {
+        cpu = qemu_get_cpu(cpu_index);
+        if (!cpu) {
+            error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "cpu-index",
+                       "a CPU number");
+            return;
+        }
+        dirtylimit_set_user(cpu, limit);
+    } else {
+        CPU_FOREACH(cpu) {
+            dirtylimit_set_user(cpu, limit);
+        }
+    }
+    dirtylimit_state_update();
+}
+
+void qmp_set_vcpu_dirty_limit(bool has_cpu_index, int64_t cpu_index,
+                              int64_t dirty_rate, Error **errp)
+{
+    if (dirty_rate < 1) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "dirty-rate",
+                   "a positive integer");
+        return;
+    }
+    dirtylimit_set(has_cpu_index, cpu_index, dirty_rate, errp);
+}
+
+void qmp_cancel_vcpu_dirty_limit(bool has_cpu_index, int64_t cpu_index,
+                                 Error **errp)
+{
+    dirtylimit_set(has_cpu_index, cpu_index, 0, errp);
+}
+
+DirtyLimitInfoList *qmp_query_vcpu_dirty_limit(Error **errp)
+{
+    DirtyLimitInfoList *head = NULL, **tail = &head;
+    CPUState *cpu;
+
+    if (!dirtylimit.nr_limited) {
+        return NULL;
+    }
+
+    CPU_FOREACH(cpu) {
+        VcpuDirtyLimit *v = &dirtylimit.vcpu[cpu->cpu_index];
+        DirtyLimitInfoList *entry;
+
+        if (!v->limit) {
+            continue;
+        }
+        entry = g_new0(DirtyLimitInfoList, 1);
+        entry->value = g_new0(DirtyLimitInfo, 1);
+        entry->value->cpu_index = cpu->cpu_index;
+        entry->value->limit_rate = v->limit;
+        entry->value->current_rate = v->rate;
+        entry->value->throttle_percentage =
+            atomic_read(&cpu->throttle_percentage);
+        *tail = entry;
+        tail = &entry->next;
+    }
+
+    return head;
+}
+
+void dirtylimit_migration_start(uint64_t limit)
+{
+    CPUState *cpu;
+
+    if (dirtylimit.by_migration) {
+        return;
+    }
+
+    /* Migration takes over from any limits the user set, which are put back
+     * by dirtylimit_migration_stop() */
+    CPU_FOREACH(cpu) {
+        VcpuDirtyLimit *v = dirtylimit_vcpu(cpu);
+
+        v->user_limit = v->limit;
+        dirtylimit_set_vcpu(cpu, limit);
+    }
+    dirtylimit.by_migration = true;
+    dirtylimit_state_update();
+}
+
+void dirtylimit_migration_stop(void)
+{
+    CPUState *cpu;
+
+    if (!dirtylimit.by_migration) {
+        return;
+    }
+
+    CPU_FOREACH(cpu) {
+        VcpuDirtyLimit *v = dirtylimit_vcpu(cpu);
+
+        dirtylimit_set_vcpu(cpu, v->user_limit);
+        v->user_limit = 0;
+    }
+    dirtylimit.by_migration = false;
+    dirtylimit_state_update();
+}
@@ -0,0 +1,167 @@
+/*
+ * QEMU live migration to/from a regular file
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qemu/main-loop.h"
+#include "qapi/error.h"
+#include "migration/migration.h"
+#include "migration/qemu-file.h"
+
+//#define DEBUG_MIGRATION_FILE
+
+#ifdef DEBUG_MIGRATION_FILE
+#define DPRINTF(fmt, ...) \
+    do { printf("migration-file: " fmt, ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...) \
+    do { } while (0)
+#endif
+
+/* Path of the file currently used by an incoming or outgoing migration,
+ * needed to open extra descriptors (e.g. O_DIRECT) for the RAM pages.
+ */
+static char *file_migration_path;
+
+static void file_set_path(const char *path)
+{
+    g_free(file_migration_path);
+    file_migration_path = g_strdup(path);
+}
+
+/*
+ * Open a second descriptor on the migration file that @f streams to or
+ * from.  It is used by the fixed-offset ("mapped-ram") RAM format, which
+ * reads and writes pages with pread/pwrite from several threads, possibly
+ * bypassing the page cache.
+ *
+ * Returns the new descriptor, or -1 with @errp set.
+ */
+int file_open_pages_fd(QEMUFile *f, bool direct, Error **errp)
+{
+    int flags = qemu_file_is_writable(f) ? O_WRONLY : O_RDONLY;
+    int fd;
+
+    if (!file_migration_path) {
+        error_setg(errp, "Fixed-offset RAM requires the 'file:' protocol");
+        return -1;
+    }
+
+    if (direct) {
+#ifdef O_DIRECT
+        flags |= O_DIRECT;
+#else
+        error_setg(errp, "O_DIRECT is not supported on this host");
+        return -1;
+#endif
+    }
+
+    fd = qemu_open(file_migration_path, flags);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "failed to open '%s'",
+                         file_migration_path);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Read or write exactly @len bytes at offset @pos of @fd, retrying on short
+ * transfers.  Safe to call from several threads on the same descriptor.
+ *
+ * Returns 0 on success or a negative errno.
+ */
+static int file_pio(int fd, uint8_t *buf, size_t len, off_t pos, bool write)
+{
+#ifdef _WIN32
+    return -ENOTSUP;
+#else
+    while (len) {
+        ssize_t ret;
+
+        if (write) {
+            ret = pwrite(fd, buf, len, pos);
+        } else {
+            ret = pread(fd, buf, len, pos);
+        }
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        if (ret == 0) {
+            /* End of file when reading */
+            return -EIO;
+        }
+        buf += ret;
+        pos += ret;
+        len -= ret;
+    }
+    return 0;
+#endif
+}
+
+int file_write_at(int fd, const void *buf, size_t len, off_t pos)
+{
+    return file_pio(fd, (uint8_t *)buf, len, pos, true);
+}
+
+int file_read_at(int fd, void *buf, size_t len, off_t pos)
+{
+    return file_pio(fd, buf, len, pos, false);
+}
+
+void file_start_outgoing_migration(MigrationState *s, const char *path,
+                                   Error **errp)
+{
+    int fd;
+
+    DPRINTF("Attempting to start an outgoing migration to %s\n", path);
+
+    fd = qemu_open(path, O_WRONLY | O_CREAT | O_TRUNC, 0660);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "failed to open '%s'", path);
+        return;
+    }
+
+    file_set_path(path);
+    s->to_dst_file = qemu_fdopen(fd, "wb");
+    migrate_fd_connect(s);
+}
+
+static void file_accept_incoming_migration(void *opaque)
+{
+    QEMUFile *f = opaque;
+
+    qemu_set_fd_handler(qemu_get_fd(f), NULL, NULL, NULL);
+    process_incoming_migration(f);
+}
+
+void file_start_incoming_migration(const char *path, Error **errp)
+{
+    QEMUFile *f;
+    int fd;
+
+    DPRINTF("Attempting to start an incoming migration from %s\n", path);
+
+    fd = qemu_open(path, O_RDONLY);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "failed to open '%s'", path);
+        return;
+    }
+
+    f = qemu_fdopen(fd, "rb");
+    if (f == NULL) {
+        error_setg_errno(errp, errno, "failed to open the source file");
+        close(fd);
+        return;
+    }
+
+    file_set_path(path);
+    qemu_set_fd_handler(fd, file_accept_incoming_migration, NULL, f);
+}
@@ -34,6 +34,9 @@
 #include "qom/cpu.h"
 #include "exec/memory.h"
 #include "exec/address-spaces.h"
+#include "sysemu/kvm.h"
+#include "migration/dirtyrate.h"
+#include "migration/compress.h"
 
 #define MAX_THROTTLE  (32 << 20)      /* Migration transfer speed throttling */
 
@@ -52,6 +55,12 @@
 /* Define default autoconverge cpu throttle migration parameters */
 #define DEFAULT_MIGRATE_X_CPU_THROTTLE_INITIAL 20
 #define DEFAULT_MIGRATE_X_CPU_THROTTLE_INCREMENT 10
+/* Default thread count for fixed-offset RAM page I/O */
+#define DEFAULT_MIGRATE_X_MAPPED_RAM_THREADS 4
+/* Default per-vCPU dirty page rate limit (MB/s) for the dirty-limit throttle */
+#define DEFAULT_MIGRATE_X_VCPU_DIRTY_LIMIT 1
+/* By default incoming pages are written by the main thread */
+#define DEFAULT_MIGRATE_X_LOAD_THREADS 0
 
 /* Migration XBZRLE default cache size */
 #define DEFAULT_MIGRATE_CACHE_SIZE (64 * 1024 * 1024)
@@ -91,6 +100,14 @@ MigrationState *migrate_get_current(void)
                 DEFAULT_MIGRATE_X_CPU_THROTTLE_INITIAL,
         .parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT] =
                 DEFAULT_MIGRATE_X_CPU_THROTTLE_INCREMENT,
+        .parameters[MIGRATION_PARAMETER_X_MAPPED_RAM_THREADS] =
+                DEFAULT_MIGRATE_X_MAPPED_RAM_THREADS,
+        .parameters[MIGRATION_PARAMETER_X_VCPU_DIRTY_LIMIT] =
+                DEFAULT_MIGRATE_X_VCPU_DIRTY_LIMIT,
+        .parameters[MIGRATION_PARAMETER_X_COMPRESS_METHOD] =
+                MIGRATION_COMPRESS_METHOD_ZLIB,
+        .parameters[MIGRATION_PARAMETER_X_LOAD_THREADS] =
+                DEFAULT_MIGRATE_X_LOAD_THREADS,
     };
 
     if (!once) {
@@ -302,6 +319,10 @@ void qemu_start_incoming_migration(const char *uri, Error **errp)
     const char *p;
 
     qapi_event_send_migration(MIGRATION_STATUS_SETUP, &error_abort);
+    if (strcmp(uri, "defer")) {
+        /* Fault in huge pages while the source is still setting up */
+        ram_prefault_incoming();
+    }
     if (!strcmp(uri, "defer")) {
         deferred_incoming_migration(errp);
     } else if (strstart(uri, "tcp:", &p)) {
@@ -317,6 +338,8 @@ void qemu_start_incoming_migration(const char *uri, Error **errp)
         unix_start_incoming_migration(p, errp);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_incoming_migration(p, errp);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_incoming_migration(p, errp);
 #endif
     } else {
         error_setg(errp, "unknown migration protocol: %s", uri);
@@ -335,6 +358,7 @@ static void process_incoming_migration_bh(void *opaque)
                           MIGRATION_STATUS_FAILED);
         error_report_err(local_err);
         migrate_decompress_threads_join();
+        migrate_load_threads_join();
         exit(EXIT_FAILURE);
     }
 
@@ -359,6 +383,7 @@ static void process_incoming_migration_bh(void *opaque)
         runstate_set(global_state_get_runstate());
     }
     migrate_decompress_threads_join();
+    migrate_load_threads_join();
     /*
      * This must happen after any state changes since as soon as an external
      * observer sees this event they might start to prod at the VM assuming
@@ -412,6 +437,7 @@ static void process_incoming_migration_co(void *opaque)
                           MIGRATION_STATUS_FAILED);
         error_report("load of migration failed: %s", strerror(-ret));
         migrate_decompress_threads_join();
+        migrate_load_threads_join();
         exit(EXIT_FAILURE);
     }
 
@@ -426,6 +452,7 @@ void process_incoming_migration(QEMUFile *f)
 
     assert(fd != -1);
     migrate_decompress_threads_create();
+    migrate_load_threads_create();
     qemu_set_nonblock(fd);
     qemu_coroutine_enter(co, f);
 }
@@ -525,6 +552,14 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
             s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INITIAL];
     params->x_cpu_throttle_increment =
             s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT];
+    params->x_mapped_ram_threads =
+            s->parameters[MIGRATION_PARAMETER_X_MAPPED_RAM_THREADS];
+    params->x_vcpu_dirty_limit =
+            s->parameters[MIGRATION_PARAMETER_X_VCPU_DIRTY_LIMIT];
+    params->x_compress_method =
+            s->parameters[MIGRATION_PARAMETER_X_COMPRESS_METHOD];
+    params->x_load_threads =
+            s->parameters[MIGRATION_PARAMETER_X_LOAD_THREADS];
 
     return params;
 }
@@ -710,6 +745,34 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
                 false;
         }
     }
+
+    if (migrate_use_mapped_ram()) {
+        if (migrate_postcopy_ram() || migrate_use_xbzrle() ||
+            migrate_use_compression()) {
+            /* Pages are stored in place in the file; there is no stream
+             * position for an XBZRLE delta or a compressed page to go to,
+             * and there is no destination to fault pages from.
+             */
+            error_report("Fixed-offset RAM is not compatible with postcopy, "
+                         "xbzrle or compression");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_X_MAPPED_RAM] =
+                false;
+        }
+    }
+
+    if (migrate_dirty_limit()) {
+        if (migrate_auto_converge()) {
+            /* Both throttles drive the same per-vCPU sleep percentage */
+            error_report("Dirty limit is not compatible with auto-converge");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_X_DIRTY_LIMIT] =
+                false;
+        } else if (!kvm_dirty_ring_enabled()) {
+            error_report("Dirty limit requires the KVM dirty ring "
+                         "(-machine kvm-dirty-ring-size)");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_X_DIRTY_LIMIT] =
+                false;
+        }
+    }
 }
 
 void qmp_migrate_set_parameters(bool has_compress_level,
@@ -721,7 +784,16 @@ void qmp_migrate_set_parameters(bool has_compress_level,
                                 bool has_x_cpu_throttle_initial,
                                 int64_t x_cpu_throttle_initial,
                                 bool has_x_cpu_throttle_increment,
-                                int64_t x_cpu_throttle_increment, Error **errp)
+                                int64_t x_cpu_throttle_increment,
+                                bool has_x_mapped_ram_threads,
+                                int64_t x_mapped_ram_threads,
+                                bool has_x_vcpu_dirty_limit,
+                                int64_t x_vcpu_dirty_limit,
+                                bool has_x_compress_method,
+                                MigrationCompressMethod x_compress_method,
+                                bool has_x_load_threads,
+                                int64_t x_load_threads,
+                                Error **errp)
 {
     MigrationState *s = migrate_get_current();
 
@@ -756,6 +828,33 @@ void qmp_migrate_set_parameters(bool has_compress_level,
                    "x_cpu_throttle_increment",
                    "an integer in the range of 1 to 99");
     }
+    if (has_x_mapped_ram_threads &&
+            (x_mapped_ram_threads < 1 || x_mapped_ram_threads > 255)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_mapped_ram_threads",
+                   "is invalid, it should be in the range of 1 to 255");
+        return;
+    }
+    if (has_x_vcpu_dirty_limit && x_vcpu_dirty_limit < 1) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_vcpu_dirty_limit",
+                   "a positive integer");
+        return;
+    }
+    if (has_x_compress_method &&
+        !migration_compress_supported(x_compress_method)) {
+        error_setg(errp, "Compression method '%s' is not supported by "
+                   "this build",
+                   MigrationCompressMethod_lookup[x_compress_method]);
+        return;
+    }
+    if (has_x_load_threads &&
+            (x_load_threads < 0 || x_load_threads > 255)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_load_threads",
+                   "is invalid, it should be in the range of 0 to 255");
+        return;
+    }
 
     if (has_compress_level) {
         s->parameters[MIGRATION_PARAMETER_COMPRESS_LEVEL] = compress_level;
@@ -776,6 +875,21 @@ void qmp_migrate_set_parameters(bool has_compress_level,
         s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT] =
                                                     x_cpu_throttle_increment;
     }
+    if (has_x_mapped_ram_threads) {
+        s->parameters[MIGRATION_PARAMETER_X_MAPPED_RAM_THREADS] =
+                                                    x_mapped_ram_threads;
+    }
+    if (has_x_vcpu_dirty_limit) {
+        s->parameters[MIGRATION_PARAMETER_X_VCPU_DIRTY_LIMIT] =
+                                                    x_vcpu_dirty_limit;
+    }
+    if (has_x_compress_method) {
+        s->parameters[MIGRATION_PARAMETER_X_COMPRESS_METHOD] =
+                                                    x_compress_method;
+    }
+    if (has_x_load_threads) {
+        s->parameters[MIGRATION_PARAMETER_X_LOAD_THREADS] = x_load_threads;
+    }
 }
 
 void qmp_migrate_start_postcopy(Error **errp)
@@ -1023,6 +1137,11 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         return;
     }
 
+    if (migrate_use_mapped_ram() && !strstart(uri, "file:", NULL)) {
+        error_setg(errp, "x-mapped-ram requires the 'file:' protocol");
+        return;
+    }
+
     s = migrate_init(&params);
 
     if (strstart(uri, "tcp:", &p)) {
@@ -1038,6 +1157,8 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         unix_start_outgoing_migration(s, p, &local_err);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_outgoing_migration(s, p, &local_err);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_outgoing_migration(s, p, &local_err);
 #endif
     } else {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "uri",
@@ -1146,6 +1267,51 @@ bool migrate_zero_blocks(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_ZERO_BLOCKS];
 }
 
+bool migrate_use_mapped_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_MAPPED_RAM];
+}
+
+bool migrate_use_direct_io(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_DIRECT_IO];
+}
+
+int migrate_mapped_ram_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_X_MAPPED_RAM_THREADS];
+}
+
+bool migrate_dirty_limit(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_DIRTY_LIMIT];
+}
+
+int64_t migrate_vcpu_dirty_limit(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_X_VCPU_DIRTY_LIMIT];
+}
+
 bool migrate_use_compression(void)
 {
     MigrationState *s;
@@ -1164,6 +1330,24 @@ int migrate_compress_level(void)
     return s->parameters[MIGRATION_PARAMETER_COMPRESS_LEVEL];
 }
 
+MigrationCompressMethod migrate_compress_method(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_X_COMPRESS_METHOD];
+}
+
+int migrate_load_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_X_LOAD_THREADS];
+}
+
 int migrate_compress_threads(void)
 {
     MigrationState *s;
@@ -1741,6 +1925,8 @@ static void *migration_thread(void *opaque)
     end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
 
     qemu_mutex_lock_iothread();
+    /* Likewise drop any dirty page rate limits the dirty-limit throttle set */
+    dirtylimit_migration_stop();
     qemu_savevm_state_cleanup();
     if (s->state == MIGRATION_STATUS_COMPLETED) {
         uint64_t transferred_bytes = qemu_ftell(s->to_dst_file);
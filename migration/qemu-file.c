@@ -22,7 +22,6 @@
  * THE SOFTWARE.
  */
 #include "qemu/osdep.h"
-#include <zlib.h>
 #include "qemu-common.h"
 #include "qemu/error-report.h"
 #include "qemu/iov.h"
@@ -535,6 +534,46 @@ int64_t qemu_ftell(QEMUFile *f)
     return f->pos;
 }
 
+/*
+ * Reposition the file descriptor underneath a seekable QEMUFile (i.e. one
+ * backed by a regular file).  Pending output is flushed and unread input is
+ * discarded first, so @offset with SEEK_CUR is relative to the logical
+ * position of the stream.  The transfer position used for accounting
+ * (qemu_ftell) is not changed.
+ *
+ * Returns the new offset of the file, or a negative errno.
+ */
+int64_t qemu_file_seek(QEMUFile *f, int64_t offset, int whence)
+{
+    int fd = qemu_get_fd(f);
+    off_t ret;
+
+    if (fd == -1) {
+        return -ENOTSUP;
+    }
+
+    if (qemu_file_is_writable(f)) {
+        qemu_fflush(f);
+        ret = qemu_file_get_error(f);
+        if (ret < 0) {
+            return ret;
+        }
+    } else {
+        if (whence == SEEK_CUR) {
+            offset -= f->buf_size - f->buf_index;
+        }
+        f->buf_index = 0;
+        f->buf_size = 0;
+    }
+
+    ret = lseek(fd, offset, whence);
+    if (ret == (off_t)-1) {
+        ret = -errno;
+        qemu_file_set_error(f, ret);
+    }
+    return ret;
+}
+
 int qemu_file_rate_limit(QEMUFile *f)
 {
     if (qemu_file_get_error(f)) {
@@ -607,28 +646,6 @@ uint64_t qemu_get_be64(QEMUFile *f)
     return v;
 }
 
-/* compress size bytes of data start at p with specific compression
- * level and store the compressed data to the buffer of f.
- */
-
-ssize_t qemu_put_compression_data(QEMUFile *f, const uint8_t *p, size_t size,
-                                  int level)
-{
-    ssize_t blen = IO_BUF_SIZE - f->buf_index - sizeof(int32_t);
-
-    if (blen < compressBound(size)) {
-        return 0;
-    }
-    if (compress2(f->buf + f->buf_index + sizeof(int32_t), (uLongf *)&blen,
-                  (Bytef *)p, size, level) != Z_OK) {
-        error_report("Compress Failed!");
-        return 0;
-    }
-    qemu_put_be32(f, blen);
-    f->buf_index += blen;
-    return blen + sizeof(int32_t);
-}
-
 /* Put the data in the buffer of f_src to the buffer of f_des, and
  * then reset the buf_index of f_src to 0.
  */
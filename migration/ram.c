@@ -26,7 +26,6 @@
  * THE SOFTWARE.
  */
 #include "qemu/osdep.h"
-#include <zlib.h>
 #include "qapi-event.h"
 #include "qemu/bitops.h"
 #include "qemu/bitmap.h"
@@ -34,6 +33,8 @@
 #include "qemu/main-loop.h"
 #include "migration/migration.h"
 #include "migration/postcopy-ram.h"
+#include "migration/dirtyrate.h"
+#include "migration/compress.h"
 #include "exec/address-spaces.h"
 #include "migration/page_cache.h"
 #include "qemu/error-report.h"
@@ -65,6 +66,8 @@ static uint64_t bitmap_sync_count;
 #define RAM_SAVE_FLAG_XBZRLE   0x40
 /* 0x80 is reserved in migration.h start with 0x100 next */
 #define RAM_SAVE_FLAG_COMPRESS_PAGE    0x100
+/* Followed by a MigrationCompressMethod byte; absent means zlib */
+#define RAM_SAVE_FLAG_COMPRESS_METHOD  0x200
 
 static const uint8_t ZERO_TARGET_PAGE[TARGET_PAGE_SIZE];
 
@@ -257,6 +260,9 @@ struct CompressParam {
     QemuCond cond;
     RAMBlock *block;
     ram_addr_t offset;
+    MigrationCompressCtx *ctx;
+    uint8_t *compbuf;
+    size_t compbuf_len;
 };
 typedef struct CompressParam CompressParam;
 
@@ -282,6 +288,8 @@ static QemuCond *comp_done_cond;
 static const QEMUFileOps empty_ops = { };
 
 static bool compression_switch;
+static MigrationCompressMethod compress_method;
+static MigrationCompressMethod decompress_method;
 static bool quit_comp_thread;
 static bool quit_decomp_thread;
 static DecompressParam *decomp_param;
@@ -344,6 +352,8 @@ void migrate_compress_threads_join(void)
     for (i = 0; i < thread_count; i++) {
         qemu_thread_join(compress_threads + i);
         qemu_fclose(comp_param[i].file);
+        migration_compress_ctx_free(comp_param[i].ctx);
+        g_free(comp_param[i].compbuf);
         qemu_mutex_destroy(&comp_param[i].mutex);
         qemu_cond_destroy(&comp_param[i].cond);
     }
@@ -368,6 +378,7 @@ void migrate_compress_threads_create(void)
     }
     quit_comp_thread = false;
     compression_switch = true;
+    compress_method = migrate_compress_method();
     thread_count = migrate_compress_threads();
     compress_threads = g_new0(QemuThread, thread_count);
     comp_param = g_new0(CompressParam, thread_count);
@@ -380,6 +391,12 @@ void migrate_compress_threads_create(void)
          * it's ops to empty.
          */
         comp_param[i].file = qemu_fopen_ops(NULL, &empty_ops);
+        comp_param[i].ctx =
+            migration_compress_ctx_new(compress_method,
+                                       migrate_compress_level());
+        comp_param[i].compbuf_len =
+            migration_compress_bound(compress_method, TARGET_PAGE_SIZE);
+        comp_param[i].compbuf = g_malloc(comp_param[i].compbuf_len);
         comp_param[i].done = true;
         qemu_mutex_init(&comp_param[i].mutex);
         qemu_cond_init(&comp_param[i].cond);
@@ -389,6 +406,312 @@ void migrate_compress_threads_create(void)
     }
 }
 
+/*
+ * Fixed-offset RAM ("mapped-ram") file layout
+ *
+ * With the x-mapped-ram capability each RAMBlock owns a region of the
+ * migration file, reserved when the block list is sent during setup:
+ *
+ *   header: version, page size, bitmap offset, pages offset
+ *   bitmap: one bit per target page that is present in the file
+ *   pages:  page N of the block lives at pages_offset + N * TARGET_PAGE_SIZE
+ *
+ * The stream itself continues after the pages region.  Dirty pages are
+ * written in place with pwrite() by a pool of writer threads, so a page
+ * dirtied again overwrites its previous copy instead of growing the file.
+ * Zero pages are not written at all; they just clear their bitmap bit,
+ * and the bitmaps are written at the end of the migration.
+ *
+ * The bitmap is stored in little-endian bit order (bit N of byte M is page
+ * M * 8 + N), padded to a multiple of 8 bytes.
+ */
+#define MAPPED_RAM_HDR_VERSION 1
+#define MAPPED_RAM_HDR_SIZE (4 + 8 + 8 + 8)
+/* Alignment of each pages region, large enough for O_DIRECT */
+#define MAPPED_RAM_FILE_OFFSET_ALIGNMENT 0x100000
+/* Largest run of contiguous pages handed to a writer thread at once */
+#define MAPPED_RAM_MAX_BATCH 0x100000
+
+struct MappedRamParam {
+    bool start;
+    bool done;
+    QemuMutex mutex;
+    QemuCond cond;
+    RAMBlock *block;
+    ram_addr_t offset;
+    size_t len;
+};
+typedef struct MappedRamParam MappedRamParam;
+
+static struct {
+    /* Descriptor used for the page I/O, possibly O_DIRECT */
+    int fd;
+    int thread_count;
+    QemuThread *threads;
+    MappedRamParam *params;
+    bool quit;
+    /* done_cond wakes the migration thread when a writer is idle;
+     * done_lock also protects error.
+     */
+    QemuMutex done_lock;
+    QemuCond done_cond;
+    int error;
+    /* Run of contiguous dirty pages not yet handed to a writer */
+    RAMBlock *batch_block;
+    ram_addr_t batch_offset;
+    size_t batch_len;
+} mapped_ram = { .fd = -1 };
+
+static size_t mapped_ram_bitmap_size(RAMBlock *block)
+{
+    return DIV_ROUND_UP(block->used_length >> TARGET_PAGE_BITS, 64) *
+           sizeof(uint64_t);
+}
+
+/* Convert between the host bitmap and the file format; self-inverse */
+static void mapped_ram_bitmap_swap(unsigned long *bmap, size_t size)
+{
+    size_t i;
+
+    for (i = 0; i < size / sizeof(unsigned long); i++) {
+        if (sizeof(unsigned long) == 8) {
+            bmap[i] = cpu_to_le64(bmap[i]);
+        } else {
+            bmap[i] = cpu_to_le32(bmap[i]);
+        }
+    }
+}
+
+static void *do_mapped_ram_write(void *opaque)
+{
+    MappedRamParam *param = opaque;
+    int ret;
+
+    while (true) {
+        qemu_mutex_lock(&param->mutex);
+        while (!param->start && !mapped_ram.quit) {
+            qemu_cond_wait(&param->cond, &param->mutex);
+        }
+        if (mapped_ram.quit) {
+            qemu_mutex_unlock(&param->mutex);
+            break;
+        }
+        /* A page dirtied while it is being written is caught by the next
+         * bitmap sync, just like qemu_put_buffer_async() in the stream case.
+         */
+        ret = file_write_at(mapped_ram.fd, param->block->host + param->offset,
+                            param->len,
+                            param->block->pages_offset + param->offset);
+        param->start = false;
+        qemu_mutex_unlock(&param->mutex);
+
+        qemu_mutex_lock(&mapped_ram.done_lock);
+        if (ret < 0 && !mapped_ram.error) {
+            mapped_ram.error = ret;
+        }
+        param->done = true;
+        qemu_cond_signal(&mapped_ram.done_cond);
+        qemu_mutex_unlock(&mapped_ram.done_lock);
+    }
+
+    return NULL;
+}
+
+static int mapped_ram_threads_create(QEMUFile *f)
+{
+    Error *local_err = NULL;
+    int i;
+
+    if (migrate_use_direct_io() && TARGET_PAGE_SIZE < qemu_real_host_page_size) {
+        error_report("x-direct-io needs target pages of at least the host "
+                     "page size");
+        return -1;
+    }
+    mapped_ram.fd = file_open_pages_fd(f, migrate_use_direct_io(), &local_err);
+    if (mapped_ram.fd < 0) {
+        error_report_err(local_err);
+        return -1;
+    }
+
+    mapped_ram.quit = false;
+    mapped_ram.error = 0;
+    mapped_ram.batch_len = 0;
+    mapped_ram.thread_count = migrate_mapped_ram_threads();
+    mapped_ram.threads = g_new0(QemuThread, mapped_ram.thread_count);
+    mapped_ram.params = g_new0(MappedRamParam, mapped_ram.thread_count);
+    qemu_mutex_init(&mapped_ram.done_lock);
+    qemu_cond_init(&mapped_ram.done_cond);
+    for (i = 0; i < mapped_ram.thread_count; i++) {
+        mapped_ram.params[i].done = true;
+        qemu_mutex_init(&mapped_ram.params[i].mutex);
+        qemu_cond_init(&mapped_ram.params[i].cond);
+        qemu_thread_create(mapped_ram.threads + i, "mapped-ram",
+                           do_mapped_ram_write, mapped_ram.params + i,
+                           QEMU_THREAD_JOINABLE);
+    }
+    return 0;
+}
+
+static void mapped_ram_threads_join(void)
+{
+    int i;
+
+    if (!mapped_ram.threads) {
+        return;
+    }
+    mapped_ram.quit = true;
+    for (i = 0; i < mapped_ram.thread_count; i++) {
+        qemu_mutex_lock(&mapped_ram.params[i].mutex);
+        qemu_cond_signal(&mapped_ram.params[i].cond);
+        qemu_mutex_unlock(&mapped_ram.params[i].mutex);
+    }
+    for (i = 0; i < mapped_ram.thread_count; i++) {
+        qemu_thread_join(mapped_ram.threads + i);
+        qemu_mutex_destroy(&mapped_ram.params[i].mutex);
+        qemu_cond_destroy(&mapped_ram.params[i].cond);
+    }
+    qemu_mutex_destroy(&mapped_ram.done_lock);
+    qemu_cond_destroy(&mapped_ram.done_cond);
+    g_free(mapped_ram.threads);
+    g_free(mapped_ram.params);
+    mapped_ram.threads = NULL;
+    mapped_ram.params = NULL;
+    close(mapped_ram.fd);
+    mapped_ram.fd = -1;
+}
+
+/* Hand the pending run of pages to the first idle writer thread */
+static void mapped_ram_dispatch_batch(void)
+{
+    MappedRamParam *param = NULL;
+    int idx;
+
+    if (!mapped_ram.batch_len) {
+        return;
+    }
+
+    qemu_mutex_lock(&mapped_ram.done_lock);
+    while (!param) {
+        for (idx = 0; idx < mapped_ram.thread_count; idx++) {
+            if (mapped_ram.params[idx].done) {
+                param = &mapped_ram.params[idx];
+                param->done = false;
+                break;
+            }
+        }
+        if (!param) {
+            qemu_cond_wait(&mapped_ram.done_cond, &mapped_ram.done_lock);
+        }
+    }
+    qemu_mutex_unlock(&mapped_ram.done_lock);
+
+    qemu_mutex_lock(&param->mutex);
+    param->block = mapped_ram.batch_block;
+    param->offset = mapped_ram.batch_offset;
+    param->len = mapped_ram.batch_len;
+    param->start = true;
+    qemu_cond_signal(&param->cond);
+    qemu_mutex_unlock(&param->mutex);
+
+    mapped_ram.batch_len = 0;
+}
+
+/* Wait until every page handed out so far is in the file */
+static int mapped_ram_flush(void)
+{
+    int idx, ret;
+
+    mapped_ram_dispatch_batch();
+
+    qemu_mutex_lock(&mapped_ram.done_lock);
+    for (idx = 0; idx < mapped_ram.thread_count; idx++) {
+        while (!mapped_ram.params[idx].done) {
+            qemu_cond_wait(&mapped_ram.done_cond, &mapped_ram.done_lock);
+        }
+    }
+    ret = mapped_ram.error;
+    qemu_mutex_unlock(&mapped_ram.done_lock);
+
+    return ret;
+}
+
+static int mapped_ram_get_error(void)
+{
+    int ret;
+
+    qemu_mutex_lock(&mapped_ram.done_lock);
+    ret = mapped_ram.error;
+    qemu_mutex_unlock(&mapped_ram.done_lock);
+
+    return ret;
+}
+
+/*
+ * Reserve the file region of @block: write its header to the stream and
+ * move the stream past the bitmap and pages.
+ */
+static int mapped_ram_put_block_header(QEMUFile *f, RAMBlock *block)
+{
+    int64_t pos;
+
+    pos = qemu_file_seek(f, 0, SEEK_CUR);
+    if (pos < 0) {
+        return pos;
+    }
+    block->bitmap_offset = pos + MAPPED_RAM_HDR_SIZE;
+    block->pages_offset = ROUND_UP(block->bitmap_offset +
+                                   mapped_ram_bitmap_size(block),
+                                   MAPPED_RAM_FILE_OFFSET_ALIGNMENT);
+    block->file_bmap = g_malloc0(mapped_ram_bitmap_size(block));
+
+    qemu_put_be32(f, MAPPED_RAM_HDR_VERSION);
+    qemu_put_be64(f, TARGET_PAGE_SIZE);
+    qemu_put_be64(f, block->bitmap_offset);
+    qemu_put_be64(f, block->pages_offset);
+
+    pos = qemu_file_seek(f, block->pages_offset + block->used_length,
+                         SEEK_SET);
+    return pos < 0 ? pos : 0;
+}
+
+/* Called with rcu_read_lock() once all pages have been written */
+static int mapped_ram_put_bitmaps(QEMUFile *f)
+{
+    RAMBlock *block;
+    int ret = 0;
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        size_t size = mapped_ram_bitmap_size(block);
+        unsigned long *bmap;
+
+        if (!block->file_bmap) {
+            continue;
+        }
+        bmap = g_memdup(block->file_bmap, size);
+        mapped_ram_bitmap_swap(bmap, size);
+        ret = file_write_at(qemu_get_fd(f), bmap, size, block->bitmap_offset);
+        g_free(bmap);
+        if (ret < 0) {
+            break;
+        }
+    }
+    return ret;
+}
+
+static void mapped_ram_cleanup(void)
+{
+    RAMBlock *block;
+
+    mapped_ram_threads_join();
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        g_free(block->file_bmap);
+        block->file_bmap = NULL;
+    }
+    rcu_read_unlock();
+}
+
 /**
  * save_page_header: Write page header to wire
  *
@@ -571,12 +894,76 @@ ram_addr_t migration_bitmap_find_dirty(RAMBlock *rb,
     return (next - base) << TARGET_PAGE_BITS;
 }
 
-static inline bool migration_bitmap_clear_dirty(ram_addr_t addr)
+/* Dirty log of the accelerator is cleared in chunks of this many target
+ * pages (1GB with 4K pages), right before the first page of a chunk is
+ * sent.  This must be a multiple of 64 pages for KVM.
+ */
+#define CLEAR_BITMAP_SHIFT 18
+#define CLEAR_BITMAP_CHUNK_SHIFT (TARGET_PAGE_BITS + CLEAR_BITMAP_SHIFT)
+
+static void migration_clear_bitmap_init(RAMBlock *block)
+{
+    unsigned long chunks = DIV_ROUND_UP(block->max_length,
+                                        1ULL << CLEAR_BITMAP_CHUNK_SHIFT);
+
+    g_free(block->clear_bmap);
+    block->clear_bmap = bitmap_new(chunks);
+}
+
+/* Called after each bitmap sync: every chunk of the block may now hold
+ * pages that were reported dirty but are still writable.
+ */
+static void migration_clear_bitmap_set(RAMBlock *block)
+{
+    if (block->clear_bmap) {
+        bitmap_set(block->clear_bmap, 0,
+                   DIV_ROUND_UP(block->used_length,
+                                1ULL << CLEAR_BITMAP_CHUNK_SHIFT));
+    }
+}
+
+/*
+ * Re-arm dirty logging for the chunk holding @offset, if not done yet
+ * since the last sync.  This must happen before any page of the chunk is
+ * sent, so that writes done after the page is read are logged again.
+ */
+static void migration_clear_memory_region_dirty_bitmap(RAMBlock *block,
+                                                       ram_addr_t offset)
+{
+    unsigned long chunk = offset >> CLEAR_BITMAP_CHUNK_SHIFT;
+    ram_addr_t start, size;
+    bool locked;
+
+    if (!block->clear_bmap || !test_and_clear_bit(chunk, block->clear_bmap)) {
+        return;
+    }
+
+    start = (ram_addr_t)chunk << CLEAR_BITMAP_CHUNK_SHIFT;
+    size = MIN((ram_addr_t)1 << CLEAR_BITMAP_CHUNK_SHIFT,
+               block->used_length - start);
+    trace_migration_bitmap_clear_dirty(block->idstr, start, size);
+
+    locked = qemu_mutex_iothread_locked();
+    if (!locked) {
+        qemu_mutex_lock_iothread();
+    }
+    memory_region_clear_dirty_bitmap(block->mr, start, size);
+    if (!locked) {
+        qemu_mutex_unlock_iothread();
+    }
+}
+
+static inline bool migration_bitmap_clear_dirty(RAMBlock *block,
+                                                ram_addr_t addr)
 {
     bool ret;
     int nr = addr >> TARGET_PAGE_BITS;
     unsigned long *bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
 
+    if (test_bit(nr, bitmap)) {
+        migration_clear_memory_region_dirty_bitmap(block,
+                                                   addr - block->offset);
+    }
     ret = test_and_clear_bit(nr, bitmap);
 
     if (ret) {
@@ -634,6 +1021,7 @@ static void migration_bitmap_sync(void)
     rcu_read_lock();
     QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
         migration_bitmap_sync_range(block->offset, block->used_length);
+        migration_clear_bitmap_set(block);
     }
     rcu_read_unlock();
     qemu_mutex_unlock(&migration_bitmap_mutex);
@@ -645,7 +1033,7 @@ static void migration_bitmap_sync(void)
 
     /* more than 1 second = 1000 millisecons */
     if (end_time > start_time + 1000) {
-        if (migrate_auto_converge()) {
+        if (migrate_auto_converge() || migrate_dirty_limit()) {
             /* The following detection logic can be refined later. For now:
                Check to see if the dirtied bytes is 50% more than the approx.
                amount of bytes that just got transferred since the last time we
@@ -659,7 +1047,13 @@ static void migration_bitmap_sync(void)
                (dirty_rate_high_cnt++ >= 2)) {
                     trace_migration_throttle();
                     dirty_rate_high_cnt = 0;
-                    mig_throttle_guest_down();
+                    if (migrate_dirty_limit()) {
+                        /* Only the vCPUs that actually dirty memory
+                         * faster than the limit get slowed down */
+                        dirtylimit_migration_start(migrate_vcpu_dirty_limit());
+                    } else {
+                        mig_throttle_guest_down();
+                    }
              }
              bytes_xfer_prev = bytes_xfer_now;
         }
@@ -714,6 +1108,56 @@ static int save_zero_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
     return pages;
 }
 
+/**
+ * ram_save_mapped_page: Write the given page at its fixed file offset
+ *
+ * Returns: Number of pages written, or < 0 on error.
+ *
+ * @f: QEMUFile where to send the data
+ * @pss: block and offset of the page
+ * @bytes_transferred: increase it with the number of transferred bytes
+ */
+static int ram_save_mapped_page(QEMUFile *f, PageSearchStatus *pss,
+                                uint64_t *bytes_transferred)
+{
+    RAMBlock *block = pss->block;
+    ram_addr_t offset = pss->offset;
+    unsigned long page = offset >> TARGET_PAGE_BITS;
+
+    if (!block->file_bmap) {
+        error_report("RAM block %s was added during the migration",
+                     block->idstr);
+        return -EINVAL;
+    }
+
+    if (is_zero_range(block->host + offset, TARGET_PAGE_SIZE)) {
+        /* Pages missing from the file are left zero by the loader */
+        clear_bit(page, block->file_bmap);
+        acct_info.dup_pages++;
+        return 1;
+    }
+    set_bit(page, block->file_bmap);
+
+    if (mapped_ram.batch_len &&
+        (mapped_ram.batch_block != block ||
+         mapped_ram.batch_offset + mapped_ram.batch_len != offset ||
+         mapped_ram.batch_len >= MAPPED_RAM_MAX_BATCH)) {
+        mapped_ram_dispatch_batch();
+    }
+    if (!mapped_ram.batch_len) {
+        mapped_ram.batch_block = block;
+        mapped_ram.batch_offset = offset;
+    }
+    mapped_ram.batch_len += TARGET_PAGE_SIZE;
+
+    /* Only for the bandwidth estimate, the stream does not grow */
+    qemu_update_position(f, TARGET_PAGE_SIZE);
+    *bytes_transferred += TARGET_PAGE_SIZE;
+    acct_info.norm_pages++;
+
+    return 1;
+}
+
 /**
  * ram_save_page: Send the given page to the stream
  *
@@ -806,20 +1250,37 @@ static int ram_save_page(QEMUFile *f, PageSearchStatus *pss,
 
 static int do_compress_ram_page(CompressParam *param)
 {
-    int bytes_sent, blen;
+    int bytes_sent;
+    ssize_t blen;
     uint8_t *p;
     RAMBlock *block = param->block;
     ram_addr_t offset = param->offset;
 
     p = block->host + (offset & TARGET_PAGE_MASK);
 
+    blen = migration_compress(param->ctx, param->compbuf, param->compbuf_len,
+                              p, TARGET_PAGE_SIZE);
+    if (blen < 0) {
+        error_report("Compress Failed!");
+        return 0;
+    }
+
     bytes_sent = save_page_header(param->file, block, offset |
                                   RAM_SAVE_FLAG_COMPRESS_PAGE);
-    blen = qemu_put_compression_data(param->file, p, TARGET_PAGE_SIZE,
-                                     migrate_compress_level());
-    bytes_sent += blen;
+    if (blen >= TARGET_PAGE_SIZE &&
+        compress_method != MIGRATION_COMPRESS_METHOD_ZLIB) {
+        /* Incompressible page: store it as is, the destination copies
+         * pages of exactly TARGET_PAGE_SIZE bytes without decompressing.
+         * zlib streams keep the historical format.
+         */
+        qemu_put_be32(param->file, TARGET_PAGE_SIZE);
+        qemu_put_buffer(param->file, p, TARGET_PAGE_SIZE);
+        return bytes_sent + sizeof(int32_t) + TARGET_PAGE_SIZE;
+    }
+    qemu_put_be32(param->file, blen);
+    qemu_put_buffer(param->file, param->compbuf, blen);
 
-    return bytes_sent;
+    return bytes_sent + sizeof(int32_t) + blen;
 }
 
 static inline void start_compression(CompressParam *param)
@@ -1240,9 +1701,11 @@ static int ram_save_target_page(MigrationState *ms, QEMUFile *f,
     int res = 0;
 
     /* Check the pages is dirty and if it is send it */
-    if (migration_bitmap_clear_dirty(dirty_ram_abs)) {
+    if (migration_bitmap_clear_dirty(pss->block, dirty_ram_abs)) {
         unsigned long *unsentmap;
-        if (compression_switch && migrate_use_compression()) {
+        if (migrate_use_mapped_ram()) {
+            res = ram_save_mapped_page(f, pss, bytes_transferred);
+        } else if (compression_switch && migrate_use_compression()) {
             res = ram_save_compressed_page(f, pss,
                                            last_stage,
                                            bytes_transferred);
@@ -1425,12 +1888,21 @@ static void ram_migration_cleanup(void *opaque)
      * no writing race against this migration_bitmap
      */
     struct BitmapRcu *bitmap = migration_bitmap_rcu;
+    RAMBlock *block;
+
     atomic_rcu_set(&migration_bitmap_rcu, NULL);
     if (bitmap) {
         memory_global_dirty_log_stop();
         call_rcu(bitmap, migration_bitmap_free, rcu);
     }
 
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        g_free(block->clear_bmap);
+        block->clear_bmap = NULL;
+    }
+    rcu_read_unlock();
+
     XBZRLE_cache_lock();
     if (XBZRLE.cache) {
         cache_fini(XBZRLE.cache);
@@ -1441,6 +1913,10 @@ static void ram_migration_cleanup(void *opaque)
         XBZRLE.current_buf = NULL;
     }
     XBZRLE_cache_unlock();
+
+    if (migrate_use_mapped_ram()) {
+        mapped_ram_cleanup();
+    }
 }
 
 static void reset_ram_globals(void)
@@ -1920,6 +2396,10 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         acct_clear();
     }
 
+    if (migrate_use_mapped_ram() && mapped_ram_threads_create(f) < 0) {
+        return -1;
+    }
+
     /* For memory_global_dirty_log_start below.  */
     qemu_mutex_lock_iothread();
 
@@ -1938,6 +2418,10 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         bitmap_set(migration_bitmap_rcu->unsentmap, 0, ram_bitmap_pages);
     }
 
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        migration_clear_bitmap_init(block);
+    }
+
     /*
      * Count the total number of pages used by ram blocks not including any
      * gaps due to alignment or unplugs.
@@ -1955,10 +2439,24 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         qemu_put_byte(f, strlen(block->idstr));
         qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
         qemu_put_be64(f, block->used_length);
+        if (migrate_use_mapped_ram() &&
+            mapped_ram_put_block_header(f, block) < 0) {
+            error_report("Failed to reserve file space for RAM block %s",
+                         block->idstr);
+            rcu_read_unlock();
+            return -1;
+        }
     }
 
     rcu_read_unlock();
 
+    /* Older destinations only know zlib, don't confuse them */
+    if (migrate_use_compression() &&
+        migrate_compress_method() != MIGRATION_COMPRESS_METHOD_ZLIB) {
+        qemu_put_be64(f, RAM_SAVE_FLAG_COMPRESS_METHOD);
+        qemu_put_byte(f, migrate_compress_method());
+    }
+
     ram_control_before_iterate(f, RAM_CONTROL_SETUP);
     ram_control_after_iterate(f, RAM_CONTROL_SETUP);
 
@@ -2013,6 +2511,14 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         i++;
     }
     flush_compressed_data(f);
+    if (migrate_use_mapped_ram()) {
+        mapped_ram_dispatch_batch();
+        ret = mapped_ram_get_error();
+        if (ret < 0) {
+            rcu_read_unlock();
+            return ret;
+        }
+    }
     rcu_read_unlock();
 
     /*
@@ -2035,6 +2541,8 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
 /* Called with iothread lock */
 static int ram_save_complete(QEMUFile *f, void *opaque)
 {
+    int ret = 0;
+
     rcu_read_lock();
 
     if (!migration_in_postcopy(migrate_get_current())) {
@@ -2057,13 +2565,19 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
     }
 
     flush_compressed_data(f);
+    if (migrate_use_mapped_ram()) {
+        ret = mapped_ram_flush();
+        if (!ret) {
+            ret = mapped_ram_put_bitmaps(f);
+        }
+    }
     ram_control_after_iterate(f, RAM_CONTROL_FINISH);
 
     rcu_read_unlock();
 
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
 
-    return 0;
+    return ret;
 }
 
 static void ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size,
@@ -2186,21 +2700,26 @@ void ram_handle_compressed(void *host, uint8_t ch, uint64_t size)
 static void *do_data_decompress(void *opaque)
 {
     DecompressParam *param = opaque;
-    unsigned long pagesize;
 
     while (!quit_decomp_thread) {
         qemu_mutex_lock(&param->mutex);
         while (!param->start && !quit_decomp_thread) {
             qemu_cond_wait(&param->cond, &param->mutex);
-            pagesize = TARGET_PAGE_SIZE;
-            if (!quit_decomp_thread) {
-                /* uncompress() will return failed in some case, especially
+            if (quit_decomp_thread) {
+                /* nothing to do */
+            } else if (param->len == TARGET_PAGE_SIZE &&
+                       decompress_method != MIGRATION_COMPRESS_METHOD_ZLIB) {
+                /* Page that was stored uncompressed */
+                memcpy(param->des, param->compbuf, TARGET_PAGE_SIZE);
+            } else {
+                /* Decompression will fail in some case, especially
                  * when the page is dirted when doing the compression, it's
                  * not a problem because the dirty page will be retransferred
-                 * and uncompress() won't break the data in other pages.
+                 * and the failure won't break the data in other pages.
                  */
-                uncompress((Bytef *)param->des, &pagesize,
-                           (const Bytef *)param->compbuf, param->len);
+                migration_decompress(decompress_method, param->des,
+                                     TARGET_PAGE_SIZE, param->compbuf,
+                                     param->len);
             }
             param->start = false;
         }
@@ -2218,10 +2737,14 @@ void migrate_decompress_threads_create(void)
     decompress_threads = g_new0(QemuThread, thread_count);
     decomp_param = g_new0(DecompressParam, thread_count);
     quit_decomp_thread = false;
+    decompress_method = MIGRATION_COMPRESS_METHOD_ZLIB;
     for (i = 0; i < thread_count; i++) {
         qemu_mutex_init(&decomp_param[i].mutex);
         qemu_cond_init(&decomp_param[i].cond);
-        decomp_param[i].compbuf = g_malloc0(compressBound(TARGET_PAGE_SIZE));
+        /* The method is only known once the stream says so */
+        decomp_param[i].compbuf = g_malloc0(
+            migration_compress_bound(MIGRATION_COMPRESS_METHOD__MAX,
+                                     TARGET_PAGE_SIZE));
         qemu_thread_create(decompress_threads + i, "decompress",
                            do_data_decompress, decomp_param + i,
                            QEMU_THREAD_JOINABLE);
@@ -2251,6 +2774,284 @@ void migrate_decompress_threads_join(void)
     decomp_param = NULL;
 }
 
+/*
+ * Parallel page loading
+ *
+ * With x-load-threads set, the incoming coroutine only parses the stream:
+ * normal pages are copied into a batch, zero pages are recorded, and full
+ * batches are handed to a pool of threads that write guest memory, taking
+ * the page faults of freshly allocated destination RAM in parallel.
+ *
+ * A page always goes to the same thread, chosen by the 2MB region it
+ * belongs to, and every thread processes its batches in order; so when a
+ * page is sent again, the newer copy still lands last.  Pages that are
+ * read back by the stream parser (XBZRLE) or written by the decompression
+ * threads wait for their load thread to drain first.
+ */
+#define LOAD_BATCH_PAGES    64
+/* Batches that can be queued per thread */
+#define LOAD_BATCH_DEPTH    4
+#define LOAD_REGION_SHIFT   21
+
+typedef struct LoadBatch {
+    unsigned int npages;
+    void *host[LOAD_BATCH_PAGES];
+    /* Fill byte of a zero page, or -1 if the page is in data */
+    int ch[LOAD_BATCH_PAGES];
+    uint8_t *data;
+} LoadBatch;
+
+struct LoadParam {
+    QemuMutex mutex;
+    /* Signalled when a batch is queued or completed */
+    QemuCond cond;
+    LoadBatch batch[LOAD_BATCH_DEPTH];
+    /* batch[tail..head) are queued, batch[head] is being filled */
+    unsigned int head;
+    unsigned int tail;
+    bool quit;
+};
+typedef struct LoadParam LoadParam;
+
+static LoadParam *load_param;
+static QemuThread *load_threads;
+static int load_thread_count;
+
+static void load_batch_process(LoadBatch *batch)
+{
+    unsigned int i;
+
+    for (i = 0; i < batch->npages; i++) {
+        if (batch->ch[i] < 0) {
+            memcpy(batch->host[i], batch->data + i * TARGET_PAGE_SIZE,
+                   TARGET_PAGE_SIZE);
+        } else {
+            ram_handle_compressed(batch->host[i], batch->ch[i],
+                                  TARGET_PAGE_SIZE);
+        }
+    }
+    batch->npages = 0;
+}
+
+static void *do_data_load(void *opaque)
+{
+    LoadParam *param = opaque;
+
+    qemu_mutex_lock(&param->mutex);
+    while (true) {
+        while (param->tail == param->head && !param->quit) {
+            qemu_cond_wait(&param->cond, &param->mutex);
+        }
+        if (param->tail == param->head) {
+            break;
+        }
+        qemu_mutex_unlock(&param->mutex);
+        load_batch_process(&param->batch[param->tail % LOAD_BATCH_DEPTH]);
+        qemu_mutex_lock(&param->mutex);
+        param->tail++;
+        qemu_cond_signal(&param->cond);
+    }
+    qemu_mutex_unlock(&param->mutex);
+
+    return NULL;
+}
+
+static LoadParam *load_param_for(void *host)
+{
+    return &load_param[((uintptr_t)host >> LOAD_REGION_SHIFT) %
+                       load_thread_count];
+}
+
+/* Queue the batch being filled, if any, and start a new one */
+static void load_submit(LoadParam *param)
+{
+    if (!param->batch[param->head % LOAD_BATCH_DEPTH].npages) {
+        return;
+    }
+    qemu_mutex_lock(&param->mutex);
+    param->head++;
+    qemu_cond_signal(&param->cond);
+    while (param->head - param->tail == LOAD_BATCH_DEPTH) {
+        qemu_cond_wait(&param->cond, &param->mutex);
+    }
+    qemu_mutex_unlock(&param->mutex);
+}
+
+/* Wait until every page queued to @param has been written */
+static void load_wait(LoadParam *param)
+{
+    load_submit(param);
+    qemu_mutex_lock(&param->mutex);
+    while (param->tail != param->head) {
+        qemu_cond_wait(&param->cond, &param->mutex);
+    }
+    qemu_mutex_unlock(&param->mutex);
+}
+
+static void load_wait_all(void)
+{
+    int i;
+
+    for (i = 0; i < load_thread_count; i++) {
+        load_wait(&load_param[i]);
+    }
+}
+
+/* Make sure no load thread is going to write the page at @host */
+static void load_wait_page(void *host)
+{
+    if (load_thread_count) {
+        load_wait(load_param_for(host));
+    }
+}
+
+/*
+ * Add a page to the batch of its load thread: a zero page filled with @ch,
+ * or the next TARGET_PAGE_SIZE bytes of @f if @ch is -1.
+ */
+static void load_queue_page(QEMUFile *f, void *host, int ch)
+{
+    LoadParam *param = load_param_for(host);
+    LoadBatch *batch = &param->batch[param->head % LOAD_BATCH_DEPTH];
+    unsigned int i = batch->npages;
+
+    batch->host[i] = host;
+    batch->ch[i] = ch;
+    if (ch < 0) {
+        qemu_get_buffer(f, batch->data + i * TARGET_PAGE_SIZE,
+                        TARGET_PAGE_SIZE);
+    }
+    if (++batch->npages == LOAD_BATCH_PAGES) {
+        load_submit(param);
+    }
+}
+
+void migrate_load_threads_create(void)
+{
+    int i, j;
+
+    load_thread_count = migrate_load_threads();
+    if (!load_thread_count) {
+        return;
+    }
+    load_threads = g_new0(QemuThread, load_thread_count);
+    load_param = g_new0(LoadParam, load_thread_count);
+    for (i = 0; i < load_thread_count; i++) {
+        qemu_mutex_init(&load_param[i].mutex);
+        qemu_cond_init(&load_param[i].cond);
+        for (j = 0; j < LOAD_BATCH_DEPTH; j++) {
+            load_param[i].batch[j].data =
+                g_malloc(LOAD_BATCH_PAGES * TARGET_PAGE_SIZE);
+        }
+        qemu_thread_create(load_threads + i, "ramload",
+                           do_data_load, load_param + i,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+void migrate_load_threads_join(void)
+{
+    int i, j;
+
+    if (!load_thread_count) {
+        return;
+    }
+    /* Queued pages are still written before the threads exit */
+    for (i = 0; i < load_thread_count; i++) {
+        load_submit(&load_param[i]);
+        qemu_mutex_lock(&load_param[i].mutex);
+        load_param[i].quit = true;
+        qemu_cond_signal(&load_param[i].cond);
+        qemu_mutex_unlock(&load_param[i].mutex);
+    }
+    for (i = 0; i < load_thread_count; i++) {
+        qemu_thread_join(load_threads + i);
+        qemu_mutex_destroy(&load_param[i].mutex);
+        qemu_cond_destroy(&load_param[i].cond);
+        for (j = 0; j < LOAD_BATCH_DEPTH; j++) {
+            g_free(load_param[i].batch[j].data);
+        }
+    }
+    g_free(load_threads);
+    g_free(load_param);
+    load_threads = NULL;
+    load_param = NULL;
+    load_thread_count = 0;
+}
+
+typedef struct PrefaultParam {
+    uint8_t *start;
+    size_t len;
+    size_t pagesize;
+} PrefaultParam;
+
+static void *do_prefault(void *opaque)
+{
+    PrefaultParam *param = opaque;
+    size_t off;
+
+    /* Every page is sent by the source, so the content doesn't matter.
+     * If the host runs out of huge pages this gets SIGBUS, just like
+     * loading the page would have.
+     */
+    for (off = 0; off < param->len; off += param->pagesize) {
+        param->start[off] = 0;
+    }
+    return NULL;
+}
+
+/*
+ * Allocate the huge pages backing guest RAM with x-load-threads threads
+ * before the stream starts: zeroing a huge page on first touch is costly
+ * and would otherwise serialize in the thread that loads the page.
+ */
+void ram_prefault_incoming(void)
+{
+    int thread_count = migrate_load_threads();
+    QemuThread *threads;
+    PrefaultParam *params;
+    RAMBlock *block;
+    int i;
+
+    if (!thread_count) {
+        return;
+    }
+
+    threads = g_new0(QemuThread, thread_count);
+    params = g_new0(PrefaultParam, thread_count);
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        size_t pagesize, npages, chunk;
+
+        /* file_ram_alloc() aligns file-backed blocks to their page size */
+        if (block->fd < 0 || block->mr->align <= getpagesize()) {
+            continue;
+        }
+        pagesize = block->mr->align;
+        npages = block->used_length / pagesize;
+        chunk = DIV_ROUND_UP(npages, thread_count);
+        trace_ram_prefault_incoming(block->idstr, npages, thread_count);
+
+        for (i = 0; i < thread_count; i++) {
+            size_t first = MIN(i * chunk, npages);
+
+            params[i].start = block->host + first * pagesize;
+            params[i].len = (MIN(first + chunk, npages) - first) * pagesize;
+            params[i].pagesize = pagesize;
+            qemu_thread_create(threads + i, "prefault", do_prefault,
+                               params + i, QEMU_THREAD_JOINABLE);
+        }
+        for (i = 0; i < thread_count; i++) {
+            qemu_thread_join(threads + i);
+        }
+    }
+    rcu_read_unlock();
+
+    g_free(params);
+    g_free(threads);
+}
+
 static void decompress_data_with_multi_threads(QEMUFile *f,
                                                void *host, int len)
 {
@@ -2273,6 +3074,129 @@ static void decompress_data_with_multi_threads(QEMUFile *f,
     }
 }
 
+struct MappedRamLoadParam {
+    int fd;
+    RAMBlock *block;
+    unsigned long *bmap;
+    off_t pages_offset;
+    /* Range of pages of the block loaded by this thread */
+    unsigned long start;
+    unsigned long end;
+    int ret;
+};
+typedef struct MappedRamLoadParam MappedRamLoadParam;
+
+static void *do_mapped_ram_read(void *opaque)
+{
+    MappedRamLoadParam *param = opaque;
+    unsigned long page, run_end;
+
+    page = find_next_bit(param->bmap, param->end, param->start);
+    while (page < param->end) {
+        run_end = find_next_zero_bit(param->bmap, param->end, page);
+        param->ret = file_read_at(param->fd,
+                                  param->block->host +
+                                  (page << TARGET_PAGE_BITS),
+                                  (run_end - page) << TARGET_PAGE_BITS,
+                                  param->pages_offset +
+                                  (page << TARGET_PAGE_BITS));
+        if (param->ret < 0) {
+            break;
+        }
+        page = find_next_bit(param->bmap, param->end, run_end);
+    }
+
+    return NULL;
+}
+
+/*
+ * Load the pages of @block from its fixed-offset region, splitting the
+ * block among x-mapped-ram-threads reader threads, then move the stream
+ * past the region.  Pages whose bit is clear are zero and left untouched.
+ */
+static int mapped_ram_load_block(QEMUFile *f, int fd, RAMBlock *block)
+{
+    unsigned long num_pages = block->used_length >> TARGET_PAGE_BITS;
+    size_t bitmap_size = mapped_ram_bitmap_size(block);
+    MappedRamLoadParam *params;
+    QemuThread *threads;
+    unsigned long *bmap;
+    unsigned long chunk;
+    uint32_t version;
+    uint64_t page_size;
+    off_t bitmap_offset, pages_offset;
+    int i, thread_count, ret;
+
+    version = qemu_get_be32(f);
+    page_size = qemu_get_be64(f);
+    bitmap_offset = qemu_get_be64(f);
+    pages_offset = qemu_get_be64(f);
+
+    if (version != MAPPED_RAM_HDR_VERSION) {
+        error_report("Unsupported fixed-offset RAM header version %" PRIu32,
+                     version);
+        return -EINVAL;
+    }
+    if (page_size != TARGET_PAGE_SIZE) {
+        error_report("Fixed-offset RAM page size mismatch: %" PRIu64
+                     " != %d", page_size, TARGET_PAGE_SIZE);
+        return -EINVAL;
+    }
+    if (pages_offset & (MAPPED_RAM_FILE_OFFSET_ALIGNMENT - 1)) {
+        error_report("Misaligned RAM pages region for block %s",
+                     block->idstr);
+        return -EINVAL;
+    }
+
+    bmap = g_malloc(bitmap_size);
+    ret = file_read_at(qemu_get_fd(f), bmap, bitmap_size, bitmap_offset);
+    if (ret < 0) {
+        error_report("Failed to read RAM bitmap of block %s: %s",
+                     block->idstr, strerror(-ret));
+        g_free(bmap);
+        return ret;
+    }
+    mapped_ram_bitmap_swap(bmap, bitmap_size);
+
+    thread_count = MIN(migrate_mapped_ram_threads(),
+                       DIV_ROUND_UP(num_pages, BITS_PER_LONG));
+    thread_count = MAX(thread_count, 1);
+    chunk = ROUND_UP(DIV_ROUND_UP(num_pages, thread_count), BITS_PER_LONG);
+    threads = g_new0(QemuThread, thread_count);
+    params = g_new0(MappedRamLoadParam, thread_count);
+    for (i = 0; i < thread_count; i++) {
+        params[i].fd = fd;
+        params[i].block = block;
+        params[i].bmap = bmap;
+        params[i].pages_offset = pages_offset;
+        params[i].start = MIN(i * chunk, num_pages);
+        params[i].end = MIN((i + 1) * chunk, num_pages);
+        qemu_thread_create(threads + i, "mapped-ram-load",
+                           do_mapped_ram_read, params + i,
+                           QEMU_THREAD_JOINABLE);
+    }
+    for (i = 0; i < thread_count; i++) {
+        qemu_thread_join(threads + i);
+        if (params[i].ret < 0 && !ret) {
+            ret = params[i].ret;
+        }
+    }
+    g_free(threads);
+    g_free(params);
+    g_free(bmap);
+
+    if (ret < 0) {
+        error_report("Failed to load RAM block %s: %s", block->idstr,
+                     strerror(-ret));
+        return ret;
+    }
+
+    trace_ram_load_mapped_block(block->idstr, pages_offset, num_pages);
+
+    ret = qemu_file_seek(f, pages_offset + block->used_length, SEEK_SET);
+    return ret < 0 ? ret : 0;
+}
+
 /*
  * Allocate data structures etc needed by incoming migration with postcopy-ram
  * postcopy-ram's similarly names postcopy_ram_incoming_init does the work
@@ -2412,6 +3336,8 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
     int flags = 0, ret = 0;
     static uint64_t seq_iter;
     int len = 0;
+    int mapped_fd = -1;
+    int method;
     /*
      * If system is running in postcopy mode, page inserts to host memory must
      * be atomic
@@ -2458,6 +3384,17 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
 
         switch (flags & ~RAM_SAVE_FLAG_CONTINUE) {
         case RAM_SAVE_FLAG_MEM_SIZE:
+            if (migrate_use_mapped_ram()) {
+                Error *local_err = NULL;
+
+                mapped_fd = file_open_pages_fd(f, migrate_use_direct_io(),
+                                               &local_err);
+                if (mapped_fd < 0) {
+                    error_report_err(local_err);
+                    ret = -EINVAL;
+                    break;
+                }
+            }
             /* Synchronize RAM block list */
             total_ram_bytes = addr;
             while (!ret && total_ram_bytes) {
@@ -2483,6 +3420,9 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                     }
                     ram_control_load_hook(f, RAM_CONTROL_BLOCK_REG,
                                           block->idstr);
+                    if (!ret && mapped_fd >= 0) {
+                        ret = mapped_ram_load_block(f, mapped_fd, block);
+                    }
                 } else {
                     error_report("Unknown ramblock \"%s\", cannot "
                                  "accept migration", id);
@@ -2491,28 +3431,55 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
 
                 total_ram_bytes -= length;
             }
+            if (mapped_fd >= 0) {
+                close(mapped_fd);
+                mapped_fd = -1;
+            }
             break;
 
         case RAM_SAVE_FLAG_COMPRESS:
             ch = qemu_get_byte(f);
-            ram_handle_compressed(host, ch, TARGET_PAGE_SIZE);
+            if (load_thread_count) {
+                load_queue_page(f, host, ch);
+            } else {
+                ram_handle_compressed(host, ch, TARGET_PAGE_SIZE);
+            }
             break;
 
         case RAM_SAVE_FLAG_PAGE:
-            qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+            if (load_thread_count) {
+                load_queue_page(f, host, -1);
+            } else {
+                qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+            }
             break;
 
         case RAM_SAVE_FLAG_COMPRESS_PAGE:
             len = qemu_get_be32(f);
-            if (len < 0 || len > compressBound(TARGET_PAGE_SIZE)) {
+            if (len < 0 ||
+                len > migration_compress_bound(decompress_method,
+                                               TARGET_PAGE_SIZE)) {
                 error_report("Invalid compressed data length: %d", len);
                 ret = -EINVAL;
                 break;
             }
+            load_wait_page(host);
             decompress_data_with_multi_threads(f, host, len);
             break;
 
+        case RAM_SAVE_FLAG_COMPRESS_METHOD:
+            method = qemu_get_byte(f);
+            if (!migration_compress_supported(method)) {
+                error_report("Unsupported page compression method %d",
+                             method);
+                ret = -EINVAL;
+                break;
+            }
+            decompress_method = method;
+            break;
+
         case RAM_SAVE_FLAG_XBZRLE:
+            load_wait_page(host);
             if (load_xbzrle(f, addr, host) < 0) {
                 error_report("Failed to decompress XBZRLE page at "
                              RAM_ADDR_FMT, addr);
@@ -2537,6 +3504,8 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
         }
     }
 
+    /* Other sections may rely on RAM being loaded */
+    load_wait_all();
     rcu_read_unlock();
     DPRINTF("Completed load of VM with exit code %d seq iteration "
             "%" PRIu64 "\n", ret, seq_iter);
@@ -1491,6 +1491,11 @@ static void hmp_info_mtree(Monitor *mon, const QDict *qdict)
     mtree_info((fprintf_function)monitor_printf, mon);
 }
 
+static void hmp_info_dma(Monitor *mon, const QDict *qdict)
+{
+    address_space_dma_info((fprintf_function)monitor_printf, mon);
+}
+
 static void hmp_info_numa(Monitor *mon, const QDict *qdict)
 {
     int i;
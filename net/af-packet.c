@@ -0,0 +1,580 @@
+/*
+ * AF_PACKET memory-mapped ring network backend
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Each queue is a packet socket bound to the host interface with a
+ * TPACKET_V3 receive ring and, where the host kernel supports it (4.11+),
+ * a transmit ring.  Received frames are handed to the peer straight out of
+ * the ring, so the NIC model's copy into guest buffers is the only one;
+ * transmitted frames are copied once into a ring slot and a whole batch is
+ * kicked with a single send().  With queues=N the sockets join one fanout
+ * group and the host kernel spreads flows across them; every netdev gets a
+ * group of its own.
+ */
+
+#include "qemu/osdep.h"
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <net/if.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+
+#include "net/net.h"
+#include "clients.h"
+#include "qemu-common.h"
+#include "qemu/error-report.h"
+#include "qemu/iov.h"
+#include "qemu/sockets.h"
+#include "qemu/main-loop.h"
+
+#define AF_PACKET_BATCH         64
+#define AF_PACKET_BLOCK_SIZE    (256 << 10)
+#define AF_PACKET_BLOCKS        16
+#define AF_PACKET_TX_FRAMES     256
+/* Milliseconds before the kernel hands over a partially filled block */
+#define AF_PACKET_RETIRE_TOV    1
+#define VLAN_HLEN               4
+
+typedef struct AFPacketState {
+    NetClientState nc;
+    int fd;
+    int ifindex;
+    bool read_poll;
+    bool write_poll;
+
+    /* Receive ring: blocks of variable-sized frames */
+    uint8_t *rx_ring;
+    size_t rx_ring_size;
+    unsigned int rx_block;
+    unsigned int rx_left;
+    struct tpacket3_hdr *rx_ppd;
+
+    /* Transmit ring: fixed-size frames; NULL if the host has none */
+    uint8_t *tx_ring;
+    size_t tx_ring_size;
+    unsigned int tx_frame_size;
+    unsigned int tx_frame;
+} AFPacketState;
+
+static void af_packet_send(void *opaque);
+static void af_packet_writable(void *opaque);
+
+static void af_packet_update_fd_handler(AFPacketState *s)
+{
+    qemu_set_fd_handler(s->fd,
+                        s->read_poll ? af_packet_send : NULL,
+                        s->write_poll ? af_packet_writable : NULL,
+                        s);
+}
+
+static void af_packet_read_poll(AFPacketState *s, bool enable)
+{
+    if (s->read_poll != enable) {
+        s->read_poll = enable;
+        af_packet_update_fd_handler(s);
+    }
+}
+
+static void af_packet_write_poll(AFPacketState *s, bool enable)
+{
+    if (s->write_poll != enable) {
+        s->write_poll = enable;
+        af_packet_update_fd_handler(s);
+    }
+}
+
+static void af_packet_poll(NetClientState *nc, bool enable)
+{
+    AFPacketState *s = DO_UPCAST(AFPacketState, nc, nc);
+
+    af_packet_read_poll(s, enable);
+    af_packet_write_poll(s, enable);
+}
+
+static void af_packet_writable(void *opaque)
+{
+    AFPacketState *s = opaque;
+
+    af_packet_write_poll(s, false);
+    qemu_flush_queued_packets(&s->nc);
+}
+
+/* TX */
+
+static void af_packet_tx_kick(AFPacketState *s)
+{
+    ssize_t ret;
+
+    do {
+        ret = send(s->fd, NULL, 0, MSG_DONTWAIT);
+    } while (ret == -1 && errno == EINTR);
+}
+
+/*
+ * Copy one frame into the next free TX slot.  Returns the frame length,
+ * 0 if the ring is full, or -1 if the frame was dropped.
+ */
+static ssize_t af_packet_tx_fill(AFPacketState *s, const struct iovec *iov,
+                                 int iovcnt)
+{
+    struct tpacket3_hdr *hdr;
+    size_t size = iov_size(iov, iovcnt);
+    size_t data = TPACKET_ALIGN(sizeof(struct tpacket3_hdr));
+
+    hdr = (struct tpacket3_hdr *)(s->tx_ring + s->tx_frame * s->tx_frame_size);
+    if (hdr->tp_status & (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING)) {
+        return 0;
+    }
+    if (size > s->tx_frame_size - data) {
+        return -1;
+    }
+
+    iov_to_buf(iov, iovcnt, 0, (uint8_t *)hdr + data, size);
+    hdr->tp_len = size;
+    hdr->tp_snaplen = size;
+    hdr->tp_next_offset = 0;
+    smp_wmb();
+    hdr->tp_status = TP_STATUS_SEND_REQUEST;
+    s->tx_frame = (s->tx_frame + 1) % AF_PACKET_TX_FRAMES;
+    return size;
+}
+
+static ssize_t af_packet_receive_iov(NetClientState *nc,
+                                     const struct iovec *iov, int iovcnt)
+{
+    AFPacketState *s = DO_UPCAST(AFPacketState, nc, nc);
+    ssize_t ret;
+
+    if (!s->tx_ring) {
+        struct msghdr msg = {
+            .msg_iov = (struct iovec *)iov,
+            .msg_iovlen = iovcnt,
+        };
+
+        do {
+            ret = sendmsg(s->fd, &msg, MSG_DONTWAIT);
+        } while (ret == -1 && errno == EINTR);
+        if (ret == -1 && (errno == EAGAIN || errno == ENOBUFS)) {
+            af_packet_write_poll(s, true);
+            return 0;
+        }
+        return ret;
+    }
+
+    ret = af_packet_tx_fill(s, iov, iovcnt);
+    if (ret == 0) {
+        af_packet_write_poll(s, true);
+        return 0;
+    }
+    af_packet_tx_kick(s);
+    return ret;
+}
+
+static ssize_t af_packet_receive(NetClientState *nc, const uint8_t *buf,
+                                 size_t size)
+{
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = size,
+    };
+
+    return af_packet_receive_iov(nc, &iov, 1);
+}
+
+static int af_packet_receive_iov_batch(NetClientState *nc,
+                                       const NetPacketIOV *pkts, int count)
+{
+    AFPacketState *s = DO_UPCAST(AFPacketState, nc, nc);
+    int i;
+
+    if (!s->tx_ring) {
+        for (i = 0; i < count; i++) {
+            if (af_packet_receive_iov(nc, pkts[i].iov, pkts[i].iovcnt) == 0) {
+                break;
+            }
+        }
+        return i;
+    }
+
+    /* Fill as many slots as are free, then one kick for all of them */
+    for (i = 0; i < count; i++) {
+        if (af_packet_tx_fill(s, pkts[i].iov, pkts[i].iovcnt) == 0) {
+            af_packet_write_poll(s, true);
+            break;
+        }
+    }
+    af_packet_tx_kick(s);
+    return i;
+}
+
+/* RX */
+
+static struct tpacket_block_desc *af_packet_rx_block(AFPacketState *s)
+{
+    return (struct tpacket_block_desc *)
+        (s->rx_ring + s->rx_block * AF_PACKET_BLOCK_SIZE);
+}
+
+/* Step to the next frame, handing the block back once it is used up */
+static void af_packet_rx_advance(AFPacketState *s)
+{
+    if (--s->rx_left) {
+        s->rx_ppd = (struct tpacket3_hdr *)
+            ((uint8_t *)s->rx_ppd + s->rx_ppd->tp_next_offset);
+        return;
+    }
+
+    smp_mb();
+    af_packet_rx_block(s)->hdr.bh1.block_status = TP_STATUS_KERNEL;
+    s->rx_block = (s->rx_block + 1) % AF_PACKET_BLOCKS;
+    s->rx_ppd = NULL;
+}
+
+/*
+ * Point @iov at a received frame and return the number of elements used.
+ * The kernel strips the VLAN tag into the frame header, so put it back
+ * between the MAC addresses and the EtherType, using @tag for its bytes.
+ */
+static int af_packet_rx_iov(struct tpacket3_hdr *ppd, struct iovec *iov,
+                            uint8_t *tag)
+{
+    uint8_t *frame = (uint8_t *)ppd + ppd->tp_mac;
+    uint16_t tpid = ETH_P_8021Q;
+
+    if (!(ppd->tp_status & TP_STATUS_VLAN_VALID) ||
+        ppd->tp_snaplen < 2 * ETH_ALEN) {
+        iov[0].iov_base = frame;
+        iov[0].iov_len = ppd->tp_snaplen;
+        return 1;
+    }
+
+#ifdef TP_STATUS_VLAN_TPID_VALID
+    if (ppd->tp_status & TP_STATUS_VLAN_TPID_VALID) {
+        tpid = ppd->hv1.tp_vlan_tpid;
+    }
+#endif
+    stw_be_p(tag, tpid);
+    stw_be_p(tag + 2, ppd->hv1.tp_vlan_tci);
+
+    iov[0].iov_base = frame;
+    iov[0].iov_len = 2 * ETH_ALEN;
+    iov[1].iov_base = tag;
+    iov[1].iov_len = VLAN_HLEN;
+    iov[2].iov_base = frame + 2 * ETH_ALEN;
+    iov[2].iov_len = ppd->tp_snaplen - 2 * ETH_ALEN;
+    return 3;
+}
+
+static void af_packet_send_completed(NetClientState *nc, ssize_t len)
+{
+    AFPacketState *s = DO_UPCAST(AFPacketState, nc, nc);
+
+    af_packet_read_poll(s, true);
+}
+
+static void af_packet_send(void *opaque)
+{
+    AFPacketState *s = opaque;
+    struct iovec iov[AF_PACKET_BATCH][3];
+    uint8_t tags[AF_PACKET_BATCH][VLAN_HLEN];
+    NetPacketIOV pkts[AF_PACKET_BATCH];
+    unsigned int frames[AF_PACKET_BATCH];
+    int packets = 0;
+
+    while (packets < 4 * AF_PACKET_BATCH) {
+        struct tpacket_block_desc *bd;
+        struct tpacket3_hdr *ppd;
+        unsigned int walked = 0;
+        int n = 0, sent;
+
+        if (!s->rx_ppd) {
+            bd = af_packet_rx_block(s);
+            if (!(bd->hdr.bh1.block_status & TP_STATUS_USER)) {
+                break;
+            }
+            smp_rmb();
+            if (!bd->hdr.bh1.num_pkts) {
+                bd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+                s->rx_block = (s->rx_block + 1) % AF_PACKET_BLOCKS;
+                continue;
+            }
+            s->rx_left = bd->hdr.bh1.num_pkts;
+            s->rx_ppd = (struct tpacket3_hdr *)
+                ((uint8_t *)bd + bd->hdr.bh1.offset_to_first_pkt);
+        }
+
+        /*
+         * Collect frames from the current block without consuming them.
+         * The frames we transmit ourselves show up as outgoing and are
+         * skipped.
+         */
+        ppd = s->rx_ppd;
+        while (walked < s->rx_left && n < AF_PACKET_BATCH) {
+            struct sockaddr_ll *sll = (struct sockaddr_ll *)
+                ((uint8_t *)ppd + TPACKET_ALIGN(sizeof(*ppd)));
+
+            walked++;
+            if (sll->sll_pkttype != PACKET_OUTGOING) {
+                pkts[n].iov = iov[n];
+                pkts[n].iovcnt = af_packet_rx_iov(ppd, iov[n], tags[n]);
+                frames[n++] = walked;
+            }
+            ppd = (struct tpacket3_hdr *)((uint8_t *)ppd + ppd->tp_next_offset);
+        }
+
+        sent = n ? qemu_sendv_packet_batch_async(&s->nc, pkts, n,
+                                                 af_packet_send_completed)
+                 : 0;
+        packets += n;
+
+        /*
+         * Hand frames back to the kernel up to and including one the
+         * peer has queued, since the queue keeps its own copy.
+         */
+        if (sent < n) {
+            walked = frames[sent];
+        }
+        while (walked--) {
+            af_packet_rx_advance(s);
+        }
+
+        if (sent < n) {
+            af_packet_read_poll(s, false);
+            break;
+        }
+    }
+}
+
+static void af_packet_cleanup(NetClientState *nc)
+{
+    AFPacketState *s = DO_UPCAST(AFPacketState, nc, nc);
+
+    qemu_purge_queued_packets(nc);
+    af_packet_poll(nc, false);
+    if (s->rx_ring) {
+        munmap(s->rx_ring, s->rx_ring_size + s->tx_ring_size);
+        s->rx_ring = NULL;
+        s->tx_ring = NULL;
+    }
+    if (s->fd >= 0) {
+        close(s->fd);
+        s->fd = -1;
+    }
+}
+
+/* Next fanout group id to try on hosts without PACKET_FANOUT_FLAG_UNIQUEID */
+static int af_packet_next_fanout;
+
+/*
+ * Create a new fanout group with the socket of the first queue and return
+ * its id, or -1 on error.  Group ids are shared by the whole host, so let
+ * the kernel pick an unused one if it can.  Otherwise try ids derived from
+ * our pid and a per-process counter until one is accepted; an id that is
+ * in use with another interface or type fails with EINVAL.
+ */
+static int af_packet_new_fanout(AFPacketState *s)
+{
+    int fanout, i;
+
+#ifdef PACKET_FANOUT_FLAG_UNIQUEID
+    socklen_t len = sizeof(fanout);
+
+    fanout = (PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_UNIQUEID) << 16;
+    if (setsockopt(s->fd, SOL_PACKET, PACKET_FANOUT, &fanout,
+                   sizeof(fanout)) == 0) {
+        if (getsockopt(s->fd, SOL_PACKET, PACKET_FANOUT, &fanout,
+                       &len) < 0) {
+            return -1;
+        }
+        return (fanout & 0xffff) | (PACKET_FANOUT_HASH << 16);
+    }
+    if (errno != EINVAL) {
+        return -1;
+    }
+#endif
+
+    for (i = 0; i <= 0xffff; i++) {
+        fanout = ((getpid() + af_packet_next_fanout++) & 0xffff) |
+                 (PACKET_FANOUT_HASH << 16);
+        if (setsockopt(s->fd, SOL_PACKET, PACKET_FANOUT, &fanout,
+                       sizeof(fanout)) == 0) {
+            return fanout;
+        }
+        if (errno != EINVAL && errno != EEXIST && errno != ENOSPC) {
+            return -1;
+        }
+    }
+    errno = EBUSY;
+    return -1;
+}
+
+static NetClientInfo net_af_packet_info = {
+    .type = NET_CLIENT_OPTIONS_KIND_AF_PACKET,
+    .size = sizeof(AFPacketState),
+    .receive = af_packet_receive,
+    .receive_iov = af_packet_receive_iov,
+    .receive_iov_batch = af_packet_receive_iov_batch,
+    .poll = af_packet_poll,
+    .cleanup = af_packet_cleanup,
+};
+
+/*
+ * Set up one queue: socket, rings and, for several queues, the fanout.
+ * A @fanout of -1 creates a new group and stores its id there.
+ */
+static int af_packet_open(AFPacketState *s, const char *ifname, int *fanout,
+                          Error **errp)
+{
+    struct tpacket_req3 req;
+    struct sockaddr_ll sll;
+    struct ifreq ifr;
+    int version = TPACKET_V3;
+    int one = 1;
+    void *ring;
+
+    s->fd = qemu_socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+    if (s->fd < 0) {
+        error_setg_errno(errp, errno, "af-packet: cannot create socket");
+        return -1;
+    }
+
+    memset(&ifr, 0, sizeof(ifr));
+    pstrcpy(ifr.ifr_name, sizeof(ifr.ifr_name), ifname);
+    if (ioctl(s->fd, SIOCGIFINDEX, &ifr) < 0) {
+        error_setg_errno(errp, errno, "af-packet: no interface %s", ifname);
+        return -1;
+    }
+    s->ifindex = ifr.ifr_ifindex;
+    if (ioctl(s->fd, SIOCGIFMTU, &ifr) < 0) {
+        error_setg_errno(errp, errno, "af-packet: cannot get MTU of %s",
+                         ifname);
+        return -1;
+    }
+
+    if (setsockopt(s->fd, SOL_PACKET, PACKET_VERSION, &version,
+                   sizeof(version)) < 0) {
+        error_setg_errno(errp, errno, "af-packet: TPACKET_V3 not supported");
+        return -1;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = AF_PACKET_BLOCK_SIZE;
+    req.tp_block_nr = AF_PACKET_BLOCKS;
+    req.tp_frame_size = TPACKET_ALIGNMENT << 7;
+    req.tp_frame_nr = AF_PACKET_BLOCK_SIZE / req.tp_frame_size *
+                      AF_PACKET_BLOCKS;
+    req.tp_retire_blk_tov = AF_PACKET_RETIRE_TOV;
+    if (setsockopt(s->fd, SOL_PACKET, PACKET_RX_RING, &req,
+                   sizeof(req)) < 0) {
+        error_setg_errno(errp, errno, "af-packet: cannot set up RX ring");
+        return -1;
+    }
+    s->rx_ring_size = (size_t)AF_PACKET_BLOCK_SIZE * AF_PACKET_BLOCKS;
+
+    /* Frames big enough for the MTU plus Ethernet and VLAN headers */
+    s->tx_frame_size = pow2ceil(TPACKET_ALIGN(sizeof(struct tpacket3_hdr)) +
+                                ifr.ifr_mtu + ETH_HLEN + 4);
+    s->tx_frame_size = MAX(s->tx_frame_size, getpagesize() / 2);
+    memset(&req, 0, sizeof(req));
+    req.tp_frame_size = s->tx_frame_size;
+    req.tp_frame_nr = AF_PACKET_TX_FRAMES;
+    req.tp_block_size = MAX(s->tx_frame_size, getpagesize());
+    req.tp_block_nr = AF_PACKET_TX_FRAMES * s->tx_frame_size /
+                      req.tp_block_size;
+    if (setsockopt(s->fd, SOL_PACKET, PACKET_TX_RING, &req,
+                   sizeof(req)) == 0) {
+        s->tx_ring_size = (size_t)AF_PACKET_TX_FRAMES * s->tx_frame_size;
+    }
+
+    ring = mmap(NULL, s->rx_ring_size + s->tx_ring_size,
+                PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, s->fd, 0);
+    if (ring == MAP_FAILED) {
+        ring = mmap(NULL, s->rx_ring_size + s->tx_ring_size,
+                    PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, 0);
+    }
+    if (ring == MAP_FAILED) {
+        error_setg_errno(errp, errno, "af-packet: cannot map rings");
+        return -1;
+    }
+    s->rx_ring = ring;
+    if (s->tx_ring_size) {
+        s->tx_ring = s->rx_ring + s->rx_ring_size;
+    }
+
+    /* Best effort: skip the host qdisc layer on transmit */
+    setsockopt(s->fd, SOL_PACKET, PACKET_QDISC_BYPASS, &one, sizeof(one));
+
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_ALL);
+    sll.sll_ifindex = s->ifindex;
+    if (bind(s->fd, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+        error_setg_errno(errp, errno, "af-packet: cannot bind to %s", ifname);
+        return -1;
+    }
+
+    if (fanout && *fanout < 0) {
+        *fanout = af_packet_new_fanout(s);
+        if (*fanout < 0) {
+            error_setg_errno(errp, errno,
+                             "af-packet: cannot create fanout group");
+            return -1;
+        }
+    } else if (fanout &&
+               setsockopt(s->fd, SOL_PACKET, PACKET_FANOUT, fanout,
+                          sizeof(*fanout)) < 0) {
+        error_setg_errno(errp, errno, "af-packet: cannot join fanout group");
+        return -1;
+    }
+
+    qemu_set_nonblock(s->fd);
+    return 0;
+}
+
+int net_init_af_packet(const NetClientOptions *opts, const char *name,
+                       NetClientState *peer, Error **errp)
+{
+    const NetdevAFPacketOptions *af_packet;
+    NetClientState *first = NULL;
+    int queues, fanout = -1, i;
+
+    assert(opts->type == NET_CLIENT_OPTIONS_KIND_AF_PACKET);
+    af_packet = opts->u.af_packet;
+
+    queues = af_packet->has_queues ? af_packet->queues : 1;
+    if (queues < 1 || queues > MAX_QUEUE_NUM) {
+        error_setg(errp, "af-packet: queues must be between 1 and %d",
+                   MAX_QUEUE_NUM);
+        return -1;
+    }
+    if (peer && queues > 1) {
+        error_setg(errp, "Multiqueue af-packet cannot be used with QEMU vlans");
+        return -1;
+    }
+    for (i = 0; i < queues; i++) {
+        NetClientState *nc;
+        AFPacketState *s;
+
+        nc = qemu_new_net_client(&net_af_packet_info, peer, "af-packet",
+                                 name);
+        s = DO_UPCAST(AFPacketState, nc, nc);
+        s->fd = -1;
+        if (!first) {
+            first = nc;
+        }
+        if (af_packet_open(s, af_packet->ifname,
+                           queues > 1 ? &fanout : NULL, errp) < 0) {
+            /* Deletes the queues set up so far as well, they share a name */
+            qemu_del_net_client(first);
+            return -1;
+        }
+        snprintf(nc->info_str, sizeof(nc->info_str),
+                 "af-packet: ifname=%s queue=%d tx-ring=%s",
+                 af_packet->ifname, i, s->tx_ring ? "on" : "off");
+        af_packet_read_poll(s, true);
+    }
+
+    return 0;
+}
@@ -0,0 +1,669 @@
+/*
+ * Receive-side TCP coalescing netfilter
+ *
+ * Merges in-order TCP segments arriving from a backend into large
+ * packets described by a virtio-net header, and software-segments
+ * TSO packets coming from the guest.  This gives backends without
+ * virtio-net header support (tap without vnet_hdr, socket, user) the
+ * offloads that tap with vnet_hdr gets from the host kernel.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "net/filter.h"
+#include "net/net.h"
+#include "net/eth.h"
+#include "net/checksum.h"
+#include "qemu-common.h"
+#include "qemu/timer.h"
+#include "qemu/iov.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qerror.h"
+#include "qapi-visit.h"
+#include "qom/object.h"
+#include "qom/object_interfaces.h"
+#include "standard-headers/linux/virtio_net.h"
+
+#define TYPE_FILTER_GRO "filter-gro"
+
+#define FILTER_GRO(obj) \
+    OBJECT_CHECK(FilterGROState, (obj), TYPE_FILTER_GRO)
+
+#define GRO_MAX_FLOWS       8
+#define GRO_MAX_IP_LEN      65535
+/* Ethernet header, one VLAN tag and the largest IP datagram */
+#define GRO_MAX_FRAME       (ETH_HLEN + 4 + GRO_MAX_IP_LEN)
+#define GRO_DEFAULT_TIMEOUT 50
+
+#ifndef TH_CWR
+#define TH_CWR  0x80
+#endif
+
+typedef struct GROPacket {
+    size_t l3_off;      /* IP header */
+    size_t l4_off;      /* TCP header */
+    size_t hdr_len;     /* up to the end of the TCP header */
+    size_t len;         /* Ethernet header and IP datagram, no padding */
+    bool ipv6;
+} GROPacket;
+
+typedef struct GROFlow {
+    QTAILQ_ENTRY(GROFlow) next;
+    GROPacket pkt;      /* pkt.len is the number of bytes held */
+    uint8_t *frame;
+    uint32_t next_seq;
+    uint16_t mss;
+    unsigned int segs;
+} GROFlow;
+
+typedef struct FilterGROState {
+    NetFilterState parent_obj;
+
+    uint32_t timeout;
+    QEMUTimer flush_timer;
+    GROFlow *flow_mem;
+    QTAILQ_HEAD(, GROFlow) flows;
+    QTAILQ_HEAD(, GROFlow) free_flows;
+    uint8_t *rx_buf;
+    uint8_t *tx_buf;
+    uint8_t *seg_buf;
+
+    uint64_t packets;
+    uint64_t coalesced;
+    uint64_t flushes;
+    uint64_t timer_flushes;
+    uint64_t segmented;
+    uint64_t dropped;
+} FilterGROState;
+
+/* Parse an Ethernet frame carrying an unfragmented TCP segment */
+static bool gro_parse_tcp(const uint8_t *frame, size_t len, GROPacket *p)
+{
+    const uint8_t *ip;
+    size_t l3 = ETH_HLEN;
+    size_t ip_len, ihl;
+    uint16_t proto;
+
+    if (len < ETH_HLEN) {
+        return false;
+    }
+    proto = lduw_be_p(frame + 12);
+    if (proto == ETH_P_VLAN) {
+        if (len < ETH_HLEN + 4) {
+            return false;
+        }
+        proto = lduw_be_p(frame + 16);
+        l3 += 4;
+    }
+    ip = frame + l3;
+
+    if (proto == ETH_P_IP) {
+        if (len < l3 + 20 || (ip[0] >> 4) != 4) {
+            return false;
+        }
+        ihl = (ip[0] & 0xf) * 4;
+        ip_len = lduw_be_p(ip + 2);
+        /* reject fragments: MF set or a non-zero offset */
+        if (ihl < 20 || ip_len < ihl || ip[9] != IP_PROTO_TCP ||
+            (lduw_be_p(ip + 6) & 0x3fff)) {
+            return false;
+        }
+        p->ipv6 = false;
+        p->l4_off = l3 + ihl;
+    } else if (proto == ETH_P_IPV6) {
+        if (len < l3 + 40 || (ip[0] >> 4) != 6 || ip[6] != IP_PROTO_TCP) {
+            return false;
+        }
+        ip_len = 40 + lduw_be_p(ip + 4);
+        p->ipv6 = true;
+        p->l4_off = l3 + 40;
+    } else {
+        return false;
+    }
+
+    p->l3_off = l3;
+    p->len = l3 + ip_len;
+    if (p->len > len || p->len < p->l4_off + 20) {
+        return false;
+    }
+    p->hdr_len = p->l4_off + (frame[p->l4_off + 12] >> 4) * 4;
+    return p->hdr_len >= p->l4_off + 20 && p->hdr_len <= p->len;
+}
+
+/* Sum of the pseudo header and the segment; 0 if the checksum is valid */
+static uint16_t gro_tcp_csum(uint8_t *frame, const GROPacket *p)
+{
+    uint8_t *ip = frame + p->l3_off;
+    size_t tcp_len = p->len - p->l4_off;
+    uint32_t sum;
+
+    if (p->ipv6) {
+        sum = net_checksum_add(32, ip + 8);
+    } else {
+        sum = net_checksum_add(8, ip + 12);
+    }
+    sum += IP_PROTO_TCP + tcp_len;
+    sum += net_checksum_add(tcp_len, frame + p->l4_off);
+    return net_checksum_finish(sum);
+}
+
+static void gro_ip4_csum(uint8_t *frame, const GROPacket *p)
+{
+    uint8_t *ip = frame + p->l3_off;
+
+    stw_be_p(ip + 10, 0);
+    stw_be_p(ip + 10,
+             net_checksum_finish(net_checksum_add(p->l4_off - p->l3_off, ip)));
+}
+
+static void gro_deliver(FilterGROState *s, const struct virtio_net_hdr *hdr,
+                        unsigned flags, uint8_t *buf, size_t len)
+{
+    NetFilterState *nf = NETFILTER(s);
+    struct virtio_net_hdr_mrg_rxbuf mhdr = { };
+    struct iovec iov[2];
+
+    if (hdr) {
+        mhdr.hdr = *hdr;
+    }
+    iov[0].iov_base = &mhdr;
+    iov[0].iov_len = nf->netdev->vnet_hdr_emu.len;
+    iov[1].iov_base = buf;
+    iov[1].iov_len = len;
+    qemu_netfilter_pass_to_next(nf->netdev, flags, iov, 2, nf);
+}
+
+static void gro_flush_flow(FilterGROState *s, GROFlow *f)
+{
+    struct virtio_net_hdr hdr = {
+        .flags = VIRTIO_NET_HDR_F_DATA_VALID,
+    };
+    uint8_t *ip = f->frame + f->pkt.l3_off;
+
+    QTAILQ_REMOVE(&s->flows, f, next);
+
+    /*
+     * The TCP checksum of a merged packet is left as it was in the first
+     * segment: every segment was verified, and DATA_VALID tells the guest
+     * not to look at it, same as GRO in the host kernel.
+     */
+    if (f->segs > 1) {
+        if (f->pkt.ipv6) {
+            stw_be_p(ip + 4, f->pkt.len - f->pkt.l4_off);
+            hdr.gso_type = VIRTIO_NET_HDR_GSO_TCPV6;
+        } else {
+            stw_be_p(ip + 2, f->pkt.len - f->pkt.l3_off);
+            gro_ip4_csum(f->frame, &f->pkt);
+            hdr.gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+        }
+        hdr.gso_size = f->mss;
+        hdr.hdr_len = f->pkt.hdr_len;
+    }
+
+    gro_deliver(s, &hdr, QEMU_NET_PACKET_FLAG_NONE, f->frame, f->pkt.len);
+    QTAILQ_INSERT_TAIL(&s->free_flows, f, next);
+    s->flushes++;
+}
+
+static void gro_flush_all(FilterGROState *s)
+{
+    GROFlow *f;
+
+    while ((f = QTAILQ_FIRST(&s->flows))) {
+        gro_flush_flow(s, f);
+    }
+}
+
+static void filter_gro_flush_timer(void *opaque)
+{
+    FilterGROState *s = opaque;
+
+    if (!QTAILQ_EMPTY(&s->flows)) {
+        s->timer_flushes++;
+        gro_flush_all(s);
+    }
+}
+
+static GROFlow *gro_lookup(FilterGROState *s, const uint8_t *frame,
+                           const GROPacket *p)
+{
+    const uint8_t *ip = frame + p->l3_off;
+    const uint8_t *th = frame + p->l4_off;
+    GROFlow *f;
+
+    QTAILQ_FOREACH(f, &s->flows, next) {
+        const uint8_t *fip = f->frame + f->pkt.l3_off;
+        const uint8_t *fth = f->frame + f->pkt.l4_off;
+
+        if (f->pkt.ipv6 != p->ipv6 || f->pkt.l3_off != p->l3_off ||
+            memcmp(fth, th, 4)) {
+            continue;
+        }
+        if (p->ipv6 ? !memcmp(fip + 8, ip + 8, 32)
+                    : !memcmp(fip + 12, ip + 12, 8)) {
+            return f;
+        }
+    }
+    return NULL;
+}
+
+/* Can segment @p, with @payload bytes of data, be appended to flow @f? */
+static bool gro_can_merge(GROFlow *f, const uint8_t *frame,
+                          const GROPacket *p, size_t payload)
+{
+    const uint8_t *ip = frame + p->l3_off;
+    const uint8_t *th = frame + p->l4_off;
+    const uint8_t *fip = f->frame + f->pkt.l3_off;
+    const uint8_t *fth = f->frame + f->pkt.l4_off;
+
+    if (p->l4_off != f->pkt.l4_off || p->hdr_len != f->pkt.hdr_len ||
+        ldl_be_p(th + 4) != f->next_seq || payload > f->mss ||
+        f->pkt.len - f->pkt.l3_off + payload > GRO_MAX_IP_LEN) {
+        return false;
+    }
+    /* same ack and identical options, timestamps included */
+    if (memcmp(th + 8, fth + 8, 4) ||
+        memcmp(th + 20, fth + 20, p->hdr_len - p->l4_off - 20)) {
+        return false;
+    }
+    if (p->ipv6) {
+        /* traffic class, flow label and hop limit */
+        return !memcmp(ip, fip, 4) && ip[7] == fip[7];
+    }
+    /* TOS, TTL and DF */
+    return ip[1] == fip[1] && ip[8] == fip[8] &&
+           !((ip[6] ^ fip[6]) & 0x40);
+}
+
+static GROFlow *gro_new_flow(FilterGROState *s)
+{
+    GROFlow *f = QTAILQ_FIRST(&s->free_flows);
+
+    if (!f) {
+        /* evict the oldest flow */
+        f = QTAILQ_FIRST(&s->flows);
+        gro_flush_flow(s, f);
+    }
+    QTAILQ_REMOVE(&s->free_flows, f, next);
+    QTAILQ_INSERT_TAIL(&s->flows, f, next);
+    return f;
+}
+
+/* Packets sent by the backend, towards the guest */
+static void filter_gro_receive_backend(FilterGROState *s, unsigned flags,
+                                       const struct iovec *iov, int iovcnt,
+                                       size_t size)
+{
+    NetVnetHdrEmulation *emu = &NETFILTER(s)->netdev->vnet_hdr_emu;
+    uint8_t *frame;
+    GROPacket p;
+    GROFlow *f;
+    size_t payload;
+    uint8_t th_flags;
+    bool enabled;
+
+    s->packets++;
+    if (iovcnt == 1) {
+        frame = iov[0].iov_base;
+    } else if (size <= GRO_MAX_FRAME) {
+        frame = s->rx_buf;
+        iov_to_buf(iov, iovcnt, 0, frame, size);
+    } else {
+        return;
+    }
+
+    if (!gro_parse_tcp(frame, size, &p)) {
+        gro_deliver(s, NULL, flags, frame, size);
+        return;
+    }
+
+    f = gro_lookup(s, frame, &p);
+    payload = p.len - p.hdr_len;
+    th_flags = frame[p.l4_off + 13];
+    enabled = emu->csum && (p.ipv6 ? emu->tso6 : emu->tso4);
+
+    if (!enabled || p.l3_off != ETH_HLEN || !payload ||
+        (th_flags & ~TH_PUSH) != TH_ACK || gro_tcp_csum(frame, &p)) {
+        if (f) {
+            gro_flush_flow(s, f);
+        }
+        gro_deliver(s, NULL, flags, frame, size);
+        return;
+    }
+
+    if (f && !gro_can_merge(f, frame, &p, payload)) {
+        gro_flush_flow(s, f);
+        f = NULL;
+    }
+
+    if (f) {
+        memcpy(f->frame + f->pkt.len, frame + p.hdr_len, payload);
+        f->pkt.len += payload;
+        f->segs++;
+        /* the latest window wins */
+        memcpy(f->frame + f->pkt.l4_off + 14, frame + p.l4_off + 14, 2);
+        f->frame[f->pkt.l4_off + 13] |= th_flags;
+        s->coalesced++;
+    } else {
+        f = gro_new_flow(s);
+        memcpy(f->frame, frame, p.len);
+        f->pkt = p;
+        f->mss = payload;
+        f->next_seq = ldl_be_p(frame + p.l4_off + 4);
+        f->segs = 1;
+    }
+    f->next_seq += payload;
+
+    /* a short or pushed segment ends the train */
+    if (payload < f->mss || (th_flags & TH_PUSH)) {
+        gro_flush_flow(s, f);
+    } else if (!timer_pending(&s->flush_timer)) {
+        timer_mod(&s->flush_timer,
+                  qemu_clock_get_us(QEMU_CLOCK_VIRTUAL) + s->timeout);
+    }
+}
+
+/* Split a TSO packet from the guest into @mss sized segments */
+static void gro_segment(FilterGROState *s, NetClientState *sender,
+                        unsigned flags, uint8_t *frame, const GROPacket *p,
+                        uint16_t mss)
+{
+    NetFilterState *nf = NETFILTER(s);
+    size_t payload = p->len - p->hdr_len;
+    uint32_t seq = ldl_be_p(frame + p->l4_off + 4);
+    uint16_t id = lduw_be_p(frame + p->l3_off + 4);
+    uint8_t th_flags = frame[p->l4_off + 13];
+    GROPacket sp = *p;
+    size_t off, n;
+
+    for (off = 0; off < payload; off += n) {
+        uint8_t *ip = s->seg_buf + p->l3_off;
+        uint8_t *th = s->seg_buf + p->l4_off;
+        struct iovec iov;
+
+        n = MIN(mss, payload - off);
+        memcpy(s->seg_buf, frame, p->hdr_len);
+        memcpy(s->seg_buf + p->hdr_len, frame + p->hdr_len + off, n);
+        sp.len = p->hdr_len + n;
+
+        if (p->ipv6) {
+            stw_be_p(ip + 4, sp.len - p->l4_off);
+        } else {
+            stw_be_p(ip + 2, sp.len - p->l3_off);
+            stw_be_p(ip + 4, id++);
+            gro_ip4_csum(s->seg_buf, &sp);
+        }
+
+        stl_be_p(th + 4, seq + off);
+        th[13] = th_flags;
+        if (off) {
+            th[13] &= ~TH_CWR;
+        }
+        if (off + n < payload) {
+            th[13] &= ~(TH_FIN | TH_PUSH);
+        }
+        stw_be_p(th + 16, 0);
+        stw_be_p(th + 16, gro_tcp_csum(s->seg_buf, &sp));
+
+        iov.iov_base = s->seg_buf;
+        iov.iov_len = sp.len;
+        qemu_netfilter_pass_to_next(sender, flags, &iov, 1, nf);
+    }
+}
+
+/* Packets sent by the guest, towards the backend */
+static void filter_gro_receive_guest(FilterGROState *s, NetClientState *sender,
+                                     unsigned flags, const struct iovec *iov,
+                                     int iovcnt, size_t size)
+{
+    NetFilterState *nf = NETFILTER(s);
+    size_t hdr_len = nf->netdev->vnet_hdr_emu.len;
+    struct virtio_net_hdr hdr;
+    struct iovec vec;
+    uint8_t *frame = s->tx_buf;
+    size_t len, start, off;
+    uint8_t gso;
+    GROPacket p;
+
+    if (size < hdr_len) {
+        return;
+    }
+    iov_to_buf(iov, iovcnt, 0, &hdr, sizeof(hdr));
+    gso = hdr.gso_type & ~VIRTIO_NET_HDR_GSO_ECN;
+
+    if (!(hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) &&
+        gso == VIRTIO_NET_HDR_GSO_NONE) {
+        struct iovec vec[iovcnt];
+        int cnt = iov_copy(vec, iovcnt, iov, iovcnt, hdr_len, size - hdr_len);
+
+        qemu_netfilter_pass_to_next(sender, flags, vec, cnt, nf);
+        return;
+    }
+
+    len = size - hdr_len;
+    if (len > GRO_MAX_FRAME) {
+        s->dropped++;
+        return;
+    }
+    iov_to_buf(iov, iovcnt, hdr_len, frame, len);
+
+    if (gso != VIRTIO_NET_HDR_GSO_NONE) {
+        /* Anything else would reach the backend as one oversized frame */
+        if ((gso == VIRTIO_NET_HDR_GSO_TCPV4 ||
+             gso == VIRTIO_NET_HDR_GSO_TCPV6) &&
+            hdr.gso_size && gro_parse_tcp(frame, len, &p)) {
+            gro_segment(s, sender, flags, frame, &p, hdr.gso_size);
+            s->segmented++;
+        } else {
+            s->dropped++;
+        }
+        return;
+    }
+
+    if (hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+        /* the field holds the pseudo header sum, fold in the rest */
+        start = hdr.csum_start;
+        off = start + hdr.csum_offset;
+        if (start < len && off + 2 <= len) {
+            stw_be_p(frame + off,
+                     net_checksum_finish(net_checksum_add(len - start,
+                                                          frame + start)));
+        }
+    }
+
+    vec.iov_base = frame;
+    vec.iov_len = len;
+    qemu_netfilter_pass_to_next(sender, flags, &vec, 1, nf);
+}
+
+/* filter APIs */
+static ssize_t filter_gro_receive_iov(NetFilterState *nf,
+                                      NetClientState *sender,
+                                      unsigned flags,
+                                      const struct iovec *iov,
+                                      int iovcnt,
+                                      NetPacketSent *sent_cb)
+{
+    FilterGROState *s = FILTER_GRO(nf);
+    size_t size = iov_size(iov, iovcnt);
+
+    if (!nf->netdev->vnet_hdr_emu.active) {
+        /* the NIC does not use virtio-net headers */
+        return 0;
+    }
+
+    /*
+     * Like filter-buffer, we always take the packet and pass it on with
+     * qemu_netfilter_pass_to_next(), so the receiver can no longer push
+     * back on the sender through sent_cb.
+     */
+    if (sender == nf->netdev) {
+        filter_gro_receive_backend(s, flags, iov, iovcnt, size);
+    } else {
+        filter_gro_receive_guest(s, sender, flags, iov, iovcnt, size);
+    }
+    return size;
+}
+
+static void filter_gro_cleanup(NetFilterState *nf)
+{
+    FilterGROState *s = FILTER_GRO(nf);
+
+    if (!s->flow_mem) {
+        return;
+    }
+
+    timer_del(&s->flush_timer);
+    gro_flush_all(s);
+    memset(&nf->netdev->vnet_hdr_emu, 0, sizeof(nf->netdev->vnet_hdr_emu));
+
+    while (!QTAILQ_EMPTY(&s->free_flows)) {
+        GROFlow *f = QTAILQ_FIRST(&s->free_flows);
+
+        QTAILQ_REMOVE(&s->free_flows, f, next);
+        g_free(f->frame);
+    }
+    g_free(s->flow_mem);
+    g_free(s->rx_buf);
+    g_free(s->tx_buf);
+    g_free(s->seg_buf);
+}
+
+static void filter_gro_setup(NetFilterState *nf, Error **errp)
+{
+    FilterGROState *s = FILTER_GRO(nf);
+    NetClientState *nc = nf->netdev;
+    int i;
+
+    if (nf->direction != NET_FILTER_DIRECTION_ALL) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "queue", "all");
+        return;
+    }
+    if (qemu_has_vnet_hdr(nc)) {
+        error_setg(errp, "netdev '%s' already handles virtio-net headers",
+                   nf->netdev_id);
+        return;
+    }
+    /* the NIC checks for header support when it is created */
+    if (nc->peer) {
+        error_setg(errp, "filter-gro must be created before the NIC "
+                   "attached to netdev '%s'", nf->netdev_id);
+        return;
+    }
+
+    QTAILQ_INIT(&s->flows);
+    QTAILQ_INIT(&s->free_flows);
+    s->flow_mem = g_new0(GROFlow, GRO_MAX_FLOWS);
+    for (i = 0; i < GRO_MAX_FLOWS; i++) {
+        s->flow_mem[i].frame = g_malloc(GRO_MAX_FRAME);
+        QTAILQ_INSERT_TAIL(&s->free_flows, &s->flow_mem[i], next);
+    }
+    s->rx_buf = g_malloc(GRO_MAX_FRAME);
+    s->tx_buf = g_malloc(GRO_MAX_FRAME);
+    s->seg_buf = g_malloc(GRO_MAX_FRAME);
+    timer_init_us(&s->flush_timer, QEMU_CLOCK_VIRTUAL,
+                  filter_gro_flush_timer, s);
+
+    nc->vnet_hdr_emu.enabled = true;
+    nc->vnet_hdr_emu.len = sizeof(struct virtio_net_hdr);
+}
+
+static void filter_gro_status_changed(NetFilterState *nf, Error **errp)
+{
+    if (!nf->on) {
+        nf->on = true;
+        error_setg(errp, "filter-gro provides the virtio-net header for "
+                   "netdev '%s' and cannot be turned off", nf->netdev_id);
+    }
+}
+
+static bool filter_gro_can_be_deleted(UserCreatable *uc, Error **errp)
+{
+    NetFilterState *nf = NETFILTER(uc);
+
+    if (nf->netdev && nf->netdev->peer) {
+        error_setg(errp, "filter-gro is in use by the NIC attached to "
+                   "netdev '%s'", nf->netdev_id);
+        return false;
+    }
+    return true;
+}
+
+static void filter_gro_class_init(ObjectClass *oc, void *data)
+{
+    NetFilterClass *nfc = NETFILTER_CLASS(oc);
+    UserCreatableClass *ucc = USER_CREATABLE_CLASS(oc);
+
+    nfc->setup = filter_gro_setup;
+    nfc->cleanup = filter_gro_cleanup;
+    nfc->receive_iov = filter_gro_receive_iov;
+    nfc->status_changed = filter_gro_status_changed;
+    ucc->can_be_deleted = filter_gro_can_be_deleted;
+}
+
+static void filter_gro_get_timeout(Object *obj, Visitor *v,
+                                   const char *name, void *opaque,
+                                   Error **errp)
+{
+    FilterGROState *s = FILTER_GRO(obj);
+    uint32_t value = s->timeout;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void filter_gro_set_timeout(Object *obj, Visitor *v,
+                                   const char *name, void *opaque,
+                                   Error **errp)
+{
+    FilterGROState *s = FILTER_GRO(obj);
+    Error *local_err = NULL;
+    uint32_t value;
+
+    visit_type_uint32(v, name, &value, &local_err);
+    if (local_err) {
+        goto out;
+    }
+    if (!value) {
+        error_setg(&local_err, "Property '%s.%s' requires a positive value",
+                   object_get_typename(obj), name);
+        goto out;
+    }
+    s->timeout = value;
+
+out:
+    error_propagate(errp, local_err);
+}
+
+static void filter_gro_init(Object *obj)
+{
+    FilterGROState *s = FILTER_GRO(obj);
+
+    s->timeout = GRO_DEFAULT_TIMEOUT;
+    object_property_add(obj, "timeout", "int",
+                        filter_gro_get_timeout,
+                        filter_gro_set_timeout, NULL, NULL, NULL);
+    object_property_add_uint64_ptr(obj, "packets", &s->packets, NULL);
+    object_property_add_uint64_ptr(obj, "coalesced", &s->coalesced, NULL);
+    object_property_add_uint64_ptr(obj, "flushes", &s->flushes, NULL);
+    object_property_add_uint64_ptr(obj, "timer-flushes", &s->timer_flushes,
+                                   NULL);
+    object_property_add_uint64_ptr(obj, "segmented", &s->segmented, NULL);
+    object_property_add_uint64_ptr(obj, "dropped", &s->dropped, NULL);
+}
+
+static const TypeInfo filter_gro_info = {
+    .name = TYPE_FILTER_GRO,
+    .parent = TYPE_NETFILTER,
+    .class_init = filter_gro_class_init,
+    .instance_init = filter_gro_init,
+    .instance_size = sizeof(FilterGROState),
+};
+
+static void register_types(void)
+{
+    type_register_static(&filter_gro_info);
+}
+
+type_init(register_types);
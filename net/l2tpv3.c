@@ -62,8 +62,8 @@ typedef struct NetL2TPV3State {
     int fd;
 
     /*
-     * these are used for xmit - that happens packet a time
-     * and for first sign of life packet (easier to parse that once)
+     * these are used for xmit - header_buf holds one header per
+     * message of a sendmmsg() batch, single packets use the first
      */
 
     uint8_t *header_buf;
@@ -179,32 +179,32 @@ static void l2tpv3_poll(NetClientState *nc, bool enable)
     l2tpv3_read_poll(s, enable);
 }
 
-static void l2tpv3_form_header(NetL2TPV3State *s)
+static void l2tpv3_form_header(NetL2TPV3State *s, uint8_t *header_buf)
 {
     uint32_t *counter;
 
     if (s->udp) {
-        stl_be_p((uint32_t *) s->header_buf, L2TPV3_DATA_PACKET);
+        stl_be_p((uint32_t *) header_buf, L2TPV3_DATA_PACKET);
     }
     stl_be_p(
-            (uint32_t *) (s->header_buf + s->session_offset),
+            (uint32_t *) (header_buf + s->session_offset),
             s->tx_session
         );
     if (s->cookie) {
         if (s->cookie_is_64) {
             stq_be_p(
-                (uint64_t *)(s->header_buf + s->cookie_offset),
+                (uint64_t *)(header_buf + s->cookie_offset),
                 s->tx_cookie
             );
         } else {
             stl_be_p(
-                (uint32_t *) (s->header_buf + s->cookie_offset),
+                (uint32_t *) (header_buf + s->cookie_offset),
                 s->tx_cookie
             );
         }
     }
     if (s->has_counter) {
-        counter = (uint32_t *)(s->header_buf + s->counter_offset);
+        counter = (uint32_t *)(header_buf + s->counter_offset);
         if (s->pin_counter) {
             *counter = 0;
         } else {
@@ -229,7 +229,7 @@ static ssize_t net_l2tpv3_receive_dgram_iov(NetClientState *nc,
         );
         return -1;
     }
-    l2tpv3_form_header(s);
+    l2tpv3_form_header(s, s->header_buf);
     memcpy(s->vec + 1, iov, iovcnt * sizeof(struct iovec));
     s->vec->iov_base = s->header_buf;
     s->vec->iov_len = s->offset;
@@ -271,7 +271,7 @@ static ssize_t net_l2tpv3_receive_dgram(NetClientState *nc,
     struct msghdr message;
     ssize_t ret = 0;
 
-    l2tpv3_form_header(s);
+    l2tpv3_form_header(s, s->header_buf);
     vec = s->vec;
     vec->iov_base = s->header_buf;
     vec->iov_len = s->offset;
@@ -306,6 +306,72 @@ static ssize_t net_l2tpv3_receive_dgram(NetClientState *nc,
     return ret;
 }
 
+#ifdef CONFIG_SENDMMSG
+static int net_l2tpv3_receive_dgram_batch(NetClientState *nc,
+                                          const NetPacketIOV *pkts, int count)
+{
+    NetL2TPV3State *s = DO_UPCAST(NetL2TPV3State, nc, nc);
+    struct mmsghdr msgs[MAX_L2TPV3_MSGCNT];
+    int done = 0;
+
+    while (done < count) {
+        int n = 0, used = 0, ret;
+
+        if (pkts[done].iovcnt > MAX_L2TPV3_IOVCNT - 1) {
+            /* reports the error and drops it */
+            net_l2tpv3_receive_dgram_iov(nc, pkts[done].iov,
+                                         pkts[done].iovcnt);
+            done++;
+            continue;
+        }
+
+        /* one header plus the packet's iovecs per message */
+        while (done + n < count && n < MAX_L2TPV3_MSGCNT &&
+               used + pkts[done + n].iovcnt + 1 <= MAX_L2TPV3_IOVCNT) {
+            const NetPacketIOV *pkt = &pkts[done + n];
+            uint8_t *header_buf = s->header_buf + n * s->header_size;
+            struct iovec *vec = s->vec + used;
+
+            l2tpv3_form_header(s, header_buf);
+            vec->iov_base = header_buf;
+            vec->iov_len = s->offset;
+            memcpy(vec + 1, pkt->iov, pkt->iovcnt * sizeof(struct iovec));
+
+            memset(&msgs[n], 0, sizeof(msgs[n]));
+            msgs[n].msg_hdr.msg_name = s->dgram_dst;
+            msgs[n].msg_hdr.msg_namelen = s->dst_size;
+            msgs[n].msg_hdr.msg_iov = vec;
+            msgs[n].msg_hdr.msg_iovlen = pkt->iovcnt + 1;
+            used += pkt->iovcnt + 1;
+            n++;
+        }
+
+        do {
+            ret = sendmmsg(s->fd, msgs, n, 0);
+        } while ((ret == -1) && (errno == EINTR));
+        if (ret < 0) {
+            if (errno != EAGAIN && errno != ENOBUFS) {
+                /* dropped, as on a sendmsg() error */
+                done += n;
+                continue;
+            }
+            ret = 0;
+        }
+        done += ret;
+        if (ret < n) {
+            /* headers not sent will be formed again */
+            if (s->has_counter && !s->pin_counter) {
+                s->counter -= n - ret;
+            }
+            /* signal upper layer that socket buffer is full */
+            l2tpv3_write_poll(s, true);
+            break;
+        }
+    }
+    return done;
+}
+#endif
+
 static int l2tpv3_verify_header(NetL2TPV3State *s, uint8_t *buf)
 {
 
@@ -346,54 +412,54 @@ static int l2tpv3_verify_header(NetL2TPV3State *s, uint8_t *buf)
 
 static void net_l2tpv3_process_queue(NetL2TPV3State *s)
 {
-    int size = 0;
+    struct iovec iov[MAX_L2TPV3_MSGCNT];
+    NetPacketIOV pkts[MAX_L2TPV3_MSGCNT];
     struct iovec *vec;
-    bool bad_read;
     int data_size;
     struct mmsghdr *msgvec;
 
     /* go into ring mode only if there is a "pending" tail */
-    if (s->queue_depth > 0) {
-        do {
+    while ((s->queue_depth > 0) && qemu_can_send_packet(&s->nc)) {
+        int n, sent;
+
+        /* hand the run of good packets at the tail over in one go */
+        for (n = 0; n < s->queue_depth; n++) {
+            msgvec = s->msgvec + (s->queue_tail + n) % MAX_L2TPV3_MSGCNT;
+            data_size = msgvec->msg_len - s->header_size;
+            vec = msgvec->msg_hdr.msg_iov;
+            if ((msgvec->msg_len == 0) || (data_size <= 0) ||
+                (l2tpv3_verify_header(s, vec->iov_base) != 0)) {
+                break;
+            }
+            iov[n].iov_base = vec[1].iov_base;
+            iov[n].iov_len = data_size;
+            pkts[n].iov = &iov[n];
+            pkts[n].iovcnt = 1;
+        }
+
+        if (n == 0) {
             msgvec = s->msgvec + s->queue_tail;
-            if (msgvec->msg_len > 0) {
-                data_size = msgvec->msg_len - s->header_size;
-                vec = msgvec->msg_hdr.msg_iov;
-                if ((data_size > 0) &&
-                    (l2tpv3_verify_header(s, vec->iov_base) == 0)) {
-                    vec++;
-                    /* Use the legacy delivery for now, we will
-                     * switch to using our own ring as a queueing mechanism
-                     * at a later date
-                     */
-                    size = qemu_send_packet_async(
-                            &s->nc,
-                            vec->iov_base,
-                            data_size,
-                            l2tpv3_send_completed
-                        );
-                    if (size == 0) {
-                        l2tpv3_read_poll(s, false);
-                    }
-                    bad_read = false;
-                } else {
-                    bad_read = true;
-                    if (!s->header_mismatch) {
-                        /* report error only once */
-                        error_report("l2tpv3 header verification failed");
-                        s->header_mismatch = true;
-                    }
-                }
-            } else {
-                bad_read = true;
+            if ((msgvec->msg_len > 0) && !s->header_mismatch) {
+                /* report error only once */
+                error_report("l2tpv3 header verification failed");
+                s->header_mismatch = true;
             }
             s->queue_tail = (s->queue_tail + 1) % MAX_L2TPV3_MSGCNT;
             s->queue_depth--;
-        } while (
-                (s->queue_depth > 0) &&
-                 qemu_can_send_packet(&s->nc) &&
-                ((size > 0) || bad_read)
-            );
+            continue;
+        }
+
+        sent = qemu_sendv_packet_batch_async(&s->nc, pkts, n,
+                                             l2tpv3_send_completed);
+        if (sent < n) {
+            /* pkts[sent] has been queued, the rest stay in the ring */
+            l2tpv3_read_poll(s, false);
+            s->queue_tail = (s->queue_tail + sent + 1) % MAX_L2TPV3_MSGCNT;
+            s->queue_depth -= sent + 1;
+            break;
+        }
+        s->queue_tail = (s->queue_tail + sent) % MAX_L2TPV3_MSGCNT;
+        s->queue_depth -= sent;
     }
 }
 
@@ -520,6 +586,9 @@ static NetClientInfo net_l2tpv3_info = {
     .size = sizeof(NetL2TPV3State),
     .receive = net_l2tpv3_receive_dgram,
     .receive_iov = net_l2tpv3_receive_dgram_iov,
+#ifdef CONFIG_SENDMMSG
+    .receive_iov_batch = net_l2tpv3_receive_dgram_batch,
+#endif
     .poll = l2tpv3_poll,
     .cleanup = net_l2tpv3_cleanup,
 };
@@ -719,7 +788,7 @@ int net_init_l2tpv3(const NetClientOptions *opts,
 
     s->msgvec = build_l2tpv3_vector(s, MAX_L2TPV3_MSGCNT);
     s->vec = g_new(struct iovec, MAX_L2TPV3_IOVCNT);
-    s->header_buf = g_malloc(s->header_size);
+    s->header_buf = g_malloc(MAX_L2TPV3_MSGCNT * s->header_size);
 
     qemu_set_nonblock(fd);
 
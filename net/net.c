@@ -28,6 +28,7 @@
 #include "hub.h"
 #include "net/slirp.h"
 #include "net/eth.h"
+#include "standard-headers/linux/virtio_net.h"
 #include "util.h"
 
 #include "monitor/monitor.h"
@@ -64,6 +65,9 @@ const char *host_net_devices[] = {
 #ifdef CONFIG_NETMAP
     "netmap",
 #endif
+#ifdef CONFIG_AF_PACKET
+    "af-packet",
+#endif
 #ifdef CONFIG_SLIRP
     "user",
 #endif
@@ -469,6 +473,10 @@ void qemu_foreach_nic(qemu_nic_foreach func, void *opaque)
 
 bool qemu_has_ufo(NetClientState *nc)
 {
+    /* filter-gro can only segment TCP */
+    if (nc && nc->vnet_hdr_emu.enabled) {
+        return false;
+    }
     if (!nc || !nc->info->has_ufo) {
         return false;
     }
@@ -478,6 +486,9 @@ bool qemu_has_ufo(NetClientState *nc)
 
 bool qemu_has_vnet_hdr(NetClientState *nc)
 {
+    if (nc && nc->vnet_hdr_emu.enabled) {
+        return true;
+    }
     if (!nc || !nc->info->has_vnet_hdr) {
         return false;
     }
@@ -487,6 +498,10 @@ bool qemu_has_vnet_hdr(NetClientState *nc)
 
 bool qemu_has_vnet_hdr_len(NetClientState *nc, int len)
 {
+    if (nc && nc->vnet_hdr_emu.enabled) {
+        return len == sizeof(struct virtio_net_hdr) ||
+               len == sizeof(struct virtio_net_hdr_mrg_rxbuf);
+    }
     if (!nc || !nc->info->has_vnet_hdr_len) {
         return false;
     }
@@ -496,6 +511,10 @@ bool qemu_has_vnet_hdr_len(NetClientState *nc, int len)
 
 void qemu_using_vnet_hdr(NetClientState *nc, bool enable)
 {
+    if (nc && nc->vnet_hdr_emu.enabled) {
+        nc->vnet_hdr_emu.active = enable;
+        return;
+    }
     if (!nc || !nc->info->using_vnet_hdr) {
         return;
     }
@@ -506,6 +525,13 @@ void qemu_using_vnet_hdr(NetClientState *nc, bool enable)
 void qemu_set_offload(NetClientState *nc, int csum, int tso4, int tso6,
                           int ecn, int ufo)
 {
+    if (nc && nc->vnet_hdr_emu.enabled) {
+        nc->vnet_hdr_emu.csum = csum;
+        nc->vnet_hdr_emu.tso4 = tso4;
+        nc->vnet_hdr_emu.tso6 = tso6;
+        nc->vnet_hdr_emu.ecn = ecn;
+        return;
+    }
     if (!nc || !nc->info->set_offload) {
         return;
     }
@@ -515,6 +541,10 @@ void qemu_set_offload(NetClientState *nc, int csum, int tso4, int tso6,
 
 void qemu_set_vnet_hdr_len(NetClientState *nc, int len)
 {
+    if (nc && nc->vnet_hdr_emu.enabled) {
+        nc->vnet_hdr_emu.len = len;
+        return;
+    }
     if (!nc || !nc->info->set_vnet_hdr_len) {
         return;
     }
@@ -795,6 +825,64 @@ qemu_sendv_packet(NetClientState *nc, const struct iovec *iov, int iovcnt)
     return qemu_sendv_packet_async(nc, iov, iovcnt, NULL);
 }
 
+static int qemu_deliver_packet_batch(NetClientState *sender,
+                                     const NetPacketIOV *pkts,
+                                     int count,
+                                     void *opaque)
+{
+    NetClientState *nc = opaque;
+    int ret;
+
+    if (nc->link_down) {
+        return count;
+    }
+
+    if (nc->receive_disabled) {
+        return 0;
+    }
+
+    ret = nc->info->receive_iov_batch(nc, pkts, count);
+    if (ret < count) {
+        nc->receive_disabled = 1;
+    }
+
+    return ret;
+}
+
+/*
+ * Send several packets with as few calls into the peer as possible.
+ * Returns the number of packets consumed.  If that is less than @count,
+ * the next packet has been queued and @sent_cb will be called for it, as
+ * when qemu_sendv_packet_async returns 0; the packets after it have not
+ * been looked at.
+ */
+int qemu_sendv_packet_batch_async(NetClientState *sender,
+                                  const NetPacketIOV *pkts, int count,
+                                  NetPacketSent *sent_cb)
+{
+    NetClientState *peer = sender->peer;
+    int i;
+
+    if (sender->link_down || !peer) {
+        return count;
+    }
+
+    /* Filters work on one packet at a time */
+    if (!peer->info->receive_iov_batch ||
+        !QTAILQ_EMPTY(&sender->filters) || !QTAILQ_EMPTY(&peer->filters)) {
+        for (i = 0; i < count; i++) {
+            if (qemu_sendv_packet_async(sender, pkts[i].iov, pkts[i].iovcnt,
+                                        sent_cb) == 0) {
+                return i;
+            }
+        }
+        return count;
+    }
+
+    return qemu_net_queue_send_batch(peer->incoming_queue, sender, pkts, count,
+                                     qemu_deliver_packet_batch, sent_cb);
+}
+
 NetClientState *qemu_find_netdev(const char *id)
 {
     NetClientState *nc;
@@ -968,6 +1056,9 @@ static int (* const net_client_init_fun[NET_CLIENT_OPTIONS_KIND__MAX])(
 #endif
 #ifdef CONFIG_NETMAP
         [NET_CLIENT_OPTIONS_KIND_NETMAP]    = net_init_netmap,
+#endif
+#ifdef CONFIG_AF_PACKET
+        [NET_CLIENT_OPTIONS_KIND_AF_PACKET] = net_init_af_packet,
 #endif
         [NET_CLIENT_OPTIONS_KIND_DUMP]      = net_init_dump,
 #ifdef CONFIG_NET_BRIDGE
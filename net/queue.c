@@ -232,6 +232,36 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
     return ret;
 }
 
+/* Like qemu_net_queue_send_iov, for several packets at once.  If fewer
+ * than @count packets are consumed, the first one left over is queued and
+ * @sent_cb is called for it later; the rest are left to the caller.
+ */
+int qemu_net_queue_send_batch(NetQueue *queue,
+                              NetClientState *sender,
+                              const NetPacketIOV *pkts,
+                              int count,
+                              NetQueueDeliverBatchFunc *deliver,
+                              NetPacketSent *sent_cb)
+{
+    int ret = 0;
+
+    if (!queue->delivering && qemu_can_send_packet(sender)) {
+        queue->delivering = 1;
+        ret = deliver(sender, pkts, count, queue->opaque);
+        queue->delivering = 0;
+    }
+
+    if (ret < count) {
+        qemu_net_queue_append_iov(queue, sender, QEMU_NET_PACKET_FLAG_NONE,
+                                  pkts[ret].iov, pkts[ret].iovcnt, sent_cb);
+        return ret;
+    }
+
+    qemu_net_queue_flush(queue);
+
+    return ret;
+}
+
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
 {
     NetPacket *packet, *next;
@@ -142,7 +142,7 @@ static int net_slirp_init(NetClientState *peer, const char *model,
                           const char *bootfile, const char *vdhcp_start,
                           const char *vnameserver, const char *vnameserver6,
                           const char *smb_export, const char *vsmbserver,
-                          const char **dnssearch)
+                          const char **dnssearch, bool thread)
 {
     /* default settings according to historic slirp */
     struct in_addr net  = { .s_addr = htonl(0x0a000200) }; /* 10.0.2.0 */
@@ -335,6 +335,11 @@ static int net_slirp_init(NetClientState *peer, const char *model,
     }
 #endif
 
+    if (thread && slirp_start_thread(s->slirp) < 0) {
+        error_report("could not start the user mode network thread");
+        goto error;
+    }
+
     return 0;
 
 error:
@@ -832,7 +837,8 @@ int net_init_slirp(const NetClientOptions *opts, const char *name,
                          user->ip6_host, user->hostname, user->tftp,
                          user->bootfile, user->dhcpstart,
                          user->dns, user->ip6_dns, user->smb,
-                         user->smbserver, dnssearch);
+                         user->smbserver, dnssearch,
+                         user->has_thread && user->thread);
 
     while (slirp_configs) {
         config = slirp_configs;
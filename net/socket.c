@@ -33,6 +33,9 @@
 #include "qemu/iov.h"
 #include "qemu/main-loop.h"
 
+/* Datagrams read with one recvmmsg() call */
+#define NET_SOCKET_BATCH 16
+
 typedef struct NetSocketState {
     NetClientState nc;
     int listen_fd;
@@ -46,6 +49,7 @@ typedef struct NetSocketState {
     IOHandler *send_fn;           /* differs between SOCK_STREAM/SOCK_DGRAM */
     bool read_poll;               /* waiting to receive data? */
     bool write_poll;              /* waiting to transmit data? */
+    uint8_t (*batch_buf)[NET_BUFSIZE]; /* recvmmsg() buffers (only SOCK_DGRAM) */
 } NetSocketState;
 
 static void net_socket_accept(void *opaque);
@@ -115,15 +119,28 @@ static ssize_t net_socket_receive(NetClientState *nc, const uint8_t *buf, size_t
     return size;
 }
 
+/* Connected datagram sockets (fd=) have no destination of their own */
+static struct sockaddr *net_socket_dgram_dst(NetSocketState *s,
+                                             socklen_t *len)
+{
+    if (s->dgram_dst.sin_family == 0) {
+        *len = 0;
+        return NULL;
+    }
+    *len = sizeof(s->dgram_dst);
+    return (struct sockaddr *)&s->dgram_dst;
+}
+
 static ssize_t net_socket_receive_dgram(NetClientState *nc, const uint8_t *buf, size_t size)
 {
     NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
+    struct sockaddr *dst;
+    socklen_t dst_len;
     ssize_t ret;
 
+    dst = net_socket_dgram_dst(s, &dst_len);
     do {
-        ret = qemu_sendto(s->fd, buf, size, 0,
-                          (struct sockaddr *)&s->dgram_dst,
-                          sizeof(s->dgram_dst));
+        ret = qemu_sendto(s->fd, buf, size, 0, dst, dst_len);
     } while (ret == -1 && errno == EINTR);
 
     if (ret == -1 && errno == EAGAIN) {
@@ -133,6 +150,44 @@ static ssize_t net_socket_receive_dgram(NetClientState *nc, const uint8_t *buf,
     return ret;
 }
 
+#ifdef CONFIG_SENDMMSG
+static int net_socket_receive_dgram_batch(NetClientState *nc,
+                                          const NetPacketIOV *pkts, int count)
+{
+    NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
+    struct mmsghdr msgs[count];
+    struct sockaddr *dst;
+    socklen_t dst_len;
+    int i, ret;
+
+    dst = net_socket_dgram_dst(s, &dst_len);
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < count; i++) {
+        msgs[i].msg_hdr.msg_name = dst;
+        msgs[i].msg_hdr.msg_namelen = dst_len;
+        msgs[i].msg_hdr.msg_iov = (struct iovec *)pkts[i].iov;
+        msgs[i].msg_hdr.msg_iovlen = pkts[i].iovcnt;
+    }
+
+    do {
+        ret = sendmmsg(s->fd, msgs, count, 0);
+    } while (ret == -1 && errno == EINTR);
+
+    if (ret == -1) {
+        if (errno == EAGAIN) {
+            net_socket_write_poll(s, true);
+            return 0;
+        }
+        /* Same as a failed sendto(): the packets are dropped */
+        return count;
+    }
+    if (ret < count) {
+        net_socket_write_poll(s, true);
+    }
+    return ret;
+}
+#endif
+
 static void net_socket_send_completed(NetClientState *nc, ssize_t len)
 {
     NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
@@ -227,20 +282,62 @@ static void net_socket_send_dgram(void *opaque)
 {
     NetSocketState *s = opaque;
     int size;
+#ifdef CONFIG_SENDMMSG
+    struct mmsghdr msgs[NET_SOCKET_BATCH];
+    struct iovec iov[NET_SOCKET_BATCH];
+    NetPacketIOV pkts[NET_SOCKET_BATCH];
+    int i, n, sent;
 
+    if (!s->batch_buf) {
+        s->batch_buf = g_malloc(NET_SOCKET_BATCH * sizeof(*s->batch_buf));
+    }
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < NET_SOCKET_BATCH; i++) {
+        iov[i].iov_base = s->batch_buf[i];
+        iov[i].iov_len = sizeof(s->batch_buf[i]);
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    do {
+        n = recvmmsg(s->fd, msgs, NET_SOCKET_BATCH, MSG_DONTWAIT, NULL);
+    } while (n == -1 && errno == EINTR);
+    if (n < 0)
+        return;
+    size = msgs[0].msg_len;
+#else
     size = qemu_recv(s->fd, s->buf, sizeof(s->buf), 0);
     if (size < 0)
         return;
+#endif
     if (size == 0) {
         /* end of connection */
         net_socket_read_poll(s, false);
         net_socket_write_poll(s, false);
         return;
     }
+#ifdef CONFIG_SENDMMSG
+    for (i = 0; i < n; i++) {
+        iov[i].iov_len = msgs[i].msg_len;
+        pkts[i].iov = &iov[i];
+        pkts[i].iovcnt = 1;
+    }
+    sent = qemu_sendv_packet_batch_async(&s->nc, pkts, n,
+                                         net_socket_send_completed);
+    if (sent < n) {
+        /* pkts[sent] is queued; the rest join it behind the peer */
+        while (++sent < n) {
+            qemu_sendv_packet_async(&s->nc, pkts[sent].iov, 1,
+                                    net_socket_send_completed);
+        }
+        net_socket_read_poll(s, false);
+    }
+#else
     if (qemu_send_packet_async(&s->nc, s->buf, size,
                                net_socket_send_completed) == 0) {
         net_socket_read_poll(s, false);
     }
+#endif
 }
 
 static int net_socket_mcast_create(struct sockaddr_in *mcastaddr, struct in_addr *localaddr)
@@ -342,12 +439,17 @@ static void net_socket_cleanup(NetClientState *nc)
         closesocket(s->listen_fd);
         s->listen_fd = -1;
     }
+    g_free(s->batch_buf);
+    s->batch_buf = NULL;
 }
 
 static NetClientInfo net_dgram_socket_info = {
     .type = NET_CLIENT_OPTIONS_KIND_SOCKET,
     .size = sizeof(NetSocketState),
     .receive = net_socket_receive_dgram,
+#ifdef CONFIG_SENDMMSG
+    .receive_iov_batch = net_socket_receive_dgram_batch,
+#endif
     .cleanup = net_socket_cleanup,
 };
 
@@ -43,12 +43,15 @@
 
 #include "net/vhost_net.h"
 
+/* Packets read from the tap fd before handing them to the peer at once */
+#define TAP_BATCH 8
+
 typedef struct TAPState {
     NetClientState nc;
     int fd;
     char down_script[1024];
     char down_script_arg[128];
-    uint8_t buf[NET_BUFSIZE];
+    uint8_t buf[TAP_BATCH][NET_BUFSIZE];
     bool read_poll;
     bool write_poll;
     bool using_vnet_hdr;
@@ -128,6 +131,20 @@ static ssize_t tap_receive_iov(NetClientState *nc, const struct iovec *iov,
     return tap_write_packet(s, iovp, iovcnt);
 }
 
+static int tap_receive_iov_batch(NetClientState *nc, const NetPacketIOV *pkts,
+                                 int count)
+{
+    int i;
+
+    /* The tap character device takes a single frame per write */
+    for (i = 0; i < count; i++) {
+        if (tap_receive_iov(nc, pkts[i].iov, pkts[i].iovcnt) == 0) {
+            break;
+        }
+    }
+    return i;
+}
+
 static ssize_t tap_receive_raw(NetClientState *nc, const uint8_t *buf, size_t size)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
@@ -179,28 +196,45 @@ static void tap_send_completed(NetClientState *nc, ssize_t len)
 static void tap_send(void *opaque)
 {
     TAPState *s = opaque;
-    int size;
+    struct iovec iov[TAP_BATCH];
+    NetPacketIOV pkts[TAP_BATCH];
     int packets = 0;
 
     while (true) {
-        uint8_t *buf = s->buf;
+        int n, sent;
 
-        size = tap_read_packet(s->fd, s->buf, sizeof(s->buf));
-        if (size <= 0) {
-            break;
-        }
+        for (n = 0; n < TAP_BATCH && packets + n < 50; n++) {
+            uint8_t *buf = s->buf[n];
+            int size;
 
-        if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
-            buf  += s->host_vnet_hdr_len;
-            size -= s->host_vnet_hdr_len;
+            size = tap_read_packet(s->fd, buf, sizeof(s->buf[n]));
+            if (size <= 0) {
+                break;
+            }
+
+            if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
+                buf  += s->host_vnet_hdr_len;
+                size -= s->host_vnet_hdr_len;
+            }
+            iov[n].iov_base = buf;
+            iov[n].iov_len = size;
+            pkts[n].iov = &iov[n];
+            pkts[n].iovcnt = 1;
+        }
+        if (n == 0) {
+            break;
         }
 
-        size = qemu_send_packet_async(&s->nc, buf, size, tap_send_completed);
-        if (size == 0) {
+        sent = qemu_sendv_packet_batch_async(&s->nc, pkts, n,
+                                             tap_send_completed);
+        if (sent < n) {
+            /* pkts[sent] is queued; the rest join it behind the peer */
+            while (++sent < n) {
+                qemu_sendv_packet_async(&s->nc, pkts[sent].iov, 1,
+                                        tap_send_completed);
+            }
             tap_read_poll(s, false);
             break;
-        } else if (size < 0) {
-            break;
         }
 
         /*
@@ -209,8 +243,8 @@ static void tap_send(void *opaque)
          * packets that are processed per tap_send() callback to prevent
          * stalling the guest.
          */
-        packets++;
-        if (packets >= 50) {
+        packets += n;
+        if (packets >= 50 || n < TAP_BATCH) {
             break;
         }
     }
@@ -337,6 +371,7 @@ static NetClientInfo net_tap_info = {
     .receive = tap_receive,
     .receive_raw = tap_receive_raw,
     .receive_iov = tap_receive_iov,
+    .receive_iov_batch = tap_receive_iov_batch,
     .poll = tap_poll,
     .cleanup = tap_cleanup,
     .has_ufo = tap_has_ufo,
@@ -661,6 +696,7 @@ static void net_init_tap_one(const NetdevTapOptions *tap, NetClientState *peer,
 
         options.backend_type = VHOST_BACKEND_TYPE_KERNEL;
         options.net_backend = &s->nc;
+        options.inflight = NULL;
 
         if (vhostfdname) {
             vhostfd = monitor_fd_param(cur_mon, vhostfdname, &err);
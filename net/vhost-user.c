@@ -12,6 +12,7 @@
 #include "clients.h"
 #include "net/vhost_net.h"
 #include "net/vhost-user.h"
+#include "hw/virtio/vhost.h"
 #include "sysemu/char.h"
 #include "qemu/config-file.h"
 #include "qemu/error-report.h"
@@ -22,6 +23,13 @@ typedef struct VhostUserState {
     NetClientState nc;
     CharDriverState *chr;
     VHostNetState *vhost_net;
+    /* Survive a backend disconnect, handed to the next connection */
+    uint64_t acked_features;
+    struct vhost_inflight inflight;
+    /* Set on the first queue only */
+    QEMUBH *close_bh;
+    bool close_pending;
+    bool started;
 } VhostUserState;
 
 typedef struct VhostUserChardevProps {
@@ -36,6 +44,13 @@ VHostNetState *vhost_user_get_vhost_net(NetClientState *nc)
     return s->vhost_net;
 }
 
+void vhost_user_reset_inflight(NetClientState *nc)
+{
+    VhostUserState *s = DO_UPCAST(VhostUserState, nc, nc);
+    assert(nc->info->type == NET_CLIENT_OPTIONS_KIND_VHOST_USER);
+    vhost_dev_reset_inflight(&s->inflight);
+}
+
 static int vhost_user_running(VhostUserState *s)
 {
     return (s->vhost_net) ? 1 : 0;
@@ -55,6 +70,7 @@ static void vhost_user_stop(int queues, NetClientState *ncs[])
         }
 
         if (s->vhost_net) {
+            s->acked_features = vhost_net_get_acked_features(s->vhost_net);
             vhost_net_cleanup(s->vhost_net);
             s->vhost_net = NULL;
         }
@@ -80,12 +96,20 @@ static int vhost_user_start(int queues, NetClientState *ncs[])
 
         options.net_backend = ncs[i];
         options.opaque      = s->chr;
+        /* The backend lays the inflight region out for a whole device,
+         * one per queue pair would not line up with it. */
+        options.inflight    = queues == 1 ? &s->inflight : NULL;
         s->vhost_net = vhost_net_init(&options);
         if (!s->vhost_net) {
             error_report("failed to init vhost_net for queue %d", i);
             goto err;
         }
 
+        /* After a reconnect, the guest will not negotiate again */
+        if (s->acked_features) {
+            vhost_net_ack_features(s->vhost_net, s->acked_features);
+        }
+
         if (i == 0) {
             max_queues = vhost_net_get_max_queues(s->vhost_net);
             if (queues > max_queues) {
@@ -140,6 +164,11 @@ static void vhost_user_cleanup(NetClientState *nc)
         vhost_net_cleanup(s->vhost_net);
         s->vhost_net = NULL;
     }
+    if (s->close_bh) {
+        qemu_bh_delete(s->close_bh);
+        s->close_bh = NULL;
+    }
+    vhost_dev_free_inflight(&s->inflight);
 
     qemu_purge_queued_packets(nc);
 }
@@ -167,6 +196,38 @@ static NetClientInfo net_vhost_user_info = {
         .has_ufo = vhost_user_has_ufo,
 };
 
+/* Taking the link down stops vhost, which saves the ring state the
+ * next backend resumes from.
+ */
+static void net_vhost_user_close(VhostUserState *s)
+{
+    NetClientState *ncs[MAX_QUEUE_NUM];
+    Error *err = NULL;
+    int queues;
+
+    s->close_pending = false;
+    s->started = false;
+
+    queues = qemu_find_net_clients_except(s->nc.name, ncs,
+                                          NET_CLIENT_OPTIONS_KIND_NIC,
+                                          MAX_QUEUE_NUM);
+    qmp_set_link(s->nc.name, false, &err);
+    vhost_user_stop(queues, ncs);
+
+    if (err) {
+        error_report_err(err);
+    }
+}
+
+static void net_vhost_user_close_bh(void *opaque)
+{
+    VhostUserState *s = opaque;
+
+    if (s->close_pending) {
+        net_vhost_user_close(s);
+    }
+}
+
 static void net_vhost_user_event(void *opaque, int event)
 {
     const char *name = opaque;
@@ -184,14 +245,26 @@ static void net_vhost_user_event(void *opaque, int event)
     trace_vhost_user_event(s->chr->label, event);
     switch (event) {
     case CHR_EVENT_OPENED:
+        if (s->close_pending) {
+            qemu_bh_cancel(s->close_bh);
+            net_vhost_user_close(s);
+        }
         if (vhost_user_start(queues, ncs) < 0) {
-            exit(1);
+            error_report("vhost-user backend on %s failed to start, "
+                         "dropping the connection", s->chr->label);
+            qemu_chr_disconnect(s->chr);
+            return;
         }
         qmp_set_link(name, true, &err);
+        s->started = true;
         break;
     case CHR_EVENT_CLOSED:
-        qmp_set_link(name, false, &err);
-        vhost_user_stop(queues, ncs);
+        /* The connection can drop in the middle of a vhost request, whose
+         * caller still expects the vhost device to be there.  Tear it
+         * down once the request has unwound.
+         */
+        s->close_pending = true;
+        qemu_bh_schedule(s->close_bh);
         break;
     }
 
@@ -204,8 +277,9 @@ static int net_vhost_user_init(NetClientState *peer, const char *device,
                                const char *name, CharDriverState *chr,
                                int queues)
 {
-    NetClientState *nc;
+    NetClientState *nc, *nc0 = NULL;
     VhostUserState *s;
+    Error *err = NULL;
     int i;
 
     assert(name);
@@ -218,12 +292,29 @@ static int net_vhost_user_init(NetClientState *peer, const char *device,
                  i, chr->label);
 
         nc->queue_index = i;
+        if (!nc0) {
+            nc0 = nc;
+        }
 
         s = DO_UPCAST(VhostUserState, nc, nc);
         s->chr = chr;
+        s->inflight.fd = -1;
     }
 
-    qemu_chr_add_handlers(chr, NULL, NULL, net_vhost_user_event, nc[0].name);
+    s = DO_UPCAST(VhostUserState, nc, nc0);
+    s->close_bh = qemu_bh_new(net_vhost_user_close_bh, s);
+
+    /* The device model needs the backend features, so wait for a first
+     * backend that starts successfully.
+     */
+    do {
+        if (qemu_chr_wait_connected(chr, &err) < 0) {
+            error_report_err(err);
+            return -1;
+        }
+        qemu_chr_add_handlers(chr, NULL, NULL,
+                              net_vhost_user_event, nc0->name);
+    } while (!s->started);
 
     return 0;
 }
@@ -239,6 +330,7 @@ static int net_vhost_chardev_opts(void *opaque,
     } else if (strcmp(name, "path") == 0) {
         props->is_unix = true;
     } else if (strcmp(name, "server") == 0) {
+    } else if (strcmp(name, "reconnect") == 0) {
     } else {
         error_setg(errp,
                    "vhost-user does not support a chardev with option %s=%s",
@@ -420,6 +420,18 @@ int qemu_chr_fe_set_msgfds(CharDriverState *s, int *fds, int num)
     return s->set_msgfds ? s->set_msgfds(s, fds, num) : -1;
 }
 
+int qemu_chr_wait_connected(CharDriverState *chr, Error **errp)
+{
+    return chr->chr_wait_connected ? chr->chr_wait_connected(chr, errp) : 0;
+}
+
+void qemu_chr_disconnect(CharDriverState *chr)
+{
+    if (chr->chr_disconnect) {
+        chr->chr_disconnect(chr);
+    }
+}
+
 int qemu_chr_add_client(CharDriverState *s, int fd)
 {
     return s->chr_add_client ? s->chr_add_client(s, fd) : -1;
@@ -2639,7 +2651,10 @@ static void check_report_connect_error(CharDriverState *chr,
                      chr->label, error_get_pretty(err));
         s->connect_err_reported = true;
     }
-    qemu_chr_socket_restart_timer(chr);
+    /* a synchronous connection may have won the race */
+    if (!s->ioc) {
+        qemu_chr_socket_restart_timer(chr);
+    }
 }
 
 static gboolean tcp_chr_accept(QIOChannel *chan,
@@ -3127,6 +3142,34 @@ static gboolean tcp_chr_accept(QIOChannel *channel,
     return TRUE;
 }
 
+static int tcp_chr_wait_connected(CharDriverState *chr, Error **errp)
+{
+    TCPCharDriver *s = chr->opaque;
+    QIOChannelSocket *sioc;
+
+    /* s->connected is set asynchronously for TLS and telnet, only wait
+     * for the underlying socket */
+    while (!s->ioc) {
+        if (s->is_listen) {
+            fprintf(stderr, "QEMU waiting for connection on: %s\n",
+                    chr->filename);
+            qio_channel_set_blocking(QIO_CHANNEL(s->listen_ioc), true, NULL);
+            tcp_chr_accept(QIO_CHANNEL(s->listen_ioc), G_IO_IN, chr);
+            qio_channel_set_blocking(QIO_CHANNEL(s->listen_ioc), false, NULL);
+        } else {
+            sioc = qio_channel_socket_new();
+            if (qio_channel_socket_connect_sync(sioc, s->addr, errp) < 0) {
+                object_unref(OBJECT(sioc));
+                return -1;
+            }
+            tcp_chr_new_client(chr, sioc);
+            object_unref(OBJECT(sioc));
+        }
+    }
+
+    return 0;
+}
+
 static void tcp_chr_close(CharDriverState *chr)
 {
     TCPCharDriver *s = chr->opaque;
@@ -4398,6 +4441,8 @@ static CharDriverState *qmp_chardev_open_socket(const char *id,
     chr->chr_add_client = tcp_chr_add_client;
     chr->chr_add_watch = tcp_chr_add_watch;
     chr->chr_update_read_handler = tcp_chr_update_read_handler;
+    chr->chr_wait_connected = tcp_chr_wait_connected;
+    chr->chr_disconnect = tcp_chr_disconnect;
     /* be isn't opened until we get a connection */
     chr->explicit_be_open = true;
 
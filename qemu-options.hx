@@ -36,6 +36,7 @@ DEF("machine", HAS_ARG, QEMU_OPTION_machine, \
     "                kernel_irqchip=on|off|split controls accelerated irqchip support (default=off)\n"
     "                vmport=on|off|auto controls emulation of vmport (default: auto)\n"
     "                kvm_shadow_mem=size of KVM shadow MMU\n"
+    "                kvm-dirty-ring-size=n per-vCPU KVM dirty ring entries (default: 0, use the dirty bitmap)\n"
     "                dump-guest-core=on|off include guest memory in a core dump (default=on)\n"
     "                mem-merge=on|off controls memory merge support (default: on)\n"
     "                iommu=on|off controls emulated Intel IOMMU (VT-d) support (default=off)\n"
@@ -67,6 +68,10 @@ value based on accel. For accel=xen the default is off otherwise the default
 is on.
 @item kvm_shadow_mem=size
 Defines the size of the KVM shadow MMU.
+@item kvm-dirty-ring-size=@var{n}
+Track dirty pages with a per-vCPU ring of @var{n} entries (a power of two)
+instead of the per-slot dirty bitmap.  This lets QEMU tell how fast each
+vCPU dirties memory, which is needed for per-vCPU dirty page rate limits.
 @item dump-guest-core=on|off
 Include guest memory in a core dump. The default is on.
 @item mem-merge=on|off
@@ -1566,6 +1571,7 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "         [,bootfile=f][,hostfwd=rule][,guestfwd=rule]"
 #ifndef _WIN32
                                              "[,smb=dir[,smbserver=addr]]\n"
+    "         [,thread=on|off]\n"
 #endif
     "                configure a user mode network backend with ID 'str',\n"
     "                its DHCP server and optional services\n"
@@ -1649,6 +1655,13 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "                attach to the existing netmap-enabled network interface 'name', or to a\n"
     "                VALE port (created on the fly) called 'name' ('nmname' is name of the \n"
     "                netmap device, defaults to '/dev/netmap')\n"
+#endif
+#ifdef CONFIG_AF_PACKET
+    "-netdev af-packet,id=str,ifname=name[,queues=n]\n"
+    "                attach to the existing host network interface 'name' through\n"
+    "                memory-mapped AF_PACKET rings\n"
+    "                use 'queues=n' to specify the number of queues for multiqueue\n"
+    "                virtio-net\n"
 #endif
     "-netdev vhost-user,id=str,chardev=dev[,vhostforce=on|off]\n"
     "                configure a vhost-user network, backed by a chardev 'dev'\n"
@@ -1673,6 +1686,9 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
 #endif
 #ifdef CONFIG_NETMAP
     "netmap|"
+#endif
+#ifdef CONFIG_AF_PACKET
+    "af-packet|"
 #endif
     "socket][,vlan=n][,option][,option][,...]\n"
     "                old way to initialize a host network interface\n"
@@ -1850,6 +1866,11 @@ so that QEMU behaves similar to an inetd process for that virtual server:
 qemu -net 'user,guestfwd=tcp:10.0.2.100:1234-cmd:netcat 10.10.1.1 4321'
 @end example
 
+@item thread=on|off
+Poll the host sockets of this backend in a dedicated thread rather than in
+the main loop. This keeps the main loop responsive when the guest has many
+connections open. Not supported on Windows.
+
 @end table
 
 Note: Legacy stand-alone options -tftp, -bootp, -smb and -redir are still
@@ -2070,6 +2091,21 @@ vde_switch -F -sock /tmp/myswitch
 qemu-system-i386 linux.img -net nic -net vde,sock=/tmp/myswitch
 @end example
 
+@item -netdev af-packet,id=@var{id},ifname=@var{name}[,queues=@var{n}]
+Attach to the existing host network interface @var{name} through
+memory-mapped AF_PACKET rings.  Frames are exchanged with the interface
+directly, without going through a tap device, which suits high packet
+rates.  Use @option{queues=@var{n}} together with a multiqueue virtio-net
+device; the host spreads incoming flows over the @var{n} queues.
+This backend needs the CAP_NET_RAW capability and is only available on
+Linux hosts.
+
+Example:
+@example
+qemu-system-x86_64 linux.img -netdev af-packet,id=n0,ifname=eth1,queues=4 \
+    -device virtio-net-pci,netdev=n0,mq=on,vectors=10
+@end example
+
 @item -netdev hubport,id=@var{id},hubid=@var{hubid}
 
 Create a hub port on QEMU "vlan" @var{hubid}.
@@ -2087,6 +2123,12 @@ end of the socket. On non-MSIX guests, the feature can be forced with
 @var{vhostforce}. Use 'queues=@var{n}' to specify the number of queues to
 be created for multiqueue vhost-user.
 
+When the chardev is a client socket with @option{reconnect} set, the backend
+may be restarted while the guest runs.  The link goes down while the backend
+is away; on reconnection the rings resume where the previous backend left
+them, and a backend with inflight tracking resubmits the requests it had not
+completed.
+
 Example:
 @example
 qemu -m 512 -object memory-backend-file,id=mem,size=512M,mem-path=/hugetlbfs,share=on \
@@ -3459,6 +3501,8 @@ DEF("incoming", HAS_ARG, QEMU_OPTION_incoming, \
     "-incoming exec:cmdline\n" \
     "                accept incoming migration on given file descriptor\n" \
     "                or from given external command\n" \
+    "-incoming file:path\n" \
+    "                load a migration stream saved in the given file\n" \
     "-incoming defer\n" \
     "                wait for the URI to be specified via migrate_incoming\n",
     QEMU_ARCH_ALL)
@@ -3477,6 +3521,12 @@ Accept incoming migration from a given filedescriptor.
 @item -incoming exec:@var{cmdline}
 Accept incoming migration as an output from specified external command.
 
+@item -incoming file:@var{path}
+Load a migration stream from a file written with @code{migrate file:path}.
+With the @code{x-mapped-ram} capability, which must then be enabled through
+@code{-incoming defer} before the load, each RAM page is at a fixed offset of
+the file and RAM is read by several threads in parallel.
+
 @item -incoming defer
 Wait for the URI to be specified via migrate_incoming.  The monitor can
 be used to change settings (such as migration parameters) prior to issuing
@@ -3837,6 +3887,22 @@ Dump the network traffic on netdev @var{dev} to the file specified by
 The file format is libpcap, so it can be analyzed with tools such as tcpdump
 or Wireshark.
 
+@item -object filter-gro,id=@var{id},netdev=@var{netdevid}[,timeout=@var{t}]
+
+Coalesce in-order TCP segments arriving on netdev @var{netdevid} into large
+packets before they reach the guest, and split TSO packets sent by the guest
+into segments. This gives virtio-net checksum and TSO offloads to backends
+that have no virtio-net header support of their own, such as user, socket,
+or tap without vnet_hdr. Held segments are delivered after at most @var{t}
+microseconds (50 by default). UDP fragmentation offload is not offered to
+the guest; guest packets that need segmentation other than TSO are dropped.
+
+The filter must be created before the NIC attached to @var{netdevid} and
+after any other filter on it, and cannot be turned off while the NIC uses
+it. The @option{packets}, @option{coalesced}, @option{flushes},
+@option{timer-flushes}, @option{segmented} and @option{dropped} properties
+count its work.
+
 @item -object secret,id=@var{id},data=@var{string},format=@var{raw|base64}[,keyid=@var{secretid},iv=@var{string}]
 @item -object secret,id=@var{id},file=@var{filename},format=@var{raw|base64}[,keyid=@var{secretid},iv=@var{string}]
 
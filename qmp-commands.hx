@@ -732,6 +732,140 @@ Example:
 -> { "execute": "migrate-start-postcopy" }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "calc-dirty-rate",
+        .args_type  = "calc-time:i,sample-pages:i?",
+        .mhandler.cmd_new = qmp_marshal_calc_dirty_rate,
+    },
+
+SQMP
+calc-dirty-rate
+---------------
+
+Start measuring the dirty page rate of the guest.  The result is available
+with query-dirty-rate once calc-time seconds have elapsed.
+
+Arguments:
+
+- "calc-time": duration of the measurement in seconds (json-int)
+- "sample-pages": pages sampled per GB of guest RAM (json-int, optional)
+
+Example:
+
+-> { "execute": "calc-dirty-rate", "arguments": { "calc-time": 1 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "query-dirty-rate",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_query_dirty_rate,
+    },
+
+SQMP
+query-dirty-rate
+----------------
+
+Return the result of the last dirty page rate measurement.
+
+- "status": "unstarted", "measuring" or "measured" (json-string)
+- "dirty-rate": estimated dirty page rate of the guest in MB/s
+                (json-int, optional)
+- "start-time": start of the measurement in seconds since the epoch
+                (json-int)
+- "calc-time": duration of the measurement in seconds (json-int)
+- "sample-pages": pages sampled per GB of guest RAM (json-int)
+- "vcpu-dirty-rate": dirty page rate of each vCPU (json-array, optional)
+         - "cpu-index": index of the vCPU (json-int)
+         - "dirty-rate": dirty page rate in MB/s (json-int)
+
+Example:
+
+-> { "execute": "query-dirty-rate" }
+<- { "return": { "status": "measured", "dirty-rate": 108,
+                 "start-time": 1460369011, "calc-time": 1,
+                 "sample-pages": 512,
+                 "vcpu-dirty-rate": [ { "cpu-index": 0, "dirty-rate": 104 },
+                                      { "cpu-index": 1, "dirty-rate": 2 } ] } }
+
+EQMP
+
+    {
+        .name       = "set-vcpu-dirty-limit",
+        .args_type  = "cpu-index:i?,dirty-rate:i",
+        .mhandler.cmd_new = qmp_marshal_set_vcpu_dirty_limit,
+    },
+
+SQMP
+set-vcpu-dirty-limit
+--------------------
+
+Limit the dirty page rate of one or all vCPUs.
+
+Arguments:
+
+- "cpu-index": index of the vCPU, all vCPUs if absent (json-int, optional)
+- "dirty-rate": upper limit of the dirty page rate in MB/s (json-int)
+
+Example:
+
+-> { "execute": "set-vcpu-dirty-limit",
+     "arguments": { "cpu-index": 1, "dirty-rate": 200 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "cancel-vcpu-dirty-limit",
+        .args_type  = "cpu-index:i?",
+        .mhandler.cmd_new = qmp_marshal_cancel_vcpu_dirty_limit,
+    },
+
+SQMP
+cancel-vcpu-dirty-limit
+-----------------------
+
+Remove the dirty page rate limit of one or all vCPUs.
+
+Arguments:
+
+- "cpu-index": index of the vCPU, all vCPUs if absent (json-int, optional)
+
+Example:
+
+-> { "execute": "cancel-vcpu-dirty-limit", "arguments": { "cpu-index": 1 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "query-vcpu-dirty-limit",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_query_vcpu_dirty_limit,
+    },
+
+SQMP
+query-vcpu-dirty-limit
+----------------------
+
+Return the dirty page rate limit of the vCPUs that have one.
+
+Each element of the returned array has:
+
+- "cpu-index": index of the vCPU (json-int)
+- "limit-rate": dirty page rate limit in MB/s (json-int)
+- "current-rate": dirty page rate over the last period in MB/s (json-int)
+- "throttle-percentage": share of time the vCPU is put to sleep (json-int)
+
+Example:
+
+-> { "execute": "query-vcpu-dirty-limit" }
+<- { "return": [ { "cpu-index": 1, "limit-rate": 200,
+                   "current-rate": 196, "throttle-percentage": 35 } ] }
+
 EQMP
 
     {
@@ -2033,7 +2167,7 @@ EQMP
 
     {
         .name       = "block_set_io_throttle",
-        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l,bps_max:l?,bps_rd_max:l?,bps_wr_max:l?,iops_max:l?,iops_rd_max:l?,iops_wr_max:l?,bps_max_length:l?,bps_rd_max_length:l?,bps_wr_max_length:l?,iops_max_length:l?,iops_rd_max_length:l?,iops_wr_max_length:l?,iops_size:l?,group:s?",
+        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l,bps_max:l?,bps_rd_max:l?,bps_wr_max:l?,iops_max:l?,iops_rd_max:l?,iops_wr_max:l?,bps_max_length:l?,bps_rd_max_length:l?,bps_wr_max_length:l?,iops_max_length:l?,iops_rd_max_length:l?,iops_wr_max_length:l?,iops_size:l?,group:s?,group-weight:l?",
         .mhandler.cmd_new = qmp_marshal_block_set_io_throttle,
     },
 
@@ -2066,6 +2200,9 @@ Arguments:
 - "iops_wr_max_length": maximum length of the @iops_wr_max burst period, in seconds (json-int, optional)
 - "iops_size":  I/O size in bytes when limiting (json-int, optional)
 - "group": throttle group name (json-string, optional)
+- "group-weight": share of the group's limits given to the device when
+                  other members compete for them, between 1 and 10000;
+                  100 by default (json-int, optional)
 
 Example:
 
@@ -2721,10 +2858,36 @@ Each json-object contain the following:
         - "avg_wr_queue_depth": average number of pending write
                                 operations in the defined interval
                                 (json-number).
+    - "rd_latency_histogram": latency histogram of read operations, only
+                              present if enabled with
+                              block-latency-histogram-set (json-object,
+                              optional), with the following members:
+        - "boundaries": upper bound of every bin but the last one, in
+                        nanoseconds (json-array of json-int)
+        - "bins": number of operations in each bin
+                  (json-array of json-int)
+    - "wr_latency_histogram": same for write operations
+                              (json-object, optional)
+    - "flush_latency_histogram": same for flush operations
+                                 (json-object, optional)
 - "parent": Contains recursively the statistics of the underlying
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
             (json-object, optional)
+- "driver-specific": Statistics specific to the block driver, only present
+                     for drivers that have any (json-object, optional).
+                     For qcow2, "type" is "qcow2" and "data" contains:
+    - "prealloc-operations": number of times the image file was grown
+                             by preallocation (json-int)
+    - "prealloc-bytes": bytes added to the image file by preallocation
+                        (json-int)
+    - "zero-clusters": clusters zeroed in their L2 entries (json-int)
+    - "unmapped-clusters": zeroed clusters whose host cluster was
+                           freed (json-int)
+    - "zero-host-bytes": bytes of write zeroes requests passed to the
+                         image file (json-int)
+    - "zero-skipped-bytes": bytes of write zeroes requests that already
+                            read as zeros (json-int)
 
 Example:
 
@@ -3684,6 +3847,10 @@ Enable/Disable migration capabilities
 - "compress": use multiple compression threads to accelerate live migration
 - "events": generate events for each migration state change
 - "postcopy-ram": postcopy mode for live migration
+- "x-mapped-ram": fixed offset of each RAM page in a migration file
+- "x-direct-io": bypass the host page cache for x-mapped-ram RAM pages
+- "x-dirty-limit": limit the dirty page rate of each vCPU instead of
+                   throttling all of them
 
 Arguments:
 
@@ -3714,6 +3881,9 @@ Query current migration capabilities
          - "compress": Multiple compression threads state (json-bool)
          - "events": Migration state change event state (json-bool)
          - "postcopy-ram": postcopy ram state (json-bool)
+         - "x-mapped-ram": fixed-offset RAM file format state (json-bool)
+         - "x-direct-io": O_DIRECT RAM page I/O state (json-bool)
+         - "x-dirty-limit": per-vCPU dirty page rate limit state (json-bool)
 
 Arguments:
 
@@ -3727,7 +3897,10 @@ Example:
      {"state": false, "capability": "zero-blocks"},
      {"state": false, "capability": "compress"},
      {"state": true, "capability": "events"},
-     {"state": false, "capability": "postcopy-ram"}
+     {"state": false, "capability": "postcopy-ram"},
+     {"state": false, "capability": "x-mapped-ram"},
+     {"state": false, "capability": "x-direct-io"},
+     {"state": false, "capability": "x-dirty-limit"}
    ]}
 
 EQMP
@@ -3751,6 +3924,14 @@ Set migration parameters
                            throttled for auto-converge (json-int)
 - "x-cpu-throttle-increment": set throttle increasing percentage for
                              auto-converge (json-int)
+- "x-mapped-ram-threads": set RAM page I/O thread count for x-mapped-ram
+                         migration (json-int)
+- "x-vcpu-dirty-limit": set per-vCPU dirty page rate limit in MB/s for
+                        x-dirty-limit migration (json-int)
+- "x-compress-method": set page compression codec, one of "zlib", "lzo",
+                       "snappy" or "lz4" (json-string)
+- "x-load-threads": set destination page load thread count, 0 to load
+                    pages in the main thread (json-int)
 
 Arguments:
 
@@ -3764,7 +3945,7 @@ EQMP
     {
         .name       = "migrate-set-parameters",
         .args_type  =
-            "compress-level:i?,compress-threads:i?,decompress-threads:i?,x-cpu-throttle-initial:i?,x-cpu-throttle-increment:i?",
+            "compress-level:i?,compress-threads:i?,decompress-threads:i?,x-cpu-throttle-initial:i?,x-cpu-throttle-increment:i?,x-mapped-ram-threads:i?,x-vcpu-dirty-limit:i?,x-compress-method:s?,x-load-threads:i?",
         .mhandler.cmd_new = qmp_marshal_migrate_set_parameters,
     },
 SQMP
@@ -3781,6 +3962,12 @@ Query current migration parameters
                                       throttled (json-int)
          - "x-cpu-throttle-increment" : throttle increasing percentage for
                                         auto-converge (json-int)
+         - "x-mapped-ram-threads" : RAM page I/O thread count for
+                                    x-mapped-ram migration (json-int)
+         - "x-vcpu-dirty-limit" : per-vCPU dirty page rate limit in MB/s
+                                  for x-dirty-limit migration (json-int)
+         - "x-compress-method" : page compression codec (json-string)
+         - "x-load-threads" : destination page load thread count (json-int)
 
 Arguments:
 
@@ -3793,7 +3980,11 @@ Example:
          "x-cpu-throttle-increment": 10,
          "compress-threads": 8,
          "compress-level": 1,
-         "x-cpu-throttle-initial": 20
+         "x-cpu-throttle-initial": 20,
+         "x-mapped-ram-threads": 4,
+         "x-vcpu-dirty-limit": 1,
+         "x-compress-method": "zlib",
+         "x-load-threads": 0
       }
    }
 
@@ -4721,6 +4912,38 @@ Move mouse pointer to absolute coordinates (20000, 400).
                { "type": "abs", "data" : { "axis": "y", "value" : 400 } } ] } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "block-latency-histogram-set",
+        .args_type  = "device:B,min-latency-ns:l?,bins:i?",
+        .mhandler.cmd_new = qmp_marshal_block_latency_histogram_set,
+    },
+
+SQMP
+block-latency-histogram-set
+---------------------------
+
+Enable, reconfigure or disable the log-scale latency histograms of a block
+device, and reset their bins.  Bin 0 counts operations faster than
+"min-latency-ns", each following bin covers twice the latency of the
+previous one and the last bin counts everything slower.
+
+Arguments:
+
+- "device": device name (json-string)
+- "min-latency-ns": upper bound of the first bin in nanoseconds; defaults
+                    to the current value, or 1000 (json-int, optional)
+- "bins": number of bins, 0 to disable; defaults to the current value,
+          or 24 (json-int, optional)
+
+Example:
+
+-> { "execute": "block-latency-histogram-set",
+     "arguments": { "device": "drive0", "min-latency-ns": 10000,
+                    "bins": 16 } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -18,6 +18,9 @@ Slirp *slirp_init(int restricted, struct in_addr vnetwork,
                   void *opaque);
 void slirp_cleanup(Slirp *slirp);
 
+/* Poll the sockets of @slirp in a thread of its own */
+int slirp_start_thread(Slirp *slirp);
+
 void slirp_pollfds_fill(GArray *pollfds, uint32_t *timeout);
 
 void slirp_pollfds_poll(GArray *pollfds, int select_error);
@@ -92,6 +92,8 @@ void free(void *ptr);
 #include "debug.h"
 
 #include "qemu/queue.h"
+#include "qemu/thread.h"
+#include "qemu/event_notifier.h"
 #include "qemu/sockets.h"
 #include "net/eth.h"
 
@@ -219,12 +221,14 @@ struct Slirp {
     /* tcp states */
     struct socket tcb;
     struct socket *tcp_last_so;
+    struct socket *tcb_hash[SO_HASH_SIZE];
     tcp_seq tcp_iss;        /* tcp initial send seq # */
     uint32_t tcp_now;       /* for RFC 1323 timestamps */
 
     /* udp states */
     struct socket udb;
     struct socket *udp_last_so;
+    struct socket *udb_hash[SO_HASH_SIZE];
 
     /* icmp states */
     struct socket icmp;
@@ -240,6 +244,13 @@ struct Slirp {
     GRand *grand;
     QEMUTimer *ra_timer;
 
+    /* polling thread, see slirp_start_thread() */
+    bool threaded;
+    bool thread_quit;
+    bool thread_polling;
+    QemuThread thread;
+    EventNotifier notifier;
+
     void *opaque;
 };
 
@@ -16,9 +16,84 @@
 static void sofcantrcvmore(struct socket *so);
 static void sofcantsendmore(struct socket *so);
 
+static uint32_t sohash_addr(const struct sockaddr_storage *ss)
+{
+    const struct sockaddr_in *sin = (const struct sockaddr_in *)ss;
+    const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)ss;
+    const uint32_t *a6 = (const uint32_t *)&sin6->sin6_addr;
+
+    switch (ss->ss_family) {
+    case AF_INET:
+        return sin->sin_addr.s_addr ^ sin->sin_port;
+    case AF_INET6:
+        return a6[0] ^ a6[1] ^ a6[2] ^ a6[3] ^ sin6->sin6_port;
+    default:
+        return 0;
+    }
+}
+
+static unsigned int sohash_bucket(const struct sockaddr_storage *lhost,
+                                  const struct sockaddr_storage *fhost)
+{
+    uint32_t h = sohash_addr(lhost);
+
+    if (fhost) {
+        h = h * 31 + sohash_addr(fhost);
+    }
+    return (h * 0x9e3779b1u) >> (32 - SO_HASH_BITS);
+}
+
+static struct socket **sohash_table(struct socket *head)
+{
+    Slirp *slirp = head->slirp;
+
+    if (!slirp) {
+        return NULL;
+    } else if (head == &slirp->tcb) {
+        return slirp->tcb_hash;
+    } else if (head == &slirp->udb) {
+        return slirp->udb_hash;
+    }
+    return NULL;
+}
+
+/*
+ * (Re)insert a socket of list @head into the lookup hash, after its
+ * addresses were set.  TCP sockets are hashed on both ends, UDP ones on
+ * the local end only, as that is what solookup() is given for them.
+ */
+void sohash(struct socket *so, struct socket *head)
+{
+    struct socket **bucket;
+
+    sounhash(so);
+    bucket = &sohash_table(head)[sohash_bucket(&so->lhost.ss,
+                                 head == &head->slirp->tcb ?
+                                 &so->fhost.ss : NULL)];
+    so->so_hnext = *bucket;
+    if (so->so_hnext) {
+        so->so_hnext->so_hprev = &so->so_hnext;
+    }
+    so->so_hprev = bucket;
+    *bucket = so;
+}
+
+void sounhash(struct socket *so)
+{
+    if (so->so_hprev) {
+        *so->so_hprev = so->so_hnext;
+        if (so->so_hnext) {
+            so->so_hnext->so_hprev = so->so_hprev;
+        }
+        so->so_hnext = NULL;
+        so->so_hprev = NULL;
+    }
+}
+
 struct socket *solookup(struct socket **last, struct socket *head,
         struct sockaddr_storage *lhost, struct sockaddr_storage *fhost)
 {
+    struct socket **table = sohash_table(head);
     struct socket *so = *last;
 
     /* Optimisation */
@@ -27,6 +102,17 @@ struct socket *solookup(struct socket **last, struct socket *head,
         return so;
     }
 
+    if (table) {
+        for (so = table[sohash_bucket(lhost, fhost)]; so; so = so->so_hnext) {
+            if (sockaddr_equal(&(so->lhost.ss), lhost)
+                    && (!fhost || sockaddr_equal(&so->fhost.ss, fhost))) {
+                *last = so;
+                return so;
+            }
+        }
+        return NULL;
+    }
+
     for (so = head->so_next; so != head; so = so->so_next) {
         if (sockaddr_equal(&(so->lhost.ss), lhost)
                 && (!fhost || sockaddr_equal(&so->fhost.ss, fhost))) {
@@ -80,6 +166,7 @@ sofree(struct socket *so)
   }
   m_free(so->so_m);
 
+  sounhash(so);
   if(so->so_next && so->so_prev)
     remque(so);  /* crashes if so is not in a queue */
 
@@ -695,6 +782,7 @@ tcp_listen(Slirp *slirp, uint32_t haddr, u_int hport, uint32_t laddr,
 	   so->so_faddr = slirp->vhost_addr;
 	else
 	   so->so_faddr = addr.sin_addr;
+	sohash(so, &slirp->tcb);
 
 	so->s = s;
 	return so;
@@ -11,12 +11,17 @@
 #define SO_EXPIRE 240000
 #define SO_EXPIREFAST 10000
 
+/* Buckets in the TCP and UDP socket lookup hashes */
+#define SO_HASH_BITS 10
+#define SO_HASH_SIZE (1 << SO_HASH_BITS)
+
 /*
  * Our socket structure
  */
 
 struct socket {
   struct socket *so_next,*so_prev;      /* For a linked list of sockets */
+  struct socket *so_hnext, **so_hprev;  /* Lookup hash chain, see sohash() */
 
   int s;                           /* The actual socket */
 
@@ -124,6 +129,8 @@ static inline int sockaddr_equal(struct sockaddr_storage *a,
 
 struct socket *solookup(struct socket **, struct socket *,
         struct sockaddr_storage *, struct sockaddr_storage *);
+void sohash(struct socket *, struct socket *);
+void sounhash(struct socket *);
 struct socket *socreate(Slirp *);
 void sofree(struct socket *);
 int soread(struct socket *);
@@ -441,6 +441,7 @@ findso:
 
 	  so->lhost.ss = lhost;
 	  so->fhost.ss = fhost;
+	  sohash(so, &slirp->tcb);
 
 	  so->so_iptos = tcp_tos(so);
 	  if (so->so_iptos == 0) {
@@ -53,6 +53,7 @@ tcp_init(Slirp *slirp)
 {
     slirp->tcp_iss = 1;		/* wrong */
     slirp->tcb.so_next = slirp->tcb.so_prev = &slirp->tcb;
+    slirp->tcb.slirp = slirp;
     slirp->tcp_last_so = &slirp->tcb;
 }
 
@@ -483,6 +484,7 @@ void tcp_connect(struct socket *inso)
 
     so->fhost.ss = addr;
     sotranslate_accept(so);
+    sohash(so, &slirp->tcb);
 
     /* Close the accept() socket, set right state */
     if (inso->so_state & SS_FACCEPTONCE) {
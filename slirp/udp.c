@@ -48,6 +48,7 @@ void
 udp_init(Slirp *slirp)
 {
     slirp->udb.so_next = slirp->udb.so_prev = &slirp->udb;
+    slirp->udb.slirp = slirp;
     slirp->udp_last_so = &slirp->udb;
 }
 
@@ -187,6 +188,7 @@ udp_input(register struct mbuf *m, int iphlen)
 	  so->so_lfamily = AF_INET;
 	  so->so_laddr = ip->ip_src;
 	  so->so_lport = uh->uh_sport;
+	  sohash(so, &slirp->udb);
 
 	  if ((so->so_iptos = udp_tos(so)) == 0)
 	    so->so_iptos = ip->ip_tos;
@@ -354,6 +356,7 @@ udp_listen(Slirp *slirp, uint32_t haddr, u_int hport, uint32_t laddr,
 	so->so_lfamily = AF_INET;
 	so->so_lport = lport;
 	so->so_laddr.s_addr = laddr;
+	sohash(so, &slirp->udb);
 	if (flags != SS_FACCEPTONCE)
 	   so->so_expire = 0;
 
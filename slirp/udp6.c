@@ -95,6 +95,7 @@ void udp6_input(struct mbuf *m)
         so->so_lfamily = AF_INET6;
         so->so_laddr6 = ip->ip_src;
         so->so_lport6 = uh->uh_sport;
+        sohash(so, &slirp->udb);
     }
 
     so->so_ffamily = AF_INET6;
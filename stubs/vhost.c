@@ -5,3 +5,11 @@ bool vhost_has_free_slot(void)
 {
     return true;
 }
+
+void vhost_dev_reset_inflight(struct vhost_inflight *inflight)
+{
+}
+
+void vhost_dev_free_inflight(struct vhost_inflight *inflight)
+{
+}
@@ -1411,6 +1411,182 @@ static void test_ncq_simple(void)
     ahci_shutdown(ahci);
 }
 
+/*** NCQ queue depth ***/
+
+#define NCQ_DEPTH               32
+#define NCQ_IO_SIZE             4096
+#define NCQ_DISK_SECTORS        ((1 << 30) / AHCI_SECTOR_SIZE)
+
+static AHCIQState *ahci_boot_null_co(int64_t latency_ns)
+{
+    return ahci_boot_and_enable("-drive if=none,id=drive0,file=null-co://,"
+                                "format=raw,file.latency-ns=%" PRId64 " "
+                                "-M q35 "
+                                "-device ide-hd,drive=drive0 ",
+                                latency_ns);
+}
+
+static AHCICommand *ahci_ncq_read_async(AHCIQState *ahci, uint8_t port,
+                                        uint64_t buffer, uint64_t sector)
+{
+    AHCICommand *cmd;
+
+    cmd = ahci_command_create(READ_FPDMA_QUEUED);
+    ahci_command_set_buffer(cmd, buffer);
+    ahci_command_set_size(cmd, NCQ_IO_SIZE);
+    ahci_command_set_offset(cmd, sector);
+    ahci_command_commit(ahci, cmd, port);
+    ahci_command_issue_async(ahci, cmd);
+    return cmd;
+}
+
+/**
+ * Issue @count NCQ reads with a single write each to PxSACT and PxCI, then
+ * wait for all of them to complete.  Returns the mask of tags issued.
+ */
+static uint32_t ahci_ncq_read_batch(AHCIQState *ahci, uint8_t port,
+                                    AHCICommand **cmd, int count,
+                                    uint64_t ptr)
+{
+    uint32_t tags = 0;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        cmd[i] = ahci_command_create(READ_FPDMA_QUEUED);
+        ahci_command_set_buffer(cmd[i], ptr + i * NCQ_IO_SIZE);
+        ahci_command_set_size(cmd[i], NCQ_IO_SIZE);
+        ahci_command_set_offset(cmd[i], i * (NCQ_IO_SIZE / AHCI_SECTOR_SIZE));
+        ahci_command_commit(ahci, cmd[i], port);
+        tags |= 1U << ahci_command_slot(cmd[i]);
+    }
+    g_assert_cmpint(ctpop32(tags), ==, count);
+
+    ahci_px_wreg(ahci, port, AHCI_PX_SACT, tags);
+    ahci_px_wreg(ahci, port, AHCI_PX_CI, tags);
+    while (ahci_px_rreg(ahci, port, AHCI_PX_SACT) & tags) {
+        usleep(50);
+    }
+    return tags;
+}
+
+/**
+ * NCQ commands that complete together must be reported with one Set Device
+ * Bits FIS and one interrupt.  null-co without latency completes every read
+ * of a batch in the same main loop iteration, so the last SDB FIS received
+ * has to carry all of the batch's tags; one FIS per command would leave only
+ * a single bit in its payload.
+ */
+static void test_ncq_batch(void)
+{
+    AHCIQState *ahci;
+    AHCICommand *cmd[NCQ_DEPTH];
+    uint32_t tags;
+    uint64_t ptr;
+    uint8_t port;
+    int i;
+
+    ahci = ahci_boot_null_co(0);
+    port = ahci_port_select(ahci);
+    ahci_port_clear(ahci, port);
+    ptr = ahci_alloc(ahci, NCQ_DEPTH * NCQ_IO_SIZE);
+    g_assert(ptr);
+
+    /* A full queue */
+    tags = ahci_ncq_read_batch(ahci, port, cmd, NCQ_DEPTH, ptr);
+    g_assert_cmphex(tags, ==, 0xffffffff);
+    ahci_port_check_error(ahci, port);
+    ahci_port_check_interrupts(ahci, port, AHCI_PX_IS_SDBS);
+    ahci_port_check_sdb_sanity(ahci, port, tags);
+    for (i = 0; i < NCQ_DEPTH; i++) {
+        ahci_port_check_nonbusy(ahci, port, ahci_command_slot(cmd[i]));
+        ahci_command_free(cmd[i]);
+    }
+
+    /* The next FIS reports only the tags of the next batch */
+    ahci_port_clear(ahci, port);
+    tags = ahci_ncq_read_batch(ahci, port, cmd, 8, ptr);
+    ahci_port_check_error(ahci, port);
+    ahci_port_check_interrupts(ahci, port, AHCI_PX_IS_SDBS);
+    ahci_port_check_sdb_sanity(ahci, port, tags);
+    for (i = 0; i < 8; i++) {
+        ahci_port_check_nonbusy(ahci, port, ahci_command_slot(cmd[i]));
+        ahci_command_free(cmd[i]);
+    }
+
+    ahci_free(ahci, ptr);
+    ahci_shutdown(ahci);
+}
+
+/**
+ * fio-like random read workload: keep @depth NCQ reads in flight until
+ * @count have completed, sampling PxSACT to measure the queue depth that
+ * the device actually sustained.
+ */
+static void ahci_ncq_randread(int depth, int count, int64_t latency_ns)
+{
+    AHCIQState *ahci;
+    AHCICommand *inflight[NCQ_DEPTH] = { NULL };
+    uint64_t ptr;
+    uint32_t sact;
+    uint8_t port;
+    gint64 start, elapsed;
+    uint64_t qd_sum = 0, samples = 0;
+    int issued = 0, done = 0;
+    int i;
+
+    ahci = ahci_boot_null_co(latency_ns);
+    port = ahci_port_select(ahci);
+    ahci_port_clear(ahci, port);
+    ptr = ahci_alloc(ahci, NCQ_DEPTH * NCQ_IO_SIZE);
+    g_assert(ptr);
+
+    start = g_get_monotonic_time();
+    while (done < count) {
+        for (i = 0; i < depth && issued < count; i++) {
+            AHCICommand *cmd;
+            uint64_t sector;
+
+            if (inflight[i]) {
+                continue;
+            }
+            sector = g_test_rand_int_range(0, NCQ_DISK_SECTORS / 8) * 8;
+            cmd = ahci_ncq_read_async(ahci, port, ptr + i * NCQ_IO_SIZE,
+                                      sector);
+            inflight[i] = cmd;
+            issued++;
+        }
+
+        sact = ahci_px_rreg(ahci, port, AHCI_PX_SACT);
+        qd_sum += ctpop32(sact);
+        samples++;
+        for (i = 0; i < depth; i++) {
+            if (inflight[i] &&
+                !(sact & (1 << ahci_command_slot(inflight[i])))) {
+                ahci_command_free(inflight[i]);
+                inflight[i] = NULL;
+                done++;
+            }
+        }
+    }
+    elapsed = g_get_monotonic_time() - start;
+
+    g_test_message("iodepth=%d: %.0f IOPS, achieved queue depth %.1f",
+                   depth, (double)count * G_USEC_PER_SEC / elapsed,
+                   (double)qd_sum / samples);
+
+    ahci_port_check_error(ahci, port);
+    ahci_free(ahci, ptr);
+    ahci_shutdown(ahci);
+}
+
+static void test_ncq_perf(void)
+{
+    ahci_ncq_randread(1, 500, 1000 * 1000);
+    ahci_ncq_randread(4, 2000, 1000 * 1000);
+    ahci_ncq_randread(8, 2000, 1000 * 1000);
+    ahci_ncq_randread(NCQ_DEPTH, 4000, 1000 * 1000);
+}
+
 static int prepare_iso(size_t size, unsigned char **buf, char **name)
 {
     char cdrom_path[] = "/tmp/qtest.iso.XXXXXX";
@@ -1786,6 +1962,10 @@ int main(int argc, char **argv)
     qtest_add_func("/ahci/migrate/ncq/simple", test_migrate_ncq);
     qtest_add_func("/ahci/io/ncq/retry", test_halted_ncq);
     qtest_add_func("/ahci/migrate/ncq/halted", test_migrate_halted_ncq);
+    qtest_add_func("/ahci/io/ncq/batch", test_ncq_batch);
+    if (g_test_perf()) {
+        qtest_add_func("/ahci/io/ncq/perf", test_ncq_perf);
+    }
 
     qtest_add_func("/ahci/cdrom/dma/single", test_cdrom_dma);
     qtest_add_func("/ahci/cdrom/dma/multi", test_cdrom_dma_multi);
@@ -469,6 +469,23 @@ void ahci_port_check_d2h_sanity(AHCIQState *ahci, uint8_t port, uint8_t slot)
     g_free(d2h);
 }
 
+void ahci_port_check_sdb_sanity(AHCIQState *ahci, uint8_t port,
+                                uint32_t tags)
+{
+    SDBFIS sdb;
+    uint32_t reg;
+
+    memread(ahci->port[port].fb + 0x58, &sdb, sizeof(sdb));
+    g_assert_cmphex(sdb.fis_type, ==, SDB_FIS);
+    /* Interrupt bit, always set for NCQ completions */
+    ASSERT_BIT_SET(sdb.flags, 0x40);
+    g_assert_cmphex(le32_to_cpu(sdb.payload), ==, tags);
+
+    reg = ahci_px_rreg(ahci, port, AHCI_PX_TFD);
+    g_assert_cmphex((reg & AHCI_PX_TFD_ERR) >> 8, ==, sdb.error);
+    g_assert_cmphex((reg & AHCI_PX_TFD_STS), ==, sdb.status);
+}
+
 void ahci_port_check_pio_sanity(AHCIQState *ahci, uint8_t port,
                                 uint8_t slot, size_t buffsize)
 {
@@ -577,7 +594,9 @@ unsigned ahci_pick_cmd(AHCIQState *ahci, uint8_t port)
     unsigned j;
     uint32_t reg;
 
-    reg = ahci_px_rreg(ahci, port, AHCI_PX_CI);
+    /* NCQ commands leave CI early but hold their slot until SACT clears */
+    reg = ahci_px_rreg(ahci, port, AHCI_PX_CI) |
+          ahci_px_rreg(ahci, port, AHCI_PX_SACT);
 
     /* Pick the least recently used command slot that's available */
     for (i = 0; i < 32; ++i) {
@@ -385,6 +385,20 @@ typedef struct PIOSetupFIS {
     uint16_t res2;
 } __attribute__((__packed__)) PIOSetupFIS;
 
+/**
+ * Set Device Bits FIS structure.
+ * For NCQ, the payload holds the tags of all completed commands.
+ */
+typedef struct SDBFIS {
+    /* DW0 */
+    uint8_t fis_type;
+    uint8_t flags;
+    uint8_t status;
+    uint8_t error;
+    /* DW1 */
+    uint32_t payload;
+} __attribute__((__packed__)) SDBFIS;
+
 /**
  * Register host-to-device FIS structure.
  */
@@ -577,6 +591,8 @@ void ahci_port_check_interrupts(AHCIQState *ahci, uint8_t port,
                                 uint32_t intr_mask);
 void ahci_port_check_nonbusy(AHCIQState *ahci, uint8_t port, uint8_t slot);
 void ahci_port_check_d2h_sanity(AHCIQState *ahci, uint8_t port, uint8_t slot);
+void ahci_port_check_sdb_sanity(AHCIQState *ahci, uint8_t port,
+                                uint32_t tags);
 void ahci_port_check_pio_sanity(AHCIQState *ahci, uint8_t port,
                                 uint8_t slot, size_t buffsize);
 void ahci_port_check_cmd_sanity(AHCIQState *ahci, AHCICommand *cmd);
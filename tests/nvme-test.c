@@ -10,24 +10,634 @@
 #include "qemu/osdep.h"
 #include <glib.h>
 #include "libqtest.h"
+#include "libqos/libqos-pc.h"
+#include "libqos/pci-pc.h"
+#include "qemu/bswap.h"
+#include "hw/pci/pci_regs.h"
 
-/* Tests only initialization so far. TODO: Replace with functional tests */
-static void nop(void)
+#define TEST_IMAGE_SIZE     (1024 * 1024)
+#define NVME_PAGE_SIZE      4096
+#define NVME_SECTOR_SIZE    512
+#define NVME_TIMEOUT_US     (5 * 1000 * 1000)
+
+/* Controller registers */
+#define NVME_REG_CC         0x14
+#define NVME_REG_CSTS       0x1c
+#define NVME_REG_AQA        0x24
+#define NVME_REG_ASQ        0x28
+#define NVME_REG_ACQ        0x30
+#define NVME_REG_DB(qid, cq) (0x1000 + ((qid) << 3) + ((cq) << 2))
+
+#define NVME_CC_EN          (1 << 0)
+#define NVME_CC_IOSQES      (6 << 16)
+#define NVME_CC_IOCQES      (4 << 20)
+#define NVME_CSTS_RDY       (1 << 0)
+
+/* Commands */
+#define NVME_ADM_CREATE_SQ  0x01
+#define NVME_ADM_CREATE_CQ  0x05
+#define NVME_ADM_IDENTIFY   0x06
+#define NVME_ADM_SET_FEAT   0x09
+#define NVME_ADM_GET_FEAT   0x0a
+#define NVME_ADM_DBBUF      0x7c
+#define NVME_CMD_WRITE      0x01
+#define NVME_CMD_READ       0x02
+
+#define NVME_FEAT_INTC      0x08
+#define NVME_FEAT_INTVC     0x09
+
+#define NVME_PSDT_SGL       (1 << 6)
+#define NVME_PSDT_RESERVED  (3 << 6)
+
+#define NVME_SGL_DATA       0x00
+#define NVME_SGL_BIT_BUCKET 0x10
+#define NVME_SGL_SEGMENT    0x20
+#define NVME_SGL_LAST_SEG   0x30
+
+/* Identify Controller fields */
+#define NVME_ID_OACS        256
+#define NVME_ID_SGLS        536
+
+/* Status codes, without the phase bit */
+#define NVME_SUCCESS                0x0000
+#define NVME_INVALID_FIELD          0x0002
+#define NVME_INVALID_SGL_SEG_DESCR  0x000d
+#define NVME_DATA_SGL_LEN_INVALID   0x000f
+#define NVME_SGL_DESCR_TYPE_INVALID 0x0011
+#define NVME_DNR                    0x4000
+
+typedef struct NvmeTestCmd {
+    uint8_t     opcode;
+    uint8_t     flags;
+    uint16_t    cid;
+    uint32_t    nsid;
+    uint64_t    rsvd2;
+    uint64_t    mptr;
+    uint64_t    dptr[2];
+    uint32_t    cdw10;
+    uint32_t    cdw11;
+    uint32_t    cdw12;
+    uint32_t    cdw13;
+    uint32_t    cdw14;
+    uint32_t    cdw15;
+} NvmeTestCmd;
+
+typedef struct NvmeTestCqe {
+    uint32_t    result;
+    uint32_t    rsvd;
+    uint16_t    sq_head;
+    uint16_t    sq_id;
+    uint16_t    cid;
+    uint16_t    status;
+} NvmeTestCqe;
+
+typedef struct NvmeTestSgl {
+    uint64_t    addr;
+    uint32_t    len;
+    uint8_t     rsvd[3];
+    uint8_t     type;
+} NvmeTestSgl;
+
+/* A submission queue and the completion queue it posts to */
+typedef struct NvmeTestQueue {
+    uint16_t    qid;
+    uint64_t    sq;
+    uint16_t    sq_size;
+    uint16_t    sq_tail;
+    uint64_t    cq;
+    uint16_t    cq_size;
+    uint16_t    cq_head;
+    uint16_t    phase;
+} NvmeTestQueue;
+
+typedef struct NvmeTestState {
+    QOSState *qs;
+    QPCIBus *pcibus;
+    QPCIDevice *dev;
+    void *bar;
+    NvmeTestQueue admin;
+    NvmeTestQueue io;
+    uint16_t cid;
+} NvmeTestState;
+
+static char tmp_path[] = "/tmp/qtest.XXXXXX";
+
+static void save_fn(QPCIDevice *dev, int devfn, void *data)
+{
+    QPCIDevice **pdev = (QPCIDevice **) data;
+
+    *pdev = dev;
+}
+
+static uint64_t nvme_alloc(NvmeTestState *s, size_t size)
+{
+    uint64_t addr = guest_alloc(s->qs->alloc, size);
+
+    g_assert_cmphex(addr & (NVME_PAGE_SIZE - 1), ==, 0);
+    qmemset(addr, 0, size);
+    return addr;
+}
+
+static void nvme_queue_init(NvmeTestState *s, NvmeTestQueue *q, uint16_t qid,
+                            uint16_t sq_size, uint16_t cq_size)
+{
+    *q = (NvmeTestQueue) {
+        .qid = qid,
+        .sq = nvme_alloc(s, sq_size * sizeof(NvmeTestCmd)),
+        .sq_size = sq_size,
+        .cq = nvme_alloc(s, cq_size * sizeof(NvmeTestCqe)),
+        .cq_size = cq_size,
+        .phase = 1,
+    };
+}
+
+/* Put a command in the queue without ringing the doorbell */
+static uint16_t nvme_queue_cmd(NvmeTestState *s, NvmeTestQueue *q,
+                               NvmeTestCmd *cmd)
+{
+    cmd->cid = cpu_to_le16(++s->cid);
+    memwrite(q->sq + q->sq_tail * sizeof(*cmd), cmd, sizeof(*cmd));
+    q->sq_tail = (q->sq_tail + 1) % q->sq_size;
+    return s->cid;
+}
+
+static void nvme_ring_sq(NvmeTestState *s, NvmeTestQueue *q, uint16_t tail)
+{
+    qpci_io_writel(s->dev, s->bar + NVME_REG_DB(q->qid, 0), tail);
+}
+
+static void nvme_ring_cq(NvmeTestState *s, NvmeTestQueue *q)
+{
+    qpci_io_writel(s->dev, s->bar + NVME_REG_DB(q->qid, 1), q->cq_head);
+}
+
+static bool nvme_cqe_posted(NvmeTestQueue *q, NvmeTestCqe *cqe)
+{
+    memread(q->cq + q->cq_head * sizeof(*cqe), cqe, sizeof(*cqe));
+    return (le16_to_cpu(cqe->status) & 1) == q->phase;
+}
+
+/* Wait for the next completion and return its status without phase bit */
+static uint16_t nvme_wait_cqe(NvmeTestQueue *q, NvmeTestCqe *cqe)
+{
+    int i;
+
+    for (i = 0; i < NVME_TIMEOUT_US / 50 && !nvme_cqe_posted(q, cqe); i++) {
+        usleep(50);
+    }
+    g_assert_cmpint(le16_to_cpu(cqe->status) & 1, ==, q->phase);
+    g_assert_cmpint(le16_to_cpu(cqe->sq_id), ==, q->qid);
+
+    if (++q->cq_head == q->cq_size) {
+        q->cq_head = 0;
+        q->phase = !q->phase;
+    }
+    return le16_to_cpu(cqe->status) >> 1;
+}
+
+/* Wait for @n successful completions of the commands in @cids, which may
+ * finish in any order */
+static void nvme_wait_cids(NvmeTestQueue *q, const uint16_t *cids, int n)
+{
+    uint32_t done = 0;
+    NvmeTestCqe cqe;
+    int i, j;
+
+    g_assert_cmpint(n, <=, 32);
+    for (i = 0; i < n; i++) {
+        g_assert_cmphex(nvme_wait_cqe(q, &cqe), ==, 0);
+        for (j = 0; j < n; j++) {
+            if (!(done & (1u << j)) && cids[j] == le16_to_cpu(cqe.cid)) {
+                done |= 1u << j;
+                break;
+            }
+        }
+        g_assert_cmpint(j, <, n);
+    }
+}
+
+static uint16_t nvme_exec(NvmeTestState *s, NvmeTestQueue *q,
+                          NvmeTestCmd *cmd, uint32_t *result)
+{
+    NvmeTestCqe cqe;
+    uint16_t cid, status;
+
+    cid = nvme_queue_cmd(s, q, cmd);
+    nvme_ring_sq(s, q, q->sq_tail);
+    status = nvme_wait_cqe(q, &cqe);
+    g_assert_cmpint(le16_to_cpu(cqe.cid), ==, cid);
+    nvme_ring_cq(s, q);
+    if (result) {
+        *result = le32_to_cpu(cqe.result);
+    }
+    return status;
+}
+
+static uint16_t nvme_admin(NvmeTestState *s, uint8_t opcode, uint64_t prp1,
+                           uint64_t prp2, uint32_t cdw10, uint32_t cdw11,
+                           uint32_t *result)
+{
+    NvmeTestCmd cmd = {
+        .opcode = opcode,
+        .dptr = { cpu_to_le64(prp1), cpu_to_le64(prp2) },
+        .cdw10 = cpu_to_le32(cdw10),
+        .cdw11 = cpu_to_le32(cdw11),
+    };
+
+    return nvme_exec(s, &s->admin, &cmd, result);
+}
+
+static void nvme_rw_cmd(NvmeTestCmd *cmd, uint8_t opcode, uint8_t flags,
+                        uint64_t slba, uint16_t nlb, uint64_t dptr0,
+                        uint64_t dptr1)
+{
+    *cmd = (NvmeTestCmd) {
+        .opcode = opcode,
+        .flags = flags,
+        .nsid = cpu_to_le32(1),
+        .dptr = { cpu_to_le64(dptr0), cpu_to_le64(dptr1) },
+        .cdw10 = cpu_to_le32(slba),
+        .cdw11 = cpu_to_le32(slba >> 32),
+        .cdw12 = cpu_to_le32(nlb - 1),
+    };
+}
+
+/* A command whose data pointer is the SGL descriptor @sgl */
+static void nvme_sgl_cmd(NvmeTestCmd *cmd, uint8_t opcode, uint8_t flags,
+                         uint64_t slba, uint16_t nlb, NvmeTestSgl *sgl)
+{
+    nvme_rw_cmd(cmd, opcode, flags, slba, nlb, 0, 0);
+    memcpy(cmd->dptr, sgl, sizeof(*sgl));
+}
+
+static void nvme_sgl_set(NvmeTestSgl *sgl, uint8_t type, uint64_t addr,
+                         uint32_t len)
+{
+    *sgl = (NvmeTestSgl) {
+        .addr = cpu_to_le64(addr),
+        .len = cpu_to_le32(len),
+        .type = type,
+    };
+}
+
+static void nvme_msix_setup(NvmeTestState *s, uint16_t entry, uint64_t addr,
+                            uint32_t data)
+{
+    void *vector = s->dev->msix_table + entry * PCI_MSIX_ENTRY_SIZE;
+    uint32_t ctrl;
+
+    qpci_io_writel(s->dev, vector + PCI_MSIX_ENTRY_LOWER_ADDR, addr);
+    qpci_io_writel(s->dev, vector + PCI_MSIX_ENTRY_UPPER_ADDR, addr >> 32);
+    qpci_io_writel(s->dev, vector + PCI_MSIX_ENTRY_DATA, data);
+    ctrl = qpci_io_readl(s->dev, vector + PCI_MSIX_ENTRY_VECTOR_CTRL);
+    qpci_io_writel(s->dev, vector + PCI_MSIX_ENTRY_VECTOR_CTRL,
+                   ctrl & ~PCI_MSIX_ENTRY_CTRL_MASKBIT);
+}
+
+static NvmeTestState *nvme_test_start(void)
+{
+    NvmeTestState *s = g_new0(NvmeTestState, 1);
+    uint64_t barsize;
+    uint32_t csts;
+    int i;
+
+    s->qs = qtest_pc_boot("-drive id=drv0,if=none,file=%s,format=raw "
+                          "-device nvme,drive=drv0,serial=foo", tmp_path);
+    s->pcibus = qpci_init_pc();
+    qpci_device_foreach(s->pcibus, 0x8086, 0x5845, save_fn, &s->dev);
+    g_assert(s->dev != NULL);
+
+    /* BAR 0 first, it is larger than the MSI-X BAR and needs alignment */
+    s->bar = qpci_iomap(s->dev, 0, &barsize);
+    g_assert(s->bar != NULL);
+    qpci_msix_enable(s->dev);
+    qpci_device_enable(s->dev);
+
+    nvme_queue_init(s, &s->admin, 0, 8, 8);
+    qpci_io_writel(s->dev, s->bar + NVME_REG_AQA,
+                   (s->admin.sq_size - 1) | (s->admin.cq_size - 1) << 16);
+    qpci_io_writel(s->dev, s->bar + NVME_REG_ASQ, s->admin.sq);
+    qpci_io_writel(s->dev, s->bar + NVME_REG_ASQ + 4, s->admin.sq >> 32);
+    qpci_io_writel(s->dev, s->bar + NVME_REG_ACQ, s->admin.cq);
+    qpci_io_writel(s->dev, s->bar + NVME_REG_ACQ + 4, s->admin.cq >> 32);
+    qpci_io_writel(s->dev, s->bar + NVME_REG_CC,
+                   NVME_CC_EN | NVME_CC_IOSQES | NVME_CC_IOCQES);
+
+    for (i = 0; i < NVME_TIMEOUT_US / 50; i++) {
+        csts = qpci_io_readl(s->dev, s->bar + NVME_REG_CSTS);
+        if (csts & NVME_CSTS_RDY) {
+            break;
+        }
+        usleep(50);
+    }
+    g_assert_cmphex(csts & NVME_CSTS_RDY, ==, NVME_CSTS_RDY);
+
+    return s;
+}
+
+static void nvme_test_stop(NvmeTestState *s)
+{
+    qpci_msix_disable(s->dev);
+    qpci_iounmap(s->dev, s->bar);
+    g_free(s->dev);
+    qpci_free_pc(s->pcibus);
+    qtest_pc_shutdown(s->qs);
+    g_free(s);
+}
+
+/* I/O queue 1, completing on MSI-X vector @vector */
+static void nvme_create_io_queue(NvmeTestState *s, uint16_t sq_size,
+                                 uint16_t cq_size, uint16_t vector)
 {
+    nvme_queue_init(s, &s->io, 1, sq_size, cq_size);
+    g_assert_cmphex(nvme_admin(s, NVME_ADM_CREATE_CQ, s->io.cq, 0,
+                               1 | (cq_size - 1) << 16,
+                               0x3 | vector << 16, NULL),
+                    ==, NVME_SUCCESS);
+    g_assert_cmphex(nvme_admin(s, NVME_ADM_CREATE_SQ, s->io.sq, 0,
+                               1 | (sq_size - 1) << 16, 0x1 | 1 << 16, NULL),
+                    ==, NVME_SUCCESS);
+}
+
+static uint32_t nvme_identify_ctrl_field(NvmeTestState *s, unsigned offset)
+{
+    uint64_t page = nvme_alloc(s, NVME_PAGE_SIZE);
+    uint32_t val;
+
+    g_assert_cmphex(nvme_admin(s, NVME_ADM_IDENTIFY, page, 0, 1, 0, NULL),
+                    ==, NVME_SUCCESS);
+    memread(page + offset, &val, sizeof(val));
+    guest_free(s->qs->alloc, page);
+    return le32_to_cpu(val);
+}
+
+static void fill_pattern(uint8_t *buf, size_t len, uint8_t seed)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        buf[i] = seed + i * 7;
+    }
+}
+
+/*
+ * SGL data transfers: a Data Block descriptor in the command, a Last
+ * Segment, and a Segment chained to a Last Segment.  Malformed lists and
+ * the reserved PSDT value fail without touching the disk.
+ */
+static void test_sgl(void)
+{
+    NvmeTestState *s = nvme_test_start();
+    uint8_t pattern[4 * NVME_SECTOR_SIZE], buf[4 * NVME_SECTOR_SIZE];
+    NvmeTestSgl sgl, list[3];
+    NvmeTestCmd cmd;
+    uint64_t data, list1, list2;
+
+    g_assert_cmphex(nvme_identify_ctrl_field(s, NVME_ID_SGLS) & 1, ==, 1);
+    nvme_create_io_queue(s, 16, 16, 1);
+
+    data = nvme_alloc(s, NVME_PAGE_SIZE);
+    list1 = nvme_alloc(s, NVME_PAGE_SIZE);
+    list2 = nvme_alloc(s, NVME_PAGE_SIZE);
+    fill_pattern(pattern, sizeof(pattern), 0x5a);
+    memwrite(data, pattern, sizeof(pattern));
+
+    /* Sectors 0-1 from a Last Segment with three uneven data blocks */
+    nvme_sgl_set(&list[0], NVME_SGL_DATA, data, 100);
+    nvme_sgl_set(&list[1], NVME_SGL_DATA, data + 100, 412);
+    nvme_sgl_set(&list[2], NVME_SGL_DATA, data + 512, 512);
+    memwrite(list1, list, sizeof(list));
+    nvme_sgl_set(&sgl, NVME_SGL_LAST_SEG, list1, sizeof(list));
+    nvme_sgl_cmd(&cmd, NVME_CMD_WRITE, NVME_PSDT_SGL, 0, 2, &sgl);
+    g_assert_cmphex(nvme_exec(s, &s->io, &cmd, NULL), ==, NVME_SUCCESS);
+
+    /* Sectors 2-3 from a Segment whose last entry chains to the next one */
+    nvme_sgl_set(&list[0], NVME_SGL_DATA, data + 1024, 256);
+    nvme_sgl_set(&list[1], NVME_SGL_LAST_SEG, list2, 2 * sizeof(list[0]));
+    memwrite(list1, list, 2 * sizeof(list[0]));
+    nvme_sgl_set(&list[0], NVME_SGL_DATA, data + 1280, 256);
+    nvme_sgl_set(&list[1], NVME_SGL_DATA, data + 1536, 512);
+    memwrite(list2, list, 2 * sizeof(list[0]));
+    nvme_sgl_set(&sgl, NVME_SGL_SEGMENT, list1, 2 * sizeof(list[0]));
+    nvme_sgl_cmd(&cmd, NVME_CMD_WRITE, NVME_PSDT_SGL, 2, 2, &sgl);
+    g_assert_cmphex(nvme_exec(s, &s->io, &cmd, NULL), ==, NVME_SUCCESS);
+
+    /* Read all four back through one Data Block descriptor */
+    qmemset(data, 0, sizeof(buf));
+    nvme_sgl_set(&sgl, NVME_SGL_DATA, data, sizeof(buf));
+    nvme_sgl_cmd(&cmd, NVME_CMD_READ, NVME_PSDT_SGL, 0, 4, &sgl);
+    g_assert_cmphex(nvme_exec(s, &s->io, &cmd, NULL), ==, NVME_SUCCESS);
+    memread(data, buf, sizeof(buf));
+    g_assert(!memcmp(buf, pattern, sizeof(buf)));
+    qmemset(data, 0xff, sizeof(buf));
+
+    /* Segment length that is not a whole number of descriptors */
+    nvme_sgl_set(&sgl, NVME_SGL_LAST_SEG, list1, 20);
+    nvme_sgl_cmd(&cmd, NVME_CMD_WRITE, NVME_PSDT_SGL, 0, 1, &sgl);
+    g_assert_cmphex(nvme_exec(s, &s->io, &cmd, NULL), ==,
+                    NVME_INVALID_SGL_SEG_DESCR | NVME_DNR);
+
+    /* Bit Bucket descriptors are not supported */
+    nvme_sgl_set(&list[0], NVME_SGL_DATA, data, 256);
+    nvme_sgl_set(&list[1], NVME_SGL_BIT_BUCKET, 0, 256);
+    memwrite(list1, list, 2 * sizeof(list[0]));
+    nvme_sgl_set(&sgl, NVME_SGL_LAST_SEG, list1, 2 * sizeof(list[0]));
+    nvme_sgl_cmd(&cmd, NVME_CMD_WRITE, NVME_PSDT_SGL, 0, 1, &sgl);
+    g_assert_cmphex(nvme_exec(s, &s->io, &cmd, NULL), ==,
+                    NVME_SGL_DESCR_TYPE_INVALID | NVME_DNR);
+
+    /* Data blocks that are shorter than the transfer */
+    nvme_sgl_set(&sgl, NVME_SGL_DATA, data, NVME_SECTOR_SIZE);
+    nvme_sgl_cmd(&cmd, NVME_CMD_WRITE, NVME_PSDT_SGL, 0, 2, &sgl);
+    g_assert_cmphex(nvme_exec(s, &s->io, &cmd, NULL), ==,
+                    NVME_DATA_SGL_LEN_INVALID | NVME_DNR);
+
+    /* PSDT 11b is reserved */
+    nvme_sgl_set(&sgl, NVME_SGL_DATA, data, NVME_SECTOR_SIZE);
+    nvme_sgl_cmd(&cmd, NVME_CMD_WRITE, NVME_PSDT_RESERVED, 0, 1, &sgl);
+    g_assert_cmphex(nvme_exec(s, &s->io, &cmd, NULL), ==,
+                    NVME_INVALID_FIELD | NVME_DNR);
+
+    /* None of the failed writes reached the disk */
+    qmemset(data, 0, sizeof(buf));
+    nvme_rw_cmd(&cmd, NVME_CMD_READ, 0, 0, 4, data, 0);
+    g_assert_cmphex(nvme_exec(s, &s->io, &cmd, NULL), ==, NVME_SUCCESS);
+    memread(data, buf, sizeof(buf));
+    g_assert(!memcmp(buf, pattern, sizeof(buf)));
+
+    nvme_test_stop(s);
+}
+
+static uint32_t nvme_shadow_read(uint64_t addr)
+{
+    return le32_to_cpu(readl(addr));
+}
+
+static void nvme_shadow_write(uint64_t addr, uint32_t val)
+{
+    writel(addr, cpu_to_le32(val));
+}
+
+/*
+ * Doorbell Buffer Config: the controller takes I/O queue tails and heads
+ * from the shadow doorbells and publishes how far it got in EventIdx.
+ */
+static void test_dbbuf(void)
+{
+    NvmeTestState *s = nvme_test_start();
+    uint64_t dbs, eis, data;
+    uint64_t sq_db, cq_db, sq_ei, cq_ei;
+    uint16_t cid[4];
+    NvmeTestCmd cmd;
+
+    g_assert_cmphex(nvme_identify_ctrl_field(s, NVME_ID_OACS) & (1 << 8),
+                    ==, 1 << 8);
+
+    /* With four entries, the completion queue holds three completions */
+    nvme_create_io_queue(s, 8, 4, 1);
+    data = nvme_alloc(s, NVME_PAGE_SIZE);
+    nvme_rw_cmd(&cmd, NVME_CMD_READ, 0, 0, 1, data, 0);
+    g_assert_cmphex(nvme_exec(s, &s->io, &cmd, NULL), ==, NVME_SUCCESS);
+
+    dbs = nvme_alloc(s, NVME_PAGE_SIZE);
+    eis = nvme_alloc(s, NVME_PAGE_SIZE);
+    sq_db = dbs + NVME_REG_DB(1, 0) - 0x1000;
+    cq_db = dbs + NVME_REG_DB(1, 1) - 0x1000;
+    sq_ei = eis + NVME_REG_DB(1, 0) - 0x1000;
+    cq_ei = eis + NVME_REG_DB(1, 1) - 0x1000;
+
+    /* The shadow doorbells start out with the values last written */
+    nvme_shadow_write(sq_db, s->io.sq_tail);
+    nvme_shadow_write(cq_db, s->io.cq_head);
+    g_assert_cmphex(nvme_admin(s, NVME_ADM_DBBUF, dbs, eis, 0, 0, NULL),
+                    ==, NVME_SUCCESS);
+    g_assert_cmpint(nvme_shadow_read(sq_ei), ==, 1);
+    g_assert_cmpint(nvme_shadow_read(cq_ei), ==, 1);
+
+    /* The MMIO doorbell only says that something changed; a stale value
+     * there must not hide the second command */
+    cid[0] = nvme_queue_cmd(s, &s->io, &cmd);
+    cid[1] = nvme_queue_cmd(s, &s->io, &cmd);
+    nvme_shadow_write(sq_db, s->io.sq_tail);
+    nvme_ring_sq(s, &s->io, s->io.sq_tail - 1);
+    nvme_wait_cids(&s->io, cid, 2);
+    g_assert_cmpint(nvme_shadow_read(sq_ei), ==, s->io.sq_tail);
+
+    /* The completion queue is full now unless the controller reads the
+     * consumed entries from the shadow head; nothing is written to the
+     * MMIO completion doorbell */
+    nvme_shadow_write(cq_db, s->io.cq_head);
+    cid[2] = nvme_queue_cmd(s, &s->io, &cmd);
+    cid[3] = nvme_queue_cmd(s, &s->io, &cmd);
+    nvme_shadow_write(sq_db, s->io.sq_tail);
+    nvme_ring_sq(s, &s->io, s->io.sq_tail);
+    nvme_wait_cids(&s->io, cid + 2, 2);
+    g_assert_cmpint(s->io.phase, ==, 0);
+    g_assert_cmpint(nvme_shadow_read(sq_ei), ==, s->io.sq_tail);
+    g_assert_cmpint(nvme_shadow_read(cq_ei), ==, 3);
+
+    /* The admin queue keeps using the MMIO doorbells */
+    g_assert_cmphex(nvme_identify_ctrl_field(s, NVME_ID_OACS) & (1 << 8),
+                    ==, 1 << 8);
+
+    nvme_test_stop(s);
+}
+
+static bool nvme_msix_fired(uint64_t addr, uint32_t data)
+{
+    if (readl(addr) != data) {
+        return false;
+    }
+    writel(addr, 0);
+    return true;
+}
+
+/*
+ * Interrupt Coalescing: the feature reads back what was set, and the
+ * interrupt for an I/O queue waits for either more than THR completions
+ * or the aggregation time.
+ */
+static void test_intc(void)
+{
+    NvmeTestState *s = nvme_test_start();
+    const uint32_t msi_data = 0x12345678;
+    uint64_t msi_addr, data;
+    uint32_t result;
+    uint16_t cid[4];
+    NvmeTestCmd cmd;
+    int i;
+
+    g_assert_cmphex(nvme_admin(s, NVME_ADM_GET_FEAT, 0, 0, NVME_FEAT_INTC, 0,
+                               &result), ==, NVME_SUCCESS);
+    g_assert_cmphex(result, ==, 0);
+
+    /* More than 3 completions or 10 * 100us */
+    g_assert_cmphex(nvme_admin(s, NVME_ADM_SET_FEAT, 0, 0, NVME_FEAT_INTC,
+                               0x0a03, NULL), ==, NVME_SUCCESS);
+    g_assert_cmphex(nvme_admin(s, NVME_ADM_GET_FEAT, 0, 0, NVME_FEAT_INTC, 0,
+                               &result), ==, NVME_SUCCESS);
+    g_assert_cmphex(result, ==, 0x0a03);
+
+    msi_addr = nvme_alloc(s, NVME_PAGE_SIZE);
+    nvme_msix_setup(s, 1, msi_addr, msi_data);
+    nvme_create_io_queue(s, 16, 16, 1);
+    data = nvme_alloc(s, NVME_PAGE_SIZE);
+    nvme_rw_cmd(&cmd, NVME_CMD_READ, 0, 0, 1, data, 0);
+
+    /* A single completion is posted, but its interrupt is held back until
+     * the aggregation time passes */
+    cid[0] = nvme_queue_cmd(s, &s->io, &cmd);
+    nvme_ring_sq(s, &s->io, s->io.sq_tail);
+    nvme_wait_cids(&s->io, cid, 1);
+    nvme_ring_cq(s, &s->io);
+    g_assert(!nvme_msix_fired(msi_addr, msi_data));
+    clock_step(500 * 1000);
+    g_assert(!nvme_msix_fired(msi_addr, msi_data));
+    clock_step(500 * 1000);
+    g_assert(nvme_msix_fired(msi_addr, msi_data));
+
+    /* Four completions cross the threshold without waiting */
+    for (i = 0; i < 4; i++) {
+        cid[i] = nvme_queue_cmd(s, &s->io, &cmd);
+    }
+    nvme_ring_sq(s, &s->io, s->io.sq_tail);
+    nvme_wait_cids(&s->io, cid, 4);
+    nvme_ring_cq(s, &s->io);
+    g_assert(nvme_msix_fired(msi_addr, msi_data));
+
+    /* Coalescing Disable in the vector's configuration bypasses it */
+    g_assert_cmphex(nvme_admin(s, NVME_ADM_SET_FEAT, 0, 0, NVME_FEAT_INTVC,
+                               1 | 1 << 16, NULL), ==, NVME_SUCCESS);
+    g_assert_cmphex(nvme_admin(s, NVME_ADM_GET_FEAT, 0, 0, NVME_FEAT_INTVC, 1,
+                               &result), ==, NVME_SUCCESS);
+    g_assert_cmphex(result, ==, 1 | 1 << 16);
+    cid[0] = nvme_queue_cmd(s, &s->io, &cmd);
+    nvme_ring_sq(s, &s->io, s->io.sq_tail);
+    nvme_wait_cids(&s->io, cid, 1);
+    nvme_ring_cq(s, &s->io);
+    g_assert(nvme_msix_fired(msi_addr, msi_data));
+
+    nvme_test_stop(s);
 }
 
 int main(int argc, char **argv)
 {
-    int ret;
+    int fd, ret;
+
+    fd = mkstemp(tmp_path);
+    g_assert(fd >= 0);
+    ret = ftruncate(fd, TEST_IMAGE_SIZE);
+    g_assert(ret == 0);
+    close(fd);
 
     g_test_init(&argc, &argv, NULL);
-    qtest_add_func("/nvme/nop", nop);
+    qtest_add_func("/nvme/sgl", test_sgl);
+    qtest_add_func("/nvme/dbbuf", test_dbbuf);
+    qtest_add_func("/nvme/intc", test_intc);
 
-    qtest_start("-drive id=drv0,if=none,file=/dev/null,format=raw "
-                "-device nvme,drive=drv0,serial=foo");
     ret = g_test_run();
 
-    qtest_end();
+    unlink(tmp_path);
 
     return ret;
 }
@@ -0,0 +1,151 @@
+/*
+ * QTest testcase and benchmark for PCI BAR remapping
+ *
+ * Plugs a number of pci-testdev devices and toggles memory decoding on
+ * them, which adds and removes their BARs from the guest address space.
+ * Every toggle is a full memory transaction, so the benchmark measures
+ * the cost of rebuilding the FlatViews and dispatch tables.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <glib.h>
+#include "libqtest.h"
+#include "libqos/pci.h"
+#include "libqos/pci-pc.h"
+#include "hw/pci/pci_regs.h"
+
+/* Slots 0 and 1 are taken by the host bridge and the ISA bridge, slot 2
+ * by the VGA card.
+ */
+#define FIRST_SLOT      3
+#define MAX_DEVS        28
+
+#define PERF_DEVS       MAX_DEVS
+#define PERF_ROUNDS     200
+
+/* pci-testdev reports the name of the selected test after its header */
+#define TESTDEV_NAME    16
+
+typedef struct BarTest {
+    QPCIBus *bus;
+    QPCIDevice *dev[MAX_DEVS];
+    void *bar[MAX_DEVS];
+    int ndevs;
+} BarTest;
+
+static void bar_test_start(BarTest *t, int ndevs)
+{
+    GString *cmdline = g_string_new("");
+    uint64_t size;
+    int i;
+
+    for (i = 0; i < ndevs; i++) {
+        g_string_append_printf(cmdline, " -device pci-testdev,addr=%x",
+                               FIRST_SLOT + i);
+    }
+    qtest_start(cmdline->str);
+    g_string_free(cmdline, true);
+
+    t->bus = qpci_init_pc();
+    t->ndevs = ndevs;
+    for (i = 0; i < ndevs; i++) {
+        t->dev[i] = qpci_device_find(t->bus, QPCI_DEVFN(FIRST_SLOT + i, 0));
+        g_assert(t->dev[i] != NULL);
+        t->bar[i] = qpci_iomap(t->dev[i], 0, &size);
+        g_assert(t->bar[i] != NULL);
+        qpci_device_enable(t->dev[i]);
+
+        /* select the first MMIO test */
+        qpci_io_writeb(t->dev[i], t->bar[i], 0);
+    }
+}
+
+static void bar_test_end(BarTest *t)
+{
+    int i;
+
+    for (i = 0; i < t->ndevs; i++) {
+        g_free(t->dev[i]);
+    }
+    qpci_free_pc(t->bus);
+    qtest_end();
+}
+
+static void bar_set_mapped(BarTest *t, int i, bool mapped)
+{
+    uint16_t cmd = qpci_config_readw(t->dev[i], PCI_COMMAND);
+
+    if (mapped) {
+        cmd |= PCI_COMMAND_MEMORY;
+    } else {
+        cmd &= ~PCI_COMMAND_MEMORY;
+    }
+    qpci_config_writew(t->dev[i], PCI_COMMAND, cmd);
+}
+
+static void test_remap(void)
+{
+    BarTest t;
+    int i;
+
+    bar_test_start(&t, 8);
+    for (i = 0; i < t.ndevs; i++) {
+        g_assert_cmpint(qpci_io_readb(t.dev[i], t.bar[i] + TESTDEV_NAME),
+                        ==, 'n');
+    }
+
+    /* Unmap every other device; the rest must keep working. */
+    for (i = 0; i < t.ndevs; i += 2) {
+        bar_set_mapped(&t, i, false);
+    }
+    for (i = 1; i < t.ndevs; i += 2) {
+        g_assert_cmpint(qpci_io_readb(t.dev[i], t.bar[i] + TESTDEV_NAME),
+                        ==, 'n');
+    }
+
+    for (i = 0; i < t.ndevs; i += 2) {
+        bar_set_mapped(&t, i, true);
+    }
+    for (i = 0; i < t.ndevs; i++) {
+        g_assert_cmpint(qpci_io_readb(t.dev[i], t.bar[i] + TESTDEV_NAME),
+                        ==, 'n');
+    }
+    bar_test_end(&t);
+}
+
+static void test_perf(void)
+{
+    BarTest t;
+    gint64 start, end;
+    int i, j;
+
+    bar_test_start(&t, PERF_DEVS);
+
+    start = g_get_monotonic_time();
+    for (j = 0; j < PERF_ROUNDS; j++) {
+        for (i = 0; i < t.ndevs; i++) {
+            bar_set_mapped(&t, i, false);
+            bar_set_mapped(&t, i, true);
+        }
+    }
+    end = g_get_monotonic_time();
+
+    g_test_message("BAR map/unmap: %.1f us with %d devices",
+                   (end - start) / (2.0 * PERF_ROUNDS * t.ndevs), t.ndevs);
+    bar_test_end(&t);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/pci-bar/remap", test_remap);
+    if (g_test_perf()) {
+        qtest_add_func("/pci-bar/perf", test_perf);
+    }
+
+    return g_test_run();
+}
@@ -0,0 +1,471 @@
+/*
+ * QTest testcase for the user mode network stack
+ *
+ * The test plays the guest: it exchanges raw Ethernet frames with slirp
+ * through a socket backend on the same hub, and runs a minimal TCP
+ * client against a listening socket on the host.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <glib.h>
+#include "libqtest.h"
+#include "qemu-common.h"
+#include "qemu/sockets.h"
+#include "qemu/iov.h"
+#include "qemu/bswap.h"
+
+#define GUEST_MAC       "\x52\x54\x00\x12\x34\x56"
+#define HOST_MAC        "\x52\x55\x0a\x00\x02\x02"
+#define GUEST_IP        "\x0a\x00\x02\x0f"      /* 10.0.2.15 */
+#define HOST_IP         "\x0a\x00\x02\x02"      /* 10.0.2.2 */
+
+#define TH_FIN          0x01
+#define TH_SYN          0x02
+#define TH_RST          0x04
+#define TH_PUSH         0x08
+#define TH_ACK          0x10
+
+#define FRAME_MAX       2048
+#define HDRS_LEN        (14 + 20 + 20)
+#define WAIT_MS         10000
+
+#define TEST_CONNS      64
+#define PERF_CONNS      1000
+#define PERF_RATE_CONNS 2000
+#define PERF_BULK_BYTES (64 * 1024 * 1024)
+
+typedef struct TCPConn {
+    uint16_t sport;
+    uint32_t snd_nxt;
+    uint32_t rcv_nxt;
+    bool established;
+} TCPConn;
+
+typedef struct TCPSeg {
+    uint16_t sport;
+    uint16_t dport;
+    uint32_t seq;
+    uint32_t ack;
+    uint8_t flags;
+    const uint8_t *data;
+    size_t len;
+} TCPSeg;
+
+typedef struct SlirpTest {
+    int fd;                 /* our end of the socket backend */
+    int listen_fd;          /* host side listener */
+    uint16_t hport;
+    uint16_t ip_id;
+    uint8_t frame[FRAME_MAX];
+} SlirpTest;
+
+static uint32_t csum_add(uint32_t sum, const uint8_t *buf, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i + 1 < len; i += 2) {
+        sum += (buf[i] << 8) | buf[i + 1];
+    }
+    if (len & 1) {
+        sum += buf[len - 1] << 8;
+    }
+    return sum;
+}
+
+static uint16_t csum_fold(uint32_t sum)
+{
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return ~sum;
+}
+
+static void frame_send(SlirpTest *t, const uint8_t *frame, size_t size)
+{
+    uint32_t len = htonl(size);
+    struct iovec iov[] = {
+        {
+            .iov_base = &len,
+            .iov_len = sizeof(len),
+        }, {
+            .iov_base = (void *)frame,
+            .iov_len = size,
+        },
+    };
+    ssize_t ret;
+
+    ret = iov_send(t->fd, iov, 2, 0, sizeof(len) + size);
+    g_assert_cmpint(ret, ==, sizeof(len) + size);
+}
+
+static bool wait_readable(int fd, int timeout_ms)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+    return poll(&pfd, 1, timeout_ms) == 1;
+}
+
+static void read_full(int fd, void *buf, size_t len)
+{
+    ssize_t ret;
+
+    while (len) {
+        g_assert(wait_readable(fd, WAIT_MS));
+        ret = read(fd, buf, len);
+        g_assert_cmpint(ret, >, 0);
+        buf = (uint8_t *)buf + ret;
+        len -= ret;
+    }
+}
+
+/* Receive the next TCP/IPv4 segment sent by slirp, skipping the rest */
+static void tcp_recv(SlirpTest *t, TCPSeg *seg)
+{
+    uint8_t *ip = t->frame + 14;
+    uint8_t *th = ip + 20;
+    uint32_t len;
+
+    for (;;) {
+        read_full(t->fd, &len, sizeof(len));
+        len = ntohl(len);
+        g_assert_cmpint(len, <=, FRAME_MAX);
+        read_full(t->fd, t->frame, len);
+
+        if (len < HDRS_LEN || lduw_be_p(t->frame + 12) != 0x0800 ||
+            ip[0] != 0x45 || ip[9] != 6) {
+            continue;
+        }
+        seg->sport = lduw_be_p(th);
+        seg->dport = lduw_be_p(th + 2);
+        seg->seq = ldl_be_p(th + 4);
+        seg->ack = ldl_be_p(th + 8);
+        seg->flags = th[13];
+        seg->data = th + (th[12] >> 4) * 4;
+        seg->len = 14 + lduw_be_p(ip + 2) - (seg->data - t->frame);
+        return;
+    }
+}
+
+static void tcp_send(SlirpTest *t, TCPConn *c, uint8_t flags,
+                     const void *data, size_t len)
+{
+    uint8_t frame[HDRS_LEN + 256];
+    uint8_t *ip = frame + 14;
+    uint8_t *th = ip + 20;
+    uint32_t sum;
+
+    g_assert_cmpint(len, <=, sizeof(frame) - HDRS_LEN);
+    memset(frame, 0, HDRS_LEN);
+    memcpy(frame, HOST_MAC, 6);
+    memcpy(frame + 6, GUEST_MAC, 6);
+    stw_be_p(frame + 12, 0x0800);
+
+    ip[0] = 0x45;
+    stw_be_p(ip + 2, 20 + 20 + len);
+    stw_be_p(ip + 4, t->ip_id++);
+    ip[8] = 64;
+    ip[9] = 6;
+    memcpy(ip + 12, GUEST_IP, 4);
+    memcpy(ip + 16, HOST_IP, 4);
+    stw_be_p(ip + 10, csum_fold(csum_add(0, ip, 20)));
+
+    stw_be_p(th, c->sport);
+    stw_be_p(th + 2, t->hport);
+    stl_be_p(th + 4, c->snd_nxt);
+    stl_be_p(th + 8, (flags & TH_ACK) ? c->rcv_nxt : 0);
+    th[12] = 5 << 4;
+    th[13] = flags;
+    stw_be_p(th + 14, 65535);
+    if (len) {
+        memcpy(th + 20, data, len);
+    }
+    sum = csum_add(6 + 20 + len, ip + 12, 8);
+    stw_be_p(th + 16, csum_fold(csum_add(sum, th, 20 + len)));
+
+    frame_send(t, frame, HDRS_LEN + len);
+    c->snd_nxt += len + ((flags & (TH_SYN | TH_FIN)) ? 1 : 0);
+}
+
+static void slirp_test_start(SlirpTest *t, bool thread, int backlog)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    socklen_t addrlen = sizeof(addr);
+    uint8_t garp[14 + 28] = { 0 };
+    char *cmdline;
+    int sv[2], ret;
+
+    memset(t, 0, sizeof(*t));
+
+    ret = socketpair(PF_UNIX, SOCK_STREAM, 0, sv);
+    g_assert_cmpint(ret, !=, -1);
+    t->fd = sv[0];
+
+    t->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    g_assert_cmpint(t->listen_fd, >=, 0);
+    g_assert_cmpint(bind(t->listen_fd, (struct sockaddr *)&addr,
+                         sizeof(addr)), ==, 0);
+    g_assert_cmpint(listen(t->listen_fd, backlog), ==, 0);
+    getsockname(t->listen_fd, (struct sockaddr *)&addr, &addrlen);
+    t->hport = ntohs(addr.sin_port);
+
+    cmdline = g_strdup_printf("-net user,vlan=0%s "
+                              "-net socket,vlan=0,fd=%d",
+                              thread ? ",thread=on" : "", sv[1]);
+    qtest_start(cmdline);
+    g_free(cmdline);
+    close(sv[1]);
+
+    /* gratuitous ARP, so that slirp knows where to send our packets */
+    memset(garp, 0xff, 6);
+    memcpy(garp + 6, GUEST_MAC, 6);
+    stw_be_p(garp + 12, 0x0806);
+    stw_be_p(garp + 14, 1);
+    stw_be_p(garp + 16, 0x0800);
+    garp[18] = 6;
+    garp[19] = 4;
+    stw_be_p(garp + 20, 1);
+    memcpy(garp + 22, GUEST_MAC, 6);
+    memcpy(garp + 28, GUEST_IP, 4);
+    memcpy(garp + 38, GUEST_IP, 4);
+    frame_send(t, garp, sizeof(garp));
+}
+
+static void slirp_test_end(SlirpTest *t)
+{
+    qtest_end();
+    close(t->fd);
+    close(t->listen_fd);
+}
+
+static TCPConn *conn_find(TCPConn *conns, int n, uint16_t port)
+{
+    int i = port - conns[0].sport;
+
+    g_assert(i >= 0 && i < n);
+    return &conns[i];
+}
+
+/* Open @n connections at once, return the accepted host sockets */
+static void tcp_open(SlirpTest *t, TCPConn *conns, int *host_fds, int n,
+                     uint16_t first_port)
+{
+    int established = 0, accepted = 0;
+    TCPSeg seg;
+    TCPConn *c;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        c = &conns[i];
+        c->sport = first_port + i;
+        c->snd_nxt = 1000 * i;
+        c->established = false;
+        tcp_send(t, c, TH_SYN, NULL, 0);
+    }
+
+    while (established < n) {
+        tcp_recv(t, &seg);
+        c = conn_find(conns, n, seg.dport);
+        g_assert_cmpint(seg.sport, ==, t->hport);
+        g_assert_cmphex(seg.flags & (TH_SYN | TH_ACK | TH_RST), ==,
+                        TH_SYN | TH_ACK);
+        g_assert_cmpint(seg.ack, ==, c->snd_nxt);
+        g_assert(!c->established);
+        c->rcv_nxt = seg.seq + 1;
+        c->established = true;
+        tcp_send(t, c, TH_ACK, NULL, 0);
+        established++;
+
+        /* keep the host backlog from filling up */
+        while (accepted < n && wait_readable(t->listen_fd, 0)) {
+            host_fds[accepted++] = accept(t->listen_fd, NULL, NULL);
+        }
+    }
+    while (accepted < n) {
+        g_assert(wait_readable(t->listen_fd, WAIT_MS));
+        host_fds[accepted++] = accept(t->listen_fd, NULL, NULL);
+    }
+    for (i = 0; i < n; i++) {
+        g_assert_cmpint(host_fds[i], >=, 0);
+    }
+}
+
+static void tcp_reset(SlirpTest *t, TCPConn *conns, int *host_fds, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        tcp_send(t, &conns[i], TH_RST | TH_ACK, NULL, 0);
+        close(host_fds[i]);
+    }
+}
+
+/*
+ * Many concurrent connections: data from the guest must reach the right
+ * host socket and vice versa.
+ */
+static void test_connections(gconstpointer data)
+{
+    bool thread = GPOINTER_TO_INT(data);
+    TCPConn conns[TEST_CONNS];
+    int host_fds[TEST_CONNS];
+    bool seen[TEST_CONNS] = { };
+    SlirpTest t;
+    TCPSeg seg;
+    TCPConn *c;
+    uint16_t port;
+    int i, got;
+
+    slirp_test_start(&t, thread, TEST_CONNS);
+    tcp_open(&t, conns, host_fds, TEST_CONNS, 20000);
+
+    /* guest to host: each connection sends its own port */
+    for (i = 0; i < TEST_CONNS; i++) {
+        uint8_t buf[2];
+
+        stw_be_p(buf, conns[i].sport);
+        tcp_send(&t, &conns[i], TH_ACK | TH_PUSH, buf, sizeof(buf));
+    }
+    for (i = 0; i < TEST_CONNS; i++) {
+        uint8_t buf[2];
+
+        read_full(host_fds[i], buf, sizeof(buf));
+        port = lduw_be_p(buf);
+        g_assert(port >= 20000 && port < 20000 + TEST_CONNS);
+        g_assert(!seen[port - 20000]);
+        seen[port - 20000] = true;
+    }
+
+    /* host to guest: each host socket sends its index */
+    for (i = 0; i < TEST_CONNS; i++) {
+        g_assert(seen[i]);
+        seen[i] = false;
+    }
+    for (i = 0; i < TEST_CONNS; i++) {
+        uint8_t buf[2];
+
+        stw_be_p(buf, i);
+        g_assert_cmpint(write(host_fds[i], buf, sizeof(buf)), ==,
+                        sizeof(buf));
+    }
+    for (got = 0; got < TEST_CONNS; ) {
+        tcp_recv(&t, &seg);
+        if (!seg.len) {
+            continue;
+        }
+        c = conn_find(conns, TEST_CONNS, seg.dport);
+        g_assert_cmpint(seg.len, ==, 2);
+        g_assert_cmpint(seg.seq, ==, c->rcv_nxt);
+        c->rcv_nxt += seg.len;
+        tcp_send(&t, c, TH_ACK, NULL, 0);
+
+        i = lduw_be_p(seg.data);
+        g_assert(i >= 0 && i < TEST_CONNS);
+        g_assert(!seen[i]);
+        seen[i] = true;
+        got++;
+    }
+
+    tcp_reset(&t, conns, host_fds, TEST_CONNS);
+    slirp_test_end(&t);
+}
+
+static void perf_bulk(bool thread)
+{
+    static uint8_t buf[65536];
+    TCPConn conn;
+    int host_fd;
+    SlirpTest t;
+    TCPSeg seg;
+    size_t written = 0, received = 0;
+    gint64 start, end;
+
+    slirp_test_start(&t, thread, 1);
+    tcp_open(&t, &conn, &host_fd, 1, 30000);
+    qemu_set_nonblock(host_fd);
+
+    start = g_get_monotonic_time();
+    while (received < PERF_BULK_BYTES) {
+        ssize_t ret;
+
+        if (written < PERF_BULK_BYTES) {
+            ret = write(host_fd, buf, MIN(sizeof(buf),
+                                          PERF_BULK_BYTES - written));
+            if (ret > 0) {
+                written += ret;
+            }
+        }
+        tcp_recv(&t, &seg);
+        if (seg.len && seg.seq == conn.rcv_nxt) {
+            conn.rcv_nxt += seg.len;
+            received += seg.len;
+            tcp_send(&t, &conn, TH_ACK, NULL, 0);
+        }
+    }
+    end = g_get_monotonic_time();
+
+    g_test_message("slirp%s bulk: %.1f MB/s", thread ? " thread" : "",
+                   (double)received / (end - start));
+
+    tcp_reset(&t, &conn, &host_fd, 1);
+    slirp_test_end(&t);
+}
+
+/* Connection setup and teardown, with many idle connections around */
+static void perf_conn_rate(bool thread)
+{
+    TCPConn *idle = g_new(TCPConn, PERF_CONNS);
+    int *idle_fds = g_new(int, PERF_CONNS);
+    TCPConn conn;
+    int host_fd;
+    SlirpTest t;
+    gint64 start, end;
+    int i;
+
+    slirp_test_start(&t, thread, PERF_CONNS);
+    tcp_open(&t, idle, idle_fds, PERF_CONNS, 10000);
+
+    start = g_get_monotonic_time();
+    for (i = 0; i < PERF_RATE_CONNS; i++) {
+        tcp_open(&t, &conn, &host_fd, 1, 40000 + i);
+        tcp_reset(&t, &conn, &host_fd, 1);
+    }
+    end = g_get_monotonic_time();
+
+    g_test_message("slirp%s connections: %.0f/s with %d open",
+                   thread ? " thread" : "",
+                   PERF_RATE_CONNS * 1e6 / (end - start), PERF_CONNS);
+
+    tcp_reset(&t, idle, idle_fds, PERF_CONNS);
+    slirp_test_end(&t);
+    g_free(idle);
+    g_free(idle_fds);
+}
+
+static void test_perf(void)
+{
+    perf_bulk(false);
+    perf_bulk(true);
+    perf_conn_rate(false);
+    perf_conn_rate(true);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_data_func("/slirp/tcp/connections", GINT_TO_POINTER(false),
+                        test_connections);
+    qtest_add_data_func("/slirp/tcp/connections-thread",
+                        GINT_TO_POINTER(true), test_connections);
+    if (g_test_perf()) {
+        qtest_add_func("/slirp/tcp/perf", test_perf);
+    }
+
+    return g_test_run();
+}
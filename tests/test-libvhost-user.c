@@ -0,0 +1,389 @@
+/*
+ * libvhost-user inflight tracking tests
+ *
+ * The test plays the vhost-user master for a backend built on
+ * libvhost-user.  The backend takes requests off the ring and then goes
+ * away without completing all of them; a new backend that is handed the
+ * same inflight area on reconnect must get the unfinished requests back
+ * from vu_queue_pop() before anything the guest queued afterwards.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <glib.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include "qemu/atomic.h"
+#include "qemu/memfd.h"
+#include "contrib/libvhost-user/libvhost-user.h"
+
+#define VHOST_USER_HDR_SIZE offsetof(VhostUserMsg, payload.u64)
+#define VHOST_USER_VERSION  1
+
+#define QUEUE_SIZE      16
+#define GUEST_MEM_SIZE  0x10000
+
+/* ring layout in guest memory, guest physical addresses start at 0 */
+#define DESC_ADDR       0x0000
+#define AVAIL_ADDR      0x1000
+#define USED_ADDR       0x2000
+#define BUF_ADDR        0x3000
+#define BUF_SIZE        0x100
+
+typedef struct TestMaster {
+    int sock;                   /* our end of the connection */
+    VuDev dev;                  /* the backend, driven from the same thread */
+    int inflight_fd;            /* kept across backend restarts */
+    uint64_t inflight_size;
+} TestMaster;
+
+static uint8_t *guest_mem;
+static int guest_mem_fd;
+
+static void panic_cb(VuDev *dev, const char *err)
+{
+    g_error("libvhost-user panic: %s", err);
+}
+
+static void set_watch_cb(VuDev *dev, int fd, int condition,
+                         vu_watch_cb cb, void *data)
+{
+}
+
+static void remove_watch_cb(VuDev *dev, int fd)
+{
+}
+
+static const VuDevIface test_iface = {
+};
+
+static void master_send(TestMaster *m, VhostUserMsg *msg, int fd)
+{
+    char control[CMSG_SPACE(sizeof(int))] = { };
+    struct iovec iov = {
+        .iov_base = msg,
+        .iov_len = VHOST_USER_HDR_SIZE + msg->size,
+    };
+    struct msghdr mh = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+    };
+    struct cmsghdr *cmsg;
+
+    msg->flags = VHOST_USER_VERSION;
+    if (fd >= 0) {
+        mh.msg_control = control;
+        mh.msg_controllen = sizeof(control);
+        cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    g_assert_cmpint(sendmsg(m->sock, &mh, 0), ==, iov.iov_len);
+    g_assert(vu_dispatch(&m->dev));
+}
+
+/* Read the reply to the last request, returning the fd it carried or -1 */
+static int master_recv(TestMaster *m, VhostUserMsg *msg, uint32_t request)
+{
+    char control[CMSG_SPACE(sizeof(int))] = { };
+    struct iovec iov = {
+        .iov_base = msg,
+        .iov_len = VHOST_USER_HDR_SIZE,
+    };
+    struct msghdr mh = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    struct cmsghdr *cmsg;
+    int fd = -1;
+
+    g_assert_cmpint(recvmsg(m->sock, &mh, 0), ==, VHOST_USER_HDR_SIZE);
+    g_assert_cmpint(msg->request, ==, request);
+    g_assert(msg->flags & VHOST_USER_REPLY_MASK);
+
+    cmsg = CMSG_FIRSTHDR(&mh);
+    if (cmsg && cmsg->cmsg_type == SCM_RIGHTS) {
+        memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+
+    g_assert_cmpint(msg->size, <=, sizeof(msg->payload));
+    g_assert_cmpint(read(m->sock, &msg->payload, msg->size), ==, msg->size);
+
+    return fd;
+}
+
+static void master_send_u64(TestMaster *m, uint32_t request, uint64_t val)
+{
+    VhostUserMsg msg = {
+        .request = request,
+        .size = sizeof(msg.payload.u64),
+        .payload.u64 = val,
+    };
+
+    master_send(m, &msg, -1);
+}
+
+static void master_send_state(TestMaster *m, uint32_t request, unsigned num)
+{
+    VhostUserMsg msg = {
+        .request = request,
+        .size = sizeof(msg.payload.state),
+        .payload.state = { .index = 0, .num = num },
+    };
+
+    master_send(m, &msg, -1);
+}
+
+/* Start a new backend and bring queue 0 up the way QEMU does */
+static void master_connect(TestMaster *m)
+{
+    VhostUserMsg msg = { };
+    int sv[2];
+    int fd;
+
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), ==, 0);
+    m->sock = sv[0];
+    vu_init(&m->dev, sv[1], panic_cb, set_watch_cb, remove_watch_cb,
+            &test_iface);
+
+    msg = (VhostUserMsg) { .request = VHOST_USER_GET_FEATURES };
+    master_send(m, &msg, -1);
+    master_recv(m, &msg, VHOST_USER_GET_FEATURES);
+    g_assert(msg.payload.u64 & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES));
+    master_send_u64(m, VHOST_USER_SET_FEATURES,
+                    1ULL << VHOST_USER_F_PROTOCOL_FEATURES);
+
+    msg = (VhostUserMsg) { .request = VHOST_USER_GET_PROTOCOL_FEATURES };
+    master_send(m, &msg, -1);
+    master_recv(m, &msg, VHOST_USER_GET_PROTOCOL_FEATURES);
+    g_assert(msg.payload.u64 &
+             (1ULL << VHOST_USER_PROTOCOL_F_INFLIGHT_SHMFD));
+    master_send_u64(m, VHOST_USER_SET_PROTOCOL_FEATURES,
+                    1ULL << VHOST_USER_PROTOCOL_F_INFLIGHT_SHMFD);
+
+    msg = (VhostUserMsg) {
+        .request = VHOST_USER_SET_MEM_TABLE,
+        .size = sizeof(msg.payload.memory),
+        .payload.memory = {
+            .nregions = 1,
+            .regions[0] = {
+                .guest_phys_addr = 0,
+                .memory_size = GUEST_MEM_SIZE,
+                .userspace_addr = (uintptr_t)guest_mem,
+                .mmap_offset = 0,
+            },
+        },
+    };
+    master_send(m, &msg, guest_mem_fd);
+
+    /* QEMU asks for the area once and hands the same one to later
+     * backends */
+    if (m->inflight_fd < 0) {
+        msg = (VhostUserMsg) {
+            .request = VHOST_USER_GET_INFLIGHT_FD,
+            .size = sizeof(msg.payload.inflight),
+            .payload.inflight = { .num_queues = 1, .queue_size = QUEUE_SIZE },
+        };
+        master_send(m, &msg, -1);
+        fd = master_recv(m, &msg, VHOST_USER_GET_INFLIGHT_FD);
+        g_assert(fd >= 0);
+        g_assert_cmpint(msg.payload.inflight.mmap_size, >, 0);
+        m->inflight_fd = fd;
+        m->inflight_size = msg.payload.inflight.mmap_size;
+    }
+
+    msg = (VhostUserMsg) {
+        .request = VHOST_USER_SET_INFLIGHT_FD,
+        .size = sizeof(msg.payload.inflight),
+        .payload.inflight = {
+            .mmap_size = m->inflight_size,
+            .mmap_offset = 0,
+            .num_queues = 1,
+            .queue_size = QUEUE_SIZE,
+        },
+    };
+    master_send(m, &msg, m->inflight_fd);
+
+    master_send_state(m, VHOST_USER_SET_VRING_NUM, QUEUE_SIZE);
+    master_send_state(m, VHOST_USER_SET_VRING_BASE,
+                      le16toh(((struct vring_used *)
+                               (guest_mem + USED_ADDR))->idx));
+
+    msg = (VhostUserMsg) {
+        .request = VHOST_USER_SET_VRING_ADDR,
+        .size = sizeof(msg.payload.addr),
+        .payload.addr = {
+            .index = 0,
+            .desc_user_addr = (uintptr_t)guest_mem + DESC_ADDR,
+            .avail_user_addr = (uintptr_t)guest_mem + AVAIL_ADDR,
+            .used_user_addr = (uintptr_t)guest_mem + USED_ADDR,
+        },
+    };
+    master_send(m, &msg, -1);
+
+    fd = eventfd(0, EFD_NONBLOCK);
+    g_assert(fd >= 0);
+    msg = (VhostUserMsg) {
+        .request = VHOST_USER_SET_VRING_CALL,
+        .size = sizeof(msg.payload.u64),
+    };
+    master_send(m, &msg, fd);
+    close(fd);
+
+    fd = eventfd(0, EFD_NONBLOCK);
+    g_assert(fd >= 0);
+    msg = (VhostUserMsg) {
+        .request = VHOST_USER_SET_VRING_KICK,
+        .size = sizeof(msg.payload.u64),
+    };
+    master_send(m, &msg, fd);
+    close(fd);
+
+    master_send_state(m, VHOST_USER_SET_VRING_ENABLE, 1);
+}
+
+/* The backend goes away without stopping the ring first */
+static void master_disconnect(TestMaster *m)
+{
+    vu_deinit(&m->dev);
+    close(m->sock);
+    m->sock = -1;
+}
+
+/* The guest side: queue a one descriptor request with buffer @head */
+static void guest_add_buf(unsigned head)
+{
+    struct vring_desc *desc = (struct vring_desc *)(guest_mem + DESC_ADDR);
+    struct vring_avail *avail = (struct vring_avail *)(guest_mem + AVAIL_ADDR);
+    uint16_t idx = le16toh(avail->idx);
+
+    desc[head] = (struct vring_desc) {
+        .addr = htole64(BUF_ADDR + head * BUF_SIZE),
+        .len = htole32(BUF_SIZE),
+        .flags = htole16(VRING_DESC_F_WRITE),
+    };
+    avail->ring[idx % QUEUE_SIZE] = htole16(head);
+    smp_wmb();
+    avail->idx = htole16(idx + 1);
+}
+
+static VuVirtqElement *pop(TestMaster *m)
+{
+    return vu_queue_pop(&m->dev, vu_get_queue(&m->dev, 0),
+                        sizeof(VuVirtqElement));
+}
+
+static void test_inflight_resubmit(void)
+{
+    TestMaster m = { .sock = -1, .inflight_fd = -1 };
+    struct vring_used *used = (struct vring_used *)(guest_mem + USED_ADDR);
+    VuVirtqElement *elem[3];
+    int i;
+
+    memset(guest_mem, 0, GUEST_MEM_SIZE);
+    master_connect(&m);
+
+    guest_add_buf(3);
+    guest_add_buf(5);
+    guest_add_buf(7);
+    for (i = 0; i < 3; i++) {
+        elem[i] = pop(&m);
+        g_assert(elem[i]);
+        g_assert_cmpint(elem[i]->in_num, ==, 1);
+    }
+    g_assert(!pop(&m));
+
+    /* Complete the oldest request only, then drop the connection */
+    memset(elem[0]->in_sg[0].iov_base, 0x33, BUF_SIZE);
+    g_assert_cmpint(guest_mem[BUF_ADDR + 3 * BUF_SIZE], ==, 0x33);
+    vu_queue_push(&m.dev, vu_get_queue(&m.dev, 0), elem[0], BUF_SIZE);
+    g_assert_cmpint(le16toh(used->idx), ==, 1);
+    g_assert_cmpint(le32toh(used->ring[0].id), ==, 3);
+    for (i = 0; i < 3; i++) {
+        free(elem[i]);
+    }
+    master_disconnect(&m);
+
+    /* The guest keeps queueing while the backend is away */
+    guest_add_buf(9);
+
+    /* The new backend gets the two unfinished requests first, oldest first,
+     * and only then looks at the ring */
+    master_connect(&m);
+    elem[0] = pop(&m);
+    elem[1] = pop(&m);
+    elem[2] = pop(&m);
+    g_assert(elem[0] && elem[1] && elem[2]);
+    g_assert_cmpint(elem[0]->index, ==, 5);
+    g_assert_cmpint(elem[1]->index, ==, 7);
+    g_assert_cmpint(elem[2]->index, ==, 9);
+    g_assert_cmpint(elem[0]->in_sg[0].iov_len, ==, BUF_SIZE);
+    memset(elem[0]->in_sg[0].iov_base, 0x55, BUF_SIZE);
+    g_assert_cmpint(guest_mem[BUF_ADDR + 5 * BUF_SIZE], ==, 0x55);
+    g_assert(!pop(&m));
+
+    for (i = 0; i < 3; i++) {
+        vu_queue_push(&m.dev, vu_get_queue(&m.dev, 0), elem[i], BUF_SIZE);
+        free(elem[i]);
+    }
+    g_assert_cmpint(le16toh(used->idx), ==, 4);
+    g_assert_cmpint(le32toh(used->ring[1].id), ==, 5);
+    g_assert_cmpint(le32toh(used->ring[2].id), ==, 7);
+    g_assert_cmpint(le32toh(used->ring[3].id), ==, 9);
+
+    /* Nothing is left to resubmit after everything completed */
+    master_disconnect(&m);
+    master_connect(&m);
+    g_assert(!pop(&m));
+    master_disconnect(&m);
+
+    close(m.inflight_fd);
+}
+
+/* A backend that never had a request in flight starts from the ring */
+static void test_inflight_empty(void)
+{
+    TestMaster m = { .sock = -1, .inflight_fd = -1 };
+    VuVirtqElement *elem;
+
+    memset(guest_mem, 0, GUEST_MEM_SIZE);
+    master_connect(&m);
+    master_disconnect(&m);
+
+    guest_add_buf(2);
+    master_connect(&m);
+    elem = pop(&m);
+    g_assert(elem);
+    g_assert_cmpint(elem->index, ==, 2);
+    g_assert(!pop(&m));
+    free(elem);
+    master_disconnect(&m);
+
+    close(m.inflight_fd);
+}
+
+int main(int argc, char **argv)
+{
+    int ret;
+
+    guest_mem = qemu_memfd_alloc("guest-mem", GUEST_MEM_SIZE, 0,
+                                 &guest_mem_fd);
+    g_assert(guest_mem);
+
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/libvhost-user/inflight/resubmit",
+                    test_inflight_resubmit);
+    g_test_add_func("/libvhost-user/inflight/empty", test_inflight_empty);
+
+    ret = g_test_run();
+
+    qemu_memfd_free(guest_mem, GUEST_MEM_SIZE, guest_mem_fd);
+    return ret;
+}
@@ -0,0 +1,244 @@
+/*
+ * Migration page compression codec tests and benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Run with "-m perf" to compare the per-page cost of every codec built in.
+ * Set QEMU_COMPRESS_IMAGE to the path of a raw guest memory image (e.g. the
+ * output of "dump-guest-memory" stripped of its headers, or a memory-backend
+ * file) to also benchmark on real guest memory.
+ */
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "migration/compress.h"
+
+#define PAGE_SIZE 4096
+
+typedef void (*PageGenerator)(uint8_t *page, GRand *rand);
+
+/* Free page */
+static void gen_zero(uint8_t *page, GRand *rand)
+{
+    memset(page, 0, PAGE_SIZE);
+}
+
+/* Page table: a few present entries in an otherwise empty page */
+static void gen_sparse(uint8_t *page, GRand *rand)
+{
+    uint64_t *pte = (uint64_t *)page;
+    int i;
+
+    memset(page, 0, PAGE_SIZE);
+    for (i = 0; i < 32; i++) {
+        pte[g_rand_int_range(rand, 0, PAGE_SIZE / 8)] =
+            ((uint64_t)g_rand_int(rand) << 12) | 0x67;
+    }
+}
+
+/* Page cache holding text */
+static void gen_text(uint8_t *page, GRand *rand)
+{
+    static const char *words[] = {
+        "the", "migration", "of", "a", "guest", "page", "is", "compressed",
+        "before", "it", "goes", "over", "network", "and", "memory", "to",
+        "kernel", "with", "data", "file", "\n", "for", "in", "that",
+    };
+    int i = 0;
+
+    while (i < PAGE_SIZE) {
+        const char *w = words[g_rand_int_range(rand, 0, ARRAY_SIZE(words))];
+        int len = MIN(strlen(w), PAGE_SIZE - i);
+
+        memcpy(page + i, w, len);
+        i += len;
+        if (i < PAGE_SIZE) {
+            page[i++] = ' ';
+        }
+    }
+}
+
+/* Heap of small structures: repeated layout, varying pointers and counters */
+static void gen_structs(uint8_t *page, GRand *rand)
+{
+    uint64_t base = (uint64_t)g_rand_int(rand) << 20;
+    uint64_t *p = (uint64_t *)page;
+    int i;
+
+    for (i = 0; i < PAGE_SIZE / 8; i += 4) {
+        p[i] = base + g_rand_int_range(rand, 0, 1 << 16) * 64;
+        p[i + 1] = base + g_rand_int_range(rand, 0, 1 << 16) * 64;
+        p[i + 2] = g_rand_int_range(rand, 0, 256);
+        p[i + 3] = 0xdeadbeef00000000ULL | (i / 4);
+    }
+}
+
+/* Encrypted or already compressed data */
+static void gen_random(uint8_t *page, GRand *rand)
+{
+    uint32_t *p = (uint32_t *)page;
+    int i;
+
+    for (i = 0; i < PAGE_SIZE / 4; i++) {
+        p[i] = g_rand_int(rand);
+    }
+}
+
+static const struct {
+    const char *name;
+    PageGenerator gen;
+} page_types[] = {
+    { "zero", gen_zero },
+    { "sparse", gen_sparse },
+    { "text", gen_text },
+    { "structs", gen_structs },
+    { "random", gen_random },
+};
+
+static void test_roundtrip(gconstpointer opaque)
+{
+    MigrationCompressMethod method = GPOINTER_TO_INT(opaque);
+    size_t bound = migration_compress_bound(method, PAGE_SIZE);
+    MigrationCompressCtx *ctx = migration_compress_ctx_new(method, 1);
+    GRand *rand = g_rand_new_with_seed(0);
+    uint8_t *page = g_malloc(PAGE_SIZE);
+    uint8_t *out = g_malloc(PAGE_SIZE);
+    uint8_t *buf = g_malloc(bound);
+    int i;
+
+    g_assert(bound >= PAGE_SIZE);
+    g_assert(bound <= migration_compress_bound(MIGRATION_COMPRESS_METHOD__MAX,
+                                               PAGE_SIZE));
+
+    for (i = 0; i < ARRAY_SIZE(page_types); i++) {
+        ssize_t clen, dlen;
+
+        page_types[i].gen(page, rand);
+        clen = migration_compress(ctx, buf, bound, page, PAGE_SIZE);
+        g_assert_cmpint(clen, >, 0);
+        g_assert_cmpint(clen, <=, bound);
+
+        memset(out, 0x5a, PAGE_SIZE);
+        dlen = migration_decompress(method, out, PAGE_SIZE, buf, clen);
+        g_assert_cmpint(dlen, ==, PAGE_SIZE);
+        g_assert(memcmp(page, out, PAGE_SIZE) == 0);
+
+        if (page_types[i].gen == gen_zero) {
+            g_assert_cmpint(clen, <, PAGE_SIZE / 16);
+        }
+    }
+
+    /* Corrupt input must fail or stay within the output buffer */
+    gen_text(page, rand);
+    migration_compress(ctx, buf, bound, page, PAGE_SIZE);
+    memset(buf, 0xff, 16);
+    g_assert_cmpint(migration_decompress(method, out, PAGE_SIZE, buf, 16),
+                    <=, PAGE_SIZE);
+
+    g_free(buf);
+    g_free(out);
+    g_free(page);
+    g_rand_free(rand);
+    migration_compress_ctx_free(ctx);
+}
+
+static void bench_pages(MigrationCompressMethod method, const char *name,
+                        const uint8_t *pages, size_t npages)
+{
+    size_t bound = migration_compress_bound(method, PAGE_SIZE);
+    MigrationCompressCtx *ctx = migration_compress_ctx_new(method, 1);
+    uint8_t *bufs = g_malloc(bound * npages);
+    size_t *lens = g_new(size_t, npages);
+    uint8_t *out = g_malloc(PAGE_SIZE);
+    uint64_t total = 0;
+    double ctime, dtime;
+    size_t i;
+
+    g_test_timer_start();
+    for (i = 0; i < npages; i++) {
+        lens[i] = migration_compress(ctx, bufs + i * bound, bound,
+                                     pages + i * PAGE_SIZE, PAGE_SIZE);
+        total += lens[i];
+    }
+    ctime = g_test_timer_elapsed();
+
+    g_test_timer_start();
+    for (i = 0; i < npages; i++) {
+        migration_decompress(method, out, PAGE_SIZE, bufs + i * bound,
+                             lens[i]);
+    }
+    dtime = g_test_timer_elapsed();
+
+    g_test_message("%-6s %-8s compress %6.0f ns/page, decompress %6.0f "
+                   "ns/page, ratio %5.1f%%",
+                   MigrationCompressMethod_lookup[method], name,
+                   ctime * 1e9 / npages, dtime * 1e9 / npages,
+                   100.0 * total / (npages * PAGE_SIZE));
+
+    g_free(out);
+    g_free(lens);
+    g_free(bufs);
+    migration_compress_ctx_free(ctx);
+}
+
+static void perf_codecs(void)
+{
+    const size_t npages = 4096;
+    uint8_t *pages = g_malloc(npages * PAGE_SIZE);
+    GRand *rand = g_rand_new_with_seed(0);
+    const char *image = getenv("QEMU_COMPRESS_IMAGE");
+    gchar *contents = NULL;
+    gsize length = 0;
+    int m, t;
+    size_t i;
+
+    if (image && !g_file_get_contents(image, &contents, &length, NULL)) {
+        g_test_message("cannot read %s", image);
+    }
+
+    for (t = 0; t < ARRAY_SIZE(page_types); t++) {
+        for (i = 0; i < npages; i++) {
+            page_types[t].gen(pages + i * PAGE_SIZE, rand);
+        }
+        for (m = 0; m < MIGRATION_COMPRESS_METHOD__MAX; m++) {
+            if (migration_compress_supported(m)) {
+                bench_pages(m, page_types[t].name, pages, npages);
+            }
+        }
+    }
+
+    if (length >= PAGE_SIZE) {
+        for (m = 0; m < MIGRATION_COMPRESS_METHOD__MAX; m++) {
+            if (migration_compress_supported(m)) {
+                bench_pages(m, "image", (uint8_t *)contents,
+                            length / PAGE_SIZE);
+            }
+        }
+    }
+
+    g_free(contents);
+    g_rand_free(rand);
+    g_free(pages);
+}
+
+int main(int argc, char **argv)
+{
+    int m;
+
+    g_test_init(&argc, &argv, NULL);
+    for (m = 0; m < MIGRATION_COMPRESS_METHOD__MAX; m++) {
+        gchar *path;
+
+        if (!migration_compress_supported(m)) {
+            continue;
+        }
+        path = g_strdup_printf("/migration/compress/%s/roundtrip",
+                               MigrationCompressMethod_lookup[m]);
+        g_test_add_data_func(path, GINT_TO_POINTER(m), test_roundtrip);
+        g_free(path);
+    }
+    if (g_test_perf()) {
+        g_test_add_func("/migration/compress/perf", perf_codecs);
+    }
+    return g_test_run();
+}
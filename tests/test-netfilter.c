@@ -40,6 +40,24 @@ static void add_one_netfilter(void)
     QDECREF(response);
 }
 
+/* filter-gro has to be created before the NIC it provides headers for */
+static void add_gro_after_nic(void)
+{
+    QDict *response;
+
+    response = qmp("{'execute': 'object-add',"
+                   " 'arguments': {"
+                   "   'qom-type': 'filter-gro',"
+                   "   'id': 'qtest-f0',"
+                   "   'props': {"
+                   "     'netdev': 'qtest-bn0'"
+                   "}}}");
+
+    g_assert(response);
+    g_assert(qdict_haskey(response, "error"));
+    QDECREF(response);
+}
+
 /* add a netfilter to a netdev and then remove the netdev */
 static void remove_netdev_with_one_netfilter(void)
 {
@@ -186,6 +204,7 @@ int main(int argc, char **argv)
 
     g_test_init(&argc, &argv, NULL);
     qtest_add_func("/netfilter/addremove_one", add_one_netfilter);
+    qtest_add_func("/netfilter/gro_after_nic", add_gro_after_nic);
     qtest_add_func("/netfilter/remove_netdev_one",
                    remove_netdev_with_one_netfilter);
     qtest_add_func("/netfilter/addremove_multi", add_multi_netfilter);
@@ -0,0 +1,324 @@
+/*
+ * qcow2 copy-on-write tests and allocating write benchmark
+ *
+ * Writes that allocate a new cluster in an overlay must copy the parts of
+ * the cluster that they don't cover from the backing file.  qcow2 writes
+ * these COW regions together with the guest data, so the tests check
+ * requests that need COW at the head, at the tail, at both ends, or not at
+ * all.  The benchmark measures allocating writes to an empty overlay, with
+ * and without a flush after each write, and counts the writes and flushes
+ * that reach the image file through a filter driver below qcow2.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <glib.h>
+#include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qstring.h"
+#include "qemu/main-loop.h"
+#include "block/block_int.h"
+#include "sysemu/block-backend.h"
+
+#define IMG_SIZE        (16 * 1024 * 1024)
+#define CLUSTER_SIZE    65536
+
+#define PERF_WRITE_SIZE 4096
+
+/* Requests that reached the image file */
+static int64_t file_writes;
+static int64_t file_flushes;
+
+static int count_open(BlockDriverState *bs, QDict *options, int flags,
+                      Error **errp)
+{
+    return 0;
+}
+
+static void count_close(BlockDriverState *bs)
+{
+}
+
+static int coroutine_fn count_co_readv(BlockDriverState *bs,
+                                       int64_t sector_num, int nb_sectors,
+                                       QEMUIOVector *qiov)
+{
+    return bdrv_co_readv(bs->file->bs, sector_num, nb_sectors, qiov);
+}
+
+static int coroutine_fn count_co_writev(BlockDriverState *bs,
+                                        int64_t sector_num, int nb_sectors,
+                                        QEMUIOVector *qiov)
+{
+    file_writes++;
+    return bdrv_co_writev(bs->file->bs, sector_num, nb_sectors, qiov);
+}
+
+static int coroutine_fn count_co_write_zeroes(BlockDriverState *bs,
+                                              int64_t sector_num,
+                                              int nb_sectors,
+                                              BdrvRequestFlags flags)
+{
+    file_writes++;
+    return bdrv_co_write_zeroes(bs->file->bs, sector_num, nb_sectors, flags);
+}
+
+/* The block layer flushes bs->file afterwards */
+static int coroutine_fn count_co_flush_to_disk(BlockDriverState *bs)
+{
+    file_flushes++;
+    return 0;
+}
+
+static int64_t count_getlength(BlockDriverState *bs)
+{
+    return bdrv_getlength(bs->file->bs);
+}
+
+static int count_truncate(BlockDriverState *bs, int64_t offset)
+{
+    return bdrv_truncate(bs->file->bs, offset);
+}
+
+static BlockDriver bdrv_count = {
+    .format_name            = "count",
+    .instance_size          = 1,
+    .bdrv_open              = count_open,
+    .bdrv_close             = count_close,
+    .bdrv_co_readv          = count_co_readv,
+    .bdrv_co_writev         = count_co_writev,
+    .bdrv_co_write_zeroes   = count_co_write_zeroes,
+    .bdrv_co_flush_to_disk  = count_co_flush_to_disk,
+    .bdrv_getlength         = count_getlength,
+    .bdrv_truncate          = count_truncate,
+};
+
+typedef struct CowTest {
+    char *dir;
+    char *base;
+    char *overlay;
+    BlockBackend *blk;
+    uint8_t *expected;
+} CowTest;
+
+static void cow_test_open(CowTest *t)
+{
+    QDict *opts = qdict_new();
+
+    qdict_put(opts, "driver", qstring_from_str("qcow2"));
+    qdict_put(opts, "file.driver", qstring_from_str("count"));
+    qdict_put(opts, "file.file.driver", qstring_from_str("file"));
+    qdict_put(opts, "file.file.filename", qstring_from_str(t->overlay));
+    t->blk = blk_new_open("overlay", NULL, NULL, opts,
+                          BDRV_O_RDWR | BDRV_O_CACHE_WB, &error_abort);
+}
+
+static void cow_test_start(CowTest *t, const char *opts)
+{
+    char *create_opts;
+    QDict *base_opts;
+    BlockBackend *base_blk;
+    int64_t i;
+    int ret;
+
+    t->dir = g_dir_make_tmp("qemu-test-qcow2-cow.XXXXXX", NULL);
+    g_assert(t->dir != NULL);
+    t->base = g_build_filename(t->dir, "base.raw", NULL);
+    t->overlay = g_build_filename(t->dir, "overlay.qcow2", NULL);
+
+    /* Every sector of the backing file has its own pattern */
+    t->expected = g_malloc(IMG_SIZE);
+    for (i = 0; i < IMG_SIZE; i++) {
+        t->expected[i] = (i >> BDRV_SECTOR_BITS) + 1;
+    }
+
+    bdrv_img_create(t->base, "raw", NULL, NULL, NULL, IMG_SIZE, 0,
+                    &error_abort, true);
+    base_opts = qdict_new();
+    qdict_put(base_opts, "driver", qstring_from_str("raw"));
+    base_blk = blk_new_open("base", t->base, NULL, base_opts, BDRV_O_RDWR,
+                            &error_abort);
+    ret = blk_pwrite(base_blk, 0, t->expected, IMG_SIZE);
+    g_assert_cmpint(ret, >=, 0);
+    blk_unref(base_blk);
+
+    create_opts = g_strdup_printf("cluster_size=%d%s%s", CLUSTER_SIZE,
+                                  opts ? "," : "", opts ? opts : "");
+    bdrv_img_create(t->overlay, "qcow2", t->base, "raw", create_opts,
+                    IMG_SIZE, 0, &error_abort, true);
+    g_free(create_opts);
+
+    cow_test_open(t);
+}
+
+static void cow_test_end(CowTest *t)
+{
+    blk_unref(t->blk);
+    unlink(t->overlay);
+    unlink(t->base);
+    rmdir(t->dir);
+    g_free(t->overlay);
+    g_free(t->base);
+    g_free(t->dir);
+    g_free(t->expected);
+}
+
+static void cow_test_write(CowTest *t, int64_t offset, int bytes, int pattern)
+{
+    uint8_t *buf = g_malloc(bytes);
+    int ret;
+
+    memset(buf, pattern, bytes);
+    memset(t->expected + offset, pattern, bytes);
+    ret = blk_pwrite(t->blk, offset, buf, bytes);
+    g_assert_cmpint(ret, >=, 0);
+    g_free(buf);
+}
+
+static void cow_test_verify(CowTest *t)
+{
+    uint8_t *buf = g_malloc(IMG_SIZE);
+    int ret;
+
+    ret = blk_pread(t->blk, 0, buf, IMG_SIZE);
+    g_assert_cmpint(ret, >=, 0);
+    g_assert(memcmp(buf, t->expected, IMG_SIZE) == 0);
+    g_free(buf);
+}
+
+static void test_cow(const char *opts)
+{
+    CowTest t;
+
+    cow_test_start(&t, opts);
+
+    /*
+     * COW at both ends, with a small and a large gap between them.  The
+     * first write also allocates the L2 table, but once that is cached the
+     * COW regions and the guest data go to the image file in one request.
+     */
+    cow_test_write(&t, 0 * CLUSTER_SIZE + 4096, 4096, 0x11);
+    file_writes = 0;
+    cow_test_write(&t, 1 * CLUSTER_SIZE + 512, CLUSTER_SIZE - 1024, 0x22);
+    g_assert_cmpint(file_writes, ==, 1);
+
+    /* COW only at the head or the tail */
+    cow_test_write(&t, 3 * CLUSTER_SIZE - 8192, 8192, 0x33);
+    cow_test_write(&t, 3 * CLUSTER_SIZE, 1536, 0x44);
+
+    /* Whole cluster, no COW */
+    cow_test_write(&t, 4 * CLUSTER_SIZE, CLUSTER_SIZE, 0x55);
+
+    /* Several clusters with COW at the outer ends */
+    file_writes = 0;
+    cow_test_write(&t, 6 * CLUSTER_SIZE - 2048, 2 * CLUSTER_SIZE + 4096, 0x66);
+    g_assert_cmpint(file_writes, ==, 1);
+
+    /* Rewrite part of an allocated cluster, then allocate next to it */
+    cow_test_write(&t, 0 * CLUSTER_SIZE + 6144, 1024, 0x77);
+    cow_test_write(&t, 10 * CLUSTER_SIZE + 3072, 512, 0x88);
+
+    cow_test_verify(&t);
+
+    /* Reopen to check that the L2 tables have been written correctly */
+    blk_unref(t.blk);
+    cow_test_open(&t);
+    cow_test_verify(&t);
+
+    cow_test_end(&t);
+}
+
+static void test_cow_standard(void)
+{
+    test_cow(NULL);
+}
+
+static void test_cow_extended_l2(void)
+{
+    test_cow("extended_l2=on");
+}
+
+static void test_cow_journal(void)
+{
+    test_cow("journal=on");
+}
+
+static void test_perf(const char *opts, const char *name, bool flush)
+{
+    CowTest t;
+    gint64 start, end;
+    int64_t offset;
+    int n = 0;
+    int ret;
+
+    cow_test_start(&t, opts);
+
+    /* Every write allocates a cluster and needs COW at both ends */
+    file_writes = 0;
+    file_flushes = 0;
+    start = g_get_monotonic_time();
+    for (offset = 0; offset < IMG_SIZE; offset += CLUSTER_SIZE) {
+        cow_test_write(&t, offset + CLUSTER_SIZE / 2, PERF_WRITE_SIZE, 0xaa);
+        if (flush) {
+            ret = blk_flush(t.blk);
+            g_assert_cmpint(ret, ==, 0);
+        }
+        n++;
+    }
+    end = g_get_monotonic_time();
+
+    g_test_message("%s%s: %d allocating %d byte writes, %.1f us per write, "
+                   "%.1f MB/s, %.2f writes and %.2f flushes of the image "
+                   "file per write", name, flush ? ", flushed" : "", n,
+                   PERF_WRITE_SIZE,
+                   (double)(end - start) / n,
+                   (double)n * PERF_WRITE_SIZE / (end - start),
+                   (double)file_writes / n, (double)file_flushes / n);
+
+    cow_test_verify(&t);
+    cow_test_end(&t);
+}
+
+static void test_perf_standard(void)
+{
+    test_perf(NULL, "standard L2 entries", false);
+}
+
+static void test_perf_extended_l2(void)
+{
+    test_perf("extended_l2=on", "extended L2 entries", false);
+}
+
+static void test_perf_flush_standard(void)
+{
+    test_perf(NULL, "standard L2 entries", true);
+}
+
+static void test_perf_flush_journal(void)
+{
+    test_perf("journal=on", "metadata journal", true);
+}
+
+int main(int argc, char **argv)
+{
+    qemu_init_main_loop(&error_abort);
+    bdrv_init();
+    bdrv_register(&bdrv_count);
+
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/qcow2-cow/standard", test_cow_standard);
+    g_test_add_func("/qcow2-cow/extended-l2", test_cow_extended_l2);
+    g_test_add_func("/qcow2-cow/journal", test_cow_journal);
+    if (g_test_perf()) {
+        g_test_add_func("/qcow2-cow/perf/standard", test_perf_standard);
+        g_test_add_func("/qcow2-cow/perf/extended-l2", test_perf_extended_l2);
+        g_test_add_func("/qcow2-cow/perf/flush/standard",
+                        test_perf_flush_standard);
+        g_test_add_func("/qcow2-cow/perf/flush/journal",
+                        test_perf_flush_journal);
+    }
+
+    return g_test_run();
+}
@@ -391,6 +391,11 @@ static TestServer *test_server_new(const gchar *name)
     g_strdup_printf(QEMU_CMD extra, (mem), (mem), (root), (s)->chr_name,       \
                     (s)->socket_path, (s)->chr_name, ##__VA_ARGS__)
 
+#define GET_QEMU_CMD_RECONNECT(s)                                              \
+    g_strdup_printf(QEMU_CMD_ACCEL QEMU_CMD_MEM QEMU_CMD_CHR ",reconnect=1"    \
+                    QEMU_CMD_NETDEV QEMU_CMD_NET, 2, 2, (root), (s)->chr_name, \
+                    (s)->socket_path, (s)->chr_name)
+
 static gboolean _test_server_free(TestServer *server)
 {
     int i;
@@ -605,6 +610,49 @@ static void test_migrate(void)
     global_qtest = global;
 }
 
+static void test_server_reset_fds(TestServer *s)
+{
+    int i;
+
+    g_mutex_lock(&s->data_mutex);
+    for (i = 0; i < s->fds_num; i++) {
+        close(s->fds[i]);
+    }
+    s->fds_num = 0;
+    g_mutex_unlock(&s->data_mutex);
+}
+
+static gboolean _test_server_disconnect(TestServer *server)
+{
+    qemu_chr_disconnect(server->chr);
+
+    return FALSE;
+}
+
+static void test_reconnect(void)
+{
+    TestServer *s = test_server_new("reconnect");
+    QTestState *global = global_qtest, *to;
+    gchar *cmd;
+
+    cmd = GET_QEMU_CMD_RECONNECT(s);
+    to = qtest_start(cmd);
+    g_free(cmd);
+
+    wait_for_fds(s);
+    test_server_reset_fds(s);
+
+    /* drop the backend connection from the main loop thread; QEMU must
+     * come back on its own and send the memory table again */
+    g_idle_add((GSourceFunc)_test_server_disconnect, s);
+    wait_for_fds(s);
+
+    qtest_quit(to);
+    test_server_free(s);
+
+    global_qtest = global;
+}
+
 int main(int argc, char **argv)
 {
     QTestState *s = NULL;
@@ -648,6 +696,7 @@ int main(int argc, char **argv)
 
     qtest_add_data_func("/vhost-user/read-guest-mem", server, read_guest_mem);
     qtest_add_func("/vhost-user/migrate", test_migrate);
+    qtest_add_func("/vhost-user/reconnect", test_reconnect);
 
     ret = g_test_run();
 
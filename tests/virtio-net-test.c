@@ -21,6 +21,11 @@
 #include "libqos/malloc-generic.h"
 #include "qemu/bswap.h"
 #include "hw/virtio/virtio-net.h"
+#ifdef CONFIG_AF_PACKET
+#include <net/if.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#endif
 
 #define PCI_SLOT_HP             0x06
 #define PCI_SLOT                0x04
@@ -29,6 +34,10 @@
 #define QVIRTIO_NET_TIMEOUT_US (30 * 1000 * 1000)
 #define VNET_HDR_SIZE sizeof(struct virtio_net_hdr_mrg_rxbuf)
 
+#define PERF_PKT_LEN            64
+#define PERF_BUF_LEN            256
+#define PERF_ROUNDS             64
+
 static void test_end(void)
 {
     qtest_end();
@@ -235,6 +244,620 @@ static void pci_basic(gconstpointer data)
     qpci_free_pc(bus);
     test_end();
 }
+
+#define GRO_TEST_MSS            1000
+#define GRO_TEST_HDR_LEN        (14 + 20 + 20)
+#define GRO_TEST_BUF_LEN        4096
+
+static uint32_t gro_csum_add(uint32_t sum, const uint8_t *buf, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i + 1 < len; i += 2) {
+        sum += (buf[i] << 8) | buf[i + 1];
+    }
+    if (len & 1) {
+        sum += buf[len - 1] << 8;
+    }
+    return sum;
+}
+
+static uint16_t gro_csum_fold(uint32_t sum)
+{
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return ~sum;
+}
+
+/* TCP checksum over @len bytes of TCP header and data */
+static uint16_t gro_tcp_csum(const uint8_t *ip, const uint8_t *th, size_t len)
+{
+    uint32_t sum = gro_csum_add(6 + len, ip + 12, 8);
+
+    return gro_csum_fold(gro_csum_add(sum, th, len));
+}
+
+static size_t gro_build_segment(uint8_t *frame, uint32_t seq, size_t payload,
+                                uint8_t flags)
+{
+    uint8_t *ip = frame + 14;
+    uint8_t *th = ip + 20;
+    size_t i;
+
+    memset(frame, 0, GRO_TEST_HDR_LEN);
+    memcpy(frame, "\x52\x54\x00\x12\x34\x56", 6);
+    memcpy(frame + 6, "\x52\x54\x00\x12\x34\x57", 6);
+    stw_be_p(frame + 12, 0x0800);
+
+    ip[0] = 0x45;
+    stw_be_p(ip + 2, 20 + 20 + payload);
+    stw_be_p(ip + 6, 0x4000);
+    ip[8] = 64;
+    ip[9] = 6;
+    memcpy(ip + 12, "\x0a\x00\x02\x02\x0a\x00\x02\x0f", 8);
+    stw_be_p(ip + 10, gro_csum_fold(gro_csum_add(0, ip, 20)));
+
+    stw_be_p(th, 5001);
+    stw_be_p(th + 2, 80);
+    stl_be_p(th + 4, seq);
+    stl_be_p(th + 8, 1);
+    th[12] = 5 << 4;
+    th[13] = flags;
+    stw_be_p(th + 14, 29200);
+    for (i = 0; i < payload; i++) {
+        th[20 + i] = seq + i;
+    }
+    stw_be_p(th + 16, gro_tcp_csum(ip, th, 20 + payload));
+
+    return GRO_TEST_HDR_LEN + payload;
+}
+
+static void gro_send_frame(int socket, uint8_t *frame, size_t size)
+{
+    uint32_t len = htonl(size);
+    struct iovec iov[] = {
+        {
+            .iov_base = &len,
+            .iov_len = sizeof(len),
+        }, {
+            .iov_base = frame,
+            .iov_len = size,
+        },
+    };
+    int ret;
+
+    ret = iov_send(socket, iov, 2, 0, sizeof(len) + size);
+    g_assert_cmpint(ret, ==, sizeof(len) + size);
+}
+
+static int64_t gro_counter(const char *name)
+{
+    QDict *rsp;
+    int64_t val;
+
+    rsp = qmp("{ 'execute': 'qom-get', 'arguments': {"
+              " 'path': '/objects/gro0', 'property': %s } }", name);
+    g_assert(qdict_haskey(rsp, "return"));
+    val = qdict_get_int(rsp, "return");
+    QDECREF(rsp);
+    return val;
+}
+
+static void gro_rx_test(const QVirtioBus *bus, QVirtioDevice *dev,
+                        QGuestAllocator *alloc, QVirtQueue *vq, int socket)
+{
+    struct virtio_net_hdr_mrg_rxbuf hdr;
+    uint8_t frame[GRO_TEST_HDR_LEN + GRO_TEST_MSS];
+    uint8_t buf[GRO_TEST_HDR_LEN + 2 * GRO_TEST_MSS];
+    uint64_t req_addr;
+    uint32_t free_head;
+    size_t size;
+    int i;
+
+    /* two full segments, the second one pushed: delivered merged at once */
+    req_addr = guest_alloc(alloc, GRO_TEST_BUF_LEN);
+    free_head = qvirtqueue_add(vq, req_addr, GRO_TEST_BUF_LEN, true, false);
+    qvirtqueue_kick(bus, dev, vq, free_head);
+
+    size = gro_build_segment(frame, 1000, GRO_TEST_MSS, 0x10);
+    gro_send_frame(socket, frame, size);
+    size = gro_build_segment(frame, 1000 + GRO_TEST_MSS, GRO_TEST_MSS, 0x18);
+    gro_send_frame(socket, frame, size);
+
+    qvirtio_wait_queue_isr(bus, dev, vq, QVIRTIO_NET_TIMEOUT_US);
+    memread(req_addr, &hdr, sizeof(hdr));
+    g_assert_cmpint(hdr.hdr.gso_type, ==, VIRTIO_NET_HDR_GSO_TCPV4);
+    g_assert_cmpint(hdr.hdr.gso_size, ==, GRO_TEST_MSS);
+    g_assert_cmpint(hdr.hdr.hdr_len, ==, GRO_TEST_HDR_LEN);
+    g_assert(hdr.hdr.flags & VIRTIO_NET_HDR_F_DATA_VALID);
+
+    memread(req_addr + VNET_HDR_SIZE, buf, sizeof(buf));
+    g_assert_cmpint(lduw_be_p(buf + 14 + 2), ==, 40 + 2 * GRO_TEST_MSS);
+    g_assert_cmpint(gro_csum_fold(gro_csum_add(0, buf + 14, 20)), ==, 0);
+    g_assert_cmphex(buf[14 + 20 + 13], ==, 0x18);
+    for (i = 0; i < 2 * GRO_TEST_MSS; i++) {
+        g_assert_cmphex(buf[GRO_TEST_HDR_LEN + i], ==, (uint8_t)(1000 + i));
+    }
+    g_assert_cmpint(gro_counter("coalesced"), ==, 1);
+    guest_free(alloc, req_addr);
+
+    /* a lone full segment is held until the flush timer fires */
+    req_addr = guest_alloc(alloc, GRO_TEST_BUF_LEN);
+    free_head = qvirtqueue_add(vq, req_addr, GRO_TEST_BUF_LEN, true, false);
+    qvirtqueue_kick(bus, dev, vq, free_head);
+
+    size = gro_build_segment(frame, 1000 + 2 * GRO_TEST_MSS, GRO_TEST_MSS,
+                             0x10);
+    gro_send_frame(socket, frame, size);
+
+    qvirtio_wait_queue_isr(bus, dev, vq, QVIRTIO_NET_TIMEOUT_US);
+    memread(req_addr, &hdr, sizeof(hdr));
+    g_assert_cmpint(hdr.hdr.gso_type, ==, VIRTIO_NET_HDR_GSO_NONE);
+    memread(req_addr + VNET_HDR_SIZE, buf, size);
+    g_assert(memcmp(buf, frame, size) == 0);
+    g_assert_cmpint(gro_counter("timer-flushes"), ==, 1);
+    guest_free(alloc, req_addr);
+}
+
+static void gro_tx_test(const QVirtioBus *bus, QVirtioDevice *dev,
+                        QGuestAllocator *alloc, QVirtQueue *vq, int socket)
+{
+    struct virtio_net_hdr_mrg_rxbuf hdr = {
+        .hdr = {
+            .gso_type = VIRTIO_NET_HDR_GSO_TCPV4,
+            .gso_size = GRO_TEST_MSS,
+            .hdr_len = GRO_TEST_HDR_LEN,
+        },
+    };
+    uint8_t frame[GRO_TEST_HDR_LEN + 2 * GRO_TEST_MSS];
+    uint8_t buf[GRO_TEST_HDR_LEN + GRO_TEST_MSS];
+    uint64_t req_addr;
+    uint32_t free_head, len;
+    size_t size;
+    int i, ret;
+
+    /* a TSO packet from the guest reaches the backend as two segments */
+    size = gro_build_segment(frame, 5000, 2 * GRO_TEST_MSS, 0x18);
+    req_addr = guest_alloc(alloc, GRO_TEST_BUF_LEN);
+    memwrite(req_addr, &hdr, sizeof(hdr));
+    memwrite(req_addr + VNET_HDR_SIZE, frame, size);
+
+    free_head = qvirtqueue_add(vq, req_addr, VNET_HDR_SIZE + size,
+                               false, false);
+    qvirtqueue_kick(bus, dev, vq, free_head);
+    qvirtio_wait_queue_isr(bus, dev, vq, QVIRTIO_NET_TIMEOUT_US);
+    guest_free(alloc, req_addr);
+
+    for (i = 0; i < 2; i++) {
+        ret = qemu_recv(socket, &len, sizeof(len), 0);
+        g_assert_cmpint(ret, ==, sizeof(len));
+        g_assert_cmpint(ntohl(len), ==, sizeof(buf));
+        ret = qemu_recv(socket, buf, sizeof(buf), 0);
+        g_assert_cmpint(ret, ==, sizeof(buf));
+
+        g_assert_cmpint(lduw_be_p(buf + 14 + 2), ==, 40 + GRO_TEST_MSS);
+        g_assert_cmpint(gro_csum_fold(gro_csum_add(0, buf + 14, 20)), ==, 0);
+        g_assert_cmpint(ldl_be_p(buf + 14 + 20 + 4), ==,
+                        5000 + i * GRO_TEST_MSS);
+        g_assert_cmphex(buf[14 + 20 + 13], ==, i ? 0x18 : 0x10);
+        g_assert_cmpint(gro_tcp_csum(buf + 14, buf + 14 + 20,
+                                     20 + GRO_TEST_MSS), ==, 0);
+    }
+    g_assert_cmpint(gro_counter("segmented"), ==, 1);
+
+    /*
+     * UFO is not offered and the filter can't segment it, so a UDP GSO
+     * packet is dropped; the plain frame sent after it arrives first
+     */
+    hdr.hdr.gso_type = VIRTIO_NET_HDR_GSO_UDP;
+    req_addr = guest_alloc(alloc, GRO_TEST_BUF_LEN);
+    memwrite(req_addr, &hdr, sizeof(hdr));
+    memwrite(req_addr + VNET_HDR_SIZE, frame, size);
+    free_head = qvirtqueue_add(vq, req_addr, VNET_HDR_SIZE + size,
+                               false, false);
+    qvirtqueue_kick(bus, dev, vq, free_head);
+    qvirtio_wait_queue_isr(bus, dev, vq, QVIRTIO_NET_TIMEOUT_US);
+
+    memset(&hdr, 0, sizeof(hdr));
+    size = gro_build_segment(frame, 9000, GRO_TEST_MSS, 0x18);
+    memwrite(req_addr, &hdr, sizeof(hdr));
+    memwrite(req_addr + VNET_HDR_SIZE, frame, size);
+    free_head = qvirtqueue_add(vq, req_addr, VNET_HDR_SIZE + size,
+                               false, false);
+    qvirtqueue_kick(bus, dev, vq, free_head);
+    qvirtio_wait_queue_isr(bus, dev, vq, QVIRTIO_NET_TIMEOUT_US);
+    guest_free(alloc, req_addr);
+
+    ret = qemu_recv(socket, &len, sizeof(len), 0);
+    g_assert_cmpint(ret, ==, sizeof(len));
+    g_assert_cmpint(ntohl(len), ==, sizeof(buf));
+    ret = qemu_recv(socket, buf, sizeof(buf), 0);
+    g_assert_cmpint(ret, ==, sizeof(buf));
+    g_assert_cmpint(ldl_be_p(buf + 14 + 20 + 4), ==, 9000);
+    g_assert_cmpint(gro_counter("dropped"), ==, 1);
+}
+
+static void pci_gro(void)
+{
+    QVirtioPCIDevice *dev;
+    QPCIBus *bus;
+    QVirtQueuePCI *tx, *rx;
+    QGuestAllocator *alloc;
+    char *cmdline;
+    int sv[2], ret;
+
+    ret = socketpair(PF_UNIX, SOCK_STREAM, 0, sv);
+    g_assert_cmpint(ret, !=, -1);
+
+    cmdline = g_strdup_printf("-netdev socket,fd=%d,id=hs0 "
+                              "-object filter-gro,id=gro0,netdev=hs0,"
+                              "timeout=100000 "
+                              "-device virtio-net-pci,netdev=hs0", sv[1]);
+    qtest_start(cmdline);
+    g_free(cmdline);
+
+    bus = qpci_init_pc();
+    dev = virtio_net_pci_init(bus, PCI_SLOT);
+
+    alloc = pc_alloc_init();
+    rx = (QVirtQueuePCI *)qvirtqueue_setup(&qvirtio_pci, &dev->vdev,
+                                           alloc, 0);
+    tx = (QVirtQueuePCI *)qvirtqueue_setup(&qvirtio_pci, &dev->vdev,
+                                           alloc, 1);
+
+    driver_init(&qvirtio_pci, &dev->vdev);
+    gro_rx_test(&qvirtio_pci, &dev->vdev, alloc, &rx->vq, sv[0]);
+    gro_tx_test(&qvirtio_pci, &dev->vdev, alloc, &tx->vq, sv[0]);
+
+    close(sv[0]);
+    guest_free(alloc, tx->vq.desc);
+    pc_alloc_uninit(alloc);
+    qvirtio_pci_device_disable(dev);
+    g_free(dev);
+    qpci_free_pc(bus);
+    test_end();
+}
+
+#ifdef CONFIG_AF_PACKET
+#define AF_PACKET_TEST_ETHERTYPE 0x88b5  /* local experimental */
+
+static bool af_packet_frame_is_test(const uint8_t *frame, size_t len)
+{
+    return len >= ETH_HLEN + 4 &&
+           lduw_be_p(frame + 12) == AF_PACKET_TEST_ETHERTYPE &&
+           !memcmp(frame + ETH_HLEN, "TEST", 4);
+}
+
+/*
+ * af-packet on one end of a veth pair and a raw socket on the other, so
+ * no hardware is needed.  Creating the pair needs CAP_NET_ADMIN, so the
+ * test does nothing without it.
+ */
+static void pci_af_packet(void)
+{
+    QVirtioPCIDevice *dev;
+    QPCIBus *bus;
+    QVirtQueuePCI *tx, *rx;
+    QGuestAllocator *alloc;
+    struct sockaddr_ll sll = {
+        .sll_family = AF_PACKET,
+        .sll_protocol = htons(ETH_P_ALL),
+    };
+    struct timeval tv = { .tv_sec = 5 };
+    uint8_t frame[ETH_HLEN + 60] = {
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff,     /* broadcast */
+        0x52, 0x54, 0x00, 0x12, 0x34, 0x99,
+        AF_PACKET_TEST_ETHERTYPE >> 8, AF_PACKET_TEST_ETHERTYPE & 0xff,
+        'T', 'E', 'S', 'T',
+    };
+    uint8_t vlan_frame[ETH_HLEN + 4 + 60] = {
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0x52, 0x54, 0x00, 0x12, 0x34, 0x99,
+        0x81, 0x00, 0x00, 0x05,                 /* VLAN 5 */
+        AF_PACKET_TEST_ETHERTYPE >> 8, AF_PACKET_TEST_ETHERTYPE & 0xff,
+        'T', 'E', 'S', 'T',
+    };
+    uint8_t buffer[2048];
+    char *veth, *peer, *cmd;
+    uint64_t req_addr;
+    uint32_t free_head;
+    int fd, i, ret;
+    bool found;
+
+    veth = g_strdup_printf("qv%d", getpid());
+    peer = g_strdup_printf("qp%d", getpid());
+    cmd = g_strdup_printf("ip link add %s type veth peer name %s 2>/dev/null"
+                          " && ip link set %s up && ip link set %s up",
+                          veth, peer, veth, peer);
+    ret = system(cmd);
+    g_free(cmd);
+    if (ret != 0) {
+        g_test_message("cannot create a veth pair, skipping");
+        goto out;
+    }
+
+    fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+    g_assert_cmpint(fd, !=, -1);
+    sll.sll_ifindex = if_nametoindex(peer);
+    ret = bind(fd, (struct sockaddr *)&sll, sizeof(sll));
+    g_assert_cmpint(ret, ==, 0);
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    cmd = g_strdup_printf("-netdev af-packet,id=hs0,ifname=%s "
+                          "-device virtio-net-pci,netdev=hs0", veth);
+    qtest_start(cmd);
+    g_free(cmd);
+    bus = qpci_init_pc();
+    dev = virtio_net_pci_init(bus, PCI_SLOT);
+    alloc = pc_alloc_init();
+    rx = (QVirtQueuePCI *)qvirtqueue_setup(&qvirtio_pci, &dev->vdev,
+                                           alloc, 0);
+    tx = (QVirtQueuePCI *)qvirtqueue_setup(&qvirtio_pci, &dev->vdev,
+                                           alloc, 1);
+    driver_init(&qvirtio_pci, &dev->vdev);
+
+    /* Host to guest; the host may put its own traffic on the link too */
+    req_addr = guest_alloc(alloc, sizeof(buffer));
+    found = false;
+    for (i = 0; i < 16 && !found; i++) {
+        free_head = qvirtqueue_add(&rx->vq, req_addr, sizeof(buffer),
+                                   true, false);
+        qvirtqueue_kick(&qvirtio_pci, &dev->vdev, &rx->vq, free_head);
+        ret = send(fd, frame, sizeof(frame), 0);
+        g_assert_cmpint(ret, ==, sizeof(frame));
+        qvirtio_wait_queue_isr(&qvirtio_pci, &dev->vdev, &rx->vq,
+                               QVIRTIO_NET_TIMEOUT_US);
+        memread(req_addr + VNET_HDR_SIZE, buffer, sizeof(frame));
+        found = af_packet_frame_is_test(buffer, sizeof(frame));
+    }
+    g_assert(found);
+
+    /* The host kernel strips VLAN tags, the backend must put them back */
+    found = false;
+    for (i = 0; i < 16 && !found; i++) {
+        free_head = qvirtqueue_add(&rx->vq, req_addr, sizeof(buffer),
+                                   true, false);
+        qvirtqueue_kick(&qvirtio_pci, &dev->vdev, &rx->vq, free_head);
+        ret = send(fd, vlan_frame, sizeof(vlan_frame), 0);
+        g_assert_cmpint(ret, ==, sizeof(vlan_frame));
+        qvirtio_wait_queue_isr(&qvirtio_pci, &dev->vdev, &rx->vq,
+                               QVIRTIO_NET_TIMEOUT_US);
+        memread(req_addr + VNET_HDR_SIZE, buffer, sizeof(vlan_frame));
+        found = !memcmp(buffer, vlan_frame, sizeof(vlan_frame));
+    }
+    g_assert(found);
+    guest_free(alloc, req_addr);
+
+    /* Guest to host */
+    req_addr = guest_alloc(alloc, VNET_HDR_SIZE + sizeof(frame));
+    memwrite(req_addr + VNET_HDR_SIZE, frame, sizeof(frame));
+    free_head = qvirtqueue_add(&tx->vq, req_addr,
+                               VNET_HDR_SIZE + sizeof(frame), false, false);
+    qvirtqueue_kick(&qvirtio_pci, &dev->vdev, &tx->vq, free_head);
+    qvirtio_wait_queue_isr(&qvirtio_pci, &dev->vdev, &tx->vq,
+                           QVIRTIO_NET_TIMEOUT_US);
+    found = false;
+    for (i = 0; i < 64 && !found; i++) {
+        socklen_t len = sizeof(sll);
+
+        ret = recvfrom(fd, buffer, sizeof(buffer), 0,
+                       (struct sockaddr *)&sll, &len);
+        g_assert_cmpint(ret, >, 0);
+        found = sll.sll_pkttype != PACKET_OUTGOING &&
+                af_packet_frame_is_test(buffer, ret);
+    }
+    g_assert(found);
+    guest_free(alloc, req_addr);
+
+    close(fd);
+    pc_alloc_uninit(alloc);
+    qvirtio_pci_device_disable(dev);
+    g_free(dev);
+    qpci_free_pc(bus);
+    test_end();
+
+    cmd = g_strdup_printf("ip link del %s", veth);
+    ret = system(cmd);
+    g_free(cmd);
+out:
+    g_free(peer);
+    g_free(veth);
+}
+
+/*
+ * Several multiqueue af-packet netdevs, two of them on the same interface
+ * and one on another.  Each must get a fanout group of its own; the
+ * sockets of a netdev on another interface can't join an existing group.
+ */
+static void pci_af_packet_multiqueue(void)
+{
+    char *veth, *peer, *cmd, *info, *p;
+    int queues, ret;
+
+    veth = g_strdup_printf("qv%d", getpid());
+    peer = g_strdup_printf("qp%d", getpid());
+    cmd = g_strdup_printf("ip link add %s type veth peer name %s 2>/dev/null"
+                          " && ip link set %s up && ip link set %s up",
+                          veth, peer, veth, peer);
+    ret = system(cmd);
+    g_free(cmd);
+    if (ret != 0) {
+        g_test_message("cannot create a veth pair, skipping");
+        goto out;
+    }
+
+    cmd = g_strdup_printf(
+        "-netdev af-packet,id=hs0,ifname=%s,queues=2 "
+        "-device virtio-net-pci,netdev=hs0,mq=on,vectors=6 "
+        "-netdev af-packet,id=hs1,ifname=%s,queues=2 "
+        "-device virtio-net-pci,netdev=hs1,mq=on,vectors=6 "
+        "-netdev af-packet,id=hs2,ifname=%s,queues=2 "
+        "-device virtio-net-pci,netdev=hs2,mq=on,vectors=6",
+        veth, veth, peer);
+    qtest_start(cmd);
+    g_free(cmd);
+
+    info = hmp("info network");
+    queues = 0;
+    for (p = strstr(info, "queue=1"); p; p = strstr(p + 1, "queue=1")) {
+        queues++;
+    }
+    g_assert_cmpint(queues, ==, 3);
+    g_free(info);
+    test_end();
+
+    cmd = g_strdup_printf("ip link del %s", veth);
+    ret = system(cmd);
+    g_free(cmd);
+out:
+    g_free(peer);
+    g_free(veth);
+}
+#endif
+
+/*
+ * Packet rate through a UDP socket backend.  Every descriptor of a queue
+ * gets its own buffer once; each round then makes the whole ring available
+ * with a single avail ring update and kick, so the device can batch freely.
+ * The numbers include the qtest round trips and are only meaningful when
+ * compared between builds on the same host.
+ */
+static void perf_ring_init(QVirtQueue *vq, QGuestAllocator *alloc, bool write)
+{
+    uint64_t bufs = guest_alloc(alloc, vq->size * PERF_BUF_LEN);
+    uint32_t i;
+
+    for (i = 0; i < vq->size; i++) {
+        writeq(vq->desc + i * 16, bufs + i * PERF_BUF_LEN);
+        writel(vq->desc + i * 16 + 8,
+               write ? PERF_BUF_LEN : VNET_HDR_SIZE + PERF_PKT_LEN);
+        writew(vq->desc + i * 16 + 12, write ? QVRING_DESC_F_WRITE : 0);
+    }
+}
+
+static void perf_ring_kick(QVirtioDevice *dev, QVirtQueue *vq, uint16_t *idx)
+{
+    uint16_t ring[vq->size];
+    uint32_t i;
+
+    for (i = 0; i < vq->size; i++) {
+        ring[i] = cpu_to_le16(i);
+    }
+    memwrite(vq->avail + 4, ring, sizeof(ring));
+    *idx += vq->size;
+    writew(vq->avail + 2, *idx);
+    qvirtio_pci.virtqueue_kick(dev, vq);
+}
+
+static void perf_ring_wait(QVirtQueue *vq, uint16_t idx)
+{
+    gint64 end = g_get_monotonic_time() + QVIRTIO_NET_TIMEOUT_US;
+
+    while (readw(vq->used + 2) != idx) {
+        g_assert(g_get_monotonic_time() < end);
+    }
+}
+
+static int perf_udp_socket(uint16_t *port)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    socklen_t len = sizeof(addr);
+    int fd, ret;
+
+    fd = qemu_socket(AF_INET, SOCK_DGRAM, 0);
+    g_assert_cmpint(fd, !=, -1);
+    ret = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    g_assert_cmpint(ret, ==, 0);
+    ret = getsockname(fd, (struct sockaddr *)&addr, &len);
+    g_assert_cmpint(ret, ==, 0);
+    *port = ntohs(addr.sin_port);
+    return fd;
+}
+
+static void pci_perf(void)
+{
+    QVirtioPCIDevice *dev;
+    QPCIBus *bus;
+    QVirtQueuePCI *tx, *rx;
+    QGuestAllocator *alloc;
+    struct sockaddr_in peer = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    struct timeval tv = { .tv_sec = 1 };
+    char pkt[PERF_BUF_LEN] = { 0 };
+    uint16_t port, qemu_port, tx_idx = 0, rx_idx = 0;
+    int fd, bufsize = 4 << 20, received = 0, round, i, ret;
+    char *cmdline;
+    double elapsed;
+
+    /* Reserve a port for QEMU's end, then release it */
+    fd = perf_udp_socket(&qemu_port);
+    close(fd);
+    fd = perf_udp_socket(&port);
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    peer.sin_port = htons(qemu_port);
+    ret = connect(fd, (struct sockaddr *)&peer, sizeof(peer));
+    g_assert_cmpint(ret, ==, 0);
+
+    cmdline = g_strdup_printf("-netdev socket,id=hs0,udp=127.0.0.1:%d,"
+                              "localaddr=127.0.0.1:%d "
+                              "-device virtio-net-pci,netdev=hs0",
+                              port, qemu_port);
+    qtest_start(cmdline);
+    g_free(cmdline);
+    bus = qpci_init_pc();
+    dev = virtio_net_pci_init(bus, PCI_SLOT);
+
+    alloc = pc_alloc_init();
+    rx = (QVirtQueuePCI *)qvirtqueue_setup(&qvirtio_pci, &dev->vdev,
+                                           alloc, 0);
+    tx = (QVirtQueuePCI *)qvirtqueue_setup(&qvirtio_pci, &dev->vdev,
+                                           alloc, 1);
+    driver_init(&qvirtio_pci, &dev->vdev);
+    perf_ring_init(&rx->vq, alloc, true);
+    perf_ring_init(&tx->vq, alloc, false);
+
+    g_test_timer_start();
+    for (round = 0; round < PERF_ROUNDS; round++) {
+        perf_ring_kick(&dev->vdev, &tx->vq, &tx_idx);
+        for (i = 0; i < tx->vq.size; i++) {
+            if (recv(fd, pkt, sizeof(pkt), 0) != PERF_PKT_LEN) {
+                break;
+            }
+            received++;
+        }
+        perf_ring_wait(&tx->vq, tx_idx);
+    }
+    elapsed = g_test_timer_elapsed();
+    g_test_message("tx: %d/%d packets, %.0f pps", received,
+                   PERF_ROUNDS * tx->vq.size, received / elapsed);
+
+    g_test_timer_start();
+    for (round = 0; round < PERF_ROUNDS; round++) {
+        perf_ring_kick(&dev->vdev, &rx->vq, &rx_idx);
+        for (i = 0; i < rx->vq.size; i++) {
+            ret = send(fd, pkt, PERF_PKT_LEN, 0);
+            g_assert_cmpint(ret, ==, PERF_PKT_LEN);
+        }
+        perf_ring_wait(&rx->vq, rx_idx);
+    }
+    elapsed = g_test_timer_elapsed();
+    g_test_message("rx: %d packets, %.0f pps", PERF_ROUNDS * rx->vq.size,
+                   PERF_ROUNDS * rx->vq.size / elapsed);
+
+    close(fd);
+    pc_alloc_uninit(alloc);
+    qvirtio_pci_device_disable(dev);
+    g_free(dev);
+    qpci_free_pc(bus);
+    test_end();
+}
 #endif
 
 static void hotplug(void)
@@ -256,6 +879,15 @@ int main(int argc, char **argv)
     qtest_add_data_func("/virtio/net/pci/basic", send_recv_test, pci_basic);
     qtest_add_data_func("/virtio/net/pci/rx_stop_cont",
                         stop_cont_test, pci_basic);
+    qtest_add_func("/virtio/net/pci/gro", pci_gro);
+#ifdef CONFIG_AF_PACKET
+    qtest_add_func("/virtio/net/pci/af-packet", pci_af_packet);
+    qtest_add_func("/virtio/net/pci/af-packet/multiqueue",
+                   pci_af_packet_multiqueue);
+#endif
+    if (g_test_perf()) {
+        qtest_add_func("/virtio/net/pci/perf", pci_perf);
+    }
 #endif
     qtest_add_func("/virtio/net/pci/hotplug", hotplug);
 
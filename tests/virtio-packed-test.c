@@ -0,0 +1,509 @@
+/*
+ * QTest testcase and benchmark for the virtio packed virtqueue layout
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * The libqos virtio drivers only speak the legacy interface, which cannot
+ * negotiate feature bits above 31, so this test drives a modern-only
+ * virtio-blk-pci device directly through its common configuration
+ * structure.
+ *
+ * Run with "-m perf" to compare the cost of processing virtio-blk requests
+ * on a split ring against a packed ring.
+ */
+
+#include "qemu/osdep.h"
+#include <glib.h>
+#include "libqtest.h"
+#include "libqos/pci-pc.h"
+#include "libqos/malloc.h"
+#include "libqos/malloc-pc.h"
+#include "hw/pci/pci_regs.h"
+#include "standard-headers/linux/virtio_config.h"
+#include "standard-headers/linux/virtio_pci.h"
+#include "standard-headers/linux/virtio_ring.h"
+#include "qemu/bswap.h"
+
+#define TEST_IMAGE_SIZE         (64 * 1024 * 1024)
+#define QVIRTIO_BLK_TIMEOUT_US  (30 * 1000 * 1000)
+#define PCI_SLOT                0x04
+#define PCI_FN                  0x00
+
+#define QVIRTIO_BLK_T_IN        0
+#define QVIRTIO_BLK_T_OUT       1
+
+#define SECTOR_SIZE             512
+
+/* Every request is a chain of header, data and status descriptors */
+#define REQ_DESCS               3
+#define REQ_HDR_SIZE            16
+#define REQ_SLOT_SIZE           32
+
+typedef struct TestDev {
+    QPCIDevice *pdev;
+    QGuestAllocator *alloc;
+    void *bar[6];
+    void *common;
+    void *notify;
+    bool packed;
+
+    /* Queue 0 */
+    uint16_t size;
+    uint64_t desc;
+    uint64_t avail;
+    uint64_t used;
+
+    /* Split: free running avail and used indexes.  Packed: next ring slot
+     * to make available and to check for completion. */
+    uint16_t avail_idx;
+    uint16_t used_idx;
+    bool avail_wrap;
+    bool used_wrap;
+
+    /* Per-request header and status, and data buffers */
+    unsigned int nreqs;
+    uint64_t hdrs;
+    uint64_t data;
+} TestDev;
+
+static char *drive_create(void)
+{
+    int fd, ret;
+    char *tmp_path = g_strdup("/tmp/qtest.XXXXXX");
+
+    /* Create a temporary raw image */
+    fd = mkstemp(tmp_path);
+    g_assert_cmpint(fd, >=, 0);
+    ret = ftruncate(fd, TEST_IMAGE_SIZE);
+    g_assert_cmpint(ret, ==, 0);
+    close(fd);
+
+    return tmp_path;
+}
+
+static QPCIBus *test_start(const char *file)
+{
+    char *cmdline;
+
+    cmdline = g_strdup_printf("-drive if=none,id=drive0,file=%s,format=raw "
+                              "-device virtio-blk-pci,drive=drive0,"
+                              "disable-legacy=on,disable-modern=off,"
+                              "packed=on,addr=%x.%x",
+                              file, PCI_SLOT, PCI_FN);
+    qtest_start(cmdline);
+    g_free(cmdline);
+
+    return qpci_init_pc();
+}
+
+static void *virtio_pci_find_cap(TestDev *d, uint8_t cfg_type,
+                                 uint32_t *notify_mult)
+{
+    uint8_t cap = qpci_config_readb(d->pdev, PCI_CAPABILITY_LIST);
+
+    while (cap) {
+        if (qpci_config_readb(d->pdev, cap + VIRTIO_PCI_CAP_VNDR) ==
+                PCI_CAP_ID_VNDR &&
+            qpci_config_readb(d->pdev, cap + VIRTIO_PCI_CAP_CFG_TYPE) ==
+                cfg_type) {
+            uint8_t bar = qpci_config_readb(d->pdev, cap + VIRTIO_PCI_CAP_BAR);
+            uint32_t offset = qpci_config_readl(d->pdev,
+                                                cap + VIRTIO_PCI_CAP_OFFSET);
+
+            if (notify_mult) {
+                *notify_mult = qpci_config_readl(d->pdev, cap +
+                                                 VIRTIO_PCI_NOTIFY_CAP_MULT);
+            }
+            g_assert_cmpint(bar, <, ARRAY_SIZE(d->bar));
+            if (!d->bar[bar]) {
+                d->bar[bar] = qpci_iomap(d->pdev, bar, NULL);
+            }
+            return d->bar[bar] + offset;
+        }
+        cap = qpci_config_readb(d->pdev, cap + VIRTIO_PCI_CAP_NEXT);
+    }
+    g_assert_not_reached();
+}
+
+static void common_set_status(TestDev *d, uint8_t status)
+{
+    qpci_io_writeb(d->pdev, d->common + VIRTIO_PCI_COMMON_STATUS, status);
+}
+
+static uint8_t common_get_status(TestDev *d)
+{
+    return qpci_io_readb(d->pdev, d->common + VIRTIO_PCI_COMMON_STATUS);
+}
+
+static void test_dev_init(TestDev *d, QPCIBus *bus, bool packed)
+{
+    uint32_t notify_mult;
+    uint64_t features;
+    size_t avail_size, used_size;
+    uint8_t status;
+
+    memset(d, 0, sizeof(*d));
+    d->packed = packed;
+    d->alloc = pc_alloc_init();
+    d->pdev = qpci_device_find(bus, QPCI_DEVFN(PCI_SLOT, PCI_FN));
+    g_assert(d->pdev != NULL);
+    qpci_device_enable(d->pdev);
+
+    d->common = virtio_pci_find_cap(d, VIRTIO_PCI_CAP_COMMON_CFG, NULL);
+    d->notify = virtio_pci_find_cap(d, VIRTIO_PCI_CAP_NOTIFY_CFG,
+                                    &notify_mult);
+
+    common_set_status(d, 0);
+    status = VIRTIO_CONFIG_S_ACKNOWLEDGE | VIRTIO_CONFIG_S_DRIVER;
+    common_set_status(d, status);
+
+    qpci_io_writel(d->pdev, d->common + VIRTIO_PCI_COMMON_DFSELECT, 1);
+    features = qpci_io_readl(d->pdev, d->common + VIRTIO_PCI_COMMON_DF);
+    features <<= 32;
+    qpci_io_writel(d->pdev, d->common + VIRTIO_PCI_COMMON_DFSELECT, 0);
+    features |= qpci_io_readl(d->pdev, d->common + VIRTIO_PCI_COMMON_DF);
+    g_assert(features & (1ULL << VIRTIO_F_VERSION_1));
+    g_assert(features & (1ULL << VIRTIO_F_RING_PACKED));
+
+    features = 1ULL << VIRTIO_F_VERSION_1;
+    if (packed) {
+        features |= 1ULL << VIRTIO_F_RING_PACKED;
+    }
+    qpci_io_writel(d->pdev, d->common + VIRTIO_PCI_COMMON_GFSELECT, 0);
+    qpci_io_writel(d->pdev, d->common + VIRTIO_PCI_COMMON_GF, features);
+    qpci_io_writel(d->pdev, d->common + VIRTIO_PCI_COMMON_GFSELECT, 1);
+    qpci_io_writel(d->pdev, d->common + VIRTIO_PCI_COMMON_GF, features >> 32);
+    status |= VIRTIO_CONFIG_S_FEATURES_OK;
+    common_set_status(d, status);
+    g_assert(common_get_status(d) & VIRTIO_CONFIG_S_FEATURES_OK);
+
+    qpci_io_writew(d->pdev, d->common + VIRTIO_PCI_COMMON_Q_SELECT, 0);
+    d->size = qpci_io_readw(d->pdev, d->common + VIRTIO_PCI_COMMON_Q_SIZE);
+    g_assert_cmpint(d->size, >=, REQ_DESCS);
+
+    /* For the packed ring, "avail" and "used" are the driver and device
+     * event suppression structures. */
+    if (packed) {
+        avail_size = used_size = sizeof(struct vring_packed_desc_event);
+    } else {
+        avail_size = sizeof(uint16_t) * (3 + d->size);
+        used_size = sizeof(uint16_t) * 3 +
+                    sizeof(struct vring_used_elem) * d->size;
+    }
+    d->desc = guest_alloc(d->alloc, d->size * sizeof(struct vring_desc));
+    d->avail = guest_alloc(d->alloc, avail_size);
+    d->used = guest_alloc(d->alloc, used_size);
+    qmemset(d->desc, 0, d->size * sizeof(struct vring_desc));
+    qmemset(d->avail, 0, avail_size);
+    qmemset(d->used, 0, used_size);
+
+    qpci_io_writel(d->pdev, d->common + VIRTIO_PCI_COMMON_Q_DESCLO, d->desc);
+    qpci_io_writel(d->pdev, d->common + VIRTIO_PCI_COMMON_Q_DESCHI,
+                   d->desc >> 32);
+    qpci_io_writel(d->pdev, d->common + VIRTIO_PCI_COMMON_Q_AVAILLO, d->avail);
+    qpci_io_writel(d->pdev, d->common + VIRTIO_PCI_COMMON_Q_AVAILHI,
+                   d->avail >> 32);
+    qpci_io_writel(d->pdev, d->common + VIRTIO_PCI_COMMON_Q_USEDLO, d->used);
+    qpci_io_writel(d->pdev, d->common + VIRTIO_PCI_COMMON_Q_USEDHI,
+                   d->used >> 32);
+    qpci_io_writew(d->pdev, d->common + VIRTIO_PCI_COMMON_Q_ENABLE, 1);
+    d->notify += notify_mult *
+        qpci_io_readw(d->pdev, d->common + VIRTIO_PCI_COMMON_Q_NOFF);
+
+    common_set_status(d, status | VIRTIO_CONFIG_S_DRIVER_OK);
+
+    d->avail_wrap = d->used_wrap = true;
+    d->nreqs = d->size / REQ_DESCS;
+    d->hdrs = guest_alloc(d->alloc, d->nreqs * REQ_SLOT_SIZE);
+    d->data = guest_alloc(d->alloc, d->nreqs * SECTOR_SIZE);
+}
+
+static void test_dev_cleanup(TestDev *d)
+{
+    g_free(d->pdev);
+    pc_alloc_uninit(d->alloc);
+}
+
+static void fill_desc(struct vring_packed_desc *pdesc, struct vring_desc *sdesc,
+                      uint64_t addr, uint32_t len, uint16_t flags,
+                      uint16_t id_or_next)
+{
+    if (pdesc) {
+        pdesc->addr = cpu_to_le64(addr);
+        pdesc->len = cpu_to_le32(len);
+        pdesc->id = cpu_to_le16(id_or_next);
+        pdesc->flags = cpu_to_le16(flags);
+    } else {
+        sdesc->addr = cpu_to_le64(addr);
+        sdesc->len = cpu_to_le32(len);
+        sdesc->next = cpu_to_le16(id_or_next);
+        sdesc->flags = cpu_to_le16(flags);
+    }
+}
+
+/* Queue @n requests of @type for sectors @sector..@sector + @n - 1 */
+static void test_dev_submit(TestDev *d, uint32_t type, uint64_t sector,
+                            unsigned int n)
+{
+    uint8_t *hdrs = g_malloc0(n * REQ_SLOT_SIZE);
+    uint16_t data_flags = type == QVIRTIO_BLK_T_IN ? VRING_DESC_F_WRITE : 0;
+    unsigned int r, i, first;
+
+    g_assert_cmpint(n, <=, d->nreqs);
+    for (r = 0; r < n; r++) {
+        uint8_t *hdr = hdrs + r * REQ_SLOT_SIZE;
+
+        stl_le_p(hdr, type);
+        stl_le_p(hdr + 4, 0);
+        stq_le_p(hdr + 8, sector + r);
+        hdr[REQ_HDR_SIZE] = 0xff;
+    }
+    memwrite(d->hdrs, hdrs, n * REQ_SLOT_SIZE);
+    g_free(hdrs);
+
+    if (d->packed) {
+        struct vring_packed_desc *ring;
+        uint16_t avail_flags;
+        unsigned int start = d->avail_idx;
+
+        ring = g_new0(struct vring_packed_desc, d->size);
+        for (r = 0; r < n; r++) {
+            uint64_t hdr = d->hdrs + r * REQ_SLOT_SIZE;
+
+            for (i = 0; i < REQ_DESCS; i++) {
+                avail_flags = d->avail_wrap ? 1 << VRING_PACKED_DESC_F_AVAIL :
+                                              1 << VRING_PACKED_DESC_F_USED;
+                switch (i) {
+                case 0:
+                    fill_desc(&ring[d->avail_idx], NULL, hdr, REQ_HDR_SIZE,
+                              avail_flags | VRING_DESC_F_NEXT, r);
+                    break;
+                case 1:
+                    fill_desc(&ring[d->avail_idx], NULL,
+                              d->data + r * SECTOR_SIZE, SECTOR_SIZE,
+                              avail_flags | VRING_DESC_F_NEXT | data_flags, r);
+                    break;
+                case 2:
+                    fill_desc(&ring[d->avail_idx], NULL, hdr + REQ_HDR_SIZE,
+                              1, avail_flags | VRING_DESC_F_WRITE, r);
+                    break;
+                }
+                if (++d->avail_idx == d->size) {
+                    d->avail_idx = 0;
+                    d->avail_wrap = !d->avail_wrap;
+                }
+            }
+        }
+
+        /* The device only looks at the ring when kicked, so the batch can
+         * go out in (at most) two writes. */
+        if (start + n * REQ_DESCS > d->size) {
+            memwrite(d->desc + start * sizeof(*ring), &ring[start],
+                     (d->size - start) * sizeof(*ring));
+            memwrite(d->desc, ring, d->avail_idx * sizeof(*ring));
+        } else {
+            memwrite(d->desc + start * sizeof(*ring), &ring[start],
+                     n * REQ_DESCS * sizeof(*ring));
+        }
+        g_free(ring);
+    } else {
+        struct vring_desc *table = g_new0(struct vring_desc, n * REQ_DESCS);
+        uint16_t *avail_ring = g_new(uint16_t, n);
+
+        for (r = 0; r < n; r++) {
+            uint64_t hdr = d->hdrs + r * REQ_SLOT_SIZE;
+            uint16_t head = r * REQ_DESCS;
+
+            fill_desc(NULL, &table[head], hdr, REQ_HDR_SIZE,
+                      VRING_DESC_F_NEXT, head + 1);
+            fill_desc(NULL, &table[head + 1], d->data + r * SECTOR_SIZE,
+                      SECTOR_SIZE, VRING_DESC_F_NEXT | data_flags, head + 2);
+            fill_desc(NULL, &table[head + 2], hdr + REQ_HDR_SIZE, 1,
+                      VRING_DESC_F_WRITE, 0);
+        }
+        memwrite(d->desc, table, n * REQ_DESCS * sizeof(*table));
+        g_free(table);
+
+        for (r = 0; r < n; r++) {
+            avail_ring[r] = cpu_to_le16(r * REQ_DESCS);
+        }
+        first = d->avail_idx % d->size;
+        i = MIN(n, d->size - first);
+        memwrite(d->avail + 4 + first * 2, avail_ring, i * 2);
+        if (i < n) {
+            memwrite(d->avail + 4, &avail_ring[i], (n - i) * 2);
+        }
+        g_free(avail_ring);
+        d->avail_idx += n;
+        writew(d->avail + 2, d->avail_idx);
+    }
+}
+
+static void test_dev_kick(TestDev *d)
+{
+    qpci_io_writew(d->pdev, d->notify, 0);
+}
+
+/* Wait for @n requests and check that they completed successfully */
+static void test_dev_wait(TestDev *d, uint32_t type, unsigned int n)
+{
+    gint64 start_time = g_get_monotonic_time();
+    uint32_t expected_len = type == QVIRTIO_BLK_T_IN ? SECTOR_SIZE + 1 : 1;
+    bool *done = g_new0(bool, n);
+    uint8_t *hdrs;
+    unsigned int r;
+
+    for (r = 0; r < n; r++) {
+        uint32_t id, len;
+
+        if (d->packed) {
+            uint64_t desc = d->desc + d->used_idx * sizeof(struct vring_desc);
+            uint16_t flags, used_flags;
+
+            used_flags = d->used_wrap ? (1 << VRING_PACKED_DESC_F_AVAIL) |
+                                        (1 << VRING_PACKED_DESC_F_USED) : 0;
+            for (;;) {
+                flags = readw(desc + offsetof(struct vring_packed_desc, flags));
+                if ((flags & ((1 << VRING_PACKED_DESC_F_AVAIL) |
+                              (1 << VRING_PACKED_DESC_F_USED))) ==
+                    used_flags) {
+                    break;
+                }
+                clock_step(100);
+                g_assert(g_get_monotonic_time() - start_time <=
+                         QVIRTIO_BLK_TIMEOUT_US);
+            }
+            id = readw(desc + offsetof(struct vring_packed_desc, id));
+            len = readl(desc + offsetof(struct vring_packed_desc, len));
+            d->used_idx += REQ_DESCS;
+            if (d->used_idx >= d->size) {
+                d->used_idx -= d->size;
+                d->used_wrap = !d->used_wrap;
+            }
+        } else {
+            uint64_t elem;
+
+            while (readw(d->used + 2) == d->used_idx) {
+                clock_step(100);
+                g_assert(g_get_monotonic_time() - start_time <=
+                         QVIRTIO_BLK_TIMEOUT_US);
+            }
+            elem = d->used + 4 + (d->used_idx % d->size) * 8;
+            id = readl(elem) / REQ_DESCS;
+            len = readl(elem + 4);
+            d->used_idx++;
+        }
+        g_assert_cmpint(id, <, n);
+        g_assert(!done[id]);
+        done[id] = true;
+        g_assert_cmpint(len, ==, expected_len);
+    }
+    g_free(done);
+
+    hdrs = g_malloc(n * REQ_SLOT_SIZE);
+    memread(d->hdrs, hdrs, n * REQ_SLOT_SIZE);
+    for (r = 0; r < n; r++) {
+        g_assert_cmpint(hdrs[r * REQ_SLOT_SIZE + REQ_HDR_SIZE], ==, 0);
+    }
+    g_free(hdrs);
+}
+
+static void test_rw(gconstpointer opaque)
+{
+    bool packed = GPOINTER_TO_INT(opaque);
+    char *file = drive_create();
+    QPCIBus *bus = test_start(file);
+    unsigned int round, n, i;
+    uint64_t sector = 0;
+    TestDev d;
+
+    test_dev_init(&d, bus, packed);
+
+    /* Batches that do not divide the ring size move the wrap point around
+     * and split chains across the end of the ring. */
+    for (round = 0; round < 8; round++) {
+        uint8_t *buf;
+
+        n = d.nreqs - round % 3;
+        buf = g_malloc(n * SECTOR_SIZE);
+        for (i = 0; i < n * SECTOR_SIZE; i++) {
+            buf[i] = (round * 31 + i / SECTOR_SIZE) & 0xff;
+        }
+        memwrite(d.data, buf, n * SECTOR_SIZE);
+        test_dev_submit(&d, QVIRTIO_BLK_T_OUT, sector, n);
+        test_dev_kick(&d);
+        test_dev_wait(&d, QVIRTIO_BLK_T_OUT, n);
+
+        qmemset(d.data, 0, n * SECTOR_SIZE);
+        test_dev_submit(&d, QVIRTIO_BLK_T_IN, sector, n);
+        test_dev_kick(&d);
+        test_dev_wait(&d, QVIRTIO_BLK_T_IN, n);
+
+        memset(buf, 0, n * SECTOR_SIZE);
+        memread(d.data, buf, n * SECTOR_SIZE);
+        for (i = 0; i < n * SECTOR_SIZE; i++) {
+            g_assert_cmpint(buf[i], ==, (round * 31 + i / SECTOR_SIZE) & 0xff);
+        }
+        g_free(buf);
+        sector += n;
+    }
+
+    test_dev_cleanup(&d);
+    qpci_free_pc(bus);
+    qtest_end();
+    unlink(file);
+    g_free(file);
+}
+
+static void perf_ring(bool packed)
+{
+    const unsigned int rounds = 200;
+    QPCIBus *bus = test_start("null-co://");
+    double kick = 0, total = 0;
+    unsigned int round;
+    TestDev d;
+
+    test_dev_init(&d, bus, packed);
+    for (round = 0; round < rounds; round++) {
+        test_dev_submit(&d, QVIRTIO_BLK_T_IN, 0, d.nreqs);
+        g_test_timer_start();
+        test_dev_kick(&d);
+        kick += g_test_timer_elapsed();
+        test_dev_wait(&d, QVIRTIO_BLK_T_IN, d.nreqs);
+        total += g_test_timer_elapsed();
+    }
+
+    /* The kick pops and submits the whole batch; completion adds the
+     * qtest round trips needed to poll for it. */
+    g_test_message("%-6s ring: kick %6.0f ns/request, "
+                   "kick to completion %6.0f ns/request",
+                   packed ? "packed" : "split",
+                   kick * 1e9 / (rounds * d.nreqs),
+                   total * 1e9 / (rounds * d.nreqs));
+
+    test_dev_cleanup(&d);
+    qpci_free_pc(bus);
+    qtest_end();
+}
+
+static void perf_split_vs_packed(void)
+{
+    perf_ring(false);
+    perf_ring(true);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_data_func("/virtio/blk/pci/split/rw",
+                        GINT_TO_POINTER(false), test_rw);
+    qtest_add_data_func("/virtio/blk/pci/packed/rw",
+                        GINT_TO_POINTER(true), test_rw);
+    if (g_test_perf()) {
+        qtest_add_func("/virtio/blk/pci/packed/perf", perf_split_vs_packed);
+    }
+
+    return g_test_run();
+}
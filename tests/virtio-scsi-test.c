@@ -259,6 +259,181 @@ static void test_unaligned_write_same(void)
     qvirtio_scsi_stop();
 }
 
+/* Commands in flight on one request queue; each takes three descriptors */
+#define IOTHREADS_DEPTH         32
+#define IOTHREADS_PERF_ROUNDS   200
+
+typedef struct {
+    uint64_t req;
+    uint64_t resp;
+    uint64_t data;
+} QVirtIOSCSISlot;
+
+static void qvirtio_scsi_iothreads_start(int num_iothreads, int num_queues,
+                                         int num_luns)
+{
+    GString *cmdline = g_string_new("");
+    int i;
+
+    for (i = 0; i < num_iothreads; i++) {
+        g_string_append_printf(cmdline, "-object iothread,id=io%d ", i);
+    }
+    g_string_append_printf(cmdline, "-device virtio-scsi-pci,id=vs0,"
+                           "num_queues=%d,iothreads=io0", num_queues);
+    for (i = 1; i < num_iothreads; i++) {
+        g_string_append_printf(cmdline, ":io%d", i);
+    }
+    for (i = 0; i < num_luns; i++) {
+        g_string_append_printf(cmdline,
+                               " -drive id=drv%d,if=none,file=null-co://"
+                               ",format=raw"
+                               " -device scsi-hd,bus=vs0.0,drive=drv%d"
+                               ",scsi-id=%d,lun=0",
+                               i, i, i + 1);
+    }
+    qtest_start(cmdline->str);
+    g_string_free(cmdline, true);
+}
+
+/* Queue a READ(10) of one block without waiting for it */
+static void virtio_scsi_queue_read(QVirtIOSCSI *vs, QVirtQueue *vq,
+                                   QVirtIOSCSISlot *slot, int target)
+{
+    QVirtIOSCSICmdReq req = { { 0 } };
+    QVirtIOSCSICmdResp resp = { .response = 0xff, .status = 0xff };
+    uint32_t free_head;
+
+    req.lun[0] = 1;
+    req.lun[1] = target;
+    req.cdb[0] = READ_10;
+    req.cdb[8] = 1;
+    memwrite(slot->req, &req, sizeof(req));
+    memwrite(slot->resp, &resp, sizeof(resp));
+
+    free_head = qvirtqueue_add(vq, slot->req, sizeof(req), false, true);
+    qvirtqueue_add(vq, slot->resp, sizeof(resp), true, true);
+    qvirtqueue_add(vq, slot->data, 512, true, false);
+    qvirtqueue_kick(&qvirtio_pci, vs->dev, vq, free_head);
+}
+
+static uint8_t virtio_scsi_wait_slot(QVirtIOSCSISlot *slot)
+{
+    gint64 start_time = g_get_monotonic_time();
+    uint8_t response;
+
+    while ((response = readb(slot->resp +
+                             offsetof(QVirtIOSCSICmdResp, response))) == 0xff) {
+        g_assert(g_get_monotonic_time() - start_time <=
+                 QVIRTIO_SCSI_TIMEOUT_US);
+    }
+    return response;
+}
+
+/* Submit IOTHREADS_DEPTH reads on every request queue, spreading them over
+ * all LUNs so that most commands are popped in a different IOThread than
+ * the one that owns their LUN.
+ */
+static void virtio_scsi_iothreads_round(QVirtIOSCSI *vs,
+                                        QVirtIOSCSISlot *slots, int num_luns)
+{
+    int q, i;
+
+    for (q = 0; q < vs->num_queues; q++) {
+        QVirtQueue *vq = vs->vq[q + 2];
+
+        /* Everything from the previous round has completed */
+        vq->free_head = 0;
+        vq->num_free = vq->size;
+        for (i = 0; i < IOTHREADS_DEPTH; i++) {
+            virtio_scsi_queue_read(vs, vq, &slots[q * IOTHREADS_DEPTH + i],
+                                   (q + i) % num_luns + 1);
+        }
+    }
+
+    for (i = 0; i < vs->num_queues * IOTHREADS_DEPTH; i++) {
+        g_assert_cmpint(virtio_scsi_wait_slot(&slots[i]), ==, 0);
+    }
+}
+
+static QVirtIOSCSISlot *virtio_scsi_alloc_slots(QVirtIOSCSI *vs)
+{
+    int n = vs->num_queues * IOTHREADS_DEPTH;
+    QVirtIOSCSISlot *slots = g_new(QVirtIOSCSISlot, n);
+    int i;
+
+    for (i = 0; i < n; i++) {
+        slots[i].req = guest_alloc(vs->alloc, sizeof(QVirtIOSCSICmdReq));
+        slots[i].resp = guest_alloc(vs->alloc, sizeof(QVirtIOSCSICmdResp));
+        slots[i].data = guest_alloc(vs->alloc, 512);
+    }
+    return slots;
+}
+
+static void virtio_scsi_free_slots(QVirtIOSCSI *vs, QVirtIOSCSISlot *slots)
+{
+    int i;
+
+    for (i = 0; i < vs->num_queues * IOTHREADS_DEPTH; i++) {
+        guest_free(vs->alloc, slots[i].req);
+        guest_free(vs->alloc, slots[i].resp);
+        guest_free(vs->alloc, slots[i].data);
+    }
+    g_free(slots);
+}
+
+/* Request queues and LUNs spread over two IOThreads */
+static void test_iothreads(void)
+{
+    QVirtIOSCSI *vs;
+    QVirtIOSCSISlot *slots;
+
+    qvirtio_scsi_iothreads_start(2, 4, 3);
+    vs = qvirtio_scsi_pci_init(PCI_SLOT);
+    g_assert_cmpint(vs->num_queues, ==, 4);
+
+    slots = virtio_scsi_alloc_slots(vs);
+    virtio_scsi_iothreads_round(vs, slots, 3);
+    virtio_scsi_iothreads_round(vs, slots, 3);
+    virtio_scsi_free_slots(vs, slots);
+
+    qvirtio_scsi_pci_free(vs);
+    qvirtio_scsi_stop();
+}
+
+static void test_iothreads_perf_one(int num_iothreads)
+{
+    QVirtIOSCSI *vs;
+    QVirtIOSCSISlot *slots;
+    gint64 start, end;
+    int i;
+
+    qvirtio_scsi_iothreads_start(num_iothreads, 4, 4);
+    vs = qvirtio_scsi_pci_init(PCI_SLOT);
+    slots = virtio_scsi_alloc_slots(vs);
+
+    start = g_get_monotonic_time();
+    for (i = 0; i < IOTHREADS_PERF_ROUNDS; i++) {
+        virtio_scsi_iothreads_round(vs, slots, 4);
+    }
+    end = g_get_monotonic_time();
+
+    g_test_message("null-co reads, %d queues, %d IOThread(s): %.0f IOPS",
+                   vs->num_queues, num_iothreads,
+                   (double)IOTHREADS_PERF_ROUNDS * vs->num_queues *
+                   IOTHREADS_DEPTH * G_USEC_PER_SEC / (end - start));
+
+    virtio_scsi_free_slots(vs, slots);
+    qvirtio_scsi_pci_free(vs);
+    qvirtio_scsi_stop();
+}
+
+static void test_iothreads_perf(void)
+{
+    test_iothreads_perf_one(1);
+    test_iothreads_perf_one(2);
+    test_iothreads_perf_one(4);
+}
+
 int main(int argc, char **argv)
 {
     int ret;
@@ -268,6 +443,11 @@ int main(int argc, char **argv)
     qtest_add_func("/virtio/scsi/pci/hotplug", hotplug);
     qtest_add_func("/virtio/scsi/pci/scsi-disk/unaligned-write-same",
                    test_unaligned_write_same);
+    qtest_add_func("/virtio/scsi/pci/iothreads", test_iothreads);
+    if (g_test_perf()) {
+        qtest_add_func("/virtio/scsi/pci/iothreads/perf",
+                       test_iothreads_perf);
+    }
 
     ret = g_test_run();
 